@@ -33,27 +33,175 @@
 #include <string.h>
 #include <fcntl.h>
 #include <err.h>
+#include <aio.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <sys/event.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef	__linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "shm_alloc.h"
 #include "netbuf.h"
 #include "fde.h"
 #include "fd_util.h"
+#include "disk.h"
+#include "taskq.h"
+#include "shm_chan.h"
 #include "comm.h"
 
 #define	XMIN(x,y)	((x) < (y) ? (x) : (y))
 
+/* Most buffers handed to a single coalesced writev() */
+#define	COMM_WC_MAXIOV		64
+
+#if defined(TCP_CORK)
+#define	COMM_TCP_CORK		TCP_CORK
+#elif defined(TCP_NOPUSH)
+#define	COMM_TCP_CORK		TCP_NOPUSH
+#endif
+
+/*
+ * How much file data to page in via a helper thread when sendfile()
+ * finds it isn't resident.
+ */
+#define	COMM_SF_PAGEIN_SIZE	(128 * 1024)
+
+/*
+ * How many datagrams to read per UDP read callback before
+ * letting other events run.
+ */
+#define	COMM_UDP_READ_BATCH	32
+
+/* Room for one message's worth of passed descriptors */
+union comm_fdpass_cmsg {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int) * COMM_FDPASS_MAX)];
+};
+
+/* Kernel receive timestamp control message (see comm_fd_set_rx_timestamps) */
+#if defined(SO_TIMESTAMPNS)
+#define	COMM_SCM_RX_TS		SCM_TIMESTAMPNS
+#elif defined(SO_TS_CLOCK)
+#define	COMM_SCM_RX_TS		SCM_REALTIME
+#endif
+
+union comm_udp_ts_cmsg {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(struct timespec))];
+};
+
+/*
+ * Splice buffering.  Each active splice holds one pipe (Linux)
+ * or one buffer (everything else) of this size; idle ones are
+ * kept on a per-thread free list.
+ */
+#define	COMM_SPLICE_BUF_SIZE	(64 * 1024)
+#define	COMM_SPLICE_POOL_MAX	64
+
+struct comm_splice_buf {
+	struct comm_splice_buf *next;
+	size_t fill;		/* bytes buffered */
+#ifdef	__linux__
+	int pfd[2];		/* pipe read, write side */
+#else
+	size_t off;		/* next byte to write out */
+	char buf[COMM_SPLICE_BUF_SIZE];
+#endif
+};
+
+/*
+ * comm objects are only used from their owning thread, so the pool
+ * is per-thread and needs no locking.
+ */
+static __thread struct comm_splice_buf *comm_splice_pool = NULL;
+static __thread int comm_splice_pool_cnt = 0;
+#ifdef	__linux__
+static __thread char *comm_sf_probe_buf = NULL;
+#endif
+
+static void comm_cb_write(int fd, struct fde *f, void *arg,
+    fde_cb_status status);
+
 /*
  * This implements the 'socket' logic for sockets, pipes and such.
  * It isn't at all useful for disk IO.
  */
 
+/*
+ * There's one read and one write registration per fd, shared by
+ * every operation.  Register on first use; drop it once nothing
+ * on that side is active any more.
+ */
+static void
+comm_rd_register(struct fde_comm *fc)
+{
+
+	if (fc->rd.is_registered)
+		return;
+	fc->rd.is_registered = 1;
+	fde_add(fc->fh_parent, fc->ev_read);
+}
+
+static void
+comm_rd_release(struct fde_comm *fc)
+{
+
+	if (fc->rd.is_registered == 0)
+		return;
+	if (fc->r.is_active || fc->a.is_active || fc->udp_r.is_active ||
+	    fc->sp.is_active || fc->fp_r.is_active || fc->hs.is_active)
+		return;
+
+	/* A channel's doorbell also signals write space */
+	if (fc->shm != NULL && fc->is_closing == 0)
+		return;
+	fde_delete(fc->fh_parent, fc->ev_read);
+	fc->rd.is_registered = fc->rd.is_ready = 0;
+}
+
+static void
+comm_wr_register(struct fde_comm *fc)
+{
+
+	if (fc->wr.is_registered)
+		return;
+	fc->wr.is_registered = 1;
+
+	/*
+	 * Channels have no write event; assume there's space and let
+	 * the write say otherwise.  The doorbell wakes us when the
+	 * peer makes room.
+	 */
+	if (fc->shm != NULL) {
+		fc->wr.is_ready = 1;
+		return;
+	}
+	fde_add(fc->fh_parent, fc->ev_write);
+}
+
+static void
+comm_wr_release(struct fde_comm *fc)
+{
+
+	if (fc->wr.is_registered == 0)
+		return;
+	if (fc->w.is_active || fc->co.is_active || fc->udp_w.is_active ||
+	    fc->sf.is_active || fc->sp_src != NULL || fc->wc.qlen != 0 ||
+	    fc->fp_w.is_active || fc->hs.is_active)
+		return;
+	if (fc->shm == NULL)
+		fde_delete(fc->fh_parent, fc->ev_write);
+	fc->wr.is_registered = fc->wr.is_ready = 0;
+}
+
 static int
 comm_is_close_ready(struct fde_comm *fc)
 {
@@ -70,7 +218,11 @@ comm_is_close_ready(struct fde_comm *fc)
 	 */
 	return (fc->r.is_active == 0 && fc->w.is_active == 0 &&
 	    fc->a.is_active == 0 && fc->co.is_active == 0 &&
-	    fc->udp_r.is_active == 0 && fc->udp_w.is_active == 0);
+	    fc->udp_r.is_active == 0 && fc->udp_w.is_active == 0 &&
+	    fc->sf.is_active == 0 && fc->sp.is_active == 0 &&
+	    fc->sp_src == NULL && fc->wc.qlen == 0 &&
+	    fc->fp_r.is_active == 0 && fc->fp_w.is_active == 0 &&
+	    fc->hs.is_active == 0);
 }
 
 static void
@@ -88,11 +240,143 @@ comm_start_cleanup(struct fde_comm *fc)
 	if (! comm_is_close_ready(fc))
 		return;
 
+	/* Nothing is using the registrations now */
+	comm_rd_release(fc);
+	comm_wr_release(fc);
+
 	/* Schedule the cleanup */
 	fc->is_cleanup = 1;
 	fde_add(fc->fh_parent, fc->ev_cleanup);
 }
 
+
+static uint64_t
+comm_now_usec(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * IO statistics.  These don't touch errno.
+ */
+static void
+comm_stat_rd(struct fde_comm *c, ssize_t ret)
+{
+
+	c->st.n_read++;
+	if (ret > 0)
+		c->st.rx_bytes += ret;
+	else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		c->st.n_rd_eagain++;
+}
+
+static void
+comm_stat_wr(struct fde_comm *c, ssize_t ret, size_t len)
+{
+
+	c->st.n_write++;
+	if (ret > 0) {
+		c->st.tx_bytes += ret;
+		if ((size_t) ret < len)
+			c->st.n_short_write++;
+	} else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		c->st.n_wr_eagain++;
+}
+
+/*
+ * An operation is about to call back; account for how long it's
+ * been since the readiness which got it here.
+ */
+static void
+comm_stat_rd_lat(struct fde_comm *c)
+{
+	uint64_t d;
+
+	if (c->stc.t_rd_ready == 0)
+		return;
+	d = comm_now_usec() - c->stc.t_rd_ready;
+	c->stc.t_rd_ready = 0;
+	c->st.n_rd_lat++;
+	c->st.rd_lat_usec += d;
+	if (d > c->st.rd_lat_max_usec)
+		c->st.rd_lat_max_usec = d;
+}
+
+static void
+comm_stat_wr_lat(struct fde_comm *c)
+{
+	uint64_t d;
+
+	if (c->stc.t_wr_ready == 0)
+		return;
+	d = comm_now_usec() - c->stc.t_wr_ready;
+	c->stc.t_wr_ready = 0;
+	c->st.n_wr_lat++;
+	c->st.wr_lat_usec += d;
+	if (d > c->st.wr_lat_max_usec)
+		c->st.wr_lat_max_usec = d;
+}
+
+/*
+ * Stream IO on the fd, or on the shared memory channel.
+ */
+static ssize_t
+comm_io_read(struct fde_comm *c, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (c->shm != NULL)
+		ret = iapp_shm_chan_read(c->shm, c->shm_side, buf, len);
+	else
+		ret = read(c->fd, buf, len);
+	comm_stat_rd(c, ret);
+	return (ret);
+}
+
+static ssize_t
+comm_io_write(struct fde_comm *c, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (c->shm != NULL)
+		ret = iapp_shm_chan_write(c->shm, c->shm_side, buf, len);
+	else
+		ret = write(c->fd, buf, len);
+	comm_stat_wr(c, ret, len);
+	return (ret);
+}
+
+static ssize_t
+comm_io_writev(struct fde_comm *c, const struct iovec *iov, int n)
+{
+	ssize_t ret, total = 0;
+	size_t len = 0;
+	int i;
+
+	if (c->shm == NULL) {
+		for (i = 0; i < n; i++)
+			len += iov[i].iov_len;
+		ret = writev(c->fd, iov, n);
+		comm_stat_wr(c, ret, len);
+		return (ret);
+	}
+
+	for (i = 0; i < n; i++) {
+		ret = iapp_shm_chan_write(c->shm, c->shm_side,
+		    iov[i].iov_base, iov[i].iov_len);
+		comm_stat_wr(c, ret, iov[i].iov_len);
+		if (ret < 0)
+			return (total != 0 ? total : -1);
+		total += ret;
+		if ((size_t) ret < iov[i].iov_len)
+			break;
+	}
+	return (total);
+}
+
 int
 comm_set_nonblocking(struct fde_comm *c, int enable)
 {
@@ -126,12 +410,36 @@ fde_comm_udp_alloc(struct fde_comm *fc, int maxlen)
 	return (fr);
 }
 
+struct fde_comm_udp_frame *
+fde_comm_udp_alloc_slice(struct fde_comm *fc,
+    const struct iapp_netbuf_slice *sl)
+{
+	struct fde_comm_udp_frame *fr;
+
+	fr = calloc(1, sizeof(*fr));
+	if (fr == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	fr->nb = iapp_netbuf_ref(sl->nb);
+	fr->buf = iapp_netbuf_buf_nonconst(sl->nb) + sl->offset;
+	fr->size = fr->len = sl->len;
+
+	fr->sl_lcl = sizeof(fr->sa_lcl);
+	fr->sl_rem = sizeof(fr->sa_rem);
+
+	return (fr);
+}
+
 void
 fde_comm_udp_free(struct fde_comm *fc, struct fde_comm_udp_frame *fr)
 {
 
 	/* XXX ensure it's not on a linked list? */
-	if (fr->buf)
+	if (fr->nb != NULL)
+		iapp_netbuf_free(fr->nb);
+	else if (fr->buf)
 		free(fr->buf);
 	free(fr);
 }
@@ -145,8 +453,35 @@ comm_cb_read(int fd, struct fde *f, void *arg, fde_cb_status status)
 {
 	struct fde_comm *c = arg;
 
-	c->r.is_ready = 1;
-	if (! c->r.is_active)
+	c->rd.is_ready = 1;
+	if (c->stc.do_timing && c->stc.t_rd_ready == 0 &&
+	    c->r.is_active && c->r.is_paused == 0)
+		c->stc.t_rd_ready = comm_now_usec();
+
+	/*
+	 * A channel doorbell means data, space, or both; writes find
+	 * out which for themselves.
+	 */
+	if (c->shm != NULL) {
+		iapp_shm_chan_drain(c->shm, c->shm_side);
+		comm_cb_write(fd, f, arg, status);
+	}
+
+	/*
+	 * Hand the readiness to whichever operation is using it.
+	 */
+	if (c->sp.is_active)
+		fde_add(c->fh_parent, c->ev_splice_cb);
+	if (c->a.is_active)
+		fde_add(c->fh_parent, c->ev_accept_cb);
+	if (c->udp_r.is_active)
+		fde_add(c->fh_parent, c->ev_udp_read_cb);
+	if (c->fp_r.is_active)
+		fde_add(c->fh_parent, c->ev_fp_read_cb);
+	if (c->hs.is_active && c->hs.want == COMM_HS_WANT_READ)
+		fde_add(c->fh_parent, c->ev_hs_cb);
+
+	if (! c->r.is_active || c->r.is_paused)
 		return;
 
 	/*
@@ -165,16 +500,16 @@ comm_cb_read(int fd, struct fde *f, void *arg, fde_cb_status status)
 static void
 comm_cb_read_cb(int fd, struct fde *f, void *arg, fde_cb_status status)
 {
-	int ret;
+	int ret, xerrno = 0;
 	struct fde_comm *c = arg;
 	fde_comm_cb_status s;
 
 	/* Closing? Don't do the IO; start the closing machinery */
 	if (c->is_closing) {
 		c->r.is_active = 0;
+		fde_delete(c->fh_parent, c->ev_rd_deadline);
 		c->r.cb(fd, c, c->r.cbdata, FDE_COMM_CB_CLOSING, 0);
-		fde_delete(c->fh_parent, c->ev_read);
-		c->r.is_read = c->r.is_ready = 0;
+		comm_rd_release(c);
 		if (comm_is_close_ready(c)) {
 			comm_start_cleanup(c);
 			return;
@@ -186,13 +521,18 @@ comm_cb_read_cb(int fd, struct fde *f, void *arg, fde_cb_status status)
 		    __func__,
 		    c,
 		    fd);
-		fde_delete(c->fh_parent, c->ev_read);
-		c->r.is_read = c->r.is_ready = 0;
+		comm_rd_release(c);
 		return;
 	}
 
+	/* Paused since this was scheduled; resume will reschedule */
+	if (c->r.is_paused)
+		return;
+
 	/* XXX validate that there's actually a buffer, len and callback */
-	ret = read(c->fd, c->r.buf, c->r.len);
+	ret = comm_io_read(c, c->r.buf, c->r.len);
+	if (ret < 0)
+		xerrno = errno;
 
 	/* If it's something we can restart, do so */
 	if (ret < 0) {
@@ -200,7 +540,7 @@ comm_cb_read_cb(int fd, struct fde *f, void *arg, fde_cb_status status)
 		 * XXX should only fail this a few times before
 		 * really failing.
 		 */
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (xerrno == EAGAIN || xerrno == EWOULDBLOCK) {
 			return;
 		}
 	}
@@ -209,6 +549,7 @@ comm_cb_read_cb(int fd, struct fde *f, void *arg, fde_cb_status status)
 	 * Call the comm callback from this context.
 	 */
 	c->r.is_active = 0;
+	fde_delete(c->fh_parent, c->ev_rd_deadline);
 	if (ret == 0)
 		s = FDE_COMM_CB_EOF;
 	else if (ret < 0)
@@ -220,16 +561,37 @@ comm_cb_read_cb(int fd, struct fde *f, void *arg, fde_cb_status status)
 	 * If we hit an error or EOF, we stop reading.
 	 */
 	if (s != FDE_COMM_CB_COMPLETED) {
-		fde_delete(c->fh_parent, c->ev_read);
-		c->r.is_read = c->r.is_ready = 0;
+		comm_rd_release(c);
 	}
 
 	/*
 	 * And now, the callback.
 	 */
+	comm_stat_rd_lat(c);
+
+	/* The releases above may have clobbered it */
+	if (s == FDE_COMM_CB_ERROR)
+		errno = xerrno;
 	c->r.cb(fd, c, c->r.cbdata, s, ret);
 }
 
+
+/*
+ * Tell the owner the stream write is done, first dropping the
+ * reference a slice write holds.
+ */
+static void
+comm_write_notify(struct fde_comm *c, fde_comm_cb_status s)
+{
+
+	if (c->w.is_ref) {
+		c->w.is_ref = 0;
+		iapp_netbuf_free(c->w.nb);
+	}
+	c->w.nb = NULL;
+	c->w.cb(c->fd, c, c->w.cbdata, s, c->w.offset);
+}
+
 /*
  * IO write ready - set the relevant bit; if there's a write
  * ongoing we schedule that callback.
@@ -239,7 +601,36 @@ comm_cb_write(int fd, struct fde *f, void *arg, fde_cb_status status)
 {
 	struct fde_comm *c = arg;
 
-	c->w.is_ready = 1;
+	c->wr.is_ready = 1;
+	if (c->stc.do_timing && c->stc.t_wr_ready == 0 &&
+	    (c->w.is_active || c->wc.qlen != 0))
+		c->stc.t_wr_ready = comm_now_usec();
+
+	/*
+	 * sendfile() shares the write readiness; kick it if it's
+	 * not waiting on a helper to page in file data.
+	 */
+	if (c->sf.is_active && c->sf.is_busy == 0)
+		fde_add(c->fh_parent, c->ev_sendfile_cb);
+
+	/* .. as does a splice writing into us */
+	if (c->sp_src != NULL)
+		fde_add(c->fh_parent, c->sp_src->ev_splice_cb);
+
+	/* .. and connect() completion, and datagram writes */
+	if (c->co.is_active)
+		fde_add(c->fh_parent, c->ev_connect_cb);
+	if (c->udp_w.is_active && TAILQ_FIRST(&c->udp_w.w_q) != NULL)
+		fde_add(c->fh_parent, c->ev_udp_write_cb);
+
+	/* .. and coalesced writes and descriptors, at the end of this pass */
+	if (c->wc.qlen != 0)
+		fde_add(c->fh_parent, c->ev_wc_flush);
+	if (c->fp_w.qlen != 0)
+		fde_add(c->fh_parent, c->ev_fp_flush);
+	if (c->hs.is_active && c->hs.want == COMM_HS_WANT_WRITE)
+		fde_add(c->fh_parent, c->ev_hs_cb);
+
 	if (! c->w.is_active)
 		return;
 
@@ -281,11 +672,11 @@ comm_cb_write_complete(struct fde_comm *c, int ret)
 
 	/* Time to notify! */
 	c->w.is_active = 0;
+	fde_delete(c->fh_parent, c->ev_wr_deadline);
 	if (ret < 0) {
 		s = FDE_COMM_CB_ERROR;
 #if 0
-		fde_delete(c->fh_parent, c->ev_write);
-		c->w.is_write = 0;
+		comm_wr_release(c);
 #endif
 	} else if (ret == 0) {
 		s = FDE_COMM_CB_EOF;
@@ -294,7 +685,8 @@ comm_cb_write_complete(struct fde_comm *c, int ret)
 	}
 //	fprintf(stderr, "%s: ret=%d, s=%d, offset=%d\n", __func__, ret, s, c->w.offset);
 
-	c->w.cb(c->fd, c, c->w.cbdata, s, c->w.offset);
+	comm_stat_wr_lat(c);
+	comm_write_notify(c, s);
 }
 
 /*
@@ -310,15 +702,16 @@ comm_cb_write_cb(int fd_notused, struct fde *f, void *arg, fde_cb_status status)
 	/* Closing? Don't do the IO; start the closing machinery */
 	if (c->is_closing) {
 		c->w.is_active = 0;
-		c->w.is_ready = 0;
-		c->w.cb(c->fd, c, c->w.cbdata, FDE_COMM_CB_CLOSING, c->w.offset);
+		fde_delete(c->fh_parent, c->ev_wr_deadline);
+		c->wr.is_ready = 0;
+		comm_write_notify(c, FDE_COMM_CB_CLOSING);
 		if (comm_is_close_ready(c)) {
 			comm_start_cleanup(c);
 			return;
 		}
 	}
 
-	if (c->w.is_active == 0 || c->w.is_ready == 0) {
+	if (c->w.is_active == 0 || c->wr.is_ready == 0) {
 		fprintf(stderr, "%s: %p: FD %d: comm_cb_write but not active?\n",
 		    __func__,
 		    c,
@@ -329,7 +722,7 @@ comm_cb_write_cb(int fd_notused, struct fde *f, void *arg, fde_cb_status status)
 	/*
 	 * Write out from the current buffer position.
 	 */
-	ret = write(c->fd,
+	ret = comm_io_write(c,
 	    iapp_netbuf_buf(c->w.nb) + c->w.nb_start_offset + c->w.offset,
 	    c->w.len - c->w.offset);
 	//	fprintf(stderr, "%s: write returned %d\n", __func__, ret);
@@ -339,7 +732,6 @@ comm_cb_write_cb(int fd_notused, struct fde *f, void *arg, fde_cb_status status)
 	 * socket buffer _has_ space to write into.
 	 */
 	if (ret < 0) {
-		fprintf(stderr, "%s: errno=%d (%s)\n", __func__, errno, strerror(errno));
 		/*
 		 * XXX should only fail this a few times before
 		 * really failing.
@@ -347,152 +739,875 @@ comm_cb_write_cb(int fd_notused, struct fde *f, void *arg, fde_cb_status status)
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
 			return;
 		}
+		fprintf(stderr, "%s: errno=%d (%s)\n", __func__, errno, strerror(errno));
 	}
 
 	/*
-	 * Wrote more than 0 bytes? Bump the offset.
+	 * Wrote more than 0 bytes? Bump the offset.  A short write
+	 * means the socket buffer is full; wait for the next write
+	 * event.  A channel has none, so try again until EAGAIN.
 	 */
 	if (ret > 0) {
 		c->w.offset += ret;
+		if (c->w.offset < c->w.len && c->shm == NULL)
+			c->wr.is_ready = 0;
+		else if (c->w.offset < c->w.len)
+			fde_add(c->fh_parent, c->ev_write_cb);
 	}
 
 	/*
-	 * If we failed the write or we hit EOF then call the completion
-	 * immediately.
+	 * Complete the write if it's all done, or if we failed the
+	 * write or hit EOF.
 	 */
-	if (ret <= 0)
-		comm_cb_write_complete(c, ret);
+	comm_cb_write_complete(c, ret);
 }
 
+#ifdef	COMM_TCP_CORK
 static void
-comm_cb_accept(int fd, struct fde *f, void *arg, fde_cb_status status)
+comm_wc_cork(struct fde_comm *c, int enable)
 {
-	int ret;
+
+	/* Not a TCP socket? Nothing to do */
+	(void) setsockopt(c->fd, IPPROTO_TCP, COMM_TCP_CORK, &enable,
+	    sizeof(enable));
+}
+#endif
+
+/*
+ * Complete the first queued coalesced write.
+ */
+static void
+comm_wc_complete(struct fde_comm *c, fde_comm_cb_status s)
+{
+	struct comm_wc_ent *e;
+
+	e = TAILQ_FIRST(&c->wc.q);
+	TAILQ_REMOVE(&c->wc.q, e, node);
+	c->wc.qlen--;
+	comm_stat_wr_lat(c);
+	if (e->is_ref)
+		iapp_netbuf_free(e->nb);
+	e->cb(c->fd, c, e->cbdata, s, e->offset);
+	free(e);
+}
+
+/*
+ * End of loop pass: write out the queued coalesced writes.
+ */
+static void
+comm_cb_wc_flush(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
+{
+	struct iovec iov[COMM_WC_MAXIOV];
+	struct comm_wc_ent *e;
 	struct fde_comm *c = arg;
-	//fde_comm_cb_status s;
-	struct sockaddr_storage sin;
-	socklen_t slen;
+	int n, is_corked = 0;
+	ssize_t ret, len;
 
 	/* Closing? Don't do the IO; start the closing machinery */
 	if (c->is_closing) {
-		c->a.is_active = 0;
-		c->a.cb(fd, c, c->a.cbdata, FDE_COMM_CB_CLOSING, 0, NULL, 0, 0);
-		if (comm_is_close_ready(c)) {
+		fde_delete(c->fh_parent, c->ev_wr_deadline);
+		while (TAILQ_FIRST(&c->wc.q) != NULL)
+			comm_wc_complete(c, FDE_COMM_CB_CLOSING);
+		comm_wr_release(c);
+		if (comm_is_close_ready(c))
 			comm_start_cleanup(c);
-			return;
-		}
-	}
-
-	if (c->a.is_active == 0) {
-		fprintf(stderr, "%s: %p: FD %d: comm_cb_accept but not active?\n",
-		    __func__,
-		    c,
-		    fd);
 		return;
 	}
 
-	/*
-	 * Loop over, accepting new connections.
-	 *
-	 * If the owner deletes the connection, we will drop out
-	 * from the loop and not re-add things.
-	 */
-	while (1) {
-		slen = sizeof(sin);
-		ret = accept(fd, (struct sockaddr *) &sin, &slen);
+	/* Not writable yet; the write event will reschedule us */
+	while (c->wr.is_ready && TAILQ_FIRST(&c->wc.q) != NULL) {
+		n = 0;
+		len = 0;
+		TAILQ_FOREACH(e, &c->wc.q, node) {
+			if (n == COMM_WC_MAXIOV)
+				break;
+			iov[n].iov_base = iapp_netbuf_buf_nonconst(e->nb) +
+			    e->nb_start_offset + e->offset;
+			iov[n].iov_len = e->len - e->offset;
+			len += iov[n].iov_len;
+			n++;
+		}
 
-		/* Break out on error; handle it elsewhere */
-		if (ret < 0)
-			break;
+#ifdef	COMM_TCP_CORK
+		/* More than one writev()? Don't push a short segment */
+		if (c->wc.do_cork && is_corked == 0 && e != NULL) {
+			comm_wc_cork(c, 1);
+			is_corked = 1;
+		}
+#endif
 
-		/*
-		 * Default - set non-blocking.
-		 */
-		(void) comm_fd_set_nonblocking(ret, 1);
+		ret = comm_io_writev(c, iov, n);
+		c->wc.n_writev++;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				c->wr.is_ready = 0;
+				break;
+			}
+
+			/* Fail everything queued, and stop watching */
+			while (TAILQ_FIRST(&c->wc.q) != NULL)
+				comm_wc_complete(c, FDE_COMM_CB_ERROR);
+			comm_wr_release(c);
+			break;
+		}
 
 		/*
-		 * Call the callback.
+		 * Short write - the socket buffer is full.  A channel
+		 * has no write event; go around and let the next write
+		 * fail with EAGAIN so the peer knows to wake us.
 		 */
-		c->a.cb(fd, c, c->a.cbdata, FDE_COMM_CB_COMPLETED, ret,
-		    (struct sockaddr *) &sin, slen, 0);
-	}
-
-	/*
-	 * Handle error or transient error.
-	 */
+		if (ret < len && c->shm == NULL)
+			c->wr.is_ready = 0;
+
+		/* Progress; restart the deadline */
+		if (ret > 0 && c->dl.write_ms != 0)
+			fde_add_deadline(c->fh_parent, c->ev_wr_deadline,
+			    c->dl.write_ms);
+
+		/* Complete what was fully written */
+		while (ret > 0) {
+			e = TAILQ_FIRST(&c->wc.q);
+			n = XMIN(ret, e->len - e->offset);
+			e->offset += n;
+			ret -= n;
+			if (e->offset == e->len)
+				comm_wc_complete(c, FDE_COMM_CB_COMPLETED);
+		}
 
-	/*
-	 * Transient error.
-	 */
-	if (errno == EWOULDBLOCK || errno == EAGAIN) {
-		fde_add(c->fh_parent, c->ev_accept);
-		return;
+		/* The callbacks may have closed us; comm_close() reschedules */
+		if (c->is_closing)
+			break;
 	}
 
-	/*
-	 * Re-add for another event; the caller may choose to
-	 * delete it and schedule things to close.
-	 */
-	fde_add(c->fh_parent, c->ev_accept);
+#ifdef	COMM_TCP_CORK
+	if (is_corked)
+		comm_wc_cork(c, 0);
+#endif
 
-	/* Non-transient error; inform the upper layer */
-	c->a.cb(fd, c, c->a.cbdata, FDE_COMM_CB_ERROR, -1, NULL, 0, errno);
+	if (c->wc.qlen == 0)
+		fde_delete(c->fh_parent, c->ev_wr_deadline);
 }
 
+/*
+ * Deadlines.  These cancel the operation and hand it back with
+ * FDE_COMM_CB_TIMEOUT.  A close in progress completes things
+ * itself, so leave those alone.
+ */
 static void
-comm_cb_cleanup(int fd, struct fde *f, void *arg, fde_cb_status status)
+comm_cb_rd_deadline(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
 {
 	struct fde_comm *c = arg;
 
-	/* XXX complain if is_closing / is_cleanup isn't done! */
-
-	/*
-	 * Call the close callback if one was registered.
-	 */
-	if (c->c.cb != NULL)
-		c->c.cb(c->fd, c, c->c.cbdata);
-
-	/*
-	 * Close the file descriptor if we're allowed to.
-	 */
-	if (c->do_close == 1)
-		close(c->fd);
-
-	/*
-	 * Free this FDE. It's fine to do it in a callback handler
-	 * as the callback API guarantees that we can do this.
-	 * (Note: it's not guaranteed for freeing IO FDEs from within
-	 * an IO callback!)
-	 *
-	 * XXX All of these should be inactive at this point; maybe
-	 * I should make fde_free() complain loudly if it's active!
-	 */
-	fde_free(c->fh_parent, c->ev_read);
-	fde_free(c->fh_parent, c->ev_read_cb);
-	fde_free(c->fh_parent, c->ev_write);
-	fde_free(c->fh_parent, c->ev_write_cb);
-	fde_free(c->fh_parent, c->ev_accept);
-	fde_free(c->fh_parent, c->ev_connect);
-	fde_free(c->fh_parent, c->ev_connect_start);
-	fde_free(c->fh_parent, c->ev_cleanup);
-	fde_free(c->fh_parent, c->ev_udp_read);
-	fde_free(c->fh_parent, c->ev_udp_write);
+	if (c->is_closing || c->r.is_active == 0)
+		return;
 
-	/*
-	 * Finally, free the fde_comm state.
-	 */
-	free(c);
+	fde_delete(c->fh_parent, c->ev_read_cb);
+	c->r.is_active = 0;
+	comm_rd_release(c);
+	c->r.cb(c->fd, c, c->r.cbdata, FDE_COMM_CB_TIMEOUT, 0);
 }
 
-/*
- * Check the progress of the connect().
- */
 static void
-comm_cb_connect(int fd, struct fde *f, void *arg, fde_cb_status status)
+comm_cb_wr_deadline(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
 {
-	int x, err;
 	struct fde_comm *c = arg;
-	socklen_t slen;
+	int n;
+
+	if (c->is_closing)
+		return;
+
+	if (c->w.is_active) {
+		fde_delete(c->fh_parent, c->ev_write_cb);
+		c->w.is_active = 0;
+		comm_wr_release(c);
+		comm_write_notify(c, FDE_COMM_CB_TIMEOUT);
+		return;
+	}
+
+	/* Time out what's queued now, not what the callbacks add */
+	for (n = c->wc.qlen; n > 0 && c->is_closing == 0; n--)
+		comm_wc_complete(c, FDE_COMM_CB_TIMEOUT);
+	if (c->wc.qlen == 0) {
+		fde_delete(c->fh_parent, c->ev_wc_flush);
+		comm_wr_release(c);
+	} else if (c->is_closing == 0 && c->dl.write_ms != 0)
+		fde_add_deadline(c->fh_parent, c->ev_wr_deadline,
+		    c->dl.write_ms);
+}
+
+static void
+comm_cb_co_deadline(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
+{
+	struct fde_comm *c = arg;
+
+	if (c->is_closing || c->co.is_active == 0)
+		return;
+
+	fde_delete(c->fh_parent, c->ev_connect_start);
+	fde_delete(c->fh_parent, c->ev_connect_cb);
+	c->co.is_active = 0;
+	comm_wr_release(c);
+	c->co.cb(c->fd, c, c->co.cbdata, FDE_COMM_CB_TIMEOUT, ETIMEDOUT);
+}
+
+static void
+comm_sendfile_complete(struct fde_comm *c, fde_comm_cb_status s, int xerrno)
+{
+
+	c->sf.is_active = 0;
+	c->sf.fdd = NULL;
+	c->sf.cb(c->fd, c, c->sf.cbdata, s, c->sf.progress, xerrno);
+}
+
+/*
+ * Do a single sendfile() pass from the current position without
+ * blocking on disk IO.
+ *
+ * Returns 0 and the number of bytes sent in *sbytes (0 meaning
+ * end of file), or -1 with errno set.  errno is EBUSY if the file
+ * data isn't resident; *sbytes may be non-zero on error.
+ */
+static int
+comm_sendfile_nodiskio(struct fde_comm *c, off_t *sbytes)
+{
+	off_t ofs = c->sf.offset + c->sf.progress;
+	size_t nbytes = c->sf.len - c->sf.progress;
+
+	*sbytes = 0;
+
+#if defined(__FreeBSD__)
+	return (sendfile(c->sf.fdd->fd, c->fd, ofs, nbytes, NULL, sbytes,
+	    SF_NODISKIO));
+#elif defined(__linux__)
+	{
+		struct iovec iov;
+		ssize_t r;
+
+		/*
+		 * There's no SF_NODISKIO here.  Instead, probe how much
+		 * of the next page-in chunk is resident with a RWF_NOWAIT
+		 * read and only send that much.  Any probe failure other
+		 * than end of file is handed to the page-in helper, which
+		 * does a plain blocking read.
+		 */
+		if (comm_sf_probe_buf == NULL) {
+			comm_sf_probe_buf = malloc(COMM_SF_PAGEIN_SIZE);
+			if (comm_sf_probe_buf == NULL)
+				return (-1);
+		}
+		iov.iov_base = comm_sf_probe_buf;
+		iov.iov_len = XMIN(nbytes, COMM_SF_PAGEIN_SIZE);
+		r = preadv2(c->sf.fdd->fd, &iov, 1, ofs, RWF_NOWAIT);
+		if (r < 0) {
+			errno = EBUSY;
+			return (-1);
+		}
+		if (r == 0)
+			return (0);
+
+		r = sendfile(c->fd, c->sf.fdd->fd, &ofs, r);
+		if (r < 0)
+			return (-1);
+		*sbytes = r;
+		return (0);
+	}
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+/*
+ * Page in file data - this runs in a helper thread.
+ */
+static void
+comm_sendfile_pagein_run(struct iapp_task *t, void *arg)
+{
+	struct fde_comm *c = arg;
+	char *buf;
+
+	buf = malloc(c->sf.pg_len);
+	if (buf == NULL) {
+		t->retval = -1;
+		t->xerrno = ENOMEM;
+		return;
+	}
+
+	/*
+	 * Reading the range pulls it into the page cache; the data
+	 * itself is thrown away and sendfile() does the real work.
+	 */
+	t->retval = pread(c->sf.fdd->fd, buf, c->sf.pg_len, c->sf.pg_offset);
+	if (t->retval < 0)
+		t->xerrno = errno;
+
+	free(buf);
+}
+
+/*
+ * Page in has finished - this runs in the owner thread.
+ */
+static void
+comm_sendfile_pagein_done(struct iapp_task *t, void *arg)
+{
+	struct fde_comm *c = arg;
+
+	c->sf.is_busy = 0;
+
+	if (c->is_closing) {
+		comm_sendfile_complete(c, FDE_COMM_CB_CLOSING, 0);
+		if (comm_is_close_ready(c))
+			comm_start_cleanup(c);
+		return;
+	}
+
+	if (t->retval < 0) {
+		comm_sendfile_complete(c, FDE_COMM_CB_ERROR, t->xerrno);
+		return;
+	}
+	if (t->retval == 0) {
+		comm_sendfile_complete(c, FDE_COMM_CB_EOF, 0);
+		return;
+	}
+
+	/* It should be resident now; try again */
+	fde_add(c->fh_parent, c->ev_sendfile_cb);
+}
+
+/*
+ * Hand the next chunk to a helper thread to page in.
+ *
+ * Returns 0 if the page-in was started, or -1 with errno set.
+ */
+static int
+comm_sendfile_pagein(struct fde_comm *c)
+{
+	struct iapp_taskq *tq;
+
+	tq = iapp_taskq_default();
+	if (tq == NULL) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+
+	if (c->sf.task == NULL) {
+		c->sf.task = calloc(1, sizeof(struct iapp_task));
+		if (c->sf.task == NULL) {
+			warn("%s: calloc", __func__);
+			errno = ENOMEM;
+			return (-1);
+		}
+		if (iapp_task_init(c->sf.task, c->fh_parent,
+		    comm_sendfile_pagein_run, comm_sendfile_pagein_done,
+		    c) < 0) {
+			free(c->sf.task);
+			c->sf.task = NULL;
+			errno = ENOMEM;
+			return (-1);
+		}
+	}
+
+	c->sf.pg_offset = c->sf.offset + c->sf.progress;
+	c->sf.pg_len = XMIN(c->sf.len - c->sf.progress, COMM_SF_PAGEIN_SIZE);
+	c->sf.is_busy = 1;
+	if (iapp_taskq_submit(tq, c->sf.task) < 0) {
+		c->sf.is_busy = 0;
+		errno = EBUSY;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Push as much of the sendfile range out as the socket will take.
+ */
+static void
+comm_cb_sendfile_cb(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
+{
+	struct fde_comm *c = arg;
+	off_t sbytes;
+	int ret;
+
+	/* Closing? Don't do the IO; start the closing machinery */
+	if (c->is_closing) {
+		/* The page-in completion will finish this off */
+		if (c->sf.is_busy)
+			return;
+		if (c->sf.is_active)
+			comm_sendfile_complete(c, FDE_COMM_CB_CLOSING, 0);
+		if (comm_is_close_ready(c))
+			comm_start_cleanup(c);
+		return;
+	}
+
+	if (c->sf.is_active == 0) {
+		fprintf(stderr, "%s: %p: FD %d: comm_cb_sendfile but not active?\n",
+		    __func__,
+		    c,
+		    c->fd);
+		return;
+	}
+
+	/* Waiting for file data; the page-in completion reschedules us */
+	if (c->sf.is_busy)
+		return;
+
+	while (c->sf.progress < c->sf.len) {
+		ret = comm_sendfile_nodiskio(c, &sbytes);
+		c->sf.progress += sbytes;
+
+		if (ret == 0) {
+			/* Nothing sent and no error: end of file */
+			if (sbytes == 0) {
+				comm_sendfile_complete(c, FDE_COMM_CB_EOF, 0);
+				return;
+			}
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		/* Socket buffer is full; wait for the next write-ready */
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			c->wr.is_ready = 0;
+			return;
+		}
+
+		/* Not resident - have a helper page it in */
+		if (errno == EBUSY) {
+			if (comm_sendfile_pagein(c) < 0)
+				comm_sendfile_complete(c, FDE_COMM_CB_ERROR,
+				    errno);
+			return;
+		}
+
+		comm_sendfile_complete(c, FDE_COMM_CB_ERROR, errno);
+		return;
+	}
+
+	comm_sendfile_complete(c, FDE_COMM_CB_COMPLETED, 0);
+}
+
+static struct comm_splice_buf *
+comm_splice_buf_get(void)
+{
+	struct comm_splice_buf *b;
+
+	if ((b = comm_splice_pool) != NULL) {
+		comm_splice_pool = b->next;
+		comm_splice_pool_cnt--;
+		b->next = NULL;
+		return (b);
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+#ifdef	__linux__
+	if (pipe2(b->pfd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		warn("%s: pipe2", __func__);
+		free(b);
+		return (NULL);
+	}
+	(void) fcntl(b->pfd[1], F_SETPIPE_SZ, COMM_SPLICE_BUF_SIZE);
+#endif
+
+	return (b);
+}
+
+static void
+comm_splice_buf_free(struct comm_splice_buf *b)
+{
+
+#ifdef	__linux__
+	close(b->pfd[0]);
+	close(b->pfd[1]);
+#endif
+	free(b);
+}
+
+static void
+comm_splice_buf_put(struct comm_splice_buf *b)
+{
+
+	/*
+	 * A pipe with data still in it can't be reused; and don't
+	 * let the pool grow without bound.
+	 */
+	if (b->fill != 0 || comm_splice_pool_cnt >= COMM_SPLICE_POOL_MAX) {
+		comm_splice_buf_free(b);
+		return;
+	}
+
+#ifndef	__linux__
+	b->off = 0;
+#endif
+	b->next = comm_splice_pool;
+	comm_splice_pool = b;
+	comm_splice_pool_cnt++;
+}
+
+/*
+ * Read from the source into the splice buffer.
+ *
+ * Returns the number of bytes read, 0 on EOF or -1 with errno set.
+ */
+static ssize_t
+comm_splice_fill(struct fde_comm *c, size_t len)
+{
+	struct comm_splice_buf *b = c->sp.b;
+	ssize_t r;
+
+#ifdef	__linux__
+	r = splice(c->fd, NULL, b->pfd[1], NULL, len,
+	    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+	b->off = 0;
+	r = read(c->fd, b->buf, len);
+#endif
+	comm_stat_rd(c, r);
+	if (r > 0)
+		b->fill += r;
+	return (r);
+}
+
+/*
+ * Write from the splice buffer to the destination.
+ *
+ * Returns the number of bytes written or -1 with errno set.
+ */
+static ssize_t
+comm_splice_drain(struct fde_comm *c)
+{
+	struct comm_splice_buf *b = c->sp.b;
+	ssize_t r;
+
+#ifdef	__linux__
+	r = splice(b->pfd[0], NULL, c->sp.dst->fd, NULL, b->fill,
+	    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+	r = send(c->sp.dst->fd, b->buf + b->off, b->fill, MSG_NOSIGNAL);
+	if (r > 0)
+		b->off += r;
+#endif
+	comm_stat_wr(c->sp.dst, r, b->fill);
+	if (r > 0) {
+		b->fill -= r;
+		c->sp.moved += r;
+	}
+	return (r);
+}
+
+static void
+comm_splice_complete(struct fde_comm *c, fde_comm_cb_status s, int xerrno)
+{
+	struct fde_comm *dst = c->sp.dst;
+
+	c->sp.is_active = 0;
+	c->sp.dst = NULL;
+	dst->sp_src = NULL;
+	comm_splice_buf_put(c->sp.b);
+	c->sp.b = NULL;
+
+	c->sp.cb(c->fd, c, c->sp.cbdata, s, c->sp.moved, xerrno);
+
+	/* Either side may have been waiting on us to finish closing */
+	if (dst->is_closing && comm_is_close_ready(dst))
+		comm_start_cleanup(dst);
+}
+
+/*
+ * Move data from the source to the destination until one of them
+ * would block.
+ */
+static void
+comm_cb_splice_cb(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
+{
+	struct fde_comm *c = arg;
+	struct comm_splice_buf *b;
+	ssize_t r;
+	size_t len;
+
+	if (c->sp.is_active == 0) {
+		/* Closing with no splice left; just finish the close */
+		if (c->is_closing && comm_is_close_ready(c))
+			comm_start_cleanup(c);
+		return;
+	}
+
+	/* Closing? Don't do the IO; start the closing machinery */
+	if (c->is_closing || c->sp.dst->is_closing) {
+		comm_splice_complete(c, FDE_COMM_CB_CLOSING, 0);
+		if (c->is_closing && comm_is_close_ready(c))
+			comm_start_cleanup(c);
+		return;
+	}
+
+	b = c->sp.b;
+
+	while (1) {
+		/*
+		 * Push out what we have first.  We only go back to the
+		 * source once the buffer is empty - that's the backpressure.
+		 */
+		if (b->fill > 0) {
+			if (c->sp.dst->wr.is_ready == 0)
+				return;
+			r = comm_splice_drain(c);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					c->sp.dst->wr.is_ready = 0;
+					return;
+				}
+				comm_splice_complete(c, FDE_COMM_CB_ERROR,
+				    errno);
+				return;
+			}
+			continue;
+		}
+
+		/* Empty buffer - are we done? */
+		if (c->sp.is_eof) {
+			comm_splice_complete(c, FDE_COMM_CB_EOF, 0);
+			return;
+		}
+		if (c->sp.max_bytes > 0 && c->sp.moved >= c->sp.max_bytes) {
+			comm_splice_complete(c, FDE_COMM_CB_COMPLETED, 0);
+			return;
+		}
+
+		if (c->rd.is_ready == 0)
+			return;
+
+		len = COMM_SPLICE_BUF_SIZE;
+		if (c->sp.max_bytes > 0)
+			len = XMIN(len, c->sp.max_bytes - c->sp.moved);
+
+		r = comm_splice_fill(c, len);
+		if (r == 0) {
+			c->sp.is_eof = 1;
+			continue;
+		}
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				c->rd.is_ready = 0;
+				return;
+			}
+			comm_splice_complete(c, FDE_COMM_CB_ERROR, errno);
+			return;
+		}
+	}
+}
+
+static void
+comm_accept_notify(struct fde_comm *c, fde_comm_cb_status s, int newfd,
+    struct sockaddr *sa, socklen_t slen, int len, int xerrno)
+{
+
+	if (c->a.data_cb != NULL)
+		c->a.data_cb(c->fd, c, c->a.cbdata, s, newfd, sa, slen,
+		    c->a.buf, len, xerrno);
+	else
+		c->a.cb(c->fd, c, c->a.cbdata, s, newfd, sa, slen, xerrno);
+}
+
+static void
+comm_cb_accept_cb(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
+{
+	int ret, len;
+	struct fde_comm *c = arg;
+	struct sockaddr_storage sin;
+	socklen_t slen;
+
+	/* Closing? Don't do the IO; start the closing machinery */
+	if (c->is_closing) {
+		c->a.is_active = 0;
+		comm_accept_notify(c, FDE_COMM_CB_CLOSING, 0, NULL, 0, 0, 0);
+		comm_rd_release(c);
+		if (comm_is_close_ready(c))
+			comm_start_cleanup(c);
+		return;
+	}
+
+	/* Stale callback; nothing to do */
+	if (c->a.is_active == 0 || c->rd.is_ready == 0)
+		return;
+
+	/*
+	 * Loop over, accepting new connections until the listen
+	 * queue is empty.
+	 *
+	 * If the owner closes the listen socket, we will drop out
+	 * from the loop; comm_close() has scheduled us again.
+	 */
+	while (c->is_closing == 0) {
+		slen = sizeof(sin);
+
+		/*
+		 * Default - set non-blocking.  accept4() does this
+		 * for us without another pair of fcntl() calls.
+		 */
+		ret = accept4(c->fd, (struct sockaddr *) &sin, &slen,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		/* Break out on error; handle it elsewhere */
+		if (ret < 0)
+			break;
+
+		/*
+		 * Pick up anything that's already arrived, eg with
+		 * the SYN.
+		 */
+		len = 0;
+		if (c->a.buflen > 0) {
+			len = recv(ret, c->a.buf, c->a.buflen, MSG_DONTWAIT);
+			if (len < 0)
+				len = 0;
+		}
+
+		/*
+		 * Call the callback.
+		 */
+		comm_accept_notify(c, FDE_COMM_CB_COMPLETED, ret,
+		    (struct sockaddr *) &sin, slen, len, 0);
+	}
+
+	if (c->is_closing)
+		return;
+
+	/*
+	 * Transient error - the queue is drained; wait for the
+	 * next readiness event.
+	 */
+	if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+		c->rd.is_ready = 0;
+		return;
+	}
+
+	/*
+	 * Non-transient error (eg out of descriptors); inform the
+	 * upper layer.  The event stays registered; the next
+	 * connection to arrive will try again.
+	 */
+	comm_accept_notify(c, FDE_COMM_CB_ERROR, -1, NULL, 0, 0, errno);
+}
+
+static void
+comm_cb_cleanup(int fd, struct fde *f, void *arg, fde_cb_status status)
+{
+	struct fde_comm *c = arg;
+
+	/* XXX complain if is_closing / is_cleanup isn't done! */
+
+	/*
+	 * Call the close callback if one was registered.
+	 */
+	if (c->c.cb != NULL)
+		c->c.cb(c->fd, c, c->c.cbdata);
+
+	/* Let a protocol layer say goodbye and free its state */
+	if (c->hs.fini != NULL)
+		c->hs.fini(c, c->hs.arg);
+
+	/*
+	 * Close the file descriptor if we're allowed to.  A channel
+	 * just tells its peer; the doorbell belongs to the channel.
+	 */
+	if (c->shm != NULL)
+		iapp_shm_chan_close(c->shm, c->shm_side);
+	else if (c->do_close == 1)
+		close(c->fd);
+
+	/*
+	 * Free this FDE. It's fine to do it in a callback handler
+	 * as the callback API guarantees that we can do this.
+	 * (Note: it's not guaranteed for freeing IO FDEs from within
+	 * an IO callback!)
+	 *
+	 * XXX All of these should be inactive at this point; maybe
+	 * I should make fde_free() complain loudly if it's active!
+	 */
+	fde_free(c->fh_parent, c->ev_read);
+	fde_free(c->fh_parent, c->ev_read_cb);
+	fde_free(c->fh_parent, c->ev_write);
+	fde_free(c->fh_parent, c->ev_write_cb);
+	fde_free(c->fh_parent, c->ev_accept_cb);
+	fde_free(c->fh_parent, c->ev_connect_cb);
+	fde_free(c->fh_parent, c->ev_connect_start);
+	fde_free(c->fh_parent, c->ev_cleanup);
+	fde_free(c->fh_parent, c->ev_udp_read_cb);
+	fde_free(c->fh_parent, c->ev_udp_write_cb);
+	fde_free(c->fh_parent, c->ev_sendfile_cb);
+	fde_free(c->fh_parent, c->ev_splice_cb);
+	fde_free(c->fh_parent, c->ev_wc_flush);
+	fde_free(c->fh_parent, c->ev_fp_read_cb);
+	fde_free(c->fh_parent, c->ev_fp_flush);
+	fde_free(c->fh_parent, c->ev_rd_deadline);
+	fde_free(c->fh_parent, c->ev_wr_deadline);
+	fde_free(c->fh_parent, c->ev_co_deadline);
+	if (c->ev_tcpi != NULL)
+		fde_free(c->fh_parent, c->ev_tcpi);
+	if (c->ev_hs_cb != NULL)
+		fde_free(c->fh_parent, c->ev_hs_cb);
+
+	if (c->sf.task != NULL) {
+		iapp_task_cleanup(c->sf.task);
+		free(c->sf.task);
+	}
+	free(c->fp_w.q);
+	free(c->a.buf);
+
+	/*
+	 * Finally, free the fde_comm state.
+	 */
+	free(c);
+}
+
+/*
+ * Check the progress of the connect().
+ */
+static void
+comm_cb_connect(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
+{
+	int x, err;
+	struct fde_comm *c = arg;
+	socklen_t slen;
+
+	/* Closing? Don't bother checking; start the closing machinery */
+	if (c->is_closing) {
+		if (c->co.is_active == 0)
+			return;
+		c->co.is_active = 0;
+		fde_delete(c->fh_parent, c->ev_co_deadline);
+		c->co.cb(c->fd, c, c->co.cbdata, FDE_COMM_CB_CLOSING, 0);
+		comm_wr_release(c);
+		if (comm_is_close_ready(c))
+			comm_start_cleanup(c);
+		return;
+	}
+
+	/* Stale callback, or not writable yet */
+	if (c->co.is_active == 0 || c->wr.is_ready == 0)
+		return;
 
 #if 0
 	fprintf(stderr, "%s: %p: FD %d: called\n", __func__, c, c->fd);
@@ -505,19 +1620,59 @@ comm_cb_connect(int fd, struct fde *f, void *arg, fde_cb_status status)
 
 	/* Now, check */
 	if (x == 0 && errno == EINPROGRESS) {
-		/* Still in progress */
-		fde_add(c->fh_parent, c->ev_connect);
+		/* Still in progress; wait for the next write event */
+		c->wr.is_ready = 0;
 	} else if (x == 0 && errno == 0) {
 		/* Completed! */
 		c->co.is_active = 0;
-		c->co.cb(c->fd, c, c->co.cbdata, FDE_COMM_CB_COMPLETED, 0);
+		fde_delete(c->fh_parent, c->ev_co_deadline);
+		c->co.cb(c->fd, c, c->co.cbdata, FDE_COMM_CB_COMPLETED,
+		    c->co.sent);
 	} else {
 		/* Failure? */
 		c->co.is_active = 0;
+		fde_delete(c->fh_parent, c->ev_co_deadline);
 		c->co.cb(c->fd, c, c->co.cbdata, FDE_COMM_CB_ERROR, errno);
 	}
 }
 
+/*
+ * connect() with the initial data in the SYN.  The data goes out
+ * if the kernel has a Fast Open cookie for the server; otherwise
+ * it asks for one and this is a plain connect.  Either way the
+ * handshake is still in progress, so finish it the same way.
+ */
+static int
+comm_connect_tfo(struct fde_comm *c)
+{
+	ssize_t r;
+	int flags = 0;
+#if	!defined(MSG_FASTOPEN) && defined(TCP_FASTOPEN)
+	int a = 1;
+#endif
+
+#if	defined(MSG_FASTOPEN)
+	flags = MSG_FASTOPEN;
+#elif	defined(TCP_FASTOPEN)
+	/* FreeBSD: an implicit connect from sendto() uses Fast Open */
+	(void) setsockopt(c->fd, IPPROTO_TCP, TCP_FASTOPEN, &a, sizeof(a));
+#else
+	return (connect(c->fd, (struct sockaddr *) &c->co.sin, c->co.slen));
+#endif
+
+	r = sendto(c->fd, c->co.buf, c->co.len, flags,
+	    (struct sockaddr *) &c->co.sin, c->co.slen);
+	if (r < 0 && (errno == EOPNOTSUPP || errno == ENOPROTOOPT))
+		return (connect(c->fd, (struct sockaddr *) &c->co.sin,
+		    c->co.slen));
+	if (r < 0)
+		return (-1);
+
+	c->co.sent = r;
+	errno = EINPROGRESS;
+	return (-1);
+}
+
 /*
  * Begin the first part of connect() - issue the connect()
  * and see if it succeeds.
@@ -542,6 +1697,7 @@ comm_cb_connect_start(int fd_unused, struct fde *f, void *arg,
 			    c,
 			    c->fd);
 		c->co.is_active = 0;
+		fde_delete(c->fh_parent, c->ev_co_deadline);
 		c->co.cb(c->fd, c, c->co.cbdata, FDE_COMM_CB_CLOSING, 0);
 		if (comm_is_close_ready(c)) {
 			comm_start_cleanup(c);
@@ -559,7 +1715,11 @@ comm_cb_connect_start(int fd_unused, struct fde *f, void *arg,
 	}
 
 	/* Start the first connect() attempt */
-	ret = connect(c->fd, (struct sockaddr *) &c->co.sin, c->co.slen);
+	if (c->co.len > 0)
+		ret = comm_connect_tfo(c);
+	else
+		ret = connect(c->fd, (struct sockaddr *) &c->co.sin,
+		    c->co.slen);
 
 #if 0
 	fprintf(stderr, "%s: %p: FD %d: connect() returned %d (errno %d (%s))\n",
@@ -575,100 +1735,162 @@ comm_cb_connect_start(int fd_unused, struct fde *f, void *arg,
 #if 0
 		fprintf(stderr, "%s: %p: FD %d: waiting\n", __func__, c, c->fd);
 #endif
-		fde_add(c->fh_parent, c->ev_connect);
+		c->wr.is_ready = 0;
+		comm_wr_register(c);
 		return;
 	}
 
 	/* Well, it completed; let's handle the error case */
 	c->co.is_active = 0;
+	fde_delete(c->fh_parent, c->ev_co_deadline);
 	if (ret < 0) {
 		s = FDE_COMM_CB_ERROR;
 	} else {
 		s = FDE_COMM_CB_COMPLETED;
 	}
-	c->co.cb(c->fd, c, c->co.cbdata, s, ret == 0 ? 0 : errno);
+	c->co.cb(c->fd, c, c->co.cbdata, s, ret == 0 ? c->co.sent : errno);
+}
+
+/*
+ * Receive one datagram, along with its kernel timestamp if asked.
+ */
+static ssize_t
+comm_udp_recv(struct fde_comm *c, struct fde_comm_udp_frame *fr)
+{
+	union comm_udp_ts_cmsg cm;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t r;
+
+	if (c->udp_r.do_timestamps == 0)
+		return (recvfrom(c->fd, fr->buf, fr->size, MSG_DONTWAIT,
+		    (struct sockaddr *) &fr->sa_rem, &fr->sl_rem));
+
+	iov.iov_base = fr->buf;
+	iov.iov_len = fr->size;
+	bzero(&msg, sizeof(msg));
+	msg.msg_name = &fr->sa_rem;
+	msg.msg_namelen = fr->sl_rem;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = sizeof(cm.buf);
+
+	r = recvmsg(c->fd, &msg, MSG_DONTWAIT);
+	if (r < 0)
+		return (r);
+	fr->sl_rem = msg.msg_namelen;
+
+#ifdef	COMM_SCM_RX_TS
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == COMM_SCM_RX_TS)
+			memcpy(&fr->ts_kern, CMSG_DATA(cmsg),
+			    sizeof(fr->ts_kern));
+	}
+#endif
+	return (r);
 }
 
 static void
-comm_cb_udp_read(int fd, struct fde *f, void *arg, fde_cb_status status)
+comm_cb_udp_read_cb(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
 {
 	struct fde_comm_udp_frame *fr;
 	struct fde_comm *c = arg;
-	int r, xerrno;
+	int i, r, xerrno;
 
 	/* Closing? Don't do the IO; start the closing machinery */
 	if (c->is_closing) {
 		c->udp_r.is_active = 0;
 		c->udp_r.cb(c->fd, c, c->udp_r.cbdata, NULL,
-		    FDE_COMM_CB_CLOSING, ENOMEM);
-		if (comm_is_close_ready(c)) {
+		    FDE_COMM_CB_CLOSING, 0);
+		comm_rd_release(c);
+		if (comm_is_close_ready(c))
 			comm_start_cleanup(c);
-			return;
-		}
-	}
-
-	if (c->udp_r.is_active == 0) {
-		/* XXX disable the event */
 		return;
 	}
 
-
-	fr = fde_comm_udp_alloc(c, c->udp_r.maxlen);
+	/* Stale callback; nothing to do */
+	if (c->udp_r.is_active == 0 || c->rd.is_ready == 0)
+		return;
 
 	/*
-	 * XXX Allocation failure? Tell the caller; we likely should
-	 * stop reading on this socket until the caller calls a 'restart'
-	 * method.
+	 * Read a batch of frames, then yield to the other events;
+	 * if we're still ready we'll be rescheduled.
 	 */
-	if (fr == NULL) {
-		/*
-		 * Reschedule; the parent can deschedule us if required.
-		 */
-		fde_add(c->fh_parent, c->ev_udp_read);
-		/* XXX ENOMEM? */
-		c->udp_r.cb(c->fd, c, c->udp_r.cbdata, NULL,
-		    FDE_COMM_CB_ERROR, ENOMEM);
-		return;
-	}
+	for (i = 0; i < COMM_UDP_READ_BATCH; i++) {
+		if (c->udp_r.is_active == 0 || c->is_closing)
+			return;
 
-	/* Do a read */
-	r = recvfrom(c->fd, fr->buf, fr->size, MSG_DONTWAIT,
-	    (struct sockaddr *) &fr->sa_rem, &fr->sl_rem);
+		fr = fde_comm_udp_alloc(c, c->udp_r.maxlen);
 
-	if (r < 0) {
-		/* Free buffer, return errno */
-		xerrno = errno;
-		fde_comm_udp_free(c, fr);
 		/*
-		 * Reschedule; the parent can deschedule us if required.
+		 * XXX Allocation failure? Tell the caller.  We stay
+		 * ready, so the next frame to arrive will try again.
 		 */
-		fde_add(c->fh_parent, c->ev_udp_read);
-		c->udp_r.cb(c->fd, c, c->udp_r.cbdata, NULL,
-		    FDE_COMM_CB_ERROR, xerrno);
-		return;
-	}
+		if (fr == NULL) {
+			c->udp_r.cb(c->fd, c, c->udp_r.cbdata, NULL,
+			    FDE_COMM_CB_ERROR, ENOMEM);
+			return;
+		}
 
-	/* Set socket length */
-	fr->len = r;
+		/* Do a read */
+		r = comm_udp_recv(c, fr);
+		comm_stat_rd(c, r);
+
+		if (r < 0) {
+			/* Free buffer, return errno */
+			xerrno = errno;
+			fde_comm_udp_free(c, fr);
+
+			/* Drained; wait for the next readiness event */
+			if (xerrno == EAGAIN || xerrno == EWOULDBLOCK) {
+				c->rd.is_ready = 0;
+				return;
+			}
+			if (xerrno == EINTR)
+				continue;
+
+			/*
+			 * Hard error; report it once and wait for the next
+			 * readiness event.  The owner decides whether to
+			 * carry on or close.
+			 */
+			c->rd.is_ready = 0;
+			c->udp_r.cb(c->fd, c, c->udp_r.cbdata, NULL,
+			    FDE_COMM_CB_ERROR, xerrno);
+			return;
+		}
 
-	/*
-	 * Re-schedule for read early; that way the callback
-	 * can just disable things.
-	 */
-	fde_add(c->fh_parent, c->ev_udp_read);
-	c->udp_r.cb(c->fd, c, c->udp_r.cbdata, fr, FDE_COMM_CB_COMPLETED, 0);
+		/* Set socket length */
+		fr->len = r;
+
+		if (c->udp_r.do_timestamps)
+			(void) clock_gettime(CLOCK_REALTIME,
+			    &fr->ts_dispatch);
+
+		c->udp_r.cb(c->fd, c, c->udp_r.cbdata, fr,
+		    FDE_COMM_CB_COMPLETED, 0);
+	}
+
+	/* Batch done; come back for more */
+	if (c->udp_r.is_active && c->is_closing == 0)
+		fde_add(c->fh_parent, c->ev_udp_read_cb);
 }
 
 /*
  * Write data to the UDP socket.
  */
 static void
-comm_cb_udp_write(int fd, struct fde *f, void *arg, fde_cb_status status)
+comm_cb_udp_write_cb(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
 {
 	struct fde_comm_udp_frame *fr;
 	struct fde_comm *c = arg;
 	int ret;
-	int r, xerrno;
 
 	/* Closing? Don't do the IO; start the closing machinery */
 	if (c->is_closing) {
@@ -681,40 +1903,18 @@ comm_cb_udp_write(int fd, struct fde *f, void *arg, fde_cb_status status)
 			    0);
 		}
 
-		/* No longer active/primed */
+		/* No longer active */
 		c->udp_w.is_active = 0;
+		comm_wr_release(c);
 
-		/* XXX disable event */
-		c->udp_w.is_primed = 0;
-
-		if (comm_is_close_ready(c)) {
+		if (comm_is_close_ready(c))
 			comm_start_cleanup(c);
-			return;
-		}
-	}
-
-	if (c->udp_w.is_active == 0 || c->udp_w.is_primed == 0) {
-		/* XXX disable the event */
 		return;
 	}
 
-	/*
-	 * If the queue is empty, just bail for now.
-	 *
-	 * The next write will re-add the event.
-	 */
-	fr = TAILQ_FIRST(&c->udp_w.w_q);
-	if (fr == NULL) {
-		/* XXX disable event */
-		c->udp_w.is_primed = 0;
+	/* Not writable yet; the write event will reschedule us */
+	if (c->udp_w.is_active == 0 || c->wr.is_ready == 0)
 		return;
-	}
-
-	/*
-	 * Since we're using one-shot events, we are no longer
-	 * primed.
-	 */
-	c->udp_w.is_primed = 0;
 
 	/*
 	 * Loop through, doing sendto() calls until the first
@@ -722,8 +1922,9 @@ comm_cb_udp_write(int fd, struct fde *f, void *arg, fde_cb_status status)
 	 */
 	while ((fr = TAILQ_FIRST(&c->udp_w.w_q)) != NULL) {
 		ret = sendto(c->fd, fr->buf, fr->len, MSG_NOSIGNAL,
-		    (struct sockaddr *) &fr->sa_rem,
+		    fr->sl_rem == 0 ? NULL : (struct sockaddr *) &fr->sa_rem,
 		    fr->sl_rem);
+		comm_stat_wr(c, ret, fr->len);
 
 		/*
 		 * error case - break out if the errors are temporary,
@@ -731,9 +1932,17 @@ comm_cb_udp_write(int fd, struct fde *f, void *arg, fde_cb_status status)
 		 * sending this message.
 		 */
 		if (ret < 0) {
-			if (errno == EWOULDBLOCK || errno == EAGAIN
-			    || errno == EINTR)
-				 break;
+			if (errno == EINTR)
+				continue;
+
+			/*
+			 * Socket buffer is full; the write event
+			 * reschedules us once there's space.
+			 */
+			if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				c->wr.is_ready = 0;
+				break;
+			}
 
 			/* Yup, an error */
 			TAILQ_REMOVE(&c->udp_w.w_q, fr, node);
@@ -757,16 +1966,214 @@ comm_cb_udp_write(int fd, struct fde *f, void *arg, fde_cb_status status)
 		    (ret == fr->len) ? FDE_COMM_CB_COMPLETED : FDE_COMM_CB_ERROR,
 		    ret,
 		    0);
+
+		/* The callback may have closed us */
+		if (c->is_closing)
+			break;
 	}
+}
 
-	/*
-	 * If there's more left in the queue, re-prime.
-	 * Otherwise, bail; the next UDP socket queue will
-	 * prime this.
-	 */
-	if (TAILQ_FIRST(&c->udp_w.w_q) != NULL) {
-		c->udp_w.is_primed = 1;
-		fde_add(c->fh_parent, c->ev_udp_write);
+/*
+ * Receive passed descriptors.  Each message carries at least one
+ * byte of filler; the descriptors ride along in the control data.
+ */
+static void
+comm_cb_fp_read_cb(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
+{
+	struct fde_comm *c = arg;
+	union comm_fdpass_cmsg cm;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char buf[COMM_FDPASS_MAX];
+	int fds[COMM_FDPASS_MAX];
+	int flags, i, n, nfds, r, xerrno;
+
+	/* Closing? Don't do the IO; start the closing machinery */
+	if (c->is_closing) {
+		c->fp_r.is_active = 0;
+		c->fp_r.cb(c->fd, c, c->fp_r.cbdata, FDE_COMM_CB_CLOSING,
+		    NULL, 0, 0);
+		comm_rd_release(c);
+		if (comm_is_close_ready(c))
+			comm_start_cleanup(c);
+		return;
+	}
+
+	/* Stale callback; nothing to do */
+	if (c->fp_r.is_active == 0 || c->rd.is_ready == 0)
+		return;
+
+	flags = MSG_DONTWAIT;
+#ifdef	MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+	for (i = 0; i < COMM_UDP_READ_BATCH; i++) {
+		if (c->fp_r.is_active == 0 || c->is_closing)
+			return;
+
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cm.buf;
+		msg.msg_controllen = sizeof(cm.buf);
+
+		r = recvmsg(c->fd, &msg, flags);
+		if (r < 0) {
+			xerrno = errno;
+			if (xerrno == EAGAIN || xerrno == EWOULDBLOCK) {
+				c->rd.is_ready = 0;
+				return;
+			}
+			if (xerrno == EINTR)
+				continue;
+		}
+
+		/* Errors and EOF stop receiving */
+		if (r <= 0) {
+			c->fp_r.is_active = 0;
+			comm_rd_release(c);
+			c->fp_r.cb(c->fd, c, c->fp_r.cbdata,
+			    r == 0 ? FDE_COMM_CB_EOF : FDE_COMM_CB_ERROR,
+			    NULL, 0, r == 0 ? 0 : xerrno);
+			return;
+		}
+
+		nfds = 0;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (n > COMM_FDPASS_MAX - nfds)
+				n = COMM_FDPASS_MAX - nfds;
+			memcpy(fds + nfds, CMSG_DATA(cmsg), n * sizeof(int));
+			nfds += n;
+		}
+
+		/*
+		 * The sender packed more than we have room for; the
+		 * rest were closed by the kernel, so don't hand out
+		 * a partial batch.
+		 */
+		if (msg.msg_flags & MSG_CTRUNC) {
+			for (n = 0; n < nfds; n++)
+				close(fds[n]);
+			c->fp_r.cb(c->fd, c, c->fp_r.cbdata,
+			    FDE_COMM_CB_ERROR, NULL, 0, EMSGSIZE);
+			continue;
+		}
+
+		/* Filler without descriptors (eg a short stream write) */
+		if (nfds == 0)
+			continue;
+
+		c->fp_r.n_msgs++;
+		c->fp_r.cb(c->fd, c, c->fp_r.cbdata, FDE_COMM_CB_COMPLETED,
+		    fds, nfds, 0);
+	}
+
+	/* Batch done; come back for more */
+	if (c->fp_r.is_active && c->is_closing == 0)
+		fde_add(c->fh_parent, c->ev_fp_read_cb);
+}
+
+/*
+ * Finish 'n' descriptors from the head of the send queue: our
+ * copies are closed either way and the owner is told.
+ */
+static void
+comm_fp_complete(struct fde_comm *c, int n, fde_comm_cb_status s,
+    int xerrno)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		close(c->fp_w.q[i]);
+	c->fp_w.qlen -= n;
+	memmove(c->fp_w.q, c->fp_w.q + n, c->fp_w.qlen * sizeof(int));
+	c->fp_w.cb(c->fd, c, c->fp_w.cbdata, s, n, xerrno);
+}
+
+/*
+ * Send queued descriptors; run at the end of the loop pass so
+ * everything queued during it is batched together.
+ */
+static void
+comm_cb_fp_flush(int fd_unused, struct fde *f, void *arg,
+    fde_cb_status status)
+{
+	static const char filler[COMM_FDPASS_MAX];
+	struct fde_comm *c = arg;
+	union comm_fdpass_cmsg cm;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int n, ret;
+
+	/* Closing? Don't do the IO; start the closing machinery */
+	if (c->is_closing) {
+		if (c->fp_w.qlen != 0)
+			comm_fp_complete(c, c->fp_w.qlen,
+			    FDE_COMM_CB_CLOSING, 0);
+		c->fp_w.is_active = 0;
+		comm_wr_release(c);
+		if (comm_is_close_ready(c))
+			comm_start_cleanup(c);
+		return;
+	}
+
+	/* Not writable yet; the write event will reschedule us */
+	if (c->fp_w.is_active == 0 || c->wr.is_ready == 0)
+		return;
+
+	while (c->fp_w.qlen != 0 && c->is_closing == 0) {
+		n = XMIN(c->fp_w.qlen, COMM_FDPASS_MAX);
+
+		/*
+		 * One filler byte per descriptor, so a stream receiver
+		 * never sees the control data without its payload.
+		 */
+		iov.iov_base = (void *) filler;
+		iov.iov_len = n;
+		bzero(&msg, sizeof(msg));
+		bzero(&cm, sizeof(cm));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cm.buf;
+		msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), c->fp_w.q, n * sizeof(int));
+
+		ret = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* The write event reschedules us */
+			if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				c->wr.is_ready = 0;
+				break;
+			}
+
+			comm_fp_complete(c, n, FDE_COMM_CB_ERROR, errno);
+			continue;
+		}
+
+		/*
+		 * The descriptors went with the first byte, so they're
+		 * all sent even if the filler was cut short.
+		 */
+		c->fp_w.n_msgs++;
+		comm_fp_complete(c, n, FDE_COMM_CB_COMPLETED, 0);
 	}
 }
 
@@ -821,13 +2228,18 @@ comm_create(int fd, struct fde_head *fh, comm_close_cb *cb, void *cbdata)
 	if (fc->ev_cleanup == NULL)
 		goto cleanup;
 
-	fc->ev_accept = fde_create(fh, fd, FDE_T_READ, 0, comm_cb_accept, fc);
-	if (fc->ev_accept == NULL)
+	/*
+	 * Accept, connect and UDP IO are driven from ev_read and
+	 * ev_write above; these are just their callbacks.
+	 */
+	fc->ev_accept_cb = fde_create(fh, -1, FDE_T_CALLBACK, 0,
+	    comm_cb_accept_cb, fc);
+	if (fc->ev_accept_cb == NULL)
 		goto cleanup;
 
-	fc->ev_connect = fde_create(fh, fd, FDE_T_WRITE, 0, comm_cb_connect,
-	    fc);
-	if (fc->ev_connect == NULL)
+	fc->ev_connect_cb = fde_create(fh, -1, FDE_T_CALLBACK, 0,
+	    comm_cb_connect, fc);
+	if (fc->ev_connect_cb == NULL)
 		goto cleanup;
 
 	fc->ev_connect_start = fde_create(fh, -1, FDE_T_CALLBACK, 0,
@@ -835,17 +2247,58 @@ comm_create(int fd, struct fde_head *fh, comm_close_cb *cb, void *cbdata)
 	if (fc->ev_connect_start == NULL)
 		goto cleanup;
 
-	fc->ev_udp_read = fde_create(fh, fd, FDE_T_READ, 0, comm_cb_udp_read,
-	    fc);
-	if (fc->ev_udp_read == NULL)
+	fc->ev_udp_read_cb = fde_create(fh, -1, FDE_T_CALLBACK, 0,
+	    comm_cb_udp_read_cb, fc);
+	if (fc->ev_udp_read_cb == NULL)
 		goto cleanup;
 
-	fc->ev_udp_write = fde_create(fh, fd, FDE_T_WRITE, 0,
-	    comm_cb_udp_write, fc);
-	if (fc->ev_udp_write == NULL)
+	fc->ev_udp_write_cb = fde_create(fh, -1, FDE_T_CALLBACK, 0,
+	    comm_cb_udp_write_cb, fc);
+	if (fc->ev_udp_write_cb == NULL)
 		goto cleanup;
 	TAILQ_INIT(&fc->udp_w.w_q);
 
+	fc->ev_sendfile_cb = fde_create(fh, -1, FDE_T_CALLBACK, 0,
+	    comm_cb_sendfile_cb, fc);
+	if (fc->ev_sendfile_cb == NULL)
+		goto cleanup;
+
+	fc->ev_splice_cb = fde_create(fh, -1, FDE_T_CALLBACK, 0,
+	    comm_cb_splice_cb, fc);
+	if (fc->ev_splice_cb == NULL)
+		goto cleanup;
+
+	fc->ev_wc_flush = fde_create(fh, -1, FDE_T_FLUSH, 0,
+	    comm_cb_wc_flush, fc);
+	if (fc->ev_wc_flush == NULL)
+		goto cleanup;
+	TAILQ_INIT(&fc->wc.q);
+
+	fc->ev_fp_read_cb = fde_create(fh, -1, FDE_T_CALLBACK, 0,
+	    comm_cb_fp_read_cb, fc);
+	if (fc->ev_fp_read_cb == NULL)
+		goto cleanup;
+
+	fc->ev_fp_flush = fde_create(fh, -1, FDE_T_FLUSH, 0,
+	    comm_cb_fp_flush, fc);
+	if (fc->ev_fp_flush == NULL)
+		goto cleanup;
+
+	fc->ev_rd_deadline = fde_create(fh, -1, FDE_T_DEADLINE, 0,
+	    comm_cb_rd_deadline, fc);
+	if (fc->ev_rd_deadline == NULL)
+		goto cleanup;
+
+	fc->ev_wr_deadline = fde_create(fh, -1, FDE_T_DEADLINE, 0,
+	    comm_cb_wr_deadline, fc);
+	if (fc->ev_wr_deadline == NULL)
+		goto cleanup;
+
+	fc->ev_co_deadline = fde_create(fh, -1, FDE_T_DEADLINE, 0,
+	    comm_cb_co_deadline, fc);
+	if (fc->ev_co_deadline == NULL)
+		goto cleanup;
+
 	return (fc);
 
 cleanup:
@@ -859,196 +2312,691 @@ cleanup:
 		fde_free(fh, fc->ev_write_cb);
 	if (fc->ev_cleanup)
 		fde_free(fh, fc->ev_cleanup);
-	if (fc->ev_accept)
-		fde_free(fh, fc->ev_accept);
-	if (fc->ev_connect)
-		fde_free(fh, fc->ev_connect);
+	if (fc->ev_accept_cb)
+		fde_free(fh, fc->ev_accept_cb);
+	if (fc->ev_connect_cb)
+		fde_free(fh, fc->ev_connect_cb);
 	if (fc->ev_connect_start)
 		fde_free(fh, fc->ev_connect_start);
-	if (fc->ev_udp_read)
-		fde_free(fh, fc->ev_udp_read);
-	if (fc->ev_udp_write)
-		fde_free(fh, fc->ev_udp_write);
+	if (fc->ev_udp_read_cb)
+		fde_free(fh, fc->ev_udp_read_cb);
+	if (fc->ev_udp_write_cb)
+		fde_free(fh, fc->ev_udp_write_cb);
+	if (fc->ev_sendfile_cb)
+		fde_free(fh, fc->ev_sendfile_cb);
+	if (fc->ev_splice_cb)
+		fde_free(fh, fc->ev_splice_cb);
+	if (fc->ev_wc_flush)
+		fde_free(fh, fc->ev_wc_flush);
+	if (fc->ev_fp_read_cb)
+		fde_free(fh, fc->ev_fp_read_cb);
+	if (fc->ev_fp_flush)
+		fde_free(fh, fc->ev_fp_flush);
+	if (fc->ev_rd_deadline)
+		fde_free(fh, fc->ev_rd_deadline);
+	if (fc->ev_wr_deadline)
+		fde_free(fh, fc->ev_wr_deadline);
+	if (fc->ev_co_deadline)
+		fde_free(fh, fc->ev_co_deadline);
 	free(fc);
 	return (NULL);
 }
 
+struct fde_comm *
+comm_create_shm(struct iapp_shm_chan *ch, int side, struct fde_head *fh,
+    comm_close_cb *cb, void *cbdata)
+{
+	struct fde_comm *fc;
+
+	if (side != 0 && side != 1)
+		return (NULL);
+
+	fc = comm_create(iapp_shm_chan_fd(ch, side), fh, cb, cbdata);
+	if (fc == NULL)
+		return (NULL);
+
+	fc->shm = ch;
+	fc->shm_side = side;
+	fc->do_close = 0;
+
+	/* The peer may have written before we were here to be woken */
+	fc->rd.is_ready = 1;
+
+	/* The doorbell stays registered for the life of the comm */
+	comm_rd_register(fc);
+
+	return (fc);
+}
+
 void
 comm_mark_nonclose(struct fde_comm *fc)
 {
 
-	fc->do_close = 0;
+	fc->do_close = 0;
+}
+
+/*
+ * Schedule a comm object to be closed.
+ *
+ * This will attempt to cancel any pending IO.
+ *
+ * All cancelled IO will be called with FDE_COMM_CB_CLOSING without the
+ * IO occuring.
+ *
+ * Once all IO on the given socket has completed or cancelled, the close
+ * callback will be made, then the state will be freed.  If do_close is
+ * set to 1, the FD will be closed.
+ */
+void
+comm_close(struct fde_comm *fc)
+{
+
+	/*
+	 * If this socket is already closing, don't bother
+	 * with the rest of this.
+	 */
+	if (fc->is_closing == 1)
+		return;
+
+	/*
+	 * Begin the process of closing.
+	 */
+	fc->is_closing = 1;
+
+	/*
+	 * XXX complain if is_cleanup is set, it shouldn't be!
+	 */
+
+	/*
+	 * XXX this just indicates to me that I need to create some
+	 * generic-ish API for each of the IO types, as I'll have to
+	 * special case _each_ of these for read/write udp, then
+	 * accept, etc.. whenever they're eventually modified to
+	 * use EV_PERSIST.
+	 */
+
+	/*
+	 * Now, since I've removed their IO - if there's an active
+	 * transaction, schedule the callback.  It'll pick up that
+	 * things are closing.
+	 */
+	if (fc->r.is_active)
+		fde_add(fc->fh_parent, fc->ev_read_cb);
+	if (fc->w.is_active)
+		fde_add(fc->fh_parent, fc->ev_write_cb);
+
+	/*
+	 * If a page-in hasn't started yet we can cancel it; otherwise
+	 * its completion will notice we're closing.
+	 */
+	if (fc->sf.is_active) {
+		if (fc->sf.is_busy &&
+		    iapp_taskq_cancel(iapp_taskq_default(), fc->sf.task) == 1)
+			fc->sf.is_busy = 0;
+		if (! fc->sf.is_busy)
+			fde_add(fc->fh_parent, fc->ev_sendfile_cb);
+	}
+
+	/*
+	 * Accept, connect and UDP IO wait on persistent events which
+	 * may not fire again; schedule their callbacks to notice the
+	 * close.
+	 */
+	if (fc->a.is_active)
+		fde_add(fc->fh_parent, fc->ev_accept_cb);
+	if (fc->co.is_active)
+		fde_add(fc->fh_parent, fc->ev_connect_cb);
+	if (fc->udp_r.is_active)
+		fde_add(fc->fh_parent, fc->ev_udp_read_cb);
+	if (fc->udp_w.is_active)
+		fde_add(fc->fh_parent, fc->ev_udp_write_cb);
+	if (fc->wc.qlen != 0)
+		fde_add(fc->fh_parent, fc->ev_wc_flush);
+	if (fc->fp_r.is_active)
+		fde_add(fc->fh_parent, fc->ev_fp_read_cb);
+	if (fc->fp_w.is_active)
+		fde_add(fc->fh_parent, fc->ev_fp_flush);
+	if (fc->hs.is_active)
+		fde_add(fc->fh_parent, fc->ev_hs_cb);
+
+	/*
+	 * Splices are completed from the source side, whichever end
+	 * is being closed.
+	 */
+	if (fc->sp.is_active)
+		fde_add(fc->fh_parent, fc->ev_splice_cb);
+	if (fc->sp_src != NULL)
+		fde_add(fc->sp_src->fh_parent, fc->sp_src->ev_splice_cb);
+
+	/* Drop the registrations nothing is using */
+	comm_rd_release(fc);
+	comm_wr_release(fc);
+
+	/*
+	 * Check to see if there's any pending IO.  If there is,
+	 * let it complete (for now) - we'll later on add some
+	 * stuff to abort IO that we can.
+	 *
+	 * If there isn't, we can just schedule the close callback.
+	 */
+	if (! comm_is_close_ready(fc))
+		return;
+
+	/*
+	 * Ready to close!
+	 */
+	comm_start_cleanup(fc);
+}
+
+/*
+ * Begin an asynchronous network read.
+ *
+ * Returns 0 if the read was scheduled, -1 if there is already
+ * a pending asynchronous read.
+ */
+int
+comm_read(struct fde_comm *fc, char *buf, int len, comm_read_cb *cb,
+    void *cbdata)
+{
+
+	/* XXX should I be more vocal if this occurs */
+	if (fc->r.is_active == 1 || fc->sp.is_active == 1)
+		return (-1);
+
+	/*
+	 * XXX This is incompatible with doing accept/connect,
+	 * so ensure they're not active.
+	 */
+
+	fc->r.cb = cb;
+	fc->r.cbdata = cbdata;
+	fc->r.buf = buf;
+	fc->r.len = len;
+
+	/*
+	 * We're now active!
+	 */
+	fc->r.is_active = 1;
+	if (fc->r.is_paused)
+		return (1);
+	if (fc->dl.read_ms != 0)
+		fde_add_deadline(fc->fh_parent, fc->ev_rd_deadline,
+		    fc->dl.read_ms);
+
+	/*
+	 * Begin doing read IO.
+	 */
+	comm_rd_register(fc);
+
+	/*
+	 * Are we already ready? Do a read.
+	 */
+	if (fc->rd.is_ready)
+		fde_add(fc->fh_parent, fc->ev_read_cb);
+
+	return (1);
+}
+
+/*
+ * Queue a coalesced write; it's flushed at the end of this pass.
+ */
+static int
+comm_wc_queue(struct fde_comm *fc, struct iapp_netbuf *nb,
+    int nb_start_offset, int len, int is_ref, comm_write_cb *cb,
+    void *cbdata)
+{
+	struct comm_wc_ent *e;
+
+	if (fc->is_closing == 1)
+		return (-1);
+
+	e = malloc(sizeof(*e));
+	if (e == NULL) {
+		warn("%s: malloc", __func__);
+		return (-1);
+	}
+	e->nb = nb;
+	e->is_ref = is_ref;
+	e->nb_start_offset = nb_start_offset;
+	e->offset = 0;
+	e->len = len;
+	e->cb = cb;
+	e->cbdata = cbdata;
+	TAILQ_INSERT_TAIL(&fc->wc.q, e, node);
+	fc->wc.qlen++;
+	if (fc->wc.qlen == 1 && fc->dl.write_ms != 0)
+		fde_add_deadline(fc->fh_parent, fc->ev_wr_deadline,
+		    fc->dl.write_ms);
+
+	comm_wr_register(fc);
+	if (fc->wr.is_ready)
+		fde_add(fc->fh_parent, fc->ev_wc_flush);
+
+	return (0);
+}
+
+void
+comm_read_pause(struct fde_comm *fc)
+{
+
+	fc->r.is_paused = 1;
+	fde_delete(fc->fh_parent, fc->ev_read_cb);
+	fde_delete(fc->fh_parent, fc->ev_rd_deadline);
+}
+
+void
+comm_read_resume(struct fde_comm *fc)
+{
+
+	if (fc->r.is_paused == 0)
+		return;
+	fc->r.is_paused = 0;
+
+	if (fc->r.is_active == 0 || fc->is_closing)
+		return;
+	if (fc->dl.read_ms != 0)
+		fde_add_deadline(fc->fh_parent, fc->ev_rd_deadline,
+		    fc->dl.read_ms);
+
+	/* The read may have been issued while paused, unregistered */
+	comm_rd_register(fc);
+	if (fc->rd.is_ready)
+		fde_add(fc->fh_parent, fc->ev_read_cb);
+}
+
+void
+comm_read_cancel(struct fde_comm *fc)
+{
+
+	if (fc->r.is_active == 0 || fc->is_closing)
+		return;
+
+	fc->r.is_active = 0;
+	fc->r.is_paused = 0;
+	fc->stc.t_rd_ready = 0;
+	fde_delete(fc->fh_parent, fc->ev_read_cb);
+	fde_delete(fc->fh_parent, fc->ev_rd_deadline);
+	comm_rd_release(fc);
+}
+
+/*
+ * Start or queue a stream write.  If is_ref is set the write owns
+ * a reference on nb, dropped just before the callback.
+ */
+static int
+comm_write_nb(struct fde_comm *fc, struct iapp_netbuf *nb,
+    int nb_start_offset, int len, int is_ref, comm_write_cb *cb,
+    void *cbdata)
+{
+
+//	fprintf(stderr, "%s: called; len=%d\n", __func__, len);
+
+	/* XXX should I be more vocal if this occurs */
+	if (fc->w.is_active == 1 || fc->sf.is_active == 1 ||
+	    fc->sp_src != NULL)
+		return (-1);
+
+	/* Small, or behind something already queued? Coalesce it */
+	if (fc->wc.qlen != 0 ||
+	    (fc->wc.max_len != 0 && len <= fc->wc.max_len))
+		return (comm_wc_queue(fc, nb, nb_start_offset, len, is_ref,
+		    cb, cbdata));
+
+	/*
+	 * XXX This is incompatible with doing accept/connect,
+	 * so ensure they're not active.
+	 */
+	fc->w.cb = cb;
+	fc->w.cbdata = cbdata;
+	fc->w.nb = nb;
+	fc->w.is_ref = is_ref;
+	fc->w.nb_start_offset = nb_start_offset;
+	fc->w.len = len;
+	fc->w.offset = 0;
+
+	/*
+	 * Begin doing write IO.  Only schedule the event if we
+	 * aren't already ready for it.
+	 */
+	comm_wr_register(fc);
+
+	/*
+	 * We're now active!
+	 */
+	fc->w.is_active = 1;
+	if (fc->dl.write_ms != 0)
+		fde_add_deadline(fc->fh_parent, fc->ev_wr_deadline,
+		    fc->dl.write_ms);
+
+	/*
+	 * Now, we're not setting w.is_pending to 0 here.
+	 *
+	 * It's possible that a previous write-ready fired whilst
+	 * we weren't yet ready to write anything, so w.is_ready=1.
+	 * Thus, we'll check here to see if it's set and if so we'll
+	 * schedule the write callback.
+	 */
+	if (fc->wr.is_ready)
+		fde_add(fc->fh_parent, fc->ev_write_cb);
+
+	return (0);
+}
+
+int
+comm_write(struct fde_comm *fc, struct iapp_netbuf *nb,
+    int nb_start_offset, int len, comm_write_cb *cb, void *cbdata)
+{
+
+	return (comm_write_nb(fc, nb, nb_start_offset, len, 0, cb, cbdata));
+}
+
+int
+comm_write_slice(struct fde_comm *fc, const struct iapp_netbuf_slice *sl,
+    comm_write_cb *cb, void *cbdata)
+{
+
+	(void) iapp_netbuf_ref(sl->nb);
+	if (comm_write_nb(fc, sl->nb, sl->offset, sl->len, 1, cb,
+	    cbdata) < 0) {
+		iapp_netbuf_free(sl->nb);
+		return (-1);
+	}
+	return (0);
+}
+
+int
+comm_set_deadline(struct fde_comm *fc, comm_deadline_op op, int msec)
+{
+
+	if (msec < 0)
+		return (-1);
+
+	switch (op) {
+	case COMM_DL_READ:
+		fc->dl.read_ms = msec;
+		break;
+	case COMM_DL_WRITE:
+		fc->dl.write_ms = msec;
+		break;
+	case COMM_DL_CONNECT:
+		fc->dl.connect_ms = msec;
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
 }
 
-/*
- * Schedule a comm object to be closed.
- *
- * This will attempt to cancel any pending IO.
- *
- * All cancelled IO will be called with FDE_COMM_CB_CLOSING without the
- * IO occuring.
- *
- * Once all IO on the given socket has completed or cancelled, the close
- * callback will be made, then the state will be freed.  If do_close is
- * set to 1, the FD will be closed.
- */
-void
-comm_close(struct fde_comm *fc)
+static void
+comm_cb_tcpi(int fd_unused, struct fde *f, void *arg, fde_cb_status status)
 {
+	struct fde_comm *c = arg;
 
-	/*
-	 * If this socket is already closing, don't bother
-	 * with the rest of this.
-	 */
-	if (fc->is_closing == 1)
+	if (c->is_closing || c->stc.tcpi_ms == 0)
 		return;
+	(void) comm_sample_tcp_info(c);
+	fde_add_deadline(c->fh_parent, c->ev_tcpi, c->stc.tcpi_ms);
+}
 
-	/*
-	 * Begin the process of closing.
-	 */
-	fc->is_closing = 1;
+int
+comm_set_stats(struct fde_comm *fc, int do_timing, int tcp_info_ms)
+{
 
-	/*
-	 * XXX complain if is_cleanup is set, it shouldn't be!
-	 */
+	if (tcp_info_ms < 0)
+		return (-1);
 
-	/*
-	 * XXX this just indicates to me that I need to create some
-	 * generic-ish API for each of the IO types, as I'll have to
-	 * special case _each_ of these for read/write udp, then
-	 * accept, etc.. whenever they're eventually modified to
-	 * use EV_PERSIST.
-	 */
+	fc->stc.do_timing = do_timing;
+	if (do_timing == 0) {
+		fc->stc.t_rd_ready = 0;
+		fc->stc.t_wr_ready = 0;
+	}
 
-	/*
-	 * Now, since I've removed their IO - if there's an active
-	 * transaction, schedule the callback.  It'll pick up that
-	 * things are closing.
-	 */
-	if (fc->r.is_active) {
-		fde_add(fc->fh_parent, fc->ev_read_cb);
-	} else if (fc->r.is_read) {
-		fde_delete(fc->fh_parent, fc->ev_read);
-		fc->r.is_read = 0;
+	fc->stc.tcpi_ms = tcp_info_ms;
+	if (tcp_info_ms == 0) {
+		if (fc->ev_tcpi != NULL)
+			fde_delete(fc->fh_parent, fc->ev_tcpi);
+		return (0);
 	}
 
-	if (fc->w.is_active) {
-		fde_add(fc->fh_parent, fc->ev_write_cb);
-	} else if (fc->w.is_write) {
-		fde_delete(fc->fh_parent, fc->ev_write);
-		fc->w.is_write = 0;
+	if (fc->ev_tcpi == NULL) {
+		fc->ev_tcpi = fde_create(fc->fh_parent, -1, FDE_T_DEADLINE, 0,
+		    comm_cb_tcpi, fc);
+		if (fc->ev_tcpi == NULL)
+			return (-1);
 	}
+	fde_add_deadline(fc->fh_parent, fc->ev_tcpi, tcp_info_ms);
+	return (0);
+}
 
-	/*
-	 * Check to see if there's any pending IO.  If there is,
-	 * let it complete (for now) - we'll later on add some
-	 * stuff to abort IO that we can.
-	 *
-	 * If there isn't, we can just schedule the close callback.
-	 */
-	if (! comm_is_close_ready(fc))
+void
+comm_get_stats(struct fde_comm *fc, struct comm_stats *st, int do_clear)
+{
+	struct comm_stats *s = &fc->st;
+
+	*st = *s;
+	if (do_clear == 0)
 		return;
 
-	/*
-	 * Ready to close!
-	 */
-	comm_start_cleanup(fc);
+	s->rx_bytes = s->tx_bytes = 0;
+	s->n_read = s->n_write = 0;
+	s->n_rd_eagain = s->n_wr_eagain = 0;
+	s->n_short_write = 0;
+	s->n_rd_lat = s->rd_lat_usec = s->rd_lat_max_usec = 0;
+	s->n_wr_lat = s->wr_lat_usec = s->wr_lat_max_usec = 0;
+	s->n_tcpi = 0;
 }
 
-/*
- * Begin an asynchronous network read.
- *
- * Returns 0 if the read was scheduled, -1 if there is already
- * a pending asynchronous read.
- */
 int
-comm_read(struct fde_comm *fc, char *buf, int len, comm_read_cb *cb,
-    void *cbdata)
+comm_sample_tcp_info(struct fde_comm *fc)
 {
+#ifdef	TCP_INFO
+	struct tcp_info ti;
+	socklen_t sl;
 
-	/* XXX should I be more vocal if this occurs */
-	if (fc->r.is_active == 1)
+	if (fc->shm != NULL)
 		return (-1);
 
-	/*
-	 * XXX This is incompatible with doing accept/connect,
-	 * so ensure they're not active.
-	 */
+	sl = sizeof(ti);
+	if (getsockopt(fc->fd, IPPROTO_TCP, TCP_INFO, &ti, &sl) < 0)
+		return (-1);
 
-	fc->r.cb = cb;
-	fc->r.cbdata = cbdata;
-	fc->r.buf = buf;
-	fc->r.len = len;
+	fc->st.tcpi_rtt_usec = ti.tcpi_rtt;
+	fc->st.tcpi_rttvar_usec = ti.tcpi_rttvar;
+	fc->st.tcpi_cwnd = ti.tcpi_snd_cwnd;
+#ifdef	__linux__
+	fc->st.tcpi_retrans = ti.tcpi_total_retrans;
+#else
+	fc->st.tcpi_retrans = ti.tcpi_snd_rexmitpack;
+#endif
+	fc->st.n_tcpi++;
+	return (0);
+#else
+	return (-1);
+#endif
+}
 
-	/*
-	 * We're now active!
-	 */
-	fc->r.is_active = 1;
+int
+comm_set_coalesce(struct fde_comm *fc, int max_len, int do_cork)
+{
+
+	if (max_len < 0)
+		return (-1);
+
+	fc->wc.max_len = max_len;
+	fc->wc.do_cork = do_cork;
+	return (0);
+}
+
+int
+comm_sendfile(struct fde_comm *fc, struct fde_disk *fdd, off_t offset,
+    off_t len, comm_sendfile_cb *cb, void *cbdata)
+{
+
+	if (fc->sf.is_active == 1 || fc->w.is_active == 1 ||
+	    fc->sp_src != NULL || fc->wc.qlen != 0)
+		return (-1);
+	if (fc->is_closing == 1 || fc->shm != NULL)
+		return (-1);
+	if (fdd->fd == -1)
+		return (-1);
+
+	fc->sf.fdd = fdd;
+	fc->sf.offset = offset;
+	fc->sf.len = len;
+	fc->sf.progress = 0;
+	fc->sf.cb = cb;
+	fc->sf.cbdata = cbdata;
+	fc->sf.is_active = 1;
 
 	/*
-	 * Begin doing read IO.
+	 * Register for write readiness if we aren't already.
 	 */
-	if (! fc->r.is_read) {
-		fc->r.is_read = 1;
-		fde_add(fc->fh_parent, fc->ev_read);
-	}
+	comm_wr_register(fc);
 
 	/*
-	 * Are we already ready? Do a read.
+	 * If we're already write-ready, start sending now.  Otherwise
+	 * the next write-ready event will kick things off.
 	 */
-	if (fc->r.is_ready)
-		fde_add(fc->fh_parent, fc->ev_read_cb);
+	if (fc->wr.is_ready)
+		fde_add(fc->fh_parent, fc->ev_sendfile_cb);
 
-	return (1);
+	return (0);
 }
 
 int
-comm_write(struct fde_comm *fc, struct iapp_netbuf *nb,
-    int nb_start_offset, int len, comm_write_cb *cb, void *cbdata)
+comm_splice(struct fde_comm *src, struct fde_comm *dst, off_t max_bytes,
+    comm_splice_cb *cb, void *cbdata)
 {
 
-//	fprintf(stderr, "%s: called; len=%d\n", __func__, len);
+	if (src == dst || src->fh_parent != dst->fh_parent)
+		return (-1);
+	if (src->is_closing || dst->is_closing)
+		return (-1);
+	if (src->shm != NULL || dst->shm != NULL)
+		return (-1);
+	if (src->sp.is_active || src->r.is_active)
+		return (-1);
+	if (dst->sp_src != NULL || dst->w.is_active || dst->sf.is_active ||
+	    dst->wc.qlen != 0)
+		return (-1);
 
-	/* XXX should I be more vocal if this occurs */
-	if (fc->w.is_active == 1)
+	src->sp.b = comm_splice_buf_get();
+	if (src->sp.b == NULL)
 		return (-1);
 
-	/*
-	 * XXX This is incompatible with doing accept/connect,
-	 * so ensure they're not active.
-	 */
-	fc->w.cb = cb;
-	fc->w.cbdata = cbdata;
-	fc->w.nb = nb;
-	fc->w.nb_start_offset = nb_start_offset;
-	fc->w.len = len;
-	fc->w.offset = 0;
+	src->sp.dst = dst;
+	src->sp.max_bytes = max_bytes;
+	src->sp.moved = 0;
+	src->sp.is_eof = 0;
+	src->sp.cb = cb;
+	src->sp.cbdata = cbdata;
+	src->sp.is_active = 1;
+	dst->sp_src = src;
 
 	/*
-	 * Begin doing write IO.  Only schedule the event if we
-	 * aren't already ready for it.
+	 * Register for read readiness on the source and write
+	 * readiness on the destination, if we aren't already.
 	 */
-	if (! fc->w.is_write) {
-		fde_add(fc->fh_parent, fc->ev_write);
-		fc->w.is_write = 1;
+	comm_rd_register(src);
+	comm_wr_register(dst);
+
+	/* Already readable? Start now */
+	if (src->rd.is_ready)
+		fde_add(src->fh_parent, src->ev_splice_cb);
+
+	return (0);
+}
+
+/*
+ * Run handshake steps until the layer needs readiness we haven't got.
+ */
+static void
+comm_cb_hs_cb(int fd_unused, struct fde *f, void *arg, fde_cb_status status)
+{
+	struct fde_comm *c = arg;
+	comm_hs_status hs;
+	int xerrno = 0;
+
+	/* Closing? Don't do the IO; start the closing machinery */
+	if (c->is_closing) {
+		if (c->hs.is_active == 0)
+			return;
+		c->hs.is_active = 0;
+		c->hs.cb(c->fd, c, c->hs.cbdata, FDE_COMM_CB_CLOSING, 0);
+		comm_rd_release(c);
+		comm_wr_release(c);
+		if (comm_is_close_ready(c))
+			comm_start_cleanup(c);
+		return;
 	}
 
-	/*
-	 * We're now active!
-	 */
-	fc->w.is_active = 1;
+	if (c->hs.is_active == 0)
+		return;
+
+	while (1) {
+		/* Wait for the readiness it asked for */
+		if (c->hs.want == COMM_HS_WANT_READ && c->rd.is_ready == 0)
+			return;
+		if (c->hs.want == COMM_HS_WANT_WRITE && c->wr.is_ready == 0)
+			return;
+
+		hs = c->hs.step(c, c->hs.arg, &xerrno);
+		switch (hs) {
+		case COMM_HS_WANT_READ:
+			/* It hit EAGAIN; the readiness is used up */
+			if (c->hs.want == COMM_HS_WANT_READ)
+				c->rd.is_ready = 0;
+			c->hs.want = hs;
+			comm_rd_register(c);
+			break;
+		case COMM_HS_WANT_WRITE:
+			if (c->hs.want == COMM_HS_WANT_WRITE)
+				c->wr.is_ready = 0;
+			c->hs.want = hs;
+			comm_wr_register(c);
+			break;
+		default:
+			c->hs.is_active = 0;
+			comm_rd_release(c);
+			comm_wr_release(c);
+			c->hs.cb(c->fd, c, c->hs.cbdata,
+			    hs == COMM_HS_DONE ? FDE_COMM_CB_COMPLETED :
+			    FDE_COMM_CB_ERROR, xerrno);
+			return;
+		}
+	}
+}
+
+int
+comm_handshake(struct fde_comm *fc, comm_hs_step_cb *step,
+    comm_hs_fini_cb *fini, void *arg, comm_hs_cb *cb, void *cbdata)
+{
+
+	if (fc->hs.is_active || fc->hs.fini != NULL || fc->shm != NULL ||
+	    fc->is_closing)
+		return (-1);
+
+	if (fc->ev_hs_cb == NULL) {
+		fc->ev_hs_cb = fde_create(fc->fh_parent, -1, FDE_T_CALLBACK,
+		    0, comm_cb_hs_cb, fc);
+		if (fc->ev_hs_cb == NULL)
+			return (-1);
+	}
+
+	fc->hs.step = step;
+	fc->hs.fini = fini;
+	fc->hs.arg = arg;
+	fc->hs.cb = cb;
+	fc->hs.cbdata = cbdata;
+	fc->hs.is_active = 1;
 
 	/*
-	 * Now, we're not setting w.is_pending to 0 here.
-	 *
-	 * It's possible that a previous write-ready fired whilst
-	 * we weren't yet ready to write anything, so w.is_ready=1.
-	 * Thus, we'll check here to see if it's set and if so we'll
-	 * schedule the write callback.
+	 * The first step just goes; it'll ask for readiness once it
+	 * can't make progress.  rd/wr.is_ready may be stale, so the
+	 * step asking again for the same thing clears it.
 	 */
-	if (fc->w.is_ready)
-		fde_add(fc->fh_parent, fc->ev_write_cb);
-
+	fc->hs.want = COMM_HS_DONE;
+	fde_add(fc->fh_parent, fc->ev_hs_cb);
 	return (0);
 }
 
@@ -1057,7 +3005,7 @@ comm_listen(struct fde_comm *fc, comm_accept_cb *cb, void *cbdata)
 {
 
 	/* XXX should I be more vocal if this occurs */
-	if (fc->a.is_active == 1)
+	if (fc->a.is_active == 1 || fc->shm != NULL)
 		return (-1);
 
 	/*
@@ -1065,14 +3013,58 @@ comm_listen(struct fde_comm *fc, comm_accept_cb *cb, void *cbdata)
 	 * enforce this.
 	 */
 	fc->a.cb = cb;
+	fc->a.data_cb = NULL;
 	fc->a.cbdata = cbdata;
+	fc->a.buflen = 0;
 
 	/*
-	 * Begin doing read IO.
+	 * Register for readiness once; connections already queued
+	 * will fire it straight away.
 	 */
-	fde_add(fc->fh_parent, fc->ev_accept);
 	fc->a.is_active = 1;
+	comm_rd_register(fc);
+	if (fc->rd.is_ready)
+		fde_add(fc->fh_parent, fc->ev_accept_cb);
+
+	return (0);
+}
+
+int
+comm_listen_data(struct fde_comm *fc, int maxlen, comm_accept_data_cb *cb,
+    void *cbdata)
+{
+	char *buf;
+
+	if (maxlen <= 0)
+		return (-1);
+
+	buf = malloc(maxlen);
+	if (buf == NULL) {
+		warn("%s: malloc", __func__);
+		return (-1);
+	}
+
+	if (comm_listen(fc, NULL, cbdata) < 0) {
+		free(buf);
+		return (-1);
+	}
+
+	free(fc->a.buf);
+	fc->a.buf = buf;
+	fc->a.buflen = maxlen;
+	fc->a.data_cb = cb;
+	return (0);
+}
+
+int
+comm_connect_data(struct fde_comm *fc, struct sockaddr *sin, socklen_t slen,
+    const char *buf, int len, comm_connect_cb *cb, void *cbdata)
+{
 
+	if (comm_connect(fc, sin, slen, cb, cbdata) < 0)
+		return (-1);
+	fc->co.buf = buf;
+	fc->co.len = len;
 	return (0);
 }
 
@@ -1081,13 +3073,16 @@ comm_connect(struct fde_comm *fc, struct sockaddr *sin, socklen_t slen,
     comm_connect_cb *cb, void *cbdata)
 {
 
-	if (fc->co.is_active == 1)
+	if (fc->co.is_active == 1 || fc->shm != NULL)
 		return (-1);
 	if (slen > sizeof(fc->co.sin))
 		return (-1);
 
 	fc->co.cb = cb;
 	fc->co.cbdata = cbdata;
+	fc->co.buf = NULL;
+	fc->co.len = 0;
+	fc->co.sent = 0;
 	memcpy(&fc->co.sin, sin, XMIN(slen, sizeof(fc->co.sin)));
 	fc->co.slen = slen;
 
@@ -1103,6 +3098,9 @@ comm_connect(struct fde_comm *fc, struct sockaddr *sin, socklen_t slen,
 	 */
 	fc->co.is_active = 1;
 	fde_add(fc->fh_parent, fc->ev_connect_start);
+	if (fc->dl.connect_ms != 0)
+		fde_add_deadline(fc->fh_parent, fc->ev_co_deadline,
+		    fc->dl.connect_ms);
 
 	return (0);
 }
@@ -1112,7 +3110,7 @@ comm_udp_read(struct fde_comm *fc, comm_read_udp_cb *cb, void *cbdata,
     int maxlen)
 {
 
-	if (fc->udp_r.is_active == 1)
+	if (fc->udp_r.is_active == 1 || fc->shm != NULL)
 		return (-1);
 
 	/* XXX fail if we're not a data socket */
@@ -1121,8 +3119,25 @@ comm_udp_read(struct fde_comm *fc, comm_read_udp_cb *cb, void *cbdata,
 	fc->udp_r.cbdata = cbdata;
 	fc->udp_r.is_active = 1;
 	fc->udp_r.maxlen = maxlen;
-	fde_add(fc->fh_parent, fc->ev_udp_read);
+	comm_rd_register(fc);
+	if (fc->rd.is_ready)
+		fde_add(fc->fh_parent, fc->ev_udp_read_cb);
+
+	return (0);
+}
+
+int
+comm_udp_set_timestamps(struct fde_comm *fc, int enable)
+{
 
+	if (fc->shm != NULL)
+		return (-1);
+	if (comm_fd_set_rx_timestamps(fc->fd, enable) < 0) {
+		warn("%s: FD %d: comm_fd_set_rx_timestamps", __func__,
+		    fc->fd);
+		return (-1);
+	}
+	fc->udp_r.do_timestamps = !! enable;
 	return (0);
 }
 
@@ -1130,16 +3145,22 @@ int
 comm_udp_write_setup(struct fde_comm *fc, comm_write_udp_cb *cb, void *cbdata,
     int qlen)
 {
-	if (fc->udp_w.is_active == 1)
+	if (fc->udp_w.is_active == 1 || fc->shm != NULL)
 		return (-1);
 
 	fc->udp_w.cb = cb;
 	fc->udp_w.cbdata = cbdata;
 	fc->udp_w.is_active = 1;
-	fc->udp_w.is_primed = 0;
 	fc->udp_w.max_qlen = qlen;
 	fc->udp_w.qlen = 0;
 
+	/*
+	 * Register for write readiness once; it fires as soon as
+	 * the socket is writable and again whenever it becomes
+	 * writable after an EAGAIN.
+	 */
+	comm_wr_register(fc);
+
 	return (0);
 }
 
@@ -1157,10 +3178,72 @@ comm_udp_write(struct fde_comm *fc, struct fde_comm_udp_frame *fr)
 	TAILQ_INSERT_TAIL(&fc->udp_w.w_q, fr, node);
 	fc->udp_w.qlen++;
 
-	if (fc->udp_w.is_primed == 0) {
-		fc->udp_w.is_primed = 1;
-		fde_add(fc->fh_parent, fc->ev_udp_write);
+	/* Writable? Flush at the next callback pass */
+	if (fc->wr.is_ready)
+		fde_add(fc->fh_parent, fc->ev_udp_write_cb);
+
+	return (0);
+}
+
+int
+comm_fdpass_recv(struct fde_comm *fc, comm_fdpass_recv_cb *cb, void *cbdata)
+{
+
+	if (fc->fp_r.is_active == 1 || fc->is_closing == 1 || fc->shm != NULL)
+		return (-1);
+
+	fc->fp_r.cb = cb;
+	fc->fp_r.cbdata = cbdata;
+	fc->fp_r.is_active = 1;
+	comm_rd_register(fc);
+	if (fc->rd.is_ready)
+		fde_add(fc->fh_parent, fc->ev_fp_read_cb);
+
+	return (0);
+}
+
+int
+comm_fdpass_send_setup(struct fde_comm *fc, comm_fdpass_send_cb *cb,
+    void *cbdata, int qlen)
+{
+
+	if (fc->fp_w.is_active == 1 || fc->is_closing == 1 || qlen <= 0 ||
+	    fc->shm != NULL)
+		return (-1);
+
+	fc->fp_w.q = calloc(qlen, sizeof(int));
+	if (fc->fp_w.q == NULL) {
+		warn("%s: calloc", __func__);
+		return (-1);
 	}
 
+	fc->fp_w.cb = cb;
+	fc->fp_w.cbdata = cbdata;
+	fc->fp_w.is_active = 1;
+	fc->fp_w.max_qlen = qlen;
+	fc->fp_w.qlen = 0;
+
+	/* As with datagram writes, stay registered for write readiness */
+	comm_wr_register(fc);
+
+	return (0);
+}
+
+int
+comm_fdpass_send(struct fde_comm *fc, int fd)
+{
+
+	if (fc->fp_w.is_active == 0 || fc->is_closing == 1)
+		return (-1);
+
+	if (fc->fp_w.qlen >= fc->fp_w.max_qlen)
+		return (-1);
+
+	fc->fp_w.q[fc->fp_w.qlen++] = fd;
+
+	/* Go out with everything else queued this pass */
+	if (fc->wr.is_ready)
+		fde_add(fc->fh_parent, fc->ev_fp_flush);
+
 	return (0);
 }
@@ -30,6 +30,12 @@
 #define	__COMM_H__
 
 struct fde_comm;
+struct fde_disk;
+struct iapp_netbuf;
+struct iapp_netbuf_slice;
+struct iapp_task;
+struct comm_splice_buf;
+struct iapp_shm_chan;
 
 typedef enum {
 	FDE_COMM_CB_NONE,
@@ -37,9 +43,21 @@ typedef enum {
 	FDE_COMM_CB_CLOSING,
 	FDE_COMM_CB_ERROR,
 	FDE_COMM_CB_EOF,
-	FDE_COMM_CB_ABORTED
+	FDE_COMM_CB_ABORTED,
+	FDE_COMM_CB_TIMEOUT
 } fde_comm_cb_status;
 
+/*
+ * Most descriptors carried by one SCM_RIGHTS message.
+ */
+#define	COMM_FDPASS_MAX		64
+
+typedef enum {
+	COMM_DL_READ,
+	COMM_DL_WRITE,
+	COMM_DL_CONNECT
+} comm_deadline_op;
+
 /*
  * Represent a frame, both for transmit and receive.
  */
@@ -48,6 +66,7 @@ struct fde_comm_udp_frame {
 	char *buf;
 	int size;
 	int len;
+	struct iapp_netbuf *nb;	/* slice frames: buf points into this */
 	int frame_id;		/* assigned by fde_comm */
 	int u_cookie;		/* assigned by owner */
 	void *p_cookie;		/* assigned by owner */
@@ -55,6 +74,14 @@ struct fde_comm_udp_frame {
 	socklen_t sl_rem;
 	struct sockaddr_storage sa_lcl;
 	struct sockaddr_storage sa_rem;
+
+	/*
+	 * Receive times (CLOCK_REALTIME), with comm_udp_set_timestamps();
+	 * otherwise zero.  ts_kern is when the kernel took the datagram,
+	 * ts_dispatch just before the read callback.
+	 */
+	struct timespec ts_kern;
+	struct timespec ts_dispatch;
 };
 
 /* General - close */
@@ -66,6 +93,10 @@ typedef void	comm_connect_cb(int fd, struct fde_comm *fc, void *arg,
 typedef void	comm_accept_cb(int fd, struct fde_comm *fc, void *arg,
 		    fde_comm_cb_status status, int newfd,
 		    struct sockaddr *saddr, socklen_t slen, int xerrno);
+typedef void	comm_accept_data_cb(int fd, struct fde_comm *fc, void *arg,
+		    fde_comm_cb_status status, int newfd,
+		    struct sockaddr *saddr, socklen_t slen, const char *buf,
+		    int len, int xerrno);
 
 /* Stream - read/write */
 typedef void	comm_read_cb(int fd, struct fde_comm *fc, void *arg,
@@ -73,6 +104,34 @@ typedef void	comm_read_cb(int fd, struct fde_comm *fc, void *arg,
 typedef void	comm_write_cb(int fd, struct fde_comm *fc, void *arg,
 		    fde_comm_cb_status status, int nwritten);
 
+/*
+ * Stream - handshake run by a protocol layer on top (eg TLS.)
+ *
+ * The step method does as much as it can without blocking and says
+ * which readiness it needs next; fini is called at cleanup, before
+ * the fd is closed.
+ */
+typedef enum {
+	COMM_HS_DONE,
+	COMM_HS_WANT_READ,
+	COMM_HS_WANT_WRITE,
+	COMM_HS_ERROR
+} comm_hs_status;
+
+typedef comm_hs_status	comm_hs_step_cb(struct fde_comm *fc, void *arg,
+			    int *xerrno);
+typedef void	comm_hs_fini_cb(struct fde_comm *fc, void *arg);
+typedef void	comm_hs_cb(int fd, struct fde_comm *fc, void *arg,
+		    fde_comm_cb_status status, int xerrno);
+
+/* Stream - sendfile */
+typedef void	comm_sendfile_cb(int fd, struct fde_comm *fc, void *arg,
+		    fde_comm_cb_status status, off_t nwritten, int xerrno);
+
+/* Stream - socket to socket splice */
+typedef void	comm_splice_cb(int fd, struct fde_comm *fc, void *arg,
+		    fde_comm_cb_status status, off_t nmoved, int xerrno);
+
 /* Datagram - read/write */
 typedef void	comm_read_udp_cb(int fd, struct fde_comm *fc, void *arg,
 		    struct fde_comm_udp_frame *fr, fde_comm_cb_status status,
@@ -81,38 +140,136 @@ typedef void	comm_write_udp_cb(int fd, struct fde_comm *fc, void *arg,
 		    struct fde_comm_udp_frame *fr, fde_comm_cb_status status,
 		    int nwritten, int xerrno);
 
+/* Unix domain - descriptor passing */
+typedef void	comm_fdpass_send_cb(int fd, struct fde_comm *fc, void *arg,
+		    fde_comm_cb_status status, int nfds, int xerrno);
+typedef void	comm_fdpass_recv_cb(int fd, struct fde_comm *fc, void *arg,
+		    fde_comm_cb_status status, const int *fds, int nfds,
+		    int xerrno);
+
+/*
+ * A queued coalesced write.
+ */
+struct comm_wc_ent {
+	TAILQ_ENTRY(comm_wc_ent) node;
+	struct iapp_netbuf *nb;
+	int is_ref;		/* holds a reference on nb */
+	int nb_start_offset;
+	int offset;
+	int len;
+	comm_write_cb *cb;
+	void *cbdata;
+};
+
+/*
+ * Per-comm IO statistics.
+ *
+ * The counters are always kept.  The readiness to callback latency
+ * (how long the event loop took to act on a readiness event) and
+ * TCP_INFO samples are only collected after comm_set_stats().
+ */
+struct comm_stats {
+	uint64_t rx_bytes, tx_bytes;
+	uint64_t n_read, n_write;	/* syscalls */
+	uint64_t n_rd_eagain, n_wr_eagain;
+	uint64_t n_short_write;
+
+	uint64_t n_rd_lat, rd_lat_usec, rd_lat_max_usec;
+	uint64_t n_wr_lat, wr_lat_usec, wr_lat_max_usec;
+
+	/* Latest TCP_INFO sample; kept across comm_get_stats() clears */
+	uint64_t n_tcpi;
+	uint32_t tcpi_rtt_usec;
+	uint32_t tcpi_rttvar_usec;
+	uint32_t tcpi_cwnd;	/* segments on Linux, bytes on FreeBSD */
+	uint64_t tcpi_retrans;	/* total retransmitted segments */
+};
+
 struct fde_comm {
 	int fd;
 	int do_close;		/* Whether to close the FD */
 	struct fde_head *fh_parent;
 
-	/* Events */
+	/*
+	 * Shared memory channel side this comm reads and writes
+	 * instead of the fd, which is then just its doorbell.
+	 */
+	struct iapp_shm_chan *shm;
+	int shm_side;
+
+	/*
+	 * Events.  ev_read and ev_write are the only kernel
+	 * registrations for the fd; every operation shares them
+	 * and the rest are callbacks they schedule.
+	 */
 	struct fde *ev_read;
 	struct fde *ev_read_cb;
 
 	struct fde *ev_write;
 	struct fde *ev_write_cb;
 
-	struct fde *ev_accept;
-	struct fde *ev_connect;
+	struct fde *ev_accept_cb;
+	struct fde *ev_connect_cb;
 	struct fde *ev_connect_start;
 
 	struct fde *ev_cleanup;
 
-	struct fde *ev_udp_read;
-	struct fde *ev_udp_write;
+	struct fde *ev_udp_read_cb;
+	struct fde *ev_udp_write_cb;
+
+	struct fde *ev_sendfile_cb;
+	struct fde *ev_splice_cb;
+
+	struct fde *ev_wc_flush;
+
+	struct fde *ev_fp_read_cb;
+	struct fde *ev_fp_flush;
+
+	/* Per-operation deadlines, on the fde_head timer wheel */
+	struct fde *ev_rd_deadline;
+	struct fde *ev_wr_deadline;
+	struct fde *ev_co_deadline;
+
+	/* TCP_INFO sampling timer; created by comm_set_stats() */
+	struct fde *ev_tcpi;
+
+	/* Handshake steps; created by comm_handshake() */
+	struct fde *ev_hs_cb;
 
 	/* General state */
 	int is_closing;		/* Are we getting ready to close? */
 	int is_cleanup;		/* cleanup has been scheduled */
 
+	/* Deadlines (msec) for each new operation; 0 - none */
+	struct {
+		int read_ms;
+		int write_ms;
+		int connect_ms;
+	} dl;
+
+	/* IO statistics */
+	struct comm_stats st;
+	struct {
+		int do_timing;
+		int tcpi_ms;	/* 0 - no TCP_INFO sampling */
+		uint64_t t_rd_ready;	/* usec; 0 - not waiting */
+		uint64_t t_wr_ready;
+	} stc;
+
+	/*
+	 * Read/write readiness, shared by all operations on the fd.
+	 */
+	struct {
+		int is_registered;	/* ev_read/ev_write is added */
+		int is_ready;	/* readiness seen but not yet consumed */
+	} rd, wr;
+
 	/*
 	 * Stream read state
 	 */
 	struct {
 		int is_active;
-		int is_ready;	/* 1 when the read-ready event has fired */
-		int is_read;	/* have we scheduled the read event? */
+		int is_paused;	/* readiness is noted but not acted on */
 		char *buf;	/* buffer to read into */
 		int len;	/* buffer length */
 		comm_read_cb *cb;
@@ -124,9 +281,8 @@ struct fde_comm {
 	 */
 	struct {
 		int is_active;
-		int is_ready;	/* 1 when the write-ready event has fired */
-		int is_write;	/* have we scheduled the write event? */
 		struct iapp_netbuf *nb;
+		int is_ref;		/* holds a reference on nb */
 		int nb_start_offset;	/* starting point _inside_ the netbuf */
 		int offset;
 		int len;
@@ -135,6 +291,76 @@ struct fde_comm {
 		int ret;	/* XXX */
 	} w;
 
+	/*
+	 * Coalesced write state.
+	 *
+	 * Writes of up to max_len bytes are queued and written with
+	 * one writev() at the end of the fde_runloop() pass.  Once
+	 * anything is queued every later write queues behind it, so
+	 * ordering is kept.
+	 */
+	struct {
+		int max_len;	/* 0 - coalescing is off */
+		int do_cork;
+		TAILQ_HEAD(, comm_wc_ent) q;
+		int qlen;
+		uint64_t n_writev;	/* flush syscalls */
+	} wc;
+
+	/*
+	 * Sendfile state.
+	 *
+	 * This shares the write readiness (ev_write / w.is_ready) with
+	 * the stream write path, so only one of them can be active.
+	 */
+	struct {
+		int is_active;
+		int is_busy;	/* 1 when a helper is paging in file data */
+		struct fde_disk *fdd;
+		off_t offset;	/* file offset to start from */
+		off_t len;	/* total bytes to send */
+		off_t progress;	/* bytes sent so far */
+		comm_sendfile_cb *cb;
+		void *cbdata;
+		struct iapp_task *task;	/* page-in task, allocated on use */
+		off_t pg_offset;	/* page-in range for the helper */
+		size_t pg_len;
+	} sf;
+
+	/*
+	 * Splice state - this lives on the source comm.
+	 *
+	 * The source read readiness and the destination write readiness
+	 * both schedule ev_splice_cb on the source.
+	 */
+	struct {
+		int is_active;
+		int is_eof;	/* source has hit EOF */
+		struct fde_comm *dst;
+		off_t max_bytes;	/* <= 0 means until EOF */
+		off_t moved;	/* bytes written to the destination */
+		comm_splice_cb *cb;
+		void *cbdata;
+		struct comm_splice_buf *b;	/* from the per-thread pool */
+	} sp;
+
+	/* Set on the destination comm whilst a splice is writing to it */
+	struct fde_comm *sp_src;
+
+	/*
+	 * Handshake state.  The layer (hs.arg) stays attached after
+	 * the handshake, until cleanup calls hs.fini.
+	 */
+	struct {
+		int is_active;
+		comm_hs_status want;
+		comm_hs_step_cb *step;
+		comm_hs_fini_cb *fini;
+		void *arg;
+		comm_hs_cb *cb;
+		void *cbdata;
+	} hs;
+
 	/*
 	 * Close state
 	 */
@@ -149,7 +375,10 @@ struct fde_comm {
 	struct {
 		int is_active;
 		comm_accept_cb *cb;
+		comm_accept_data_cb *data_cb;	/* comm_listen_data() */
 		void *cbdata;
+		char *buf;	/* early data from the new connection */
+		int buflen;
 	} a;
 
 	/*
@@ -161,6 +390,9 @@ struct fde_comm {
 		void *cbdata;
 		struct sockaddr_storage sin;
 		socklen_t slen;
+		const char *buf;	/* TCP Fast Open data */
+		int len;
+		int sent;	/* .. and how much went with the SYN */
 	} co;
 
 	/*
@@ -169,6 +401,7 @@ struct fde_comm {
 	struct {
 		int maxlen;
 		int is_active;
+		int do_timestamps;
 		comm_read_udp_cb *cb;
 		void *cbdata;
 	} udp_r;
@@ -178,13 +411,37 @@ struct fde_comm {
 	 */
 	struct {
 		int is_active;
-		int is_primed;
 		int max_qlen;
 		int qlen;
 		TAILQ_HEAD(udp_w_q, fde_comm_udp_frame) w_q;
 		comm_write_udp_cb *cb;
 		void *cbdata;
 	} udp_w;
+
+	/*
+	 * Descriptor passing receive state
+	 */
+	struct {
+		int is_active;
+		comm_fdpass_recv_cb *cb;
+		void *cbdata;
+		uint64_t n_msgs;
+	} fp_r;
+
+	/*
+	 * Descriptor passing send state.  Queued descriptors are sent
+	 * at the end of the loop pass, up to COMM_FDPASS_MAX in each
+	 * sendmsg().
+	 */
+	struct {
+		int is_active;
+		int *q;
+		int qlen;
+		int max_qlen;
+		comm_fdpass_send_cb *cb;
+		void *cbdata;
+		uint64_t n_msgs;
+	} fp_w;
 };
 
 /*
@@ -193,6 +450,18 @@ struct fde_comm {
 extern	struct fde_comm * comm_create(int fd, struct fde_head *fh,
 	    comm_close_cb *cb, void *cbdata);
 
+/*
+ * Create a comm struct for one side (0 or 1) of a shared memory
+ * channel (shm_chan.h.)
+ *
+ * Stream reads, writes (including coalesced writes), deadlines and
+ * close behave as they do on a socket.  Sendfile, splice, accept,
+ * connect, datagram IO and descriptor passing aren't available.
+ * The channel must outlive the comm.
+ */
+extern	struct fde_comm * comm_create_shm(struct iapp_shm_chan *ch, int side,
+	    struct fde_head *fh, comm_close_cb *cb, void *cbdata);
+
 /*
  * Mark the comm struct as non-closing
  */
@@ -216,7 +485,9 @@ extern	int comm_set_nonblocking(struct fde_comm *c, int enable);
 /*
  * Schedule some data to be read.
  *
- * The buffer must stay valid for the lifetime of the read.
+ * The buffer must stay valid for the lifetime of the read.  On
+ * FDE_COMM_CB_ERROR errno holds the read's error when the callback
+ * is entered.
  */
 extern	int comm_read(struct fde_comm *fc, char *buf, int len,
 	    comm_read_cb *cb, void *cbdata);
@@ -229,6 +500,119 @@ extern	int comm_read(struct fde_comm *fc, char *buf, int len,
 extern	int comm_write(struct fde_comm *fc, struct iapp_netbuf *nb,
 	    int nb_start_offset, int len, comm_write_cb *cb, void *cbdata);
 
+/*
+ * Write a slice.  The write holds its own reference on the netbuf
+ * until just before the callback, so the caller may release the
+ * slice straight away - eg after writing it to every peer.
+ */
+extern	int comm_write_slice(struct fde_comm *fc,
+	    const struct iapp_netbuf_slice *sl, comm_write_cb *cb,
+	    void *cbdata);
+
+/*
+ * Stop and restart reading.  Whilst paused a scheduled comm_read()
+ * stays pending and its deadline is stopped; the kernel read
+ * registration is left alone, so this costs no kevent() changes.
+ */
+extern	void comm_read_pause(struct fde_comm *fc);
+extern	void comm_read_resume(struct fde_comm *fc);
+
+/*
+ * Cancel an outstanding comm_read() without calling its callback,
+ * eg to hand an idle connection to someone else.
+ */
+extern	void comm_read_cancel(struct fde_comm *fc);
+
+/*
+ * Coalesce writes of up to max_len bytes; they're queued and
+ * flushed with a single writev() at the end of the current
+ * fde_runloop() pass.  Completions are reported per write, in
+ * order.  max_len of 0 turns it off again, for latency sensitive
+ * connections.
+ *
+ * If do_cork is set and a flush takes more than one writev(), the
+ * socket is corked (TCP_CORK / TCP_NOPUSH) until it's done.
+ */
+extern	int comm_set_coalesce(struct fde_comm *fc, int max_len, int do_cork);
+
+/*
+ * Give every following read, write or connect on this comm a
+ * deadline of 'msec' milliseconds (0 - no deadline.)
+ *
+ * If the operation hasn't completed by then it's cancelled and its
+ * callback is called with FDE_COMM_CB_TIMEOUT.  A write deadline
+ * covers the whole write; for coalesced writes it's restarted
+ * whenever the queue makes progress.
+ */
+extern	int comm_set_deadline(struct fde_comm *fc, comm_deadline_op op,
+	    int msec);
+
+/*
+ * Turn on readiness to callback timing, and TCP_INFO sampling every
+ * tcp_info_ms milliseconds (0 - off.)
+ */
+extern	int comm_set_stats(struct fde_comm *fc, int do_timing,
+	    int tcp_info_ms);
+
+/*
+ * Copy out the IO statistics; do_clear resets everything except the
+ * latest TCP_INFO values.
+ */
+extern	void comm_get_stats(struct fde_comm *fc, struct comm_stats *st,
+	    int do_clear);
+
+/*
+ * Take a TCP_INFO sample now.  Returns -1 if it's not a TCP socket
+ * or the system doesn't have TCP_INFO.
+ */
+extern	int comm_sample_tcp_info(struct fde_comm *fc);
+
+/*
+ * Schedule a range of the given disk file to be sent on this socket.
+ *
+ * The transfer is done using sendfile().  The event loop thread never
+ * blocks on disk IO - if the file data isn't cached it's paged in by
+ * a helper thread first.
+ *
+ * The callback is called once, when the whole range has been sent,
+ * an error/EOF occurs or the comm is closed.  'nwritten' is the
+ * number of bytes successfully sent.
+ *
+ * This can't be active at the same time as comm_write().
+ */
+extern	int comm_sendfile(struct fde_comm *fc, struct fde_disk *fdd,
+	    off_t offset, off_t len, comm_sendfile_cb *cb, void *cbdata);
+
+/*
+ * Copy data from the 'src' socket to the 'dst' socket.
+ *
+ * Up to max_bytes (or until EOF if max_bytes <= 0) is moved.  On
+ * Linux this is done with splice() through a per-thread pool of
+ * pipes, so the data never enters userland; elsewhere it's a copy
+ * loop through a per-thread pool of buffers.
+ *
+ * Reading from 'src' stops whilst 'dst' isn't writable, so at most
+ * one buffer/pipe worth of data is in flight.
+ *
+ * The callback is called once on 'src' with the number of bytes
+ * written to 'dst', when max_bytes is reached (COMPLETED), 'src'
+ * hits EOF (EOF), an IO error occurs (ERROR) or either comm is
+ * closed (CLOSING.)
+ *
+ * No reads may be active on 'src' and no writes on 'dst'.
+ */
+extern	int comm_splice(struct fde_comm *src, struct fde_comm *dst,
+	    off_t max_bytes, comm_splice_cb *cb, void *cbdata);
+
+/*
+ * Run a protocol handshake on a connected stream socket; 'step' is
+ * called from the event loop whenever the readiness it last asked
+ * for arrives, until it returns COMM_HS_DONE or COMM_HS_ERROR.  No
+ * other IO may be active until the callback.
+ */
+extern	int comm_handshake(struct fde_comm *fc, comm_hs_step_cb *step,
+	    comm_hs_fini_cb *fini, void *arg, comm_hs_cb *cb, void *cbdata);
+
 /*
  * Start accept()ing on the given socket.
  *
@@ -237,18 +621,46 @@ extern	int comm_write(struct fde_comm *fc, struct iapp_netbuf *nb,
 extern	int comm_listen(struct fde_comm *fc, comm_accept_cb *cb,
 	    void *cbdata);
 
+/*
+ * Like comm_listen(), but also read up to 'maxlen' bytes from each
+ * new connection before handing it over - with TCP Fast Open that's
+ * the data which came in with the SYN.  'buf' is only valid during
+ * the callback; len is 0 if nothing has arrived yet.
+ */
+extern	int comm_listen_data(struct fde_comm *fc, int maxlen,
+	    comm_accept_data_cb *cb, void *cbdata);
+
 /*
  * Start a connect() to the remote address.
  */
 extern	int comm_connect(struct fde_comm *fc, struct sockaddr *sin,
 	    socklen_t slen, comm_connect_cb *cb, void *cbdata);
 
+/*
+ * Start a connect() carrying up to 'len' bytes of 'buf' in the SYN
+ * with TCP Fast Open, if the kernel has a cookie for the server.
+ * 'buf' must stay valid until the callback, whose retval is the
+ * number of bytes sent on success; the caller writes the rest.
+ * Without TCP Fast Open support this is comm_connect().
+ */
+extern	int comm_connect_data(struct fde_comm *fc, struct sockaddr *sin,
+	    socklen_t slen, const char *buf, int len, comm_connect_cb *cb,
+	    void *cbdata);
+
 /*
  * Allocate a UDP frame.
  */
 extern	struct fde_comm_udp_frame * fde_comm_udp_alloc(struct fde_comm *fc,
 	    int maxlen);
 
+/*
+ * Allocate a UDP frame to transmit a slice.  The frame holds its
+ * own reference on the netbuf rather than copying it, so the same
+ * payload can go to many destinations.
+ */
+extern	struct fde_comm_udp_frame * fde_comm_udp_alloc_slice(
+	    struct fde_comm *fc, const struct iapp_netbuf_slice *sl);
+
 /*
  * Free the given UDP frame.
  */
@@ -261,6 +673,11 @@ extern	void fde_comm_udp_free(struct fde_comm *fc,
 extern	int comm_udp_read(struct fde_comm *fc, comm_read_udp_cb *cb,
 	    void *cbdata, int maxlen);
 
+/*
+ * Record kernel receive and dispatch timestamps on received frames.
+ */
+extern	int comm_udp_set_timestamps(struct fde_comm *fc, int enable);
+
 /*
  * Set the callback and the number of UDP frames that we will
  * queue on this comm FD.  Any attempt to queue more will result
@@ -274,6 +691,9 @@ extern	int comm_udp_write_setup(struct fde_comm *fc, comm_write_udp_cb *cb,
  * queue failed.  It's up to the caller to free the buffer
  * if the transmit fails.
  *
+ * A frame with sl_rem of 0 is sent to the connected peer; this
+ * is what AF_UNIX datagram socketpairs need.
+ *
  * Each queued item will have the callback called, either on
  * success or failure/close.  So the caller is responsible
  * for freeing the frame.
@@ -281,4 +701,32 @@ extern	int comm_udp_write_setup(struct fde_comm *fc, comm_write_udp_cb *cb,
 extern	int comm_udp_write(struct fde_comm *fc,
 	    struct fde_comm_udp_frame *fr);
 
+/*
+ * Start receiving descriptors (SCM_RIGHTS) on an AF_UNIX socket.
+ *
+ * The callback is called once per message with up to
+ * COMM_FDPASS_MAX descriptors, which the callee then owns.  EOF,
+ * errors and close stop receiving.
+ */
+extern	int comm_fdpass_recv(struct fde_comm *fc, comm_fdpass_recv_cb *cb,
+	    void *cbdata);
+
+/*
+ * Set the callback and the number of descriptors that can be
+ * queued for sending on this AF_UNIX socket.
+ */
+extern	int comm_fdpass_send_setup(struct fde_comm *fc,
+	    comm_fdpass_send_cb *cb, void *cbdata, int qlen);
+
+/*
+ * Queue a descriptor to send.  Returns -1 if the queue is full.
+ *
+ * Everything queued during a loop pass goes out together at the
+ * end of it, batched into as few messages as possible.  The comm
+ * owns 'fd' from here on and closes our copy once it's sent (or
+ * fails); the callback is called per message with how many
+ * descriptors it carried.
+ */
+extern	int comm_fdpass_send(struct fde_comm *fc, int fd);
+
 #endif	/* __COMM_H__ */
@@ -34,10 +34,6 @@
 #include <string.h>
 #include <pthread.h>
 
-/* For thread affinity */
-#include <pthread_np.h>
-#include <sys/cpuset.h>
-
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/event.h>
@@ -79,6 +75,8 @@ client_ev_cleanup_cb(int fd, struct fde *f, void *arg, fde_cb_status status)
 		c->cb.cb(c, c->cb.cbdata, CONN_STATE_FREEING);
 
 	fde_free(c->h, c->ev_cleanup);
+	if (c->io_stats_cb.ev != NULL)
+		fde_free(c->h, c->io_stats_cb.ev);
 	free(c->r.buf);
 	iapp_netbuf_free(c->w.nb);
 	free(c);
@@ -99,6 +97,28 @@ client_ev_close_cb(int fd, struct fde_comm *fc, void *arg)
 	/* XXX should ensure we only call this once */
 	fde_add(c->h, c->ev_cleanup);
 }
+static void
+conn_io_stats_push(struct conn *c)
+{
+	struct comm_stats st;
+
+	if (c->io_stats_cb.cb == NULL || c->comm == NULL)
+		return;
+	comm_get_stats(c->comm, &st, 1);
+	c->io_stats_cb.cb(c, c->io_stats_cb.cbdata, &st);
+}
+
+static void
+conn_io_stats_cb(int fd, struct fde *f, void *arg, fde_cb_status s)
+{
+	struct conn *c = arg;
+
+	if (c->state == CONN_STATE_CLOSING)
+		return;
+	conn_io_stats_push(c);
+	fde_add_deadline(c->h, c->io_stats_cb.ev, c->io_stats_cb.interval_ms);
+}
+
 /*
  * Initiate shutdown of a given conn.
  *
@@ -122,6 +142,11 @@ conn_close(struct conn *c)
 	if (c->cb.cb)
 		c->cb.cb(c, c->cb.cbdata, CONN_STATE_CLOSING);
 
+	/* Last of the IO statistics */
+	if (c->io_stats_cb.ev != NULL)
+		fde_delete(c->h, c->io_stats_cb.ev);
+	conn_io_stats_push(c);
+
 	/* Call comm_close(); when IO completes we'll get notified */
 	/*
 	 * The alternative is to track when we're writing and if we
@@ -259,14 +284,37 @@ conn_set_stats_cb(struct conn *c, conn_owner_stats_update_cb *cb, void *cbdata)
 	c->stats_cb.cbdata = cbdata;
 }
 
-struct conn *
-conn_new(struct fde_head *h, struct cfg *cfg, struct shm_alloc_state *sm,
-    int fd, conn_owner_update_cb *cb, void *cbdata)
+int
+conn_set_io_stats_cb(struct conn *c, conn_owner_io_stats_cb *cb,
+    void *cbdata, int interval_ms)
+{
+
+	if (interval_ms <= 0 || c->comm == NULL)
+		return (-1);
+
+	if (c->io_stats_cb.ev == NULL) {
+		c->io_stats_cb.ev = fde_create(c->h, -1, FDE_T_DEADLINE, 0,
+		    conn_io_stats_cb, c);
+		if (c->io_stats_cb.ev == NULL)
+			return (-1);
+	}
+
+	c->io_stats_cb.cb = cb;
+	c->io_stats_cb.cbdata = cbdata;
+	c->io_stats_cb.interval_ms = interval_ms;
+
+	/* Keep any TCP_INFO sampling conn_new() set up */
+	(void) comm_set_stats(c->comm, 1, c->comm->stc.tcpi_ms);
+	fde_add_deadline(c->h, c->io_stats_cb.ev, interval_ms);
+	return (0);
+}
+
+static struct conn *
+conn_alloc(struct cfg *cfg, struct shm_alloc_state *sm)
 {
 	struct conn *c;
 	char *buf;
 	int i;
-	int sn;
 
 	c = calloc(1, sizeof(*c));
 	if (c == NULL) {
@@ -282,6 +330,12 @@ conn_new(struct fde_head *h, struct cfg *cfg, struct shm_alloc_state *sm,
 		return (NULL);
 	}
 
+	/* Everyone sending the same payload? Just take a reference */
+	if (cfg->shared_nb != NULL) {
+		c->w.nb = iapp_netbuf_ref(cfg->shared_nb);
+		return (c);
+	}
+
 	c->w.nb = iapp_netbuf_alloc(sm, cfg->atype, cfg->io_size);
 	if (c->w.nb == NULL) {
 		warn("%s: iapp_netbuf_alloc", __func__);
@@ -296,25 +350,14 @@ conn_new(struct fde_head *h, struct cfg *cfg, struct shm_alloc_state *sm,
 		buf[i] = (i % 10) + '0';
 	}
 
-	/*
-	 * Limit the send size to one buffer for now.
-	 *
-	 * This isn't optimal but until we queue multiple buffers
-	 * via sendfile, we will end up queueing the same memory region
-	 * over and over again via different mbufs to the same socket
-	 * and that isn't at all useful or correct.
-	 *
-	 * Once the shm allocator handles returning buffers, we can
-	 * modify the transmit path to allocate buffers as required and
-	 * then keep up to two in flight.  Then we can just remove
-	 * this limit.
-	 */
-	sn = cfg->io_size;
-	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sn, sizeof(sn)) < 0)
-		warn("%s: setsockopt(SO_SNDBUF)", __func__);
+	return (c);
+}
+
+static void
+conn_start(struct conn *c, struct fde_head *h, conn_owner_update_cb *cb,
+    void *cbdata)
+{
 
-	c->fd = fd;
-	c->comm = comm_create(fd, h, client_ev_close_cb, c);
 	c->ev_cleanup = fde_create(h, -1, FDE_T_CALLBACK, 0,
 	    client_ev_cleanup_cb, c);
 	c->state = CONN_STATE_RUNNING;
@@ -337,6 +380,77 @@ conn_new(struct fde_head *h, struct cfg *cfg, struct shm_alloc_state *sm,
 	 * Start writing!
 	 */
 	comm_write(c->comm, c->w.nb, 0, iapp_netbuf_size(c->w.nb), conn_write_cb, c);
+}
+
+struct conn *
+conn_new(struct fde_head *h, struct cfg *cfg, struct shm_alloc_state *sm,
+    int fd, conn_owner_update_cb *cb, void *cbdata)
+{
+	struct conn *c;
+	int sn;
+
+	c = conn_alloc(cfg, sm);
+	if (c == NULL)
+		return (NULL);
+
+	/*
+	 * Limit the send size to one buffer for now.
+	 *
+	 * This isn't optimal but until we queue multiple buffers
+	 * via sendfile, we will end up queueing the same memory region
+	 * over and over again via different mbufs to the same socket
+	 * and that isn't at all useful or correct.
+	 *
+	 * Once the shm allocator handles returning buffers, we can
+	 * modify the transmit path to allocate buffers as required and
+	 * then keep up to two in flight.  Then we can just remove
+	 * this limit.
+	 */
+	sn = cfg->io_size;
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sn, sizeof(sn)) < 0)
+		warn("%s: setsockopt(SO_SNDBUF)", __func__);
+
+	c->fd = fd;
+	c->comm = comm_create(fd, h, client_ev_close_cb, c);
+
+	/*
+	 * Sample TCP_INFO on a (cheaply chosen) subset of connections.
+	 * The samples only go anywhere with the IO stats pushes, so
+	 * don't bother without them.
+	 */
+	if (cfg->io_stats_ms > 0 && cfg->tcp_info_sample > 0 &&
+	    cfg->tcp_info_ms > 0 && fd % cfg->tcp_info_sample == 0)
+		(void) comm_set_stats(c->comm, 0, cfg->tcp_info_ms);
+
+	conn_start(c, h, cb, cbdata);
+
+	return (c);
+}
+
+/*
+ * As conn_new(), but over one side of a shared memory channel
+ * rather than a socket.
+ */
+struct conn *
+conn_new_shm(struct fde_head *h, struct cfg *cfg, struct shm_alloc_state *sm,
+    struct iapp_shm_chan *ch, int side, conn_owner_update_cb *cb,
+    void *cbdata)
+{
+	struct conn *c;
+
+	c = conn_alloc(cfg, sm);
+	if (c == NULL)
+		return (NULL);
+
+	c->fd = -1;
+	c->comm = comm_create_shm(ch, side, h, client_ev_close_cb, c);
+	if (c->comm == NULL) {
+		iapp_netbuf_free(c->w.nb);
+		free(c->r.buf);
+		free(c);
+		return (NULL);
+	}
+	conn_start(c, h, cb, cbdata);
 
 	return (c);
 }
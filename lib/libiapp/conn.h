@@ -30,6 +30,7 @@
 
 struct thr;
 struct conn;
+struct iapp_shm_chan;
 
 typedef enum {
 	CONN_STATE_NONE,
@@ -42,6 +43,7 @@ typedef enum {
 
 typedef void conn_owner_update_cb(struct conn *c, void *arg, conn_state_t newstate);
 typedef void conn_owner_stats_update_cb(struct conn *c, void *arg, size_t tx_bytes, size_t rx_bytes);
+typedef void conn_owner_io_stats_cb(struct conn *c, void *arg, const struct comm_stats *st);
 
 struct conn {
 	int fd;
@@ -72,6 +74,14 @@ struct conn {
 		void *cbdata;
 	} stats_cb;
 
+	/* Periodic comm IO statistics; the counters since the last call */
+	struct {
+		conn_owner_io_stats_cb *cb;
+		void *cbdata;
+		int interval_ms;
+		struct fde *ev;
+	} io_stats_cb;
+
 	/* Configuration related information */
 	struct {
 	} cfg;
@@ -86,8 +96,18 @@ struct conn {
 extern	struct conn * conn_new(struct fde_head *h, struct cfg *cfg,
 	    struct shm_alloc_state *sm, int fd,
 	    conn_owner_update_cb *cb, void *cbdata);
+extern	struct conn * conn_new_shm(struct fde_head *h, struct cfg *cfg,
+	    struct shm_alloc_state *sm, struct iapp_shm_chan *ch, int side,
+	    conn_owner_update_cb *cb, void *cbdata);
 extern	void conn_close(struct conn *c);
 extern	void conn_set_stats_cb(struct conn *c, conn_owner_stats_update_cb *cb,
 	    void *cbdata);
 
+/*
+ * Push the comm's IO statistics to the owner every interval_ms, and
+ * once more as the connection closes.
+ */
+extern	int conn_set_io_stats_cb(struct conn *c, conn_owner_io_stats_cb *cb,
+	    void *cbdata, int interval_ms);
+
 #endif	/* __CONN_H__ */
@@ -36,6 +36,15 @@ struct cfg {
 	int port;
 	int do_thread_pin;
 	int do_fd_affinity;
+	int listen_steer;	/* iapp_listen_steer_t */
+	char *rss_key;		/* hex Toeplitz key, NULL for default */
+	char *rss_indir;	/* comma separated thread ids, or NULL */
+	int accept_data;	/* read this much early (eg SYN) data on accept */
+	int io_stats_ms;	/* push comm IO stats this often; 0 - off */
+	int tcp_info_sample;	/* .. with TCP_INFO from 1 in N conns */
+	int tcp_info_ms;	/* .. this often */
+	int shared_buf;		/* all conns write one buffer .. */
+	struct iapp_netbuf *shared_nb;	/* .. this one */
 };
 
 #endif	/* __CFG_H__ */
@@ -0,0 +1,407 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "fde.h"
+#include "comm.h"
+#include "fd_util.h"
+#include "connpool.h"
+
+static struct iapp_connpool_host *
+iapp_connpool_host_lookup(struct iapp_connpool *cp, const struct sockaddr *sa,
+    socklen_t slen)
+{
+	struct iapp_connpool_host *h;
+
+	TAILQ_FOREACH(h, &cp->hosts, node) {
+		if (h->slen == slen && memcmp(&h->sa, sa, slen) == 0)
+			return (h);
+	}
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	memcpy(&h->sa, sa, slen);
+	h->slen = slen;
+	TAILQ_INIT(&h->idle);
+	TAILQ_INSERT_TAIL(&cp->hosts, h, node);
+	return (h);
+}
+
+/*
+ * Free a host entry once it has no connections left.
+ */
+static void
+iapp_connpool_host_release(struct iapp_connpool *cp,
+    struct iapp_connpool_host *h)
+{
+
+	if (h->n_conns != 0)
+		return;
+	TAILQ_REMOVE(&cp->hosts, h, node);
+	free(h);
+}
+
+/*
+ * Take a connection off the idle lists.
+ */
+static void
+iapp_connpool_unpark(struct iapp_pconn *pc)
+{
+	struct iapp_connpool *cp = pc->cp;
+
+	if (pc->is_idle == 0)
+		return;
+	pc->is_idle = 0;
+	TAILQ_REMOVE(&pc->host->idle, pc, h_node);
+	pc->host->n_idle--;
+	TAILQ_REMOVE(&cp->idle, pc, p_node);
+	cp->n_idle--;
+	fde_delete(cp->fh, pc->ev_idle);
+}
+
+/*
+ * An idle connection should have nothing to read.  EOF means the
+ * peer closed it; data means it's out of step with the protocol.
+ */
+static int
+iapp_connpool_is_healthy(struct iapp_pconn *pc)
+{
+	char c;
+	ssize_t r;
+
+	r = recv(pc->fc->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return (1);
+	return (0);
+}
+
+static void
+iapp_connpool_close_cb(int fd, struct fde_comm *fc, void *arg)
+{
+	struct iapp_pconn *pc = arg;
+
+	/* Already off the pool; it may be gone (see iapp_connpool_free()) */
+	if (pc->ev_ready != NULL)
+		fde_free(fc->fh_parent, pc->ev_ready);
+	if (pc->ev_idle != NULL)
+		fde_free(fc->fh_parent, pc->ev_idle);
+	free(pc);
+}
+
+/*
+ * Take a connection off the pool and close it.  One detached by
+ * iapp_connpool_free() is just closed.
+ */
+static void
+iapp_connpool_close(struct iapp_pconn *pc)
+{
+	struct iapp_connpool *cp = pc->cp;
+
+	if (cp != NULL) {
+		iapp_connpool_unpark(pc);
+		fde_delete(cp->fh, pc->ev_ready);
+		TAILQ_REMOVE(&cp->conns, pc, c_node);
+		pc->host->n_conns--;
+		iapp_connpool_host_release(cp, pc->host);
+		pc->cp = NULL;
+		pc->host = NULL;
+	}
+	comm_close(pc->fc);
+}
+
+static void
+iapp_connpool_ready_cb(int fd, struct fde *f, void *arg, fde_cb_status s)
+{
+	struct iapp_pconn *pc = arg;
+
+	pc->is_pending = 0;
+	pc->cb(pc->cp, pc->cbdata, pc, FDE_COMM_CB_COMPLETED);
+}
+
+static void
+iapp_connpool_idle_cb(int fd, struct fde *f, void *arg, fde_cb_status s)
+{
+	struct iapp_pconn *pc = arg;
+
+	pc->cp->stats.n_expired++;
+	iapp_connpool_close(pc);
+}
+
+static void
+iapp_connpool_connect_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval)
+{
+	struct iapp_pconn *pc = arg;
+
+	/* Closed from under the checkout by iapp_connpool_free() */
+	if (pc->cp == NULL)
+		return;
+
+	pc->is_pending = 0;
+	if (status != FDE_COMM_CB_COMPLETED) {
+		pc->cb(pc->cp, pc->cbdata, NULL, status);
+		iapp_connpool_close(pc);
+		return;
+	}
+
+	pc->n_uses++;
+	pc->cb(pc->cp, pc->cbdata, pc, FDE_COMM_CB_COMPLETED);
+}
+
+static struct iapp_pconn *
+iapp_connpool_connect(struct iapp_connpool *cp, struct iapp_connpool_host *h)
+{
+	struct iapp_pconn *pc;
+	int fd;
+
+	pc = calloc(1, sizeof(*pc));
+	if (pc == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	pc->cp = cp;
+	pc->host = h;
+
+	pc->ev_ready = fde_create(cp->fh, -1, FDE_T_CALLBACK, 0,
+	    iapp_connpool_ready_cb, pc);
+	pc->ev_idle = fde_create(cp->fh, -1, FDE_T_DEADLINE, 0,
+	    iapp_connpool_idle_cb, pc);
+	if (pc->ev_ready == NULL || pc->ev_idle == NULL)
+		goto error;
+
+	fd = socket(h->sa.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		warn("%s: socket", __func__);
+		goto error;
+	}
+	(void) comm_fd_set_nonblocking(fd, 1);
+
+	pc->fc = comm_create(fd, cp->fh, iapp_connpool_close_cb, pc);
+	if (pc->fc == NULL) {
+		close(fd);
+		goto error;
+	}
+
+	/* From here on the close callback frees us */
+	if (comm_connect(pc->fc, (struct sockaddr *) &h->sa, h->slen,
+	    iapp_connpool_connect_cb, pc) < 0) {
+		comm_close(pc->fc);
+		return (NULL);
+	}
+
+	pc->is_pending = 1;
+	TAILQ_INSERT_TAIL(&cp->conns, pc, c_node);
+	h->n_conns++;
+	return (pc);
+
+error:
+	if (pc->ev_ready != NULL)
+		fde_free(cp->fh, pc->ev_ready);
+	if (pc->ev_idle != NULL)
+		fde_free(cp->fh, pc->ev_idle);
+	free(pc);
+	return (NULL);
+}
+
+struct iapp_connpool *
+iapp_connpool_create(struct fde_head *fh, int max_idle, int max_idle_host,
+    int idle_ms)
+{
+	struct iapp_connpool *cp;
+
+	cp = calloc(1, sizeof(*cp));
+	if (cp == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	cp->fh = fh;
+	cp->max_idle = max_idle;
+	cp->max_idle_host = max_idle_host;
+	cp->idle_ms = idle_ms;
+	TAILQ_INIT(&cp->hosts);
+	TAILQ_INIT(&cp->idle);
+	TAILQ_INIT(&cp->conns);
+
+	return (cp);
+}
+
+void
+iapp_connpool_free(struct iapp_connpool *cp)
+{
+	struct iapp_connpool_host *h;
+	struct iapp_pconn *pc;
+
+	/*
+	 * Detach every connection from the pool.  Idle ones, and
+	 * checkouts not yet handed over, are closed and their close
+	 * callbacks finish up.  Ones the caller has are left with
+	 * them; putting or discarding them later just closes them.
+	 */
+	while ((pc = TAILQ_FIRST(&cp->conns)) != NULL) {
+		TAILQ_REMOVE(&cp->conns, pc, c_node);
+		iapp_connpool_unpark(pc);
+		fde_free(cp->fh, pc->ev_ready);
+		fde_free(cp->fh, pc->ev_idle);
+		pc->ev_ready = pc->ev_idle = NULL;
+		pc->cp = NULL;
+		pc->host = NULL;
+		if (pc->is_pending == 0 && pc->is_idle == 0)
+			continue;
+		pc->is_pending = 0;
+		comm_close(pc->fc);
+	}
+
+	while ((h = TAILQ_FIRST(&cp->hosts)) != NULL) {
+		TAILQ_REMOVE(&cp->hosts, h, node);
+		free(h);
+	}
+	free(cp);
+}
+
+int
+iapp_connpool_get(struct iapp_connpool *cp, const struct sockaddr *sa,
+    socklen_t slen, iapp_connpool_cb *cb, void *cbdata)
+{
+	struct iapp_connpool_host *h;
+	struct iapp_pconn *pc;
+
+	if (slen > sizeof(h->sa))
+		return (-1);
+
+	h = iapp_connpool_host_lookup(cp, sa, slen);
+	if (h == NULL)
+		return (-1);
+
+	/* The most recently used connection is the most likely alive */
+	while ((pc = TAILQ_FIRST(&h->idle)) != NULL) {
+		iapp_connpool_unpark(pc);
+		if (iapp_connpool_is_healthy(pc) == 0) {
+			cp->stats.n_unhealthy++;
+			iapp_connpool_close(pc);
+			continue;
+		}
+
+		cp->stats.n_reuse++;
+		pc->is_reused = 1;
+		pc->is_pending = 1;
+		pc->n_uses++;
+		pc->cb = cb;
+		pc->cbdata = cbdata;
+		fde_add(cp->fh, pc->ev_ready);
+		return (0);
+	}
+
+	pc = iapp_connpool_connect(cp, h);
+	if (pc == NULL) {
+		iapp_connpool_host_release(cp, h);
+		return (-1);
+	}
+
+	cp->stats.n_connect++;
+	pc->cb = cb;
+	pc->cbdata = cbdata;
+	return (0);
+}
+
+void
+iapp_connpool_put(struct iapp_pconn *pc)
+{
+	struct iapp_connpool *cp = pc->cp;
+	struct iapp_pconn *old;
+
+	if (pc->is_idle)
+		return;
+
+	/* The pool has been freed */
+	if (cp == NULL) {
+		iapp_connpool_close(pc);
+		return;
+	}
+	fde_delete(cp->fh, pc->ev_ready);
+
+	/* Nowhere to park it, or it isn't quiet */
+	if (cp->max_idle_host <= 0 || cp->max_idle <= 0 ||
+	    pc->fc->is_closing || pc->fc->r.is_active ||
+	    pc->fc->w.is_active || pc->fc->wc.qlen != 0) {
+		iapp_connpool_close(pc);
+		return;
+	}
+
+	/* Make room: the host's, then the pool's least recently used */
+	if (pc->host->n_idle >= cp->max_idle_host) {
+		old = TAILQ_LAST(&pc->host->idle, iapp_pconn_list);
+		cp->stats.n_evicted++;
+		iapp_connpool_close(old);
+	}
+	if (cp->n_idle >= cp->max_idle) {
+		old = TAILQ_LAST(&cp->idle, iapp_pconn_list);
+		cp->stats.n_evicted++;
+		iapp_connpool_close(old);
+	}
+
+	pc->is_idle = 1;
+	pc->is_reused = 0;
+	pc->cb = NULL;
+	pc->cbdata = NULL;
+	TAILQ_INSERT_HEAD(&pc->host->idle, pc, h_node);
+	pc->host->n_idle++;
+	TAILQ_INSERT_HEAD(&cp->idle, pc, p_node);
+	cp->n_idle++;
+	if (cp->idle_ms != 0)
+		fde_add_deadline(cp->fh, pc->ev_idle, cp->idle_ms);
+}
+
+void
+iapp_connpool_discard(struct iapp_pconn *pc)
+{
+
+	iapp_connpool_close(pc);
+}
+
+void
+iapp_connpool_get_stats(struct iapp_connpool *cp,
+    struct iapp_connpool_stats *st, int do_clear)
+{
+
+	*st = cp->stats;
+	if (do_clear)
+		bzero(&cp->stats, sizeof(cp->stats));
+}
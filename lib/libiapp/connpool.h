@@ -0,0 +1,139 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	__LIBIAPP_CONNPOOL_H__
+#define	__LIBIAPP_CONNPOOL_H__
+
+/*
+ * Per-thread pool of outbound stream connections, keyed by remote
+ * address.
+ *
+ * A connection that's handed back whilst healthy is parked rather
+ * than closed, and the next checkout for that address reuses it
+ * instead of paying for another handshake.  Idle connections are
+ * checked with a non-blocking MSG_PEEK when they're checked out;
+ * one the peer has closed, or that has unexpected data waiting, is
+ * thrown away.
+ */
+
+struct iapp_connpool;
+struct iapp_connpool_host;
+struct iapp_pconn;
+
+/*
+ * Called once per checkout, never from inside
+ * iapp_connpool_get().  On FDE_COMM_CB_COMPLETED the connection is
+ * the caller's until it's handed to iapp_connpool_put() or
+ * iapp_connpool_discard(); on anything else it's already gone.
+ */
+typedef	void iapp_connpool_cb(struct iapp_connpool *cp, void *arg,
+	    struct iapp_pconn *pc, fde_comm_cb_status status);
+
+struct iapp_pconn {
+	struct iapp_connpool *cp;
+	struct iapp_connpool_host *host;
+	TAILQ_ENTRY(iapp_pconn) h_node;		/* host's idle list */
+	TAILQ_ENTRY(iapp_pconn) p_node;		/* pool's idle list */
+	TAILQ_ENTRY(iapp_pconn) c_node;		/* pool's list of all */
+	struct fde_comm *fc;
+	struct fde *ev_ready;			/* checkout completion */
+	struct fde *ev_idle;			/* idle timeout */
+	int is_idle;
+	int is_pending;		/* checkout callback not yet called */
+	int is_reused;		/* this checkout didn't connect */
+	uint64_t n_uses;
+
+	iapp_connpool_cb *cb;
+	void *cbdata;
+};
+
+TAILQ_HEAD(iapp_pconn_list, iapp_pconn);
+
+struct iapp_connpool_host {
+	TAILQ_ENTRY(iapp_connpool_host) node;
+	struct sockaddr_storage sa;
+	socklen_t slen;
+	struct iapp_pconn_list idle;		/* most recently parked first */
+	int n_idle;
+	int n_conns;		/* open connections; freed at 0 */
+};
+
+struct iapp_connpool_stats {
+	uint64_t n_connect;	/* checkouts that made a new connection */
+	uint64_t n_reuse;	/* .. and that reused an idle one */
+	uint64_t n_unhealthy;	/* idle connections found dead */
+	uint64_t n_expired;	/* idle too long */
+	uint64_t n_evicted;	/* pushed out by the pool limits */
+};
+
+struct iapp_connpool {
+	struct fde_head *fh;
+	int max_idle;		/* parked connections, all hosts */
+	int max_idle_host;	/* .. and per host */
+	int idle_ms;		/* 0 - no idle timeout */
+
+	TAILQ_HEAD(, iapp_connpool_host) hosts;
+	struct iapp_pconn_list idle;		/* most recently parked first */
+	int n_idle;
+	struct iapp_pconn_list conns;		/* every open connection */
+
+	struct iapp_connpool_stats stats;
+};
+
+extern	struct iapp_connpool * iapp_connpool_create(struct fde_head *fh,
+	    int max_idle, int max_idle_host, int idle_ms);
+
+/*
+ * Close every parked connection and free the pool.  Checkouts whose
+ * callback hasn't run yet are closed without it.  Connections the
+ * caller still holds stay usable; putting or discarding them
+ * afterwards closes them.
+ */
+extern	void iapp_connpool_free(struct iapp_connpool *cp);
+
+/*
+ * Check out a connection to the given address, reusing a healthy
+ * idle one if there is one.  Returns -1 if nothing could be started.
+ */
+extern	int iapp_connpool_get(struct iapp_connpool *cp,
+	    const struct sockaddr *sa, socklen_t slen, iapp_connpool_cb *cb,
+	    void *cbdata);
+
+/*
+ * Hand back a connection with no IO outstanding on it (see
+ * comm_read_cancel().)  It's parked if the pool has room, otherwise
+ * closed.
+ */
+extern	void iapp_connpool_put(struct iapp_pconn *pc);
+
+/*
+ * Close a checked out connection, eg after a protocol error.
+ */
+extern	void iapp_connpool_discard(struct iapp_pconn *pc);
+
+extern	void iapp_connpool_get_stats(struct iapp_connpool *cp,
+	    struct iapp_connpool_stats *st, int do_clear);
+
+#endif	/* __LIBIAPP_CONNPOOL_H__ */
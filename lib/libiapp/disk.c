@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <err.h>
 #include <aio.h>
 #include <sys/types.h>
@@ -125,6 +126,28 @@ cleanup:
 	return (NULL);
 }
 
+/*
+ * Attach an existing file descriptor.
+ *
+ * This is for callers which have already opened the file (or
+ * otherwise received a descriptor) and just want to use the
+ * rest of the disk/comm machinery with it.
+ */
+int
+disk_set_fd(struct fde_disk *fdd, int fd, int do_close)
+{
+
+	if (fdd->fd != -1) {
+		fprintf(stderr, "%s: handle is already opened!\n", __func__);
+		return (-1);
+	}
+
+	fdd->fd = fd;
+	fdd->do_close = do_close;
+
+	return (0);
+}
+
 /*
  * Schedule an async disk open.
  *
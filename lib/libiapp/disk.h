@@ -101,6 +101,14 @@ struct fde_disk {
 extern	struct fde_disk * disk_create(struct fde_head *fh,
 	    disk_close_cb *cb, void *cbdata);
 
+/*
+ * Attach an already opened file descriptor to a disk handle.
+ *
+ * If do_close is 1, the descriptor will be closed when the handle
+ * is closed.
+ */
+extern	int disk_set_fd(struct fde_disk *fdd, int fd, int do_close);
+
 /*
  * Schedule an asynchronous file open.
  */
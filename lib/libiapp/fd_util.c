@@ -38,8 +38,11 @@
 #include <sys/event.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "fd_util.h"
 
@@ -57,13 +60,49 @@ comm_fd_set_nonblocking(int fd, int enable)
 	return (fcntl(fd, F_SETFL, a));
 }
 
+int
+comm_fd_set_fastopen(int fd, int qlen)
+{
+#ifdef	TCP_FASTOPEN
+	/* Linux takes the pending queue length, FreeBSD an on/off flag */
+	if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen,
+	    sizeof(qlen)) < 0)
+		return (-1);
+	return (0);
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+int
+comm_fd_set_rx_timestamps(int fd, int enable)
+{
+#if defined(SO_TIMESTAMPNS)
+	return (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable,
+	    sizeof(enable)));
+#elif defined(SO_TS_CLOCK)
+	int clk = SO_TS_REALTIME;
+
+	if (enable && setsockopt(fd, SOL_SOCKET, SO_TS_CLOCK, &clk,
+	    sizeof(clk)) < 0)
+		return (-1);
+	return (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &enable,
+	    sizeof(enable)));
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
 static int
-comm_fd_listenfd_setup_tcp(struct sockaddr_storage *sin, int type, int len)
+comm_fd_listenfd_setup(struct sockaddr_storage *sin, int family, int type,
+    int len, int do_lb)
 {
 	int fd;
 	int a;
 
-	fd = socket(type, SOCK_STREAM, 0);
+	fd = socket(family, type, 0);
 	if (fd < 0) {
 		fprintf(stderr, "%s: socket() failed; errno=%d (%s)\n",
 		    __func__,
@@ -87,6 +126,26 @@ comm_fd_listenfd_setup_tcp(struct sockaddr_storage *sin, int type, int len)
 		err(1, "%s: setsockopt", __func__);
 	}
 
+	/*
+	 * If asked, spread incoming connections/datagrams over all of
+	 * the sockets bound to this port rather than just the last one.
+	 * (Linux always does this with SO_REUSEPORT.)
+	 */
+#ifdef	SO_REUSEPORT_LB
+	if (do_lb) {
+		a = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT_LB, &a,
+		    sizeof(a)) < 0)
+			err(1, "%s: setsockopt (SO_REUSEPORT_LB)", __func__);
+	}
+#endif
+
+	/* Keep v6 sockets from also grabbing the v4 port */
+	if (family == AF_INET6) {
+		a = 1;
+		(void) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &a, sizeof(a));
+	}
+
 	if (bind(fd, (struct sockaddr *) sin, len) < 0) {
 		fprintf(stderr, "%s: bind() failed; errno=%d (%s)\n",
 		    __func__,
@@ -96,7 +155,7 @@ comm_fd_listenfd_setup_tcp(struct sockaddr_storage *sin, int type, int len)
 		return (-1);
 	}
 
-	if (listen(fd, -1) < 0) {
+	if (type == SOCK_STREAM && listen(fd, -1) < 0) {
 		fprintf(stderr, "%s: listen() failed; errno=%d (%s)\n",
 		    __func__,
 		    errno,
@@ -105,43 +164,180 @@ comm_fd_listenfd_setup_tcp(struct sockaddr_storage *sin, int type, int len)
 		return (-1);
 	}
 
+	/* Accept data in the SYN; not fatal if the kernel won't */
+	if (type == SOCK_STREAM &&
+	    (family == AF_INET || family == AF_INET6))
+		(void) comm_fd_set_fastopen(fd, COMM_FD_FASTOPEN_QLEN);
+
 	return (fd);
 }
 
+/*
+ * Fill in a wildcard address for the given family/port.
+ * Returns the sockaddr length, or -1 if the family isn't supported.
+ */
+static int
+comm_fd_sockaddr_any(struct sockaddr_storage *s, int family, int port)
+{
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+
+	bzero(s, sizeof(*s));
+
+	switch (family) {
+	case AF_INET:
+		sin = (struct sockaddr_in *) s;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = 0;
+		sin->sin_port = htons(port);
+#ifndef	__linux__
+		sin->sin_len = sizeof(struct sockaddr_in);
+#endif
+		return (sizeof(struct sockaddr_in));
+	case AF_INET6:
+		sin6 = (struct sockaddr_in6 *) s;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_any;
+		sin6->sin6_port = htons(port);
+#ifndef	__linux__
+		sin6->sin6_len = sizeof(struct sockaddr_in6);
+#endif
+		return (sizeof(struct sockaddr_in6));
+	default:
+		fprintf(stderr, "%s: unknown family (%d)\n", __func__, family);
+		return (-1);
+	}
+}
+
 int
-comm_fd_create_listen_tcp_v4(int port)
+comm_fd_create_listen(int family, int type, int port, int do_lb)
 {
 	struct sockaddr_storage s;
-	struct sockaddr_in *sin;
+	int len;
 
-	bzero(&s, sizeof(s));
+	len = comm_fd_sockaddr_any(&s, family, port);
+	if (len < 0)
+		return (-1);
 
-	sin = (struct sockaddr_in *) &s;
+	return (comm_fd_listenfd_setup(&s, family, type, len, do_lb));
+}
 
-	sin->sin_family = AF_INET;
-	sin->sin_addr.s_addr = 0;
-	sin->sin_port = htons(port);
-	sin->sin_len = sizeof(struct sockaddr_in);
+int
+comm_fd_create_listen_tcp_v4(int port)
+{
 
-	return (comm_fd_listenfd_setup_tcp(&s, AF_INET,
-	    sizeof(struct sockaddr_in)));
+	return (comm_fd_create_listen(AF_INET, SOCK_STREAM, port, 0));
 }
 
 int
 comm_fd_create_listen_tcp_v6(int port)
+{
+
+	return (comm_fd_create_listen(AF_INET6, SOCK_STREAM, port, 0));
+}
+
+int
+comm_fd_sockaddr_unix(struct sockaddr_storage *s, const char *path)
+{
+	struct sockaddr_un *sun;
+
+	bzero(s, sizeof(*s));
+	sun = (struct sockaddr_un *) s;
+
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		fprintf(stderr, "%s: path too long (%s)\n", __func__, path);
+		return (-1);
+	}
+
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+#ifndef	__linux__
+	sun->sun_len = SUN_LEN(sun);
+#endif
+	return (SUN_LEN(sun));
+}
+
+int
+comm_fd_create_listen_unix(const char *path, int type)
 {
 	struct sockaddr_storage s;
-	struct sockaddr_in6 *sin6;
+	struct stat st;
+	int fd, len;
+
+	len = comm_fd_sockaddr_unix(&s, path);
+	if (len < 0)
+		return (-1);
+
+	fd = socket(AF_UNIX, type, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: socket() failed; errno=%d (%s)\n",
+		    __func__,
+		    errno,
+		    strerror(errno));
+		return (-1);
+	}
+
+	(void) comm_fd_set_nonblocking(fd, 1);
+
+	/*
+	 * A previous run may have left its socket behind.  Only ever
+	 * remove a socket; anything else makes bind() fail instead.
+	 */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		(void) unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &s, len) < 0) {
+		fprintf(stderr, "%s: bind() failed; errno=%d (%s)\n",
+		    __func__,
+		    errno,
+		    strerror(errno));
+		close(fd);
+		return (-1);
+	}
+
+	if ((type == SOCK_STREAM || type == SOCK_SEQPACKET) &&
+	    listen(fd, -1) < 0) {
+		fprintf(stderr, "%s: listen() failed; errno=%d (%s)\n",
+		    __func__,
+		    errno,
+		    strerror(errno));
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+int
+comm_fd_create_unix_pair(int type, int fds[2])
+{
+
+	if (socketpair(AF_UNIX, type, 0, fds) < 0) {
+		fprintf(stderr, "%s: socketpair() failed; errno=%d (%s)\n",
+		    __func__,
+		    errno,
+		    strerror(errno));
+		return (-1);
+	}
 
-	bzero(&s, sizeof(s));
+	(void) comm_fd_set_nonblocking(fds[0], 1);
+	(void) comm_fd_set_nonblocking(fds[1], 1);
+	return (0);
+}
 
-	sin6 = (struct sockaddr_in6 *) &s;
+int
+comm_fd_create_pipe(int fds[2])
+{
 
-	sin6->sin6_family = AF_INET6;
-	sin6->sin6_addr = in6addr_any;
-	sin6->sin6_port = htons(port);
-	sin6->sin6_len = sizeof(struct sockaddr_in6);
+	if (pipe(fds) < 0) {
+		fprintf(stderr, "%s: pipe() failed; errno=%d (%s)\n",
+		    __func__,
+		    errno,
+		    strerror(errno));
+		return (-1);
+	}
 
-	return (comm_fd_listenfd_setup_tcp(&s, AF_INET6,
-	    sizeof(struct sockaddr_in6)));
+	(void) comm_fd_set_nonblocking(fds[0], 1);
+	(void) comm_fd_set_nonblocking(fds[1], 1);
+	return (0);
 }
@@ -38,7 +38,46 @@
  */
 
 extern	int comm_fd_set_nonblocking(int fd, int enable);
+
+/*
+ * Create a non-blocking SO_REUSEPORT socket bound to the wildcard
+ * address.  SOCK_STREAM sockets are also put into listen.
+ *
+ * If do_lb is 1, incoming connections / datagrams are load balanced
+ * across every socket bound to the port.
+ */
+extern	int comm_fd_create_listen(int family, int type, int port, int do_lb);
 extern	int comm_fd_create_listen_tcp_v4(int port);
 extern	int comm_fd_create_listen_tcp_v6(int port);
 
+/*
+ * Enable TCP Fast Open on a listen socket, with up to 'qlen'
+ * connections whose SYN data hasn't been accepted yet.  TCP listen
+ * sockets from above get COMM_FD_FASTOPEN_QLEN.
+ */
+#define	COMM_FD_FASTOPEN_QLEN	256
+extern	int comm_fd_set_fastopen(int fd, int qlen);
+
+/*
+ * Have the kernel stamp received datagrams with their arrival time
+ * (CLOCK_REALTIME, nanoseconds) in the control data: SO_TIMESTAMPNS
+ * on Linux, SO_TIMESTAMP with SO_TS_REALTIME on FreeBSD.
+ */
+extern	int comm_fd_set_rx_timestamps(int fd, int enable);
+
+/*
+ * Unix domain sockets and pipes, all non-blocking.
+ *
+ * comm_fd_create_listen_unix() binds to 'path' (removing any stale
+ * socket there first) and listens if it's a stream or seqpacket
+ * socket.  comm_fd_sockaddr_unix() fills in an address for
+ * comm_connect(); it returns the length or -1 if 'path' is too long.
+ */
+struct sockaddr_storage;
+extern	int comm_fd_create_listen_unix(const char *path, int type);
+extern	int comm_fd_sockaddr_unix(struct sockaddr_storage *s,
+	    const char *path);
+extern	int comm_fd_create_unix_pair(int type, int fds[2]);
+extern	int comm_fd_create_pipe(int fds[2]);
+
 #endif	/* __FDUTIL_H__ */
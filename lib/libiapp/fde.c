@@ -31,7 +31,9 @@
 #include <unistd.h>
 #include <err.h>
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
@@ -39,10 +41,29 @@
 
 #include "fde.h"
 
+static void
+fde_remote_wakeup_cb(int fd, struct fde *f, void *arg, fde_cb_status status)
+{
+	/*
+	 * Do nothing here; the wakeup just breaks us out of kevent()
+	 * so fde_runloop() can pick up the remote callback list.
+	 */
+}
+
+static void
+fde_w_set_now(struct fde_head *fh, const struct timeval *tv)
+{
+
+	fh->wheel.now_tick = ((uint64_t) tv->tv_sec * 1000 +
+	    tv->tv_usec / 1000) / FDE_WHEEL_TICK_MSEC;
+}
+
 struct fde_head *
 fde_ctx_new(void)
 {
 	struct fde_head *fh;
+	struct timeval tv;
+	int i;
 
 	fh = calloc(1, sizeof(*fh));
 	if (fh == NULL) {
@@ -53,6 +74,14 @@ fde_ctx_new(void)
 	TAILQ_INIT(&fh->f_head);
 	TAILQ_INIT(&fh->f_cb_head);
 	TAILQ_INIT(&fh->f_t_head);
+	TAILQ_INIT(&fh->f_fl_head);
+
+	for (i = 0; i < FDE_WHEEL_SLOTS; i++)
+		TAILQ_INIT(&fh->wheel.slot[i]);
+	TAILQ_INIT(&fh->wheel.expired);
+	(void) gettimeofday(&tv, NULL);
+	fde_w_set_now(fh, &tv);
+	fh->wheel.cur_tick = fh->wheel.now_tick;
 
 	fh->kqfd = kqueue();
 	if (fh->kqfd == -1) {
@@ -60,6 +89,22 @@ fde_ctx_new(void)
 		free(fh);
 		return (NULL);
 	}
+
+	/*
+	 * Remote callback list and its wakeup event.
+	 */
+	pthread_mutex_init(&fh->remote.l, NULL);
+	TAILQ_INIT(&fh->remote.r_head);
+	fh->remote.ev_wakeup = fde_create(fh, -1, FDE_T_USER, FDE_F_PERSIST,
+	    fde_remote_wakeup_cb, fh);
+	if (fh->remote.ev_wakeup == NULL) {
+		pthread_mutex_destroy(&fh->remote.l);
+		close(fh->kqfd);
+		free(fh);
+		return (NULL);
+	}
+	fde_add(fh, fh->remote.ev_wakeup);
+
 	return (fh);
 }
 
@@ -145,6 +190,8 @@ fde_create(struct fde_head *fh, int fd, fde_type t, fde_flags fl,
 			break;
 		case FDE_T_CALLBACK:
 		case FDE_T_TIMER:
+		case FDE_T_FLUSH:
+		case FDE_T_DEADLINE:
 			/* Nothing to do here */
 			break;
 		case FDE_T_USER:
@@ -224,6 +271,7 @@ fde_kq_push(struct fde_head *fh, struct kevent *k)
 
 	memcpy(&fh->pending.kev_list[fh->pending.n], k, sizeof(struct kevent));
 	fh->pending.n++;
+	fh->stats.n_changes++;
 #else
 	ret = kevent(fh->kqfd, k, 1, NULL, 0, NULL);
 	if (ret < 0) {
@@ -290,7 +338,16 @@ fde_ue_add(struct fde_head *fh, struct fde *f)
 	f->kev.flags &= (EV_DELETE | EV_ADD | EV_CLEAR | EV_ONESHOT);
 	f->kev.flags |= fde_ev_flags(f, EV_ADD | EV_ENABLE);
 
-	fde_kq_push(fh, &f->kev);
+	/*
+	 * User events are triggered from other threads, so they
+	 * must exist in the kqueue before fde_add() returns.
+	 * Don't put them on the pending changelist.
+	 */
+	if (kevent(fh->kqfd, &f->kev, 1, NULL, 0, NULL) < 0) {
+		warn("%s: kevent", __func__);
+		return;
+	}
+	fh->stats.n_changes++;
 
 	f->is_active = 1;
 	TAILQ_INSERT_TAIL(&fh->f_head, f, node);
@@ -339,13 +396,59 @@ fde_ue_push(struct fde_head *fh, struct fde *f)
 	    NOTE_FFCOPY | NOTE_TRIGGER | 0x1, 0, f);
 
 	ret = kevent(fh->kqfd, &kev, 1, NULL, 0, NULL);
-	if (ret != 1) {
+	if (ret < 0) {
 		warn("%s: kevent", __func__);
 		return (0);
 	}
 	return (1);
 }
 
+void
+fde_add_remote(struct fde_head *fh, struct fde *f)
+{
+	int do_wakeup;
+
+	if (f->f_type != FDE_T_CALLBACK) {
+		fprintf(stderr, "%s: %p: wrong type (%d)\n",
+		    __func__,
+		    f,
+		    f->f_type);
+		return;
+	}
+
+	pthread_mutex_lock(&fh->remote.l);
+	if (f->is_remote) {
+		pthread_mutex_unlock(&fh->remote.l);
+		return;
+	}
+	/*
+	 * Only the first entry needs to wake up the owner; it
+	 * drains the whole list each time it wakes up.
+	 */
+	do_wakeup = TAILQ_EMPTY(&fh->remote.r_head);
+	f->is_remote = 1;
+	TAILQ_INSERT_TAIL(&fh->remote.r_head, f, r_node);
+	pthread_mutex_unlock(&fh->remote.l);
+
+	if (do_wakeup)
+		(void) fde_ue_push(fh, fh->remote.ev_wakeup);
+}
+
+int
+fde_delete_remote(struct fde_head *fh, struct fde *f)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&fh->remote.l);
+	if (f->is_remote) {
+		TAILQ_REMOVE(&fh->remote.r_head, f, r_node);
+		f->is_remote = 0;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&fh->remote.l);
+
+	return (ret);
+}
 
 static void
 fde_cb_add(struct fde_head *fh, struct fde *f)
@@ -372,6 +475,83 @@ fde_cb_delete(struct fde_head *fh, struct fde *f)
 	TAILQ_REMOVE(&fh->f_cb_head, f, cb_node);
 }
 
+static void
+fde_fl_add(struct fde_head *fh, struct fde *f)
+{
+
+	if (f->is_active)
+		return;
+
+	f->is_active = 1;
+	f->f_cb_genid = fh->f_fl_genid;
+	TAILQ_INSERT_TAIL(&fh->f_head, f, node);
+	TAILQ_INSERT_TAIL(&fh->f_fl_head, f, cb_node);
+}
+
+static void
+fde_fl_delete(struct fde_head *fh, struct fde *f)
+{
+
+	if (! f->is_active)
+		return;
+
+	f->is_active = 0;
+	TAILQ_REMOVE(&fh->f_head, f, node);
+	TAILQ_REMOVE(&fh->f_fl_head, f, cb_node);
+}
+
+static struct fde_w_list *
+fde_w_list(struct fde_head *fh, int slot)
+{
+
+	if (slot == FDE_WHEEL_SLOTS)
+		return (&fh->wheel.expired);
+	return (&fh->wheel.slot[slot]);
+}
+
+static void
+fde_w_delete(struct fde_head *fh, struct fde *f)
+{
+
+	if (! f->is_active)
+		return;
+
+	f->is_active = 0;
+	TAILQ_REMOVE(&fh->f_head, f, node);
+	TAILQ_REMOVE(fde_w_list(fh, f->w_slot), f, cb_node);
+	fh->wheel.n--;
+}
+
+void
+fde_add_deadline(struct fde_head *fh, struct fde *f, int msec)
+{
+	uint64_t t;
+
+	if (f->f_type != FDE_T_DEADLINE) {
+		fprintf(stderr, "%s: %p: wrong type (%d)\n",
+		    __func__,
+		    f,
+		    f->f_type);
+		return;
+	}
+
+	/* Re-arm */
+	fde_w_delete(fh, f);
+
+	/* Round up, and never into a tick that has already run */
+	t = fh->wheel.now_tick +
+	    (msec + FDE_WHEEL_TICK_MSEC - 1) / FDE_WHEEL_TICK_MSEC;
+	if (t < fh->wheel.cur_tick)
+		t = fh->wheel.cur_tick;
+
+	f->is_active = 1;
+	f->w_tick = t;
+	f->w_slot = t % FDE_WHEEL_SLOTS;
+	TAILQ_INSERT_TAIL(&fh->f_head, f, node);
+	TAILQ_INSERT_TAIL(&fh->wheel.slot[f->w_slot], f, cb_node);
+	fh->wheel.n++;
+}
+
 static void
 fde_t_delete(struct fde_head *fh, struct fde *f)
 {
@@ -396,6 +576,9 @@ fde_add(struct fde_head *fh, struct fde *f)
 		case FDE_T_CALLBACK:
 			fde_cb_add(fh, f);
 			break;
+		case FDE_T_FLUSH:
+			fde_fl_add(fh, f);
+			break;
 		case FDE_T_USER:
 			fde_ue_add(fh, f);
 			break;
@@ -491,6 +674,12 @@ fde_delete(struct fde_head *fh, struct fde *f)
 		case FDE_T_CALLBACK:
 			fde_cb_delete(fh, f);
 			break;
+		case FDE_T_FLUSH:
+			fde_fl_delete(fh, f);
+			break;
+		case FDE_T_DEADLINE:
+			fde_w_delete(fh, f);
+			break;
 		case FDE_T_TIMER:
 			fde_t_delete(fh, f);
 			break;
@@ -528,6 +717,112 @@ fde_cb_runloop(struct fde_head *fh)
 	}
 }
 
+/*
+ * Run the flush callbacks queued during this pass.  Anything they
+ * queue in turn runs at the end of the next pass.
+ */
+static void
+fde_fl_runloop(struct fde_head *fh)
+{
+	struct fde *f;
+	uint32_t cur_genid;
+
+	cur_genid = fh->f_fl_genid;
+	fh->f_fl_genid++;
+
+	while ((f = TAILQ_FIRST(&fh->f_fl_head)) != NULL) {
+		if (f->f_cb_genid != cur_genid)
+			break;
+		fde_delete(fh, f);
+		f->cb(f->fd, f, f->cbdata, FDE_CB_COMPLETED);
+		/* f may be free at this point */
+	}
+}
+
+/*
+ * Run the deadlines for every tick up to now.
+ *
+ * Due events are moved to the expired list first, so callbacks
+ * can delete any other event (including ones in the same bucket)
+ * while we're calling them.
+ */
+static void
+fde_w_runloop(struct fde_head *fh)
+{
+	struct fde *f, *f_next;
+	uint64_t t, n;
+
+	if (fh->wheel.cur_tick > fh->wheel.now_tick)
+		return;
+
+	/* Each bucket only needs looking at once */
+	n = fh->wheel.now_tick - fh->wheel.cur_tick + 1;
+	if (n > FDE_WHEEL_SLOTS)
+		n = FDE_WHEEL_SLOTS;
+
+	for (t = fh->wheel.cur_tick; n > 0; t++, n--) {
+		f = TAILQ_FIRST(&fh->wheel.slot[t % FDE_WHEEL_SLOTS]);
+		for (; f != NULL; f = f_next) {
+			f_next = TAILQ_NEXT(f, cb_node);
+			if (f->w_tick > fh->wheel.now_tick)
+				continue;
+			TAILQ_REMOVE(&fh->wheel.slot[f->w_slot], f, cb_node);
+			TAILQ_INSERT_TAIL(&fh->wheel.expired, f, cb_node);
+			f->w_slot = FDE_WHEEL_SLOTS;
+		}
+	}
+	fh->wheel.cur_tick = fh->wheel.now_tick + 1;
+
+	while ((f = TAILQ_FIRST(&fh->wheel.expired)) != NULL) {
+		fde_delete(fh, f);
+		f->cb(f->fd, f, f->cbdata, FDE_CB_COMPLETED);
+		/* f may be free at this point */
+	}
+}
+
+/*
+ * Earliest tick anything on the wheel is due.
+ *
+ * Everything in the bucket for tick t is due at t or a whole
+ * number of laps later, so walk the buckets from the next tick
+ * to run and stop once we're past the best seen so far.
+ */
+static uint64_t
+fde_w_next_tick(struct fde_head *fh)
+{
+	struct fde *f;
+	uint64_t t, best = UINT64_MAX;
+	int n;
+
+	for (t = fh->wheel.cur_tick, n = 0;
+	    n < FDE_WHEEL_SLOTS && t < best; t++, n++) {
+		TAILQ_FOREACH(f, &fh->wheel.slot[t % FDE_WHEEL_SLOTS],
+		    cb_node) {
+			if (f->w_tick < best)
+				best = f->w_tick;
+		}
+	}
+	return (best);
+}
+
+/*
+ * Move callbacks scheduled by other threads onto the local
+ * callback list.
+ */
+static void
+fde_remote_runloop(struct fde_head *fh)
+{
+	struct fde *f;
+
+	pthread_mutex_lock(&fh->remote.l);
+	while ((f = TAILQ_FIRST(&fh->remote.r_head)) != NULL) {
+		TAILQ_REMOVE(&fh->remote.r_head, f, r_node);
+		f->is_remote = 0;
+		fde_cb_add(fh, f);
+	}
+	pthread_mutex_unlock(&fh->remote.l);
+}
+
 static void
 fde_t_get_timeout(struct fde_head *fh, const struct timeval *tv_now,
     const struct timeval *tv_timeout, struct timeval *tv_sleep)
@@ -625,6 +920,7 @@ fde_rw_runloop(struct fde_head *fh, const struct timespec *timeout)
 		warn("%s: kevent", __func__);
 		return;
 	}
+	fh->stats.n_events += ret;
 
 	for (i = 0; i < ret; i++) {
 		f = fh->kev_list[i].udata;
@@ -730,9 +1026,13 @@ fde_runloop(struct fde_head *fh, const struct timeval *timeout)
 {
 	struct timespec ts;
 	struct timeval tv_now, tv_sleep;
+	uint64_t now_ms, due_ms;
 
 	(void) gettimeofday(&tv_now, NULL);
 
+	/* Pick up callbacks scheduled from other threads */
+	fde_remote_runloop(fh);
+
 	/* Run callbacks - this may schedule more callbacks */
 	fde_cb_runloop(fh);
 
@@ -742,11 +1042,22 @@ fde_runloop(struct fde_head *fh, const struct timeval *timeout)
 	 */
 	fde_t_runloop(fh, &tv_now);
 
+	/* .. and the deadlines on the timer wheel */
+	fde_w_set_now(fh, &tv_now);
+	fde_w_runloop(fh);
+
+	/*
+	 * End of pass - run the flush callbacks (eg coalesced writes)
+	 * before we go to sleep in kevent().
+	 */
+	fde_fl_runloop(fh);
+
 	/*
 	 * If there are any scheduled callbacks, make sure we
 	 * immediately bail out of the kevent loop.
 	 */
-	if (TAILQ_FIRST(&fh->f_cb_head) != NULL) {
+	if (TAILQ_FIRST(&fh->f_cb_head) != NULL ||
+	    TAILQ_FIRST(&fh->f_fl_head) != NULL) {
 		ts.tv_sec = ts.tv_nsec = 0;
 	} else {
 		/*
@@ -757,10 +1068,27 @@ fde_runloop(struct fde_head *fh, const struct timeval *timeout)
 
 		ts.tv_sec = tv_sleep.tv_sec;
 		ts.tv_nsec = tv_sleep.tv_usec * 1000;
+
+		/* .. and no later than the next deadline on the wheel */
+		if (fh->wheel.n != 0) {
+			now_ms = (uint64_t) tv_now.tv_sec * 1000 +
+			    tv_now.tv_usec / 1000;
+			due_ms = fde_w_next_tick(fh) * FDE_WHEEL_TICK_MSEC;
+			due_ms = (due_ms > now_ms) ? due_ms - now_ms : 0;
+			if ((uint64_t) ts.tv_sec * 1000 +
+			    ts.tv_nsec / 1000000 > due_ms) {
+				ts.tv_sec = due_ms / 1000;
+				ts.tv_nsec = (due_ms % 1000) * 1000000;
+			}
+		}
 	}
 
 	/*
 	 * Run the read/write IO kqueue loop.
 	 */
 	fde_rw_runloop(fh, &ts);
+
+	/* Deadlines armed from here until the next pass count from now */
+	(void) gettimeofday(&tv_now, NULL);
+	fde_w_set_now(fh, &tv_now);
 }
@@ -47,6 +47,14 @@ struct fde;
 
 #define	FDE_HEAD_MAXEVENTS	128
 
+/*
+ * Deadline timer wheel: FDE_WHEEL_SLOTS buckets of
+ * FDE_WHEEL_TICK_MSEC each, so one lap is about ten seconds.
+ * Longer deadlines just sit in their bucket for more laps.
+ */
+#define	FDE_WHEEL_SLOTS		1024
+#define	FDE_WHEEL_TICK_MSEC	10
+
 /*
  * FD event queue.  One per thread.
  */
@@ -54,6 +62,7 @@ struct fde_head {
 	TAILQ_HEAD(, fde) f_head;	/* list of all active entries */
 	TAILQ_HEAD(, fde) f_cb_head;	/* list of callbacks to perform */
 	TAILQ_HEAD(f_t, fde) f_t_head;	/* list of timer events to perform */
+	TAILQ_HEAD(f_fl, fde) f_fl_head;	/* end of pass callbacks */
 	int kqfd;
 	struct kevent kev_list[FDE_HEAD_MAXEVENTS];
 	struct {
@@ -61,6 +70,37 @@ struct fde_head {
 		int n;
 	} pending;
 	uint32_t f_cb_genid;
+	uint32_t f_fl_genid;
+
+	/*
+	 * FDE_T_DEADLINE events.  Adding and deleting is O(1); each
+	 * pass only looks at the buckets for the ticks that have
+	 * gone by.
+	 */
+	struct {
+		TAILQ_HEAD(fde_w_list, fde) slot[FDE_WHEEL_SLOTS];
+		struct fde_w_list expired;	/* due; being called */
+		uint64_t cur_tick;	/* next tick to run */
+		uint64_t now_tick;	/* as of the last loop pass */
+		int n;			/* events on the wheel */
+	} wheel;
+
+	/*
+	 * Callbacks scheduled from other threads.  These are moved
+	 * onto f_cb_head by the owning thread at the start of each
+	 * fde_runloop() pass.
+	 */
+	struct {
+		pthread_mutex_t l;
+		TAILQ_HEAD(, fde) r_head;
+		struct fde *ev_wakeup;
+	} remote;
+
+	/* Counters; owning thread only */
+	struct {
+		uint64_t n_changes;	/* changelist entries submitted */
+		uint64_t n_events;	/* events returned by kevent() */
+	} stats;
 };
 
 typedef enum {
@@ -79,6 +119,8 @@ typedef enum {
 	FDE_T_TIMER,		/* XXX not yet implemented */
 	FDE_T_AIO,		/* XXX not yet implemented */
 	FDE_T_USER,
+	FDE_T_FLUSH,		/* Callback at the end of this loop pass */
+	FDE_T_DEADLINE,		/* Coarse timer on the timer wheel */
 } fde_type;
 
 typedef enum {
@@ -103,6 +145,10 @@ struct fde {
 	struct timeval tv;		/* time to fire this event */
 	void *cbdata;
 	uint32_t f_cb_genid;
+	uint64_t w_tick;		/* deadline tick */
+	int w_slot;			/* wheel bucket; FDE_WHEEL_SLOTS if due */
+	int is_remote;			/* on the remote callback list */
+	TAILQ_ENTRY(fde) r_node;
 };
 
 /*
@@ -132,6 +178,9 @@ extern	void fde_free(struct fde_head *, struct fde *);
 
 /*
  * Add the event.
+ *
+ * FDE_T_FLUSH events run once, after the callbacks and timers of
+ * the current fde_runloop() pass and before it sleeps in kevent().
  */
 extern	void fde_add(struct fde_head *, struct fde *);
 
@@ -145,6 +194,15 @@ extern	void fde_add(struct fde_head *, struct fde *);
 extern	void fde_add_timeout(struct fde_head *, struct fde *,
 	    struct timeval *tv);
 
+/*
+ * Add an FDE_T_DEADLINE event to fire in about 'msec' milliseconds,
+ * at FDE_WHEEL_TICK_MSEC resolution.  Adding it again re-arms it.
+ *
+ * This is O(1) to add and to delete, so it's cheap to arm one per
+ * IO operation.  Use fde_add_timeout() for precise timers.
+ */
+extern	void fde_add_deadline(struct fde_head *, struct fde *, int msec);
+
 /*
  * Remove the event.
  */
@@ -165,4 +223,21 @@ extern	void fde_runloop(struct fde_head *, const struct timeval *timeout);
  */
 extern	int fde_ue_push(struct fde_head *fh, struct fde *f);
 
+/*
+ * Schedule the given FDE_T_CALLBACK event to run in the thread
+ * owning the given fde_head.  This may be called from any thread.
+ *
+ * The callback runs during the next fde_runloop() pass of the
+ * owning thread.
+ */
+extern	void fde_add_remote(struct fde_head *fh, struct fde *f);
+
+/*
+ * Attempt to cancel a callback scheduled with fde_add_remote().
+ *
+ * Returns 1 if the callback was cancelled, 0 if it has already
+ * been handed to the owning thread (and thus may already have run.)
+ */
+extern	int fde_delete_remote(struct fde_head *fh, struct fde *f);
+
 #endif	/* __FDE_H__ */
@@ -0,0 +1,358 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fde.h"
+#include "comm.h"
+#include "vring.h"
+#include "frame.h"
+
+static void comm_frame_read_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval);
+
+/*
+ * Find the first 'c' in p[0..len).  Returns its offset, or len
+ * if it isn't there.
+ */
+static int
+comm_frame_scan_byte(const char *p, int len, char c)
+{
+	int i = 0;
+
+#if defined(__AVX2__)
+	__m256i n = _mm256_set1_epi8(c);
+	unsigned int m;
+
+	for (; i + 32 <= len; i += 32) {
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(n,
+		    _mm256_loadu_si256((const __m256i *) (p + i))));
+		if (m != 0)
+			return (i + __builtin_ctz(m));
+	}
+#elif defined(__SSE2__)
+	__m128i n = _mm_set1_epi8(c);
+	unsigned int m;
+
+	for (; i + 16 <= len; i += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(n,
+		    _mm_loadu_si128((const __m128i *) (p + i))));
+		if (m != 0)
+			return (i + __builtin_ctz(m));
+	}
+#endif
+	for (; i < len; i++) {
+		if (p[i] == c)
+			return (i);
+	}
+	return (len);
+}
+
+/*
+ * Search for the delimiter, resuming where the last search left
+ * off.  Returns the offset from head of the delimiter, or -1.
+ */
+static int
+comm_frame_find_delim(struct comm_frame *cf, const char *p, int fill)
+{
+	int off;
+
+	off = cf->dl_scan_off;
+	while (off < fill) {
+		off += comm_frame_scan_byte(p + off, fill - off, cf->dl[0]);
+		if (off == fill)
+			break;
+
+		/* Rest of the delimiter not here yet; resume from here */
+		if (off + cf->dl_len > fill)
+			break;
+
+		if (memcmp(p + off + 1, cf->dl + 1, cf->dl_len - 1) == 0)
+			return (off);
+		off++;
+	}
+
+	cf->dl_scan_off = off;
+	return (-1);
+}
+
+static void
+comm_frame_consume(struct comm_frame *cf, int len)
+{
+
+	iapp_vring_consume(cf->vr, len);
+	cf->dl_scan_off = 0;
+}
+
+static void
+comm_frame_deliver(struct comm_frame *cf, const char *msg, int len)
+{
+
+	cf->n_msgs++;
+	cf->cb(cf, cf->cbdata, FDE_COMM_CB_COMPLETED, msg, len, 0);
+}
+
+static void
+comm_frame_error(struct comm_frame *cf, int xerrno)
+{
+
+	cf->is_stopped = 1;
+	cf->cb(cf, cf->cbdata, FDE_COMM_CB_ERROR, NULL, 0, xerrno);
+}
+
+/*
+ * Deliver every complete message in the ring.
+ *
+ * Returns 0, or -1 if framing hit an error.
+ */
+static int
+comm_frame_parse(struct comm_frame *cf)
+{
+	const unsigned char *p;
+	uint32_t mlen;
+	size_t len;
+	int fill, i, off;
+
+	while (cf->is_stopped == 0 && cf->is_freeing == 0) {
+		p = (const unsigned char *) iapp_vring_read_ptr(cf->vr, &len);
+		fill = len;
+
+		if (cf->type == COMM_FRAME_LEN_PREFIX) {
+			if (fill < cf->lp_len)
+				break;
+			mlen = 0;
+			for (i = 0; i < cf->lp_len; i++)
+				mlen = (mlen << 8) | p[i];
+			if (mlen > (uint32_t) cf->max_msg) {
+				comm_frame_error(cf, EMSGSIZE);
+				return (-1);
+			}
+			if (fill < cf->lp_len + (int) mlen)
+				break;
+			comm_frame_deliver(cf, (const char *) p + cf->lp_len,
+			    mlen);
+			comm_frame_consume(cf, cf->lp_len + mlen);
+		} else {
+			off = comm_frame_find_delim(cf, (const char *) p, fill);
+			if (off < 0) {
+				/* No room left for the rest of it? */
+				if (fill >= cf->max_msg + cf->dl_len) {
+					comm_frame_error(cf, EMSGSIZE);
+					return (-1);
+				}
+				break;
+			}
+			if (off > cf->max_msg) {
+				comm_frame_error(cf, EMSGSIZE);
+				return (-1);
+			}
+			comm_frame_deliver(cf, (const char *) p, off);
+			comm_frame_consume(cf, off + cf->dl_len);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Issue a read into the free space after the data.
+ */
+static int
+comm_frame_read(struct comm_frame *cf)
+{
+	char *p;
+	size_t len;
+
+	if (cf->is_reading || cf->is_stopped || cf->is_freeing)
+		return (0);
+
+	p = iapp_vring_write_ptr(cf->vr, &len);
+	if (len == 0)
+		return (0);
+
+	if (comm_read(cf->fc, p, len, comm_frame_read_cb, cf) < 0)
+		return (-1);
+	cf->is_reading = 1;
+	return (0);
+}
+
+static void
+comm_frame_destroy(struct comm_frame *cf)
+{
+
+	free(cf);
+}
+
+static void
+comm_frame_read_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval)
+{
+	struct comm_frame *cf = arg;
+	int xerrno;
+
+	/* Grab it before anything else can overwrite it */
+	xerrno = (status == FDE_COMM_CB_ERROR) ? errno : 0;
+
+	cf->is_reading = 0;
+
+	if (cf->is_freeing) {
+		comm_frame_destroy(cf);
+		return;
+	}
+
+	if (status != FDE_COMM_CB_COMPLETED) {
+		cf->is_stopped = 1;
+		cf->cb(cf, cf->cbdata, status, NULL, 0, xerrno);
+		return;
+	}
+
+	iapp_vring_produce(cf->vr, retval);
+	if (comm_frame_parse(cf) < 0)
+		return;
+
+	/* The owner may have freed us from the callback */
+	if (cf->is_freeing) {
+		comm_frame_destroy(cf);
+		return;
+	}
+
+	if (comm_frame_read(cf) < 0)
+		comm_frame_error(cf, EINVAL);
+}
+
+/*
+ * Create framing state for the given comm, reading into 'vr'.
+ * The ring stays owned by the caller and must outlive this.
+ * Set the framing type before starting it.
+ */
+struct comm_frame *
+comm_frame_create(struct fde_comm *fc, struct iapp_vring *vr,
+    comm_frame_cb *cb, void *cbdata)
+{
+	struct comm_frame *cf;
+
+	cf = calloc(1, sizeof(*cf));
+	if (cf == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	cf->fc = fc;
+	cf->vr = vr;
+	cf->cb = cb;
+	cf->cbdata = cbdata;
+	cf->is_stopped = 1;
+
+	return (cf);
+}
+
+/*
+ * Free the framing state.  If a read is outstanding this is
+ * deferred until it completes, so close the comm as well.
+ */
+void
+comm_frame_free(struct comm_frame *cf)
+{
+
+	cf->is_freeing = 1;
+	if (cf->is_reading == 0)
+		comm_frame_destroy(cf);
+}
+
+int
+comm_frame_set_len_prefix(struct comm_frame *cf, int lp_len, int max_msg)
+{
+
+	if (lp_len != 1 && lp_len != 2 && lp_len != 4)
+		return (-1);
+	if (max_msg <= 0 || max_msg > (int) cf->vr->size - lp_len)
+		return (-1);
+
+	cf->type = COMM_FRAME_LEN_PREFIX;
+	cf->lp_len = lp_len;
+	cf->max_msg = max_msg;
+	return (0);
+}
+
+int
+comm_frame_set_delim(struct comm_frame *cf, const char *dl, int dl_len,
+    int max_msg)
+{
+
+	if (dl_len <= 0 || dl_len > COMM_FRAME_DELIM_MAX)
+		return (-1);
+	if (max_msg <= 0 || max_msg > (int) cf->vr->size - dl_len)
+		return (-1);
+
+	cf->type = COMM_FRAME_DELIM;
+	memcpy(cf->dl, dl, dl_len);
+	cf->dl_len = dl_len;
+	cf->dl_scan_off = 0;
+	cf->max_msg = max_msg;
+	return (0);
+}
+
+/*
+ * Start (or resume) delivering messages.  Anything already
+ * buffered is delivered first.
+ */
+int
+comm_frame_start(struct comm_frame *cf)
+{
+
+	if (cf->type == COMM_FRAME_NONE || cf->is_freeing)
+		return (-1);
+
+	cf->is_stopped = 0;
+	if (comm_frame_parse(cf) < 0)
+		return (-1);
+	return (comm_frame_read(cf));
+}
+
+/*
+ * Stop delivering messages.  An outstanding read still completes;
+ * its data is kept until comm_frame_start() is called again.
+ */
+void
+comm_frame_stop(struct comm_frame *cf)
+{
+
+	cf->is_stopped = 1;
+}
@@ -0,0 +1,92 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef	__FRAME_H__
+#define	__FRAME_H__
+
+/*
+ * Message framing over a stream comm.
+ *
+ * Data is read straight into a per-connection mirror-mapped ring
+ * (vring.h) and complete messages are handed to the owner in place,
+ * as many per read as are available.  Nothing is copied or
+ * compacted, even when a message wraps the end of the ring.
+ */
+
+#define	COMM_FRAME_DELIM_MAX	8
+
+struct comm_frame;
+struct iapp_vring;
+
+typedef enum {
+	COMM_FRAME_NONE,
+	COMM_FRAME_LEN_PREFIX,	/* big endian length, then payload */
+	COMM_FRAME_DELIM,	/* payload, then delimiter */
+} comm_frame_type_t;
+
+/*
+ * Called once per message with status FDE_COMM_CB_COMPLETED; msg
+ * is only valid for the duration of the call.  Any other status
+ * (EOF, error, closing) means framing has stopped and msg is NULL.
+ */
+typedef	void comm_frame_cb(struct comm_frame *cf, void *arg,
+	    fde_comm_cb_status status, const char *msg, int len, int xerrno);
+
+struct comm_frame {
+	struct fde_comm *fc;
+	comm_frame_type_t type;
+	int max_msg;
+
+	/* Length prefix */
+	int lp_len;		/* 1, 2 or 4 bytes */
+
+	/* Delimiter */
+	char dl[COMM_FRAME_DELIM_MAX];
+	int dl_len;
+	int dl_scan_off;	/* bytes after head already searched */
+
+	struct iapp_vring *vr;
+
+	comm_frame_cb *cb;
+	void *cbdata;
+
+	int is_reading;		/* comm_read() outstanding */
+	int is_stopped;
+	int is_freeing;
+
+	/* Statistics */
+	uint64_t n_msgs;
+};
+
+extern	struct comm_frame * comm_frame_create(struct fde_comm *fc,
+	    struct iapp_vring *vr, comm_frame_cb *cb, void *cbdata);
+extern	void comm_frame_free(struct comm_frame *cf);
+extern	int comm_frame_set_len_prefix(struct comm_frame *cf, int lp_len,
+	    int max_msg);
+extern	int comm_frame_set_delim(struct comm_frame *cf, const char *dl,
+	    int dl_len, int max_msg);
+extern	int comm_frame_start(struct comm_frame *cf);
+extern	void comm_frame_stop(struct comm_frame *cf);
+
+#endif	/* __FRAME_H__ */
@@ -0,0 +1,269 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+
+#include "fde.h"
+#include "handoff.h"
+
+/*
+ * The ring is the bounded MPMC queue from Dmitry Vyukov; each slot
+ * carries a sequence number which says whether it's free for the
+ * producer at 'pos' (seq == pos) or holds an entry for the consumer
+ * at 'pos' (seq == pos + 1).
+ */
+
+static void
+iapp_handoff_record(struct iapp_handoff *ho, const struct timespec *ts)
+{
+	struct timespec now;
+	int64_t us;
+	int b;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - ts->tv_sec) * 1000000 +
+	    (now.tv_nsec - ts->tv_nsec) / 1000;
+
+	/* Bucket b holds latencies below 2^b usec */
+	for (b = 0; b < IAPP_HANDOFF_HIST_BUCKETS - 1; b++) {
+		if (us < (1LL << b))
+			break;
+	}
+	ho->lat_hist[b]++;
+	ho->n_handoff++;
+}
+
+static int
+iapp_handoff_pop(struct iapp_handoff *ho, struct iapp_handoff_ent *e)
+{
+	struct iapp_handoff_slot *s;
+	uint64_t seq;
+
+	s = &ho->slots[ho->tail & (ho->size - 1)];
+	seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+	if (seq != ho->tail + 1)
+		return (0);
+
+	*e = s->e;
+	atomic_store_explicit(&s->seq, ho->tail + ho->size,
+	    memory_order_release);
+	ho->tail++;
+	return (1);
+}
+
+static void
+iapp_handoff_wakeup_cb(int fd, struct fde *f, void *arg, fde_cb_status s)
+{
+	struct iapp_handoff *ho = arg;
+	struct iapp_handoff_ent e;
+
+	/*
+	 * Clear this before draining; anything pushed after the
+	 * drain misses it will post another wakeup.
+	 */
+	atomic_store(&ho->wake_pending, 0);
+
+	while (iapp_handoff_pop(ho, &e)) {
+		iapp_handoff_record(ho, &e.ts);
+		ho->cb(ho, ho->cbdata, &e);
+	}
+}
+
+/*
+ * Create a handoff ring owned by the thread running 'fh'.
+ *
+ * This must be created before other threads push to it; the size
+ * is rounded up to a power of two.
+ */
+struct iapp_handoff *
+iapp_handoff_create(struct fde_head *fh, int size, iapp_handoff_cb *cb,
+    void *cbdata)
+{
+	struct iapp_handoff *ho;
+	uint32_t i, sz;
+
+	for (sz = 1; sz < (uint32_t) size; sz <<= 1)
+		;
+
+	if (posix_memalign((void **) &ho, 64, sizeof(*ho)) != 0) {
+		warn("%s: posix_memalign", __func__);
+		return (NULL);
+	}
+	bzero(ho, sizeof(*ho));
+
+	ho->fh = fh;
+	ho->cb = cb;
+	ho->cbdata = cbdata;
+	ho->size = sz;
+
+	ho->slots = calloc(sz, sizeof(struct iapp_handoff_slot));
+	if (ho->slots == NULL) {
+		warn("%s: calloc", __func__);
+		goto cleanup;
+	}
+	for (i = 0; i < sz; i++)
+		atomic_init(&ho->slots[i].seq, i);
+	atomic_init(&ho->head, 0);
+	atomic_init(&ho->wake_pending, 0);
+	atomic_init(&ho->n_full, 0);
+
+	ho->ev_wakeup = fde_create(fh, -1, FDE_T_USER, FDE_F_PERSIST,
+	    iapp_handoff_wakeup_cb, ho);
+	if (ho->ev_wakeup == NULL)
+		goto cleanup;
+	fde_add(fh, ho->ev_wakeup);
+
+	return (ho);
+
+cleanup:
+	free(ho->slots);
+	free(ho);
+	return (NULL);
+}
+
+/*
+ * Free the ring; any fds still on it are closed.
+ *
+ * This must be called on the owning thread once nothing else
+ * will push to it.
+ */
+void
+iapp_handoff_free(struct iapp_handoff *ho)
+{
+	struct iapp_handoff_ent e;
+
+	while (iapp_handoff_pop(ho, &e))
+		close(e.fd);
+
+	fde_delete(ho->fh, ho->ev_wakeup);
+	fde_free(ho->fh, ho->ev_wakeup);
+	free(ho->slots);
+	free(ho);
+}
+
+/*
+ * Hand the given fd to the ring's owner.  This can be called from
+ * any thread.
+ *
+ * Returns 0 on success, or -1 if the ring is full; the caller
+ * still owns the fd in that case.
+ */
+int
+iapp_handoff_push(struct iapp_handoff *ho, int fd, uint32_t flowid,
+    const struct sockaddr *saddr, socklen_t slen)
+{
+	struct iapp_handoff_slot *s;
+	uint64_t pos, seq;
+	int64_t dif;
+
+	pos = atomic_load_explicit(&ho->head, memory_order_relaxed);
+	for (;;) {
+		s = &ho->slots[pos & (ho->size - 1)];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		dif = (int64_t) seq - (int64_t) pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ho->head,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			atomic_fetch_add_explicit(&ho->n_full, 1,
+			    memory_order_relaxed);
+			return (-1);
+		} else {
+			pos = atomic_load_explicit(&ho->head,
+			    memory_order_relaxed);
+		}
+	}
+
+	s->e.fd = fd;
+	s->e.flowid = flowid;
+	s->e.slen = 0;
+	if (saddr != NULL && slen <= sizeof(s->e.saddr)) {
+		memcpy(&s->e.saddr, saddr, slen);
+		s->e.slen = slen;
+	}
+	(void) clock_gettime(CLOCK_MONOTONIC, &s->e.ts);
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+
+	/* Only the first push since the last drain needs to wake it */
+	if (atomic_exchange(&ho->wake_pending, 1) == 0)
+		(void) fde_ue_push(ho->fh, ho->ev_wakeup);
+
+	return (0);
+}
+
+/*
+ * Fetch the handoff statistics.  Call this from the owning thread.
+ */
+void
+iapp_handoff_get_stats(struct iapp_handoff *ho, struct iapp_handoff_stats *st,
+    int do_clear)
+{
+
+	st->n_handoff = ho->n_handoff;
+	memcpy(st->lat_hist, ho->lat_hist, sizeof(st->lat_hist));
+	if (do_clear) {
+		st->n_full = atomic_exchange(&ho->n_full, 0);
+		ho->n_handoff = 0;
+		bzero(ho->lat_hist, sizeof(ho->lat_hist));
+	} else
+		st->n_full = atomic_load(&ho->n_full);
+}
+
+/*
+ * Return the upper bound (in usec) of the histogram bucket holding
+ * the given percentile, or 0 if there's nothing recorded.
+ */
+uint32_t
+iapp_handoff_hist_pct(const struct iapp_handoff_stats *st, int pct)
+{
+	uint64_t n, target;
+	int b;
+
+	if (st->n_handoff == 0)
+		return (0);
+
+	target = (st->n_handoff * pct + 99) / 100;
+	n = 0;
+	for (b = 0; b < IAPP_HANDOFF_HIST_BUCKETS; b++) {
+		n += st->lat_hist[b];
+		if (n >= target)
+			break;
+	}
+	if (b == IAPP_HANDOFF_HIST_BUCKETS)
+		b--;
+	return (1U << b);
+}
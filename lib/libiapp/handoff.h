@@ -0,0 +1,99 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef	__HANDOFF_H__
+#define	__HANDOFF_H__
+
+#include <stdatomic.h>
+
+/*
+ * Cross-thread handoff of accepted sockets.
+ *
+ * Each owning thread has a bounded ring that any thread can push
+ * an fd (and its metadata) onto without taking a lock.  The first
+ * push after the owner last drained the ring posts a user event,
+ * so the owner picks it up on its next runloop pass rather than
+ * via a polling timer.
+ */
+
+#define	IAPP_HANDOFF_HIST_BUCKETS	24	/* log2 usec buckets */
+
+struct iapp_handoff;
+
+struct iapp_handoff_ent {
+	int fd;
+	uint32_t flowid;
+	socklen_t slen;
+	struct sockaddr_storage saddr;
+	struct timespec ts;		/* when it was queued */
+};
+
+/*
+ * Called on the owning thread for each handed off fd; the callee
+ * owns the fd.
+ */
+typedef	void iapp_handoff_cb(struct iapp_handoff *ho, void *arg,
+	    const struct iapp_handoff_ent *e);
+
+struct iapp_handoff_slot {
+	_Atomic uint64_t seq;
+	struct iapp_handoff_ent e;
+};
+
+struct iapp_handoff_stats {
+	uint64_t n_handoff;
+	uint64_t n_full;
+	uint64_t lat_hist[IAPP_HANDOFF_HIST_BUCKETS];
+};
+
+struct iapp_handoff {
+	struct fde_head *fh;
+	struct fde *ev_wakeup;
+	iapp_handoff_cb *cb;
+	void *cbdata;
+	uint32_t size;
+	struct iapp_handoff_slot *slots;
+
+	/* Producer side; shared */
+	_Alignas(64) _Atomic uint64_t head;
+	_Atomic int wake_pending;
+	_Atomic uint64_t n_full;
+
+	/* Consumer side; owning thread only */
+	_Alignas(64) uint64_t tail;
+	uint64_t n_handoff;
+	uint64_t lat_hist[IAPP_HANDOFF_HIST_BUCKETS];
+};
+
+extern	struct iapp_handoff * iapp_handoff_create(struct fde_head *fh,
+	    int size, iapp_handoff_cb *cb, void *cbdata);
+extern	void iapp_handoff_free(struct iapp_handoff *ho);
+extern	int iapp_handoff_push(struct iapp_handoff *ho, int fd, uint32_t flowid,
+	    const struct sockaddr *saddr, socklen_t slen);
+extern	void iapp_handoff_get_stats(struct iapp_handoff *ho,
+	    struct iapp_handoff_stats *st, int do_clear);
+extern	uint32_t iapp_handoff_hist_pct(const struct iapp_handoff_stats *st,
+	    int pct);
+
+#endif	/* __HANDOFF_H__ */
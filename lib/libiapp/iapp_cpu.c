@@ -1,14 +1,33 @@
 #include <stdio.h>
+#include <unistd.h>
 #include <err.h>
+#include <pthread.h>
 
 #include <sys/types.h>
+#ifdef	__linux__
+#include <sched.h>
+#else
 #include <sys/sysctl.h>
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+#endif
 
 #include "iapp_cpu.h"
 
 int
 iapp_get_ncpus(void)
 {
+#ifdef	__linux__
+	long r;
+
+	r = sysconf(_SC_NPROCESSORS_ONLN);
+	if (r < 0) {
+		warn("%s: sysconf (_SC_NPROCESSORS_ONLN)", __func__);
+		return (-1);
+	}
+
+	return (r);
+#else
 	int r;
 	int v;
 	size_t l;
@@ -22,4 +41,28 @@ iapp_get_ncpus(void)
 	}
 
 	return v;
+#endif
+}
+
+/*
+ * Pin the given thread to a single CPU.
+ */
+int
+iapp_thread_pin(pthread_t thr, int cpu)
+{
+#ifdef	__linux__
+	cpu_set_t cp;
+#else
+	cpuset_t cp;
+#endif
+
+	CPU_ZERO(&cp);
+	CPU_SET(cpu, &cp);
+
+	if (pthread_setaffinity_np(thr, sizeof(cp), &cp) != 0) {
+		warn("%s: pthread_setaffinity_np (cpu %d)", __func__, cpu);
+		return (-1);
+	}
+
+	return (0);
 }
@@ -2,5 +2,6 @@
 #define	__IAPP_CPU_H__
 
 extern	int iapp_get_ncpus(void);
+extern	int iapp_thread_pin(pthread_t thr, int cpu);
 
 #endif	/* __IAPP_CPU_H__ */
@@ -0,0 +1,247 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifndef	__linux__
+#include <sys/sysctl.h>
+#endif
+
+#include "iapp_cpu.h"
+#include "iapp_place.h"
+
+#ifdef	IP_RSSBUCKETID
+/*
+ * Load the kernel RSS bucket to CPU mapping.  The sysctl is
+ * a list of "bucket:cpu" pairs; it only exists on kernels built
+ * with "options RSS".
+ */
+static int
+iapp_place_load_buckets(struct iapp_place *p)
+{
+	char *buf, *s, *tok;
+	size_t len;
+	int b, c, n;
+
+	if (sysctlbyname("net.inet.rss.bucket_mapping", NULL, &len,
+	    NULL, 0) < 0)
+		return (0);
+
+	buf = calloc(1, len + 1);
+	if (buf == NULL) {
+		warn("%s: calloc", __func__);
+		return (-1);
+	}
+	if (sysctlbyname("net.inet.rss.bucket_mapping", buf, &len,
+	    NULL, 0) < 0) {
+		warn("%s: sysctlbyname", __func__);
+		free(buf);
+		return (-1);
+	}
+
+	/* First pass - size the table */
+	n = 0;
+	for (s = buf; (tok = strsep(&s, " ")) != NULL; ) {
+		if (sscanf(tok, "%d:%d", &b, &c) == 2 && b >= n)
+			n = b + 1;
+	}
+	free(buf);
+
+	if (n == 0)
+		return (0);
+
+	p->bucket_cpu = calloc(n, sizeof(int));
+	buf = calloc(1, len + 1);
+	if (p->bucket_cpu == NULL || buf == NULL) {
+		warn("%s: calloc", __func__);
+		free(buf);
+		return (-1);
+	}
+	if (sysctlbyname("net.inet.rss.bucket_mapping", buf, &len,
+	    NULL, 0) < 0) {
+		warn("%s: sysctlbyname", __func__);
+		free(buf);
+		return (-1);
+	}
+
+	for (b = 0; b < n; b++)
+		p->bucket_cpu[b] = -1;
+	for (s = buf; (tok = strsep(&s, " ")) != NULL; ) {
+		if (sscanf(tok, "%d:%d", &b, &c) == 2 && b < n)
+			p->bucket_cpu[b] = c;
+	}
+	p->n_buckets = n;
+	free(buf);
+
+	return (0);
+}
+#endif
+
+struct iapp_place *
+iapp_place_create(int n_threads)
+{
+	struct iapp_place *p;
+	int i;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	p->n_threads = n_threads;
+	p->n_cpus = iapp_get_ncpus();
+	if (p->n_cpus <= 0)
+		goto cleanup;
+
+	p->cpu_thr = calloc(p->n_cpus, sizeof(int));
+	if (p->cpu_thr == NULL) {
+		warn("%s: calloc", __func__);
+		goto cleanup;
+	}
+	for (i = 0; i < p->n_cpus; i++)
+		p->cpu_thr[i] = -1;
+
+	if (posix_memalign((void **) &p->stats, IAPP_PLACE_CACHE_LINE,
+	    n_threads * sizeof(struct iapp_place_stats)) != 0) {
+		warn("%s: posix_memalign", __func__);
+		p->stats = NULL;
+		goto cleanup;
+	}
+	bzero(p->stats, n_threads * sizeof(struct iapp_place_stats));
+
+#ifdef	IP_RSSBUCKETID
+	if (iapp_place_load_buckets(p) < 0)
+		goto cleanup;
+#endif
+
+	return (p);
+
+cleanup:
+	iapp_place_free(p);
+	return (NULL);
+}
+
+void
+iapp_place_free(struct iapp_place *p)
+{
+
+	free(p->cpu_thr);
+	free(p->bucket_cpu);
+	free(p->stats);
+	free(p);
+}
+
+/*
+ * Record that the given thread is pinned to the given CPU.
+ *
+ * This must be done before the worker threads start placing
+ * sockets.  If several threads share a CPU, the first one wins.
+ */
+int
+iapp_place_set_thread_cpu(struct iapp_place *p, int thr, int cpu)
+{
+
+	if (cpu < 0 || cpu >= p->n_cpus || thr < 0 || thr >= p->n_threads)
+		return (-1);
+	if (p->cpu_thr[cpu] == -1)
+		p->cpu_thr[cpu] = thr;
+	return (0);
+}
+
+/*
+ * Return the CPU which processed packets for the given socket,
+ * or -1 if it isn't known.
+ */
+int
+iapp_place_fd_cpu(struct iapp_place *p, int fd)
+{
+	socklen_t sl;
+	int v;
+
+	sl = sizeof(v);
+#if defined(SO_INCOMING_CPU)
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &v, &sl) < 0)
+		return (-1);
+	return (v);
+#elif defined(IP_RSSBUCKETID)
+	if (p->n_buckets == 0)
+		return (-1);
+	if (getsockopt(fd, IPPROTO_IP, IP_RSSBUCKETID, &v, &sl) < 0)
+		return (-1);
+	if (v < 0 || v >= p->n_buckets)
+		return (-1);
+	return (p->bucket_cpu[v]);
+#else
+	return (-1);
+#endif
+}
+
+/*
+ * Pick the thread that should own the given socket, which was
+ * accepted on thread 'thr'.  Returns -1 if there's no good answer;
+ * the caller should then keep it or use some other policy.
+ */
+int
+iapp_place_fd(struct iapp_place *p, int thr, int fd)
+{
+	int cpu, dst;
+
+	cpu = iapp_place_fd_cpu(p, fd);
+	if (cpu < 0 || cpu >= p->n_cpus || p->cpu_thr[cpu] == -1) {
+		p->stats[thr].unknown++;
+		return (-1);
+	}
+
+	dst = p->cpu_thr[cpu];
+	if (dst == thr)
+		p->stats[thr].local++;
+	else
+		p->stats[thr].remote++;
+
+	return (dst);
+}
+
+/*
+ * Fetch the placement counters for the given thread.  Only the
+ * owning thread should clear them.
+ */
+void
+iapp_place_get_stats(struct iapp_place *p, int thr,
+    struct iapp_place_stats *st, int do_clear)
+{
+
+	*st = p->stats[thr];
+	if (do_clear)
+		bzero(&p->stats[thr], sizeof(p->stats[thr]));
+}
@@ -0,0 +1,61 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef	__IAPP_PLACE_H__
+#define	__IAPP_PLACE_H__
+
+/*
+ * Receive-CPU aware placement of accepted sockets.
+ *
+ * Each worker thread is pinned to a CPU; the placement object maps
+ * the CPU which processed a socket's packets back to the thread
+ * pinned there, so the socket can be handed to that thread.
+ */
+
+#define	IAPP_PLACE_CACHE_LINE	64
+
+struct iapp_place_stats {
+	uint64_t local;		/* landed on the correct thread */
+	uint64_t remote;	/* needed a handoff */
+	uint64_t unknown;	/* receive CPU unknown or unmapped */
+} __attribute__((__aligned__(IAPP_PLACE_CACHE_LINE)));
+
+struct iapp_place {
+	int n_threads;
+	int n_cpus;
+	int *cpu_thr;		/* CPU -> thread, -1 if none */
+	int n_buckets;
+	int *bucket_cpu;	/* RSS bucket -> CPU (FreeBSD) */
+	struct iapp_place_stats *stats;	/* per-thread */
+};
+
+extern	struct iapp_place * iapp_place_create(int n_threads);
+extern	void iapp_place_free(struct iapp_place *p);
+extern	int iapp_place_set_thread_cpu(struct iapp_place *p, int thr, int cpu);
+extern	int iapp_place_fd_cpu(struct iapp_place *p, int fd);
+extern	int iapp_place_fd(struct iapp_place *p, int thr, int fd);
+extern	void iapp_place_get_stats(struct iapp_place *p, int thr,
+	    struct iapp_place_stats *st, int do_clear);
+
+#endif	/* __IAPP_PLACE_H__ */
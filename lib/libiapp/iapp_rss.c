@@ -0,0 +1,268 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <err.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "iapp_rss.h"
+
+/*
+ * The key from the Microsoft RSS specification; most NIC drivers
+ * default to it and its verification vectors are well known.
+ */
+const uint8_t iapp_rss_default_key[IAPP_RSS_KEY_LEN] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/*
+ * Return the 32 bit key window starting at bit 'bit'.
+ * Bits past the end of the key read as zero.
+ */
+static uint32_t
+iapp_rss_key_window(const uint8_t *key, int key_len, int bit)
+{
+	uint32_t v = 0;
+	int i, b;
+
+	for (i = 0; i < 32; i++) {
+		b = bit + i;
+		v <<= 1;
+		if ((b / 8) < key_len && (key[b / 8] & (0x80 >> (b % 8))))
+			v |= 1;
+	}
+	return (v);
+}
+
+/*
+ * Reference implementation - one bit at a time.
+ */
+uint32_t
+iapp_rss_hash_slow(const uint8_t *key, int key_len, const uint8_t *data,
+    int len)
+{
+	uint32_t h = 0;
+	int i, j;
+
+	for (i = 0; i < len; i++) {
+		for (j = 0; j < 8; j++) {
+			if (data[i] & (0x80 >> j))
+				h ^= iapp_rss_key_window(key, key_len,
+				    i * 8 + j);
+		}
+	}
+	return (h);
+}
+
+/*
+ * Table driven version - one lookup per input byte.
+ */
+uint32_t
+iapp_rss_hash(const struct iapp_rss *r, const uint8_t *data, int len)
+{
+	uint32_t h = 0;
+	int i;
+
+	if (len > IAPP_RSS_MAX_INPUT)
+		len = IAPP_RSS_MAX_INPUT;
+
+	for (i = 0; i < len; i++)
+		h ^= r->tbl[i][data[i]];
+	return (h);
+}
+
+struct iapp_rss *
+iapp_rss_create(const uint8_t *key, int key_len, int n_queues)
+{
+	struct iapp_rss *r;
+	uint32_t w[8];
+	int i, j, v;
+
+	if (n_queues <= 0)
+		return (NULL);
+	if (key == NULL) {
+		key = iapp_rss_default_key;
+		key_len = IAPP_RSS_KEY_LEN;
+	}
+	if (key_len > IAPP_RSS_KEY_LEN)
+		key_len = IAPP_RSS_KEY_LEN;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	memcpy(r->key, key, key_len);
+
+	for (i = 0; i < IAPP_RSS_MAX_INPUT; i++) {
+		for (j = 0; j < 8; j++)
+			w[j] = iapp_rss_key_window(r->key, IAPP_RSS_KEY_LEN,
+			    i * 8 + j);
+		for (v = 0; v < 256; v++) {
+			r->tbl[i][v] = 0;
+			for (j = 0; j < 8; j++) {
+				if (v & (0x80 >> j))
+					r->tbl[i][v] ^= w[j];
+			}
+		}
+	}
+
+	/* Default indirection table - round robin, like most drivers */
+	for (i = 0; i < IAPP_RSS_INDIR_SIZE; i++)
+		r->indir[i] = i % n_queues;
+
+	return (r);
+}
+
+void
+iapp_rss_free(struct iapp_rss *r)
+{
+
+	free(r);
+}
+
+/*
+ * Set the indirection table.  A short table is repeated to fill
+ * all IAPP_RSS_INDIR_SIZE entries.
+ */
+int
+iapp_rss_set_indir(struct iapp_rss *r, const uint32_t *q, int n)
+{
+	int i;
+
+	if (n <= 0)
+		return (-1);
+	for (i = 0; i < IAPP_RSS_INDIR_SIZE; i++)
+		r->indir[i] = q[i % n];
+	return (0);
+}
+
+/*
+ * Parse a hex key ("6d:5a:56:.." or "6d5a56..") into key.
+ * Returns the key length or -1 on error.
+ */
+int
+iapp_rss_parse_key(const char *str, uint8_t *key, int len)
+{
+	unsigned int v;
+	int n = 0;
+
+	while (*str != '\0') {
+		if (*str == ':') {
+			str++;
+			continue;
+		}
+		/* Exactly two hex digits; sscanf would take "6z" as 0x06 */
+		if (n >= len || !isxdigit((unsigned char) str[0]) ||
+		    !isxdigit((unsigned char) str[1]))
+			return (-1);
+		if (sscanf(str, "%2x", &v) != 1)
+			return (-1);
+		key[n++] = v;
+		str += 2;
+	}
+	return (n);
+}
+
+/*
+ * Parse a comma separated list of queue ids.
+ * Returns the number of entries or -1 on error.
+ */
+int
+iapp_rss_parse_indir(const char *str, uint32_t *q, int len)
+{
+	char *s, *p, *tok, *ep;
+	long v;
+	int n = 0;
+
+	s = p = strdup(str);
+	if (s == NULL) {
+		warn("%s: strdup", __func__);
+		return (-1);
+	}
+	while ((tok = strsep(&p, ",")) != NULL) {
+		v = strtol(tok, &ep, 10);
+		if (n >= len || *tok == '\0' || *ep != '\0' || v < 0) {
+			n = -1;
+			break;
+		}
+		q[n++] = v;
+	}
+	free(s);
+	return (n);
+}
+
+/*
+ * Hash the 4-tuple of a received packet.  'src' is the remote end
+ * (eg the peer address from accept()), 'dst' the local end.
+ */
+int
+iapp_rss_hash_sockaddr(const struct iapp_rss *r, const struct sockaddr *src,
+    const struct sockaddr *dst, uint32_t *hash)
+{
+	uint8_t buf[IAPP_RSS_MAX_INPUT];
+	const struct sockaddr_in *s4, *d4;
+	const struct sockaddr_in6 *s6, *d6;
+	int l;
+
+	if (src->sa_family != dst->sa_family)
+		return (-1);
+
+	switch (src->sa_family) {
+	case AF_INET:
+		s4 = (const struct sockaddr_in *) src;
+		d4 = (const struct sockaddr_in *) dst;
+		memcpy(buf, &s4->sin_addr, 4);
+		memcpy(buf + 4, &d4->sin_addr, 4);
+		memcpy(buf + 8, &s4->sin_port, 2);
+		memcpy(buf + 10, &d4->sin_port, 2);
+		l = 12;
+		break;
+	case AF_INET6:
+		s6 = (const struct sockaddr_in6 *) src;
+		d6 = (const struct sockaddr_in6 *) dst;
+		memcpy(buf, &s6->sin6_addr, 16);
+		memcpy(buf + 16, &d6->sin6_addr, 16);
+		memcpy(buf + 32, &s6->sin6_port, 2);
+		memcpy(buf + 34, &d6->sin6_port, 2);
+		l = 36;
+		break;
+	default:
+		return (-1);
+	}
+
+	*hash = iapp_rss_hash(r, buf, l);
+	return (0);
+}
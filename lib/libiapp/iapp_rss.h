@@ -0,0 +1,74 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef	__IAPP_RSS_H__
+#define	__IAPP_RSS_H__
+
+/*
+ * Software Toeplitz RSS hash.
+ *
+ * This computes the same hash a NIC does over the receive 4-tuple
+ * (source address, destination address, source port, destination
+ * port) so flows can be mapped to worker threads the way the NIC
+ * maps them to queues.
+ */
+
+#define	IAPP_RSS_KEY_LEN	40
+#define	IAPP_RSS_INDIR_SIZE	128	/* power of two */
+#define	IAPP_RSS_MAX_INPUT	36	/* v6 addresses + ports */
+
+struct sockaddr;
+
+struct iapp_rss {
+	uint8_t key[IAPP_RSS_KEY_LEN];
+	uint32_t indir[IAPP_RSS_INDIR_SIZE];
+	/* Per input byte, the hash contribution of each byte value */
+	uint32_t tbl[IAPP_RSS_MAX_INPUT][256];
+};
+
+extern	const uint8_t iapp_rss_default_key[IAPP_RSS_KEY_LEN];
+
+extern	struct iapp_rss * iapp_rss_create(const uint8_t *key, int key_len,
+	    int n_queues);
+extern	void iapp_rss_free(struct iapp_rss *r);
+extern	int iapp_rss_set_indir(struct iapp_rss *r, const uint32_t *q, int n);
+extern	int iapp_rss_parse_key(const char *str, uint8_t *key, int len);
+extern	int iapp_rss_parse_indir(const char *str, uint32_t *q, int len);
+
+extern	uint32_t iapp_rss_hash_slow(const uint8_t *key, int key_len,
+	    const uint8_t *data, int len);
+extern	uint32_t iapp_rss_hash(const struct iapp_rss *r, const uint8_t *data,
+	    int len);
+extern	int iapp_rss_hash_sockaddr(const struct iapp_rss *r,
+	    const struct sockaddr *src, const struct sockaddr *dst,
+	    uint32_t *hash);
+
+static inline uint32_t
+iapp_rss_to_queue(const struct iapp_rss *r, uint32_t hash)
+{
+
+	return (r->indir[hash & (IAPP_RSS_INDIR_SIZE - 1)]);
+}
+
+#endif	/* __IAPP_RSS_H__ */
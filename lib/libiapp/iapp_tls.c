@@ -0,0 +1,286 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "fde.h"
+#include "comm.h"
+#include "iapp_tls.h"
+
+/* Ciphers the kernel can do the record layer for */
+#define	IAPP_TLS_CIPHERSUITES	"TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+#define	IAPP_TLS_CIPHER_LIST	"ECDHE+AESGCM"
+
+/*
+ * Log and drain the OpenSSL error queue.
+ */
+static void
+iapp_tls_warn(const char *fn, const char *msg)
+{
+	char buf[256];
+	unsigned long e;
+
+	e = ERR_get_error();
+	if (e == 0) {
+		warnx("%s: %s", fn, msg);
+		return;
+	}
+	for (; e != 0; e = ERR_get_error()) {
+		ERR_error_string_n(e, buf, sizeof(buf));
+		warnx("%s: %s: %s", fn, msg, buf);
+	}
+}
+
+struct iapp_tls_ctx *
+iapp_tls_ctx_create(int is_server, const char *cert_file,
+    const char *key_file, const char *ca_file, int flags)
+{
+	struct iapp_tls_ctx *tc;
+	int ret;
+
+	if (is_server && (cert_file == NULL || key_file == NULL)) {
+		warnx("%s: a server needs a certificate and key", __func__);
+		return (NULL);
+	}
+
+	tc = calloc(1, sizeof(*tc));
+	if (tc == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	tc->is_server = is_server;
+	tc->flags = flags;
+
+	tc->ctx = SSL_CTX_new(is_server ? TLS_server_method() :
+	    TLS_client_method());
+	if (tc->ctx == NULL) {
+		iapp_tls_warn(__func__, "SSL_CTX_new");
+		goto error;
+	}
+
+	(void) SSL_CTX_set_min_proto_version(tc->ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(tc->ctx, SSL_OP_ENABLE_KTLS);
+	if (SSL_CTX_set_ciphersuites(tc->ctx, IAPP_TLS_CIPHERSUITES) != 1 ||
+	    SSL_CTX_set_cipher_list(tc->ctx, IAPP_TLS_CIPHER_LIST) != 1) {
+		iapp_tls_warn(__func__, "couldn't set ciphers");
+		goto error;
+	}
+
+	/*
+	 * No session resumption; and in particular no TLS 1.3
+	 * tickets turning up on a client's kTLS RX path.
+	 */
+	SSL_CTX_set_session_cache_mode(tc->ctx, SSL_SESS_CACHE_OFF);
+	(void) SSL_CTX_set_num_tickets(tc->ctx, 0);
+
+	if (is_server) {
+		if (SSL_CTX_use_certificate_chain_file(tc->ctx,
+		    cert_file) != 1 ||
+		    SSL_CTX_use_PrivateKey_file(tc->ctx, key_file,
+		    SSL_FILETYPE_PEM) != 1 ||
+		    SSL_CTX_check_private_key(tc->ctx) != 1) {
+			iapp_tls_warn(__func__, "couldn't load certificate");
+			goto error;
+		}
+	} else if (flags & IAPP_TLS_CTX_F_INSECURE_NO_VERIFY) {
+		warnx("%s: not verifying server certificates", __func__);
+		SSL_CTX_set_verify(tc->ctx, SSL_VERIFY_NONE, NULL);
+	} else {
+		if (ca_file != NULL)
+			ret = SSL_CTX_load_verify_locations(tc->ctx, ca_file,
+			    NULL);
+		else
+			ret = SSL_CTX_set_default_verify_paths(tc->ctx);
+		if (ret != 1) {
+			iapp_tls_warn(__func__, "couldn't load CA file");
+			goto error;
+		}
+		SSL_CTX_set_verify(tc->ctx, SSL_VERIFY_PEER, NULL);
+	}
+
+	return (tc);
+
+error:
+	iapp_tls_ctx_free(tc);
+	return (NULL);
+}
+
+void
+iapp_tls_ctx_free(struct iapp_tls_ctx *tc)
+{
+
+	if (tc->ctx != NULL)
+		SSL_CTX_free(tc->ctx);
+	free(tc);
+}
+
+int
+iapp_tls_set_peer_name(SSL *ssl, const char *host)
+{
+	struct in6_addr in6;
+	struct in_addr in;
+
+	/*
+	 * An address is checked against the certificate's IP entries;
+	 * SNI only carries host names.
+	 */
+	if (inet_pton(AF_INET, host, &in) == 1 ||
+	    inet_pton(AF_INET6, host, &in6) == 1) {
+		if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl),
+		    host) != 1) {
+			iapp_tls_warn(__func__, "couldn't set address");
+			return (-1);
+		}
+		return (0);
+	}
+
+	if (SSL_set_tlsext_host_name(ssl, host) != 1 ||
+	    SSL_set1_host(ssl, host) != 1) {
+		iapp_tls_warn(__func__, "couldn't set host name");
+		return (-1);
+	}
+	return (0);
+}
+
+static comm_hs_status
+iapp_tls_step(struct fde_comm *fc, void *arg, int *xerrno)
+{
+	struct iapp_tls *t = arg;
+	int r;
+
+	ERR_clear_error();
+	errno = 0;
+	r = SSL_do_handshake(t->ssl);
+	if (r != 1) {
+		switch (SSL_get_error(t->ssl, r)) {
+		case SSL_ERROR_WANT_READ:
+			return (COMM_HS_WANT_READ);
+		case SSL_ERROR_WANT_WRITE:
+			return (COMM_HS_WANT_WRITE);
+		case SSL_ERROR_SYSCALL:
+			*xerrno = (errno != 0) ? errno : ECONNRESET;
+			return (COMM_HS_ERROR);
+		default:
+			iapp_tls_warn(__func__, "handshake failed");
+			*xerrno = EPROTO;
+			return (COMM_HS_ERROR);
+		}
+	}
+
+	/*
+	 * Done; from here on the comm layer does plain socket IO, so
+	 * the record layer has to have made it into the kernel.
+	 */
+	t->is_ktls_tx = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+	t->is_ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(t->ssl));
+	if (t->is_ktls_tx == 0 ||
+	    (t->is_ktls_rx == 0 && (t->flags & IAPP_TLS_F_TX_ONLY) == 0)) {
+		warnx("%s: FD %d: kernel TLS not enabled (tx=%d, rx=%d, %s)",
+		    __func__, fc->fd, t->is_ktls_tx, t->is_ktls_rx,
+		    SSL_get_cipher_name(t->ssl));
+		*xerrno = EOPNOTSUPP;
+		return (COMM_HS_ERROR);
+	}
+
+	return (COMM_HS_DONE);
+}
+
+static void
+iapp_tls_fini(struct fde_comm *fc, void *arg)
+{
+	struct iapp_tls *t = arg;
+
+	/* Best effort close_notify; the socket is non-blocking */
+	if (SSL_is_init_finished(t->ssl) && t->is_ktls_tx)
+		(void) SSL_shutdown(t->ssl);
+	ERR_clear_error();
+	SSL_free(t->ssl);
+	free(t);
+}
+
+int
+comm_tls_start(struct fde_comm *fc, struct iapp_tls_ctx *tc,
+    const char *host, int flags, comm_hs_cb *cb, void *cbdata)
+{
+	struct iapp_tls *t;
+
+	if (tc->is_server == 0 && host == NULL &&
+	    (tc->flags & IAPP_TLS_CTX_F_INSECURE_NO_VERIFY) == 0) {
+		warnx("%s: FD %d: a verifying client needs the server name",
+		    __func__, fc->fd);
+		return (-1);
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		warn("%s: calloc", __func__);
+		return (-1);
+	}
+	t->tc = tc;
+	t->flags = flags;
+
+	t->ssl = SSL_new(tc->ctx);
+	if (t->ssl == NULL) {
+		iapp_tls_warn(__func__, "SSL_new");
+		goto error;
+	}
+	if (SSL_set_fd(t->ssl, fc->fd) != 1) {
+		iapp_tls_warn(__func__, "SSL_set_fd");
+		goto error;
+	}
+	if (tc->is_server)
+		SSL_set_accept_state(t->ssl);
+	else {
+		if (host != NULL && iapp_tls_set_peer_name(t->ssl, host) < 0)
+			goto error;
+		SSL_set_connect_state(t->ssl);
+	}
+
+	if (comm_handshake(fc, iapp_tls_step, iapp_tls_fini, t, cb,
+	    cbdata) < 0)
+		goto error;
+	return (0);
+
+error:
+	if (t->ssl != NULL)
+		SSL_free(t->ssl);
+	free(t);
+	return (-1);
+}
@@ -0,0 +1,98 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	__LIBIAPP_IAPP_TLS_H__
+#define	__LIBIAPP_IAPP_TLS_H__
+
+/*
+ * TLS for stream comms, with the record layer in the kernel.
+ *
+ * OpenSSL does the handshake on the comm's socket (via
+ * comm_handshake()) and then hands the session keys to kernel TLS.
+ * After that the socket carries plaintext as far as the comm layer
+ * is concerned, so comm_read(), comm_write() and comm_sendfile()
+ * work as they always have.
+ *
+ * A session that couldn't be offloaded is an error rather than a
+ * silent fallback - the comm layer has no userspace record path.
+ *
+ * With kTLS RX, non-data records (alerts, a TLS 1.3 key update)
+ * show up as read errors.  Servers don't send session tickets so
+ * a client doesn't trip over those.
+ */
+
+struct iapp_tls_ctx {
+	SSL_CTX *ctx;
+	int is_server;
+	int flags;
+};
+
+/*
+ * Clients don't check the server's certificate at all.  Only for
+ * testing (eg loopback with a throwaway self-signed certificate.)
+ */
+#define	IAPP_TLS_CTX_F_INSECURE_NO_VERIFY	0x00000001
+
+/* Only offload TX; the caller never reads from the comm */
+#define	IAPP_TLS_F_TX_ONLY		0x00000001
+
+struct iapp_tls {
+	struct iapp_tls_ctx *tc;
+	SSL *ssl;
+	int flags;
+	int is_ktls_tx;
+	int is_ktls_rx;
+};
+
+/*
+ * Create a context.  A server needs a certificate and key (PEM.)
+ * A client verifies the server against ca_file, or the system CA
+ * store if it's NULL, unless IAPP_TLS_CTX_F_INSECURE_NO_VERIFY is set.
+ */
+extern	struct iapp_tls_ctx * iapp_tls_ctx_create(int is_server,
+	    const char *cert_file, const char *key_file, const char *ca_file,
+	    int flags);
+extern	void iapp_tls_ctx_free(struct iapp_tls_ctx *tc);
+
+/*
+ * Start TLS on a connected stream comm.  The callback gets
+ * FDE_COMM_CB_COMPLETED once the session is up and offloaded;
+ * the session is torn down when the comm is closed.
+ *
+ * A client sends 'host' as SNI and checks the server's certificate
+ * against it (a literal address is checked against the certificate's
+ * IP entries.)  It's required unless the context doesn't verify;
+ * servers ignore it.
+ */
+extern	int comm_tls_start(struct fde_comm *fc, struct iapp_tls_ctx *tc,
+	    const char *host, int flags, comm_hs_cb *cb, void *cbdata);
+
+/*
+ * Set the expected server name on a client SSL, as comm_tls_start()
+ * does; for callers driving OpenSSL themselves.
+ */
+extern	int iapp_tls_set_peer_name(SSL *ssl, const char *host);
+
+#endif	/* __LIBIAPP_IAPP_TLS_H__ */
@@ -0,0 +1,173 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <err.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef	__linux__
+#include <linux/filter.h>
+#endif
+
+#include <netinet/in.h>
+
+#include "fd_util.h"
+#include "listener.h"
+
+/*
+ * Attach a classic BPF program to the reuseport group which returns
+ * the socket index to hand the connection / datagram to.
+ */
+static int
+iapp_listener_attach_steer(struct iapp_listener *l)
+{
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+	struct sock_filter code[3];
+	struct sock_fprog prog;
+	int ad;
+
+	switch (l->steer) {
+	case IAPP_LISTEN_STEER_CPU:
+		ad = SKF_AD_CPU;
+		break;
+	case IAPP_LISTEN_STEER_HASH:
+		ad = SKF_AD_RXHASH;
+		break;
+	default:
+		return (0);
+	}
+
+	/* A = <ancillary value>; A = A % nsocks; return A */
+	code[0] = (struct sock_filter)
+	    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + ad);
+	code[1] = (struct sock_filter)
+	    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, l->n_fds);
+	code[2] = (struct sock_filter)
+	    BPF_STMT(BPF_RET | BPF_A, 0);
+
+	prog.len = 3;
+	prog.filter = code;
+
+	/* The program applies to the whole group; attach it once */
+	if (setsockopt(l->fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	    &prog, sizeof(prog)) < 0) {
+		warn("%s: setsockopt (SO_ATTACH_REUSEPORT_CBPF)", __func__);
+		return (-1);
+	}
+	return (0);
+#else
+	if (l->steer != IAPP_LISTEN_STEER_NONE)
+		fprintf(stderr,
+		    "%s: steering not supported here; using kernel hashing\n",
+		    __func__);
+	return (0);
+#endif
+}
+
+struct iapp_listener *
+iapp_listener_create(int family, int type, int port, int nsocks,
+    iapp_listen_steer_t steer)
+{
+	struct iapp_listener *l;
+	int i;
+
+	if (nsocks < 1)
+		return (NULL);
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	l->fds = calloc(nsocks, sizeof(int));
+	if (l->fds == NULL) {
+		warn("%s: calloc", __func__);
+		free(l);
+		return (NULL);
+	}
+
+	l->family = family;
+	l->type = type;
+	l->port = port;
+	l->steer = steer;
+
+	for (i = 0; i < nsocks; i++) {
+		l->fds[i] = comm_fd_create_listen(family, type, port, 1);
+		if (l->fds[i] < 0)
+			goto error;
+		l->n_fds++;
+	}
+
+	if (iapp_listener_attach_steer(l) < 0)
+		goto error;
+
+	return (l);
+
+error:
+	iapp_listener_free(l);
+	return (NULL);
+}
+
+void
+iapp_listener_free(struct iapp_listener *l)
+{
+	int i;
+
+	for (i = 0; i < l->n_fds; i++)
+		close(l->fds[i]);
+	free(l->fds);
+	free(l);
+}
+
+int
+iapp_listener_fd(struct iapp_listener *l, int idx)
+{
+
+	if (idx < 0 || idx >= l->n_fds)
+		return (-1);
+	return (l->fds[idx]);
+}
+
+int
+iapp_listener_parse_steer(const char *str, iapp_listen_steer_t *steer)
+{
+
+	if (strcmp(str, "none") == 0)
+		*steer = IAPP_LISTEN_STEER_NONE;
+	else if (strcmp(str, "cpu") == 0)
+		*steer = IAPP_LISTEN_STEER_CPU;
+	else if (strcmp(str, "hash") == 0)
+		*steer = IAPP_LISTEN_STEER_HASH;
+	else
+		return (-1);
+	return (0);
+}
@@ -0,0 +1,86 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	__LIBIAPP_LISTENER_H__
+#define	__LIBIAPP_LISTENER_H__
+
+/*
+ * A group of listen sockets for the same port - one per worker
+ * thread - so each thread has its own accept queue / receive queue
+ * and doesn't get woken up for connections or datagrams that other
+ * threads end up handling.
+ *
+ * The kernel picks which socket gets a new connection or datagram.
+ * By default that's a hash of the flow.  On Linux a steering program
+ * can be attached to pick the socket instead.
+ */
+
+typedef enum {
+	IAPP_LISTEN_STEER_NONE,		/* kernel default flow hashing */
+	IAPP_LISTEN_STEER_CPU,		/* socket index = receiving CPU */
+	IAPP_LISTEN_STEER_HASH,		/* socket index = NIC RX hash */
+} iapp_listen_steer_t;
+
+struct iapp_listener {
+	int family;
+	int type;
+	int port;
+	iapp_listen_steer_t steer;
+	int n_fds;
+	int *fds;
+};
+
+/*
+ * Create 'nsocks' SO_REUSEPORT sockets of the given family/type bound
+ * to the given port.  SOCK_STREAM sockets are put into listen.
+ *
+ * For IAPP_LISTEN_STEER_CPU, socket N should be serviced by a thread
+ * pinned to CPU N (modulo nsocks.)
+ *
+ * Steering modes are only available on Linux; elsewhere they fall
+ * back to the kernel flow hashing with a warning.
+ */
+extern	struct iapp_listener * iapp_listener_create(int family, int type,
+	    int port, int nsocks, iapp_listen_steer_t steer);
+
+/*
+ * Close all the sockets and free the listener.  Any fde_comm using
+ * these sockets should have been closed first.
+ */
+extern	void iapp_listener_free(struct iapp_listener *l);
+
+/*
+ * Return the socket for the given index, or -1 if it's out of range.
+ */
+extern	int iapp_listener_fd(struct iapp_listener *l, int idx);
+
+/*
+ * Parse "none", "cpu" or "hash" into a steering mode.
+ * Returns -1 if it's not recognised.
+ */
+extern	int iapp_listener_parse_steer(const char *str,
+	    iapp_listen_steer_t *steer);
+
+#endif	/* __LIBIAPP_LISTENER_H__ */
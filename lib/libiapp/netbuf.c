@@ -7,12 +7,85 @@
 #include "shm_alloc.h"
 #include "netbuf.h"
 
+/*
+ * Shared netbufs we've let go of that another process still holds.
+ */
+static TAILQ_HEAD(, iapp_netbuf) nb_orphans =
+    TAILQ_HEAD_INITIALIZER(nb_orphans);
+static pthread_mutex_t nb_orphans_l = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic int nb_n_orphans;
+
+/* Shared buffer generations; 0 means free */
+static _Atomic uint32_t nb_shm_gen;
+
 void
 iapp_netbuf_init(void)
 {
 
 }
 
+static inline struct iapp_netbuf_shm_hdr *
+iapp_netbuf_shm_hdr(char *meta, uint64_t offset)
+{
+
+	return ((struct iapp_netbuf_shm_hdr *) meta +
+	    (offset >> IAPP_NETBUF_SHM_GRAIN_SHIFT));
+}
+
+/*
+ * Give a shared buffer nobody holds back to the allocator, after
+ * making sure no stale handle can resolve to it.
+ */
+static void
+iapp_netbuf_shm_free(struct iapp_netbuf *n)
+{
+
+	atomic_store_explicit(&n->shm_hdr->gen, 0, memory_order_release);
+	shm_alloc_free(n->sa);
+}
+
+/*
+ * Free parked buffers nobody holds; with is_full == 0 only from the
+ * front of the list up to the first one still held, which is cheap
+ * enough to do on every allocation.
+ */
+static int
+iapp_netbuf_reap(int is_full)
+{
+	struct iapp_netbuf *n, *nn;
+	int count = 0;
+
+	if (atomic_load_explicit(&nb_n_orphans, memory_order_relaxed) == 0)
+		return (0);
+
+	pthread_mutex_lock(&nb_orphans_l);
+	for (n = TAILQ_FIRST(&nb_orphans); n != NULL; n = nn) {
+		nn = TAILQ_NEXT(n, orphan_node);
+		if (atomic_load_explicit(&n->shm_hdr->refcnt,
+		    memory_order_acquire) != 0) {
+			if (is_full == 0)
+				break;
+			continue;
+		}
+		TAILQ_REMOVE(&nb_orphans, n, orphan_node);
+		atomic_fetch_sub_explicit(&nb_n_orphans, 1,
+		    memory_order_relaxed);
+		iapp_netbuf_shm_free(n);
+		free(n);
+		count++;
+	}
+	pthread_mutex_unlock(&nb_orphans_l);
+
+	return (count);
+}
+
+int
+iapp_netbuf_shm_reap(void)
+{
+
+	return (iapp_netbuf_reap(1));
+}
+
 void
 iapp_netbuf_shutdown(void)
 {
@@ -25,9 +98,9 @@ iapp_netbuf_alloc(struct shm_alloc_state *sm, netbuf_alloc_type atype,
 {
 	struct iapp_netbuf *n;
 
-	n = malloc(sizeof(*n));
+	n = calloc(1, sizeof(*n));
 	if (n == NULL) {
-		warn("%s: malloc", __func__);
+		warn("%s: calloc", __func__);
 		return (NULL);
 	}
 
@@ -53,6 +126,42 @@ iapp_netbuf_alloc(struct shm_alloc_state *sm, netbuf_alloc_type atype,
 		n->bufptr = n->sa->sha_ptr;
 		n->nb_type = NB_ALLOC_POSIXSHM;
 		break;
+	case NB_ALLOC_SHM_SHARED:
+		if (sm->meta_shift != IAPP_NETBUF_SHM_META_SHIFT) {
+			warnx("%s: allocator has no room for shared state",
+			    __func__);
+			free(n);
+			return (NULL);
+		}
+		(void) iapp_netbuf_reap(0);
+
+		/* At least a granule, so each has one buffer at most */
+		n->sa = shm_alloc_alloc(sm,
+		    minsize < (1 << IAPP_NETBUF_SHM_GRAIN_SHIFT) ?
+		    (1 << IAPP_NETBUF_SHM_GRAIN_SHIFT) : minsize);
+		if (n->sa == NULL) {
+			warn("%s: malloc (buf %d bytes)", __func__, (int) minsize);
+			free(n);
+			return (NULL);
+		}
+
+		n->shm_hdr = iapp_netbuf_shm_hdr(n->sa->sha_slab->shm_meta,
+		    n->sa->sha_offset);
+		n->shm_h.slab_id = n->sa->sha_slab->slab_id;
+		n->shm_h.grain = n->sa->sha_offset >>
+		    IAPP_NETBUF_SHM_GRAIN_SHIFT;
+		n->shm_h.len = minsize;
+		do {
+			n->shm_h.gen = atomic_fetch_add_explicit(&nb_shm_gen,
+			    1, memory_order_relaxed) + 1;
+		} while (n->shm_h.gen == 0);
+		atomic_store_explicit(&n->shm_hdr->refcnt, 1,
+		    memory_order_relaxed);
+		atomic_store_explicit(&n->shm_hdr->gen, n->shm_h.gen,
+		    memory_order_release);
+		n->bufptr = n->sa->sha_ptr;
+		n->nb_type = NB_ALLOC_SHM_SHARED;
+		break;
 	default:
 		fprintf(stderr, "%s: invalid type (%d)\n", __func__, atype);
 		free(n);
@@ -60,21 +169,78 @@ iapp_netbuf_alloc(struct shm_alloc_state *sm, netbuf_alloc_type atype,
 	}
 
 	n->buf_size = minsize;
+	atomic_init(&n->refcnt, 1);
 
 	return (n);
 }
 
+/*
+ * Wrap an existing buffer (eg a ring) so it can be handed to
+ * comm_write().  The buffer stays owned by the caller.
+ */
+struct iapp_netbuf *
+iapp_netbuf_wrap(char *buf, size_t size)
+{
+	struct iapp_netbuf *n;
+
+	n = calloc(1, sizeof(*n));
+	if (n == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	n->bufptr = buf;
+	n->buf_size = size;
+	n->nb_type = NB_ALLOC_WRAP;
+	atomic_init(&n->refcnt, 1);
+
+	return (n);
+}
+
+struct iapp_netbuf *
+iapp_netbuf_ref(struct iapp_netbuf *n)
+{
+
+	atomic_fetch_add_explicit(&n->refcnt, 1, memory_order_relaxed);
+	return (n);
+}
+
 void
 iapp_netbuf_free(struct iapp_netbuf *n)
 {
 
+	/* Not the last reference? Done */
+	if (atomic_fetch_sub_explicit(&n->refcnt, 1,
+	    memory_order_acq_rel) != 1)
+		return;
+
 	switch (n->nb_type) {
 	case NB_ALLOC_MALLOC:
 		free(n->bufptr);
 		break;
+	case NB_ALLOC_WRAP:
+		break;
 	case NB_ALLOC_POSIXSHM:
 		shm_alloc_free(n->sa);
 		break;
+	case NB_ALLOC_SHM_SHARED:
+		/* Someone else still has it; park it until they're done */
+		if (atomic_fetch_sub_explicit(&n->shm_hdr->refcnt, 1,
+		    memory_order_acq_rel) != 1) {
+			pthread_mutex_lock(&nb_orphans_l);
+			TAILQ_INSERT_TAIL(&nb_orphans, n, orphan_node);
+			atomic_fetch_add_explicit(&nb_n_orphans, 1,
+			    memory_order_relaxed);
+			pthread_mutex_unlock(&nb_orphans_l);
+			return;
+		}
+		iapp_netbuf_shm_free(n);
+		break;
+	case NB_ALLOC_SHM_PEER:
+		/* The owner frees it, once it's seen the count hit zero */
+		atomic_fetch_sub_explicit(&n->shm_hdr->refcnt, 1,
+		    memory_order_acq_rel);
+		break;
 	default:
 		fprintf(stderr, "%s: %p: invalid type (%d), leaking!\n",
 		    __func__,
@@ -83,3 +249,110 @@ iapp_netbuf_free(struct iapp_netbuf *n)
 	}
 	free(n);
 }
+
+int
+iapp_netbuf_export(struct iapp_netbuf *n, struct iapp_netbuf_handle *h)
+{
+
+	if (n->nb_type != NB_ALLOC_SHM_SHARED &&
+	    n->nb_type != NB_ALLOC_SHM_PEER)
+		return (-1);
+
+	atomic_fetch_add_explicit(&n->shm_hdr->refcnt, 1,
+	    memory_order_relaxed);
+	*h = n->shm_h;
+	return (0);
+}
+
+void
+iapp_netbuf_export_cancel(struct iapp_netbuf *n)
+{
+
+	/* We still hold one, so this is never the last */
+	atomic_fetch_sub_explicit(&n->shm_hdr->refcnt, 1,
+	    memory_order_relaxed);
+}
+
+struct iapp_netbuf *
+iapp_netbuf_import(struct shm_alloc_peer *p,
+    const struct iapp_netbuf_handle *h)
+{
+	struct iapp_netbuf_shm_hdr *hdr;
+	struct iapp_netbuf *n;
+	uint64_t offset;
+	char *ptr, *meta = NULL;
+
+	offset = (uint64_t) h->grain << IAPP_NETBUF_SHM_GRAIN_SHIFT;
+	ptr = shm_alloc_peer_lookup(p, h->slab_id, offset, h->len, &meta);
+	if (ptr == NULL || meta == NULL) {
+		warnx("%s: slab %u offset %llu len %u isn't mapped",
+		    __func__, h->slab_id, (unsigned long long) offset,
+		    h->len);
+		return (NULL);
+	}
+
+	/* Freed (and maybe reused) since the handle was made? */
+	hdr = iapp_netbuf_shm_hdr(meta, offset);
+	if (h->gen == 0 || atomic_load_explicit(&hdr->gen,
+	    memory_order_acquire) != h->gen) {
+		warnx("%s: slab %u offset %llu is a stale handle",
+		    __func__, h->slab_id, (unsigned long long) offset);
+		return (NULL);
+	}
+
+	n = calloc(1, sizeof(*n));
+	if (n == NULL) {
+		warn("%s: calloc", __func__);
+		/* Don't strand the owner's buffer */
+		atomic_fetch_sub_explicit(&hdr->refcnt, 1,
+		    memory_order_acq_rel);
+		return (NULL);
+	}
+
+	/* The handle's reference is ours now */
+	n->shm_hdr = hdr;
+	n->shm_h = *h;
+	n->bufptr = ptr;
+	n->buf_size = h->len;
+	n->nb_type = NB_ALLOC_SHM_PEER;
+	atomic_init(&n->refcnt, 1);
+
+	return (n);
+}
+
+int
+iapp_netbuf_slice_init(struct iapp_netbuf_slice *s, struct iapp_netbuf *nb,
+    int offset, int len)
+{
+
+	if (offset < 0 || len < 0 || offset > nb->buf_size - len)
+		return (-1);
+
+	s->nb = iapp_netbuf_ref(nb);
+	s->offset = offset;
+	s->len = len;
+	return (0);
+}
+
+int
+iapp_netbuf_slice_sub(struct iapp_netbuf_slice *s,
+    const struct iapp_netbuf_slice *src, int offset, int len)
+{
+
+	if (offset < 0 || len < 0 || offset > src->len - len)
+		return (-1);
+
+	return (iapp_netbuf_slice_init(s, src->nb, src->offset + offset,
+	    len));
+}
+
+void
+iapp_netbuf_slice_release(struct iapp_netbuf_slice *s)
+{
+
+	if (s->nb == NULL)
+		return;
+	iapp_netbuf_free(s->nb);
+	s->nb = NULL;
+	s->offset = s->len = 0;
+}
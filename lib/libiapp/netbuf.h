@@ -1,13 +1,49 @@
 #ifndef	__NETBUF_H__
 #define	__NETBUF_H__
 
+#include <stdint.h>
+#include <stdatomic.h>
 
 typedef enum {
 	NB_ALLOC_NONE		= 0,
 	NB_ALLOC_MALLOC,
 	NB_ALLOC_POSIXSHM,
+	NB_ALLOC_WRAP,		/* caller's buffer; not freed with us */
+	NB_ALLOC_SHM_SHARED,	/* POSIXSHM, shareable with other processes */
+	NB_ALLOC_SHM_PEER,	/* .. and another process' one, imported */
 } netbuf_alloc_type;
 
+/*
+ * NB_ALLOC_SHM_SHARED buffers keep their state out of line, in the
+ * slab's metadata area (so the buffer itself stays page aligned),
+ * one of these per 512 byte granule of the slab.  The allocator has
+ * to be set up with shm_alloc_init_named(.., IAPP_NETBUF_SHM_META_SHIFT)
+ * and peers with shm_alloc_peer_init(.., IAPP_NETBUF_SHM_META_SHIFT).
+ *
+ * The reference count is the number of processes (well, handles and
+ * netbufs) holding it.  The generation is non-zero while the buffer
+ * is live, and different each time the memory is handed out, so a
+ * stale handle doesn't resolve to someone else's buffer.
+ */
+#define	IAPP_NETBUF_SHM_GRAIN_SHIFT	9	/* smallest shared buffer */
+#define	IAPP_NETBUF_SHM_META_SHIFT	6	/* 8 bytes per 512 */
+
+struct iapp_netbuf_shm_hdr {
+	_Atomic uint32_t refcnt;
+	_Atomic uint32_t gen;
+};
+
+/*
+ * What gets passed to another process to name a shared buffer:
+ * which slab of the owner's allocator, and which granule in it.
+ */
+struct iapp_netbuf_handle {
+	uint32_t slab_id;
+	uint32_t grain;		/* offset >> IAPP_NETBUF_SHM_GRAIN_SHIFT */
+	uint32_t len;
+	uint32_t gen;
+};
+
 /*
  * Representation of a single network buffer entry.
  *
@@ -22,14 +58,74 @@ struct iapp_netbuf {
 	char *bufptr;
 	int buf_size;
 	netbuf_alloc_type nb_type;
+	_Atomic int refcnt;
+
+	/* NB_ALLOC_SHM_SHARED / NB_ALLOC_SHM_PEER */
+	struct iapp_netbuf_shm_hdr *shm_hdr;
+	struct iapp_netbuf_handle shm_h;
+	TAILQ_ENTRY(iapp_netbuf) orphan_node;
+};
+
+/*
+ * A window onto part of a netbuf.  A slice holds a reference on
+ * its netbuf, so it can be handed to another layer (or written to
+ * many comms) without copying; the buffer goes away when the last
+ * slice and the owner have let go.
+ */
+struct iapp_netbuf_slice {
+	struct iapp_netbuf *nb;
+	int offset;
+	int len;
 };
 
 extern	void iapp_netbuf_init(void);
 extern	struct iapp_netbuf * iapp_netbuf_alloc(struct shm_alloc_state *sm,
 	    netbuf_alloc_type atype, size_t minsize);
-extern	void iapp_netbuf_free(struct iapp_netbuf *);
+extern	struct iapp_netbuf * iapp_netbuf_wrap(char *buf, size_t size);
 extern	void iapp_netbuf_shutdown(void);
 
+/*
+ * Netbufs start with one reference, owned by whoever allocated it.
+ * iapp_netbuf_free() drops a reference; the buffer is freed with
+ * the last one.  References may be taken and dropped from any
+ * thread.
+ */
+extern	struct iapp_netbuf * iapp_netbuf_ref(struct iapp_netbuf *);
+extern	void iapp_netbuf_free(struct iapp_netbuf *);
+
+/*
+ * Take a reference on [offset, offset+len) of a netbuf, or of an
+ * existing slice.  Returns -1 if the range doesn't fit.
+ */
+extern	int iapp_netbuf_slice_init(struct iapp_netbuf_slice *s,
+	    struct iapp_netbuf *nb, int offset, int len);
+extern	int iapp_netbuf_slice_sub(struct iapp_netbuf_slice *s,
+	    const struct iapp_netbuf_slice *src, int offset, int len);
+extern	void iapp_netbuf_slice_release(struct iapp_netbuf_slice *s);
+
+/*
+ * Cross-process sharing.
+ *
+ * iapp_netbuf_export() fills in a handle for a shared (or imported)
+ * netbuf and takes a shared reference for it; the process that
+ * iapp_netbuf_import()s the handle owns that reference through the
+ * netbuf it gets back.  If the handle can't be delivered,
+ * iapp_netbuf_export_cancel() drops it again.
+ *
+ * Only the owning process can free the memory.  When its last local
+ * reference goes while another process still holds one, the buffer
+ * is parked until that's dropped; iapp_netbuf_shm_reap() frees the
+ * parked buffers nobody holds any more, and allocating a shared
+ * netbuf reaps the oldest of them as it goes.
+ */
+struct shm_alloc_peer;
+extern	int iapp_netbuf_export(struct iapp_netbuf *n,
+	    struct iapp_netbuf_handle *h);
+extern	void iapp_netbuf_export_cancel(struct iapp_netbuf *n);
+extern	struct iapp_netbuf * iapp_netbuf_import(struct shm_alloc_peer *p,
+	    const struct iapp_netbuf_handle *h);
+extern	int iapp_netbuf_shm_reap(void);
+
 static inline const char *
 iapp_netbuf_buf(struct iapp_netbuf *n)
 {
@@ -51,4 +147,11 @@ iapp_netbuf_size(struct iapp_netbuf *n)
 	return (n->buf_size);
 }
 
+static inline const char *
+iapp_netbuf_slice_buf(const struct iapp_netbuf_slice *s)
+{
+
+	return (s->nb->bufptr + s->offset);
+}
+
 #endif	/* __NETBUF_H__ */
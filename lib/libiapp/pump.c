@@ -0,0 +1,271 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+
+#include "fde.h"
+#include "shm_alloc.h"
+#include "netbuf.h"
+#include "comm.h"
+#include "vring.h"
+#include "pump.h"
+
+static void comm_pump_read_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval);
+static void comm_pump_write_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval);
+
+static void
+comm_pump_destroy(struct comm_pump *p)
+{
+
+	iapp_netbuf_free(p->nb);
+	iapp_vring_free(p->vr);
+	free(p);
+}
+
+/*
+ * Tell the owner we're done; only the first stop is reported.
+ */
+static void
+comm_pump_finish(struct comm_pump *p, fde_comm_cb_status status, int xerrno)
+{
+
+	if (p->is_done)
+		return;
+	p->is_done = 1;
+	p->cb(p, p->cbdata, status, p->n_bytes, xerrno);
+}
+
+/*
+ * Read into the free space; a paused source keeps the read
+ * pending until it's resumed.
+ */
+static int
+comm_pump_read(struct comm_pump *p)
+{
+	char *buf;
+	size_t len;
+
+	if (p->is_reading || p->is_eof || p->is_done)
+		return (0);
+
+	buf = iapp_vring_write_ptr(p->vr, &len);
+	if (len == 0)
+		return (0);
+
+	if (comm_read(p->src, buf, len, comm_pump_read_cb, p) < 0)
+		return (-1);
+	p->is_reading = 1;
+	return (0);
+}
+
+/*
+ * Write everything that's buffered.  The ring is mirror mapped so
+ * this is one contiguous region even when it wraps.
+ */
+static int
+comm_pump_write(struct comm_pump *p)
+{
+
+	if (p->is_writing || p->is_done || p->vr->fill == 0)
+		return (0);
+
+	if (comm_write(p->dst, p->nb, p->vr->head, p->vr->fill,
+	    comm_pump_write_cb, p) < 0)
+		return (-1);
+	p->is_writing = 1;
+	return (0);
+}
+
+static void
+comm_pump_read_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval)
+{
+	struct comm_pump *p = arg;
+
+	p->is_reading = 0;
+
+	if (p->is_freeing) {
+		if (p->is_writing == 0)
+			comm_pump_destroy(p);
+		return;
+	}
+
+	if (status == FDE_COMM_CB_EOF) {
+		p->is_eof = 1;
+		if (p->vr->fill == 0 && p->is_writing == 0)
+			comm_pump_finish(p, FDE_COMM_CB_COMPLETED, 0);
+		return;
+	}
+
+	if (status != FDE_COMM_CB_COMPLETED) {
+		comm_pump_finish(p, status,
+		    status == FDE_COMM_CB_ERROR ? errno : 0);
+		return;
+	}
+
+	if (p->is_done)
+		return;
+
+	iapp_vring_produce(p->vr, retval);
+	if (p->is_paused == 0 && p->vr->fill >= p->hiwat) {
+		p->is_paused = 1;
+		p->n_pauses++;
+		comm_read_pause(p->src);
+	}
+
+	if (comm_pump_write(p) < 0 || comm_pump_read(p) < 0)
+		comm_pump_finish(p, FDE_COMM_CB_ERROR, EINVAL);
+}
+
+static void
+comm_pump_write_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval)
+{
+	struct comm_pump *p = arg;
+
+	p->is_writing = 0;
+
+	if (p->is_freeing) {
+		if (p->is_reading == 0)
+			comm_pump_destroy(p);
+		return;
+	}
+
+	/* retval is how much of this write went out, whatever the status */
+	if (retval > 0) {
+		iapp_vring_consume(p->vr, retval);
+		p->n_bytes += retval;
+	}
+
+	if (status != FDE_COMM_CB_COMPLETED) {
+		comm_pump_finish(p, status,
+		    status == FDE_COMM_CB_ERROR ? errno : 0);
+		return;
+	}
+
+	if (p->is_done)
+		return;
+
+	if (p->is_eof && p->vr->fill == 0) {
+		comm_pump_finish(p, FDE_COMM_CB_COMPLETED, 0);
+		return;
+	}
+
+	if (p->is_paused && p->vr->fill <= p->lowat) {
+		p->is_paused = 0;
+		comm_read_resume(p->src);
+	}
+
+	/* Restart reading if it stopped on a full ring */
+	if (comm_pump_write(p) < 0 || comm_pump_read(p) < 0)
+		comm_pump_finish(p, FDE_COMM_CB_ERROR, EINVAL);
+}
+
+/*
+ * Create a pump from 'src' to 'dst', buffering at most 'hiwat'
+ * bytes (rounded up to the ring's page size) before the source is
+ * paused.  Neither comm may have other reads or writes issued on
+ * it whilst the pump is running.
+ */
+struct comm_pump *
+comm_pump_create(struct fde_comm *src, struct fde_comm *dst, size_t hiwat,
+    size_t lowat, comm_pump_cb *cb, void *cbdata)
+{
+	struct comm_pump *p;
+
+	if (hiwat == 0 || lowat >= hiwat) {
+		warnx("%s: invalid watermarks (hi=%zu, lo=%zu)", __func__,
+		    hiwat, lowat);
+		return (NULL);
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	p->vr = iapp_vring_create(hiwat);
+	if (p->vr == NULL)
+		goto error;
+	p->nb = iapp_netbuf_wrap(p->vr->base, p->vr->size * 2);
+	if (p->nb == NULL)
+		goto error;
+
+	p->src = src;
+	p->dst = dst;
+	p->hiwat = hiwat;
+	p->lowat = lowat;
+	p->cb = cb;
+	p->cbdata = cbdata;
+
+	return (p);
+
+error:
+	if (p->vr != NULL)
+		iapp_vring_free(p->vr);
+	free(p);
+	return (NULL);
+}
+
+int
+comm_pump_start(struct comm_pump *p)
+{
+
+	if (p->is_done || p->is_freeing)
+		return (-1);
+	return (comm_pump_read(p));
+}
+
+/*
+ * Free the pump.  If IO is outstanding this is deferred until it
+ * completes, so close the comms as well.
+ */
+void
+comm_pump_free(struct comm_pump *p)
+{
+
+	p->is_freeing = 1;
+
+	/* A paused read would otherwise never complete */
+	if (p->is_paused) {
+		p->is_paused = 0;
+		comm_read_resume(p->src);
+	}
+
+	if (p->is_reading == 0 && p->is_writing == 0)
+		comm_pump_destroy(p);
+}
@@ -0,0 +1,81 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	__LIBIAPP_PUMP_H__
+#define	__LIBIAPP_PUMP_H__
+
+/*
+ * Relay bytes from one stream comm to another through a bounded
+ * ring.
+ *
+ * Reading from the source is paused once 'hiwat' bytes are waiting
+ * to be written and resumed once the destination has drained them
+ * to 'lowat', so per-connection memory stays bounded no matter how
+ * far apart the two sides' speeds are.
+ */
+
+struct comm_pump;
+struct iapp_vring;
+struct iapp_netbuf;
+
+/*
+ * Called once when the pump stops: COMPLETED when the source hit
+ * EOF and everything was written, otherwise the status of the
+ * failing side.  The comms are left open for the owner to close.
+ */
+typedef	void comm_pump_cb(struct comm_pump *p, void *arg,
+	    fde_comm_cb_status status, uint64_t nbytes, int xerrno);
+
+struct comm_pump {
+	struct fde_comm *src;
+	struct fde_comm *dst;
+
+	struct iapp_vring *vr;
+	struct iapp_netbuf *nb;	/* wraps vr for comm_write() */
+	size_t hiwat;
+	size_t lowat;
+
+	comm_pump_cb *cb;
+	void *cbdata;
+
+	int is_reading;		/* comm_read() outstanding */
+	int is_writing;		/* comm_write() outstanding */
+	int is_paused;		/* source paused at the high watermark */
+	int is_eof;
+	int is_done;
+	int is_freeing;
+
+	/* Statistics */
+	uint64_t n_bytes;
+	uint64_t n_pauses;
+};
+
+extern	struct comm_pump * comm_pump_create(struct fde_comm *src,
+	    struct fde_comm *dst, size_t hiwat, size_t lowat,
+	    comm_pump_cb *cb, void *cbdata);
+extern	int comm_pump_start(struct comm_pump *p);
+extern	void comm_pump_free(struct comm_pump *p);
+
+#endif	/* __LIBIAPP_PUMP_H__ */
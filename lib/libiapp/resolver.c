@@ -0,0 +1,381 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "fde.h"
+#include "taskq.h"
+#include "resolver.h"
+
+static int
+iapp_resolver_ent_is_fresh(struct iapp_resolver *rs,
+    struct iapp_resolver_ent *e)
+{
+
+	return (e->is_pending == 0 && e->expire_tick != 0 &&
+	    e->expire_tick > rs->fh->wheel.now_tick);
+}
+
+static void
+iapp_resolver_ent_free(struct iapp_resolver_ent *e)
+{
+
+	iapp_task_cleanup(&e->task);
+	free(e->host);
+	free(e->port);
+	free(e);
+}
+
+static struct iapp_resolver_ent *
+iapp_resolver_ent_find(struct iapp_resolver *rs, const char *host,
+    const char *port)
+{
+	struct iapp_resolver_ent *e;
+
+	TAILQ_FOREACH(e, &rs->ents, node) {
+		if (strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0)
+			break;
+	}
+	if (e == NULL)
+		return (NULL);
+
+	/* Keep it at the head for the LRU */
+	if (e != TAILQ_FIRST(&rs->ents)) {
+		TAILQ_REMOVE(&rs->ents, e, node);
+		TAILQ_INSERT_HEAD(&rs->ents, e, node);
+	}
+	return (e);
+}
+
+/*
+ * Helper thread: do the blocking lookup.
+ */
+static void
+iapp_resolver_run_cb(struct iapp_task *t, void *arg)
+{
+	struct iapp_resolver_ent *e = arg;
+	struct addrinfo hints, *res, *ai;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = e->socktype;
+
+	e->naddrs = 0;
+	e->error = getaddrinfo(e->host, e->port, &hints, &res);
+	if (e->error != 0)
+		return;
+
+	for (ai = res; ai != NULL && e->naddrs < IAPP_RESOLVER_MAX_ADDRS;
+	    ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(e->addrs[0].sa))
+			continue;
+		memcpy(&e->addrs[e->naddrs].sa, ai->ai_addr, ai->ai_addrlen);
+		e->addrs[e->naddrs].slen = ai->ai_addrlen;
+		e->naddrs++;
+	}
+	freeaddrinfo(res);
+
+	if (e->naddrs == 0)
+		e->error = EAI_NONAME;
+}
+
+static void
+iapp_resolver_complete(struct iapp_resolver_ent *e)
+{
+	struct iapp_resolver_req *rq;
+
+	while ((rq = TAILQ_FIRST(&e->waiters)) != NULL) {
+		TAILQ_REMOVE(&e->waiters, rq, node);
+		rq->cb(e->rs, rq->arg, e->error, e->addrs, e->naddrs);
+		free(rq);
+	}
+}
+
+/*
+ * Owner thread: cache the answer and tell everyone waiting on it.
+ */
+static void
+iapp_resolver_done_cb(struct iapp_task *t, void *arg)
+{
+	struct iapp_resolver_ent *e = arg;
+	struct iapp_resolver *rs = e->rs;
+	int ttl_ms;
+
+	/* The resolver was freed whilst this was running */
+	if (e->is_orphan) {
+		iapp_resolver_ent_free(e);
+		return;
+	}
+
+	e->is_pending = 0;
+	if (e->error != 0)
+		rs->stats.n_fail++;
+
+	/* The wheel counts FDE_WHEEL_TICK_MSEC ticks, not milliseconds */
+	ttl_ms = (e->error == 0 ? rs->ttl_ms : rs->neg_ttl_ms);
+	e->expire_tick = rs->fh->wheel.now_tick +
+	    (ttl_ms + FDE_WHEEL_TICK_MSEC - 1) / FDE_WHEEL_TICK_MSEC;
+	if (e->expire_tick == 0)
+		e->expire_tick = 1;
+
+	iapp_resolver_complete(e);
+}
+
+static void
+iapp_resolver_ready_cb(int fd, struct fde *f, void *arg, fde_cb_status s)
+{
+	struct iapp_resolver *rs = arg;
+	struct iapp_resolver_req *rq;
+	struct iapp_resolver_ent *e;
+
+	while ((rq = TAILQ_FIRST(&rs->ready)) != NULL) {
+		TAILQ_REMOVE(&rs->ready, rq, node);
+		e = rq->ent;
+		rq->cb(rs, rq->arg, e->error, e->addrs, e->naddrs);
+		free(rq);
+	}
+}
+
+/*
+ * Drop the least recently used entries that nobody is waiting on.
+ */
+static void
+iapp_resolver_trim(struct iapp_resolver *rs)
+{
+	struct iapp_resolver_ent *e, *prev;
+	struct iapp_resolver_req *rq;
+
+	for (e = TAILQ_LAST(&rs->ents, iapp_resolver_entq);
+	    e != NULL && rs->n_ents > rs->max_ents; e = prev) {
+		prev = TAILQ_PREV(e, iapp_resolver_entq, node);
+		if (e->is_pending || TAILQ_FIRST(&e->waiters) != NULL)
+			continue;
+		TAILQ_FOREACH(rq, &rs->ready, node) {
+			if (rq->ent == e)
+				break;
+		}
+		if (rq != NULL)
+			continue;
+		TAILQ_REMOVE(&rs->ents, e, node);
+		rs->n_ents--;
+		iapp_resolver_ent_free(e);
+	}
+}
+
+struct iapp_resolver *
+iapp_resolver_create(struct fde_head *fh, struct iapp_taskq *tq,
+    int socktype, int ttl_ms, int neg_ttl_ms, int max_ents)
+{
+	struct iapp_resolver *rs;
+
+	if (tq == NULL)
+		tq = iapp_taskq_default();
+	if (tq == NULL)
+		return (NULL);
+
+	rs = calloc(1, sizeof(*rs));
+	if (rs == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	rs->ev_ready = fde_create(fh, -1, FDE_T_CALLBACK, 0,
+	    iapp_resolver_ready_cb, rs);
+	if (rs->ev_ready == NULL) {
+		free(rs);
+		return (NULL);
+	}
+
+	rs->fh = fh;
+	rs->tq = tq;
+	rs->socktype = socktype;
+	rs->ttl_ms = ttl_ms;
+	rs->neg_ttl_ms = neg_ttl_ms;
+	rs->max_ents = max_ents;
+	TAILQ_INIT(&rs->ents);
+	TAILQ_INIT(&rs->ready);
+
+	return (rs);
+}
+
+void
+iapp_resolver_free(struct iapp_resolver *rs)
+{
+	struct iapp_resolver_ent *e;
+	struct iapp_resolver_req *rq;
+
+	while ((rq = TAILQ_FIRST(&rs->ready)) != NULL) {
+		TAILQ_REMOVE(&rs->ready, rq, node);
+		free(rq);
+	}
+	while ((e = TAILQ_FIRST(&rs->ents)) != NULL) {
+		TAILQ_REMOVE(&rs->ents, e, node);
+		while ((rq = TAILQ_FIRST(&e->waiters)) != NULL) {
+			TAILQ_REMOVE(&e->waiters, rq, node);
+			free(rq);
+		}
+
+		/*
+		 * A lookup that a helper thread has already picked up
+		 * can't be stopped; leave the entry for its completion
+		 * to free.
+		 */
+		if (e->is_pending &&
+		    iapp_taskq_cancel(rs->tq, &e->task) == 0) {
+			e->is_orphan = 1;
+			e->rs = NULL;
+			continue;
+		}
+		iapp_resolver_ent_free(e);
+	}
+	fde_free(rs->fh, rs->ev_ready);
+	free(rs);
+}
+
+int
+iapp_resolver_lookup(struct iapp_resolver *rs, const char *host,
+    const char *port, iapp_resolver_cb *cb, void *arg)
+{
+	struct iapp_resolver_ent *e;
+	struct iapp_resolver_req *rq, *rq2, *rq_next;
+
+	rq = calloc(1, sizeof(*rq));
+	if (rq == NULL) {
+		warn("%s: calloc", __func__);
+		return (-1);
+	}
+	rq->cb = cb;
+	rq->arg = arg;
+
+	e = iapp_resolver_ent_find(rs, host, port);
+
+	/* Cached; answer from the event loop */
+	if (e != NULL && iapp_resolver_ent_is_fresh(rs, e)) {
+		rs->stats.n_hit++;
+		rq->ent = e;
+		TAILQ_INSERT_TAIL(&rs->ready, rq, node);
+		fde_add(rs->fh, rs->ev_ready);
+		return (0);
+	}
+
+	/* Someone's already asked */
+	if (e != NULL && e->is_pending) {
+		rs->stats.n_join++;
+		rq->ent = e;
+		TAILQ_INSERT_TAIL(&e->waiters, rq, node);
+		return (0);
+	}
+
+	if (e == NULL) {
+		e = calloc(1, sizeof(*e));
+		if (e == NULL) {
+			warn("%s: calloc", __func__);
+			goto error;
+		}
+		e->rs = rs;
+		e->socktype = rs->socktype;
+		e->host = strdup(host);
+		e->port = strdup(port);
+		TAILQ_INIT(&e->waiters);
+		if (e->host == NULL || e->port == NULL ||
+		    iapp_task_init(&e->task, rs->fh, iapp_resolver_run_cb,
+		    iapp_resolver_done_cb, e) < 0) {
+			free(e->host);
+			free(e->port);
+			free(e);
+			goto error;
+		}
+		TAILQ_INSERT_HEAD(&rs->ents, e, node);
+		rs->n_ents++;
+	}
+
+	/* Missing or stale; go and ask */
+	if (iapp_taskq_submit(rs->tq, &e->task) < 0)
+		goto error;
+	e->is_pending = 1;
+
+	/*
+	 * The helper thread is about to overwrite the answer; any
+	 * hits not yet called back get the new one instead.
+	 */
+	for (rq2 = TAILQ_FIRST(&rs->ready); rq2 != NULL; rq2 = rq_next) {
+		rq_next = TAILQ_NEXT(rq2, node);
+		if (rq2->ent != e)
+			continue;
+		TAILQ_REMOVE(&rs->ready, rq2, node);
+		TAILQ_INSERT_TAIL(&e->waiters, rq2, node);
+	}
+
+	rs->stats.n_miss++;
+	rq->ent = e;
+	TAILQ_INSERT_TAIL(&e->waiters, rq, node);
+
+	iapp_resolver_trim(rs);
+	return (0);
+
+error:
+	free(rq);
+	return (-1);
+}
+
+int
+iapp_resolver_get_cached(struct iapp_resolver *rs, const char *host,
+    const char *port, int idx, struct iapp_resolver_addr *ra)
+{
+	struct iapp_resolver_ent *e;
+
+	e = iapp_resolver_ent_find(rs, host, port);
+	if (e == NULL || iapp_resolver_ent_is_fresh(rs, e) == 0 ||
+	    e->error != 0 || e->naddrs == 0)
+		return (-1);
+
+	rs->stats.n_hit++;
+	*ra = e->addrs[idx % e->naddrs];
+	return (0);
+}
+
+void
+iapp_resolver_get_stats(struct iapp_resolver *rs,
+    struct iapp_resolver_stats *st, int do_clear)
+{
+
+	*st = rs->stats;
+	if (do_clear)
+		bzero(&rs->stats, sizeof(rs->stats));
+}
@@ -0,0 +1,147 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	__LIBIAPP_RESOLVER_H__
+#define	__LIBIAPP_RESOLVER_H__
+
+/*
+ * Per-thread name resolver.
+ *
+ * getaddrinfo() runs as a task on a helper thread (see taskq.h) and
+ * the answer comes back to the owning fde_head as a callback.
+ * Answers are cached per resolver for a fixed TTL - getaddrinfo()
+ * doesn't say how long a record is good for - and failures for a
+ * shorter one.  Concurrent lookups of the same name share a single
+ * getaddrinfo() call.
+ *
+ * Everything except the getaddrinfo() call itself happens in the
+ * owning thread, so there's no locking.
+ */
+
+#define	IAPP_RESOLVER_MAX_ADDRS		8
+
+struct iapp_resolver;
+struct iapp_resolver_ent;
+
+struct iapp_resolver_addr {
+	struct sockaddr_storage sa;
+	socklen_t slen;
+};
+
+/*
+ * Lookup completion.  'error' is 0 or a getaddrinfo() EAI_* error.
+ * The addresses are only valid during the callback.
+ */
+typedef	void iapp_resolver_cb(struct iapp_resolver *rs, void *arg, int error,
+	    const struct iapp_resolver_addr *addrs, int naddrs);
+
+struct iapp_resolver_req {
+	TAILQ_ENTRY(iapp_resolver_req) node;
+	struct iapp_resolver_ent *ent;
+	iapp_resolver_cb *cb;
+	void *arg;
+};
+
+struct iapp_resolver_ent {
+	TAILQ_ENTRY(iapp_resolver_ent) node;
+	struct iapp_resolver *rs;
+	char *host;
+	char *port;
+	struct iapp_task task;
+	int socktype;
+	int is_pending;		/* task submitted */
+	int is_orphan;		/* resolver freed; completion frees this */
+	uint64_t expire_tick;	/* fde wheel time; 0 - never resolved */
+
+	/* Result; written by the helper thread whilst pending */
+	int error;
+	int naddrs;
+	struct iapp_resolver_addr addrs[IAPP_RESOLVER_MAX_ADDRS];
+
+	TAILQ_HEAD(, iapp_resolver_req) waiters;
+};
+
+struct iapp_resolver_stats {
+	uint64_t n_hit;
+	uint64_t n_miss;	/* started a getaddrinfo() */
+	uint64_t n_join;	/* .. or waited on one already running */
+	uint64_t n_fail;
+};
+
+struct iapp_resolver {
+	struct fde_head *fh;
+	struct iapp_taskq *tq;
+	int socktype;
+	int ttl_ms;
+	int neg_ttl_ms;
+	int max_ents;
+
+	/* Most recently used first */
+	TAILQ_HEAD(iapp_resolver_entq, iapp_resolver_ent) ents;
+	int n_ents;
+
+	/* Cache hits waiting for their (deferred) callback */
+	TAILQ_HEAD(, iapp_resolver_req) ready;
+	struct fde *ev_ready;
+
+	struct iapp_resolver_stats stats;
+};
+
+/*
+ * Create a resolver for the given fde_head.  Lookups run on 'tq'
+ * (NULL - the library default) and are for 'socktype' sockets.
+ * Up to max_ents names are cached.
+ */
+extern	struct iapp_resolver * iapp_resolver_create(struct fde_head *fh,
+	    struct iapp_taskq *tq, int socktype, int ttl_ms, int neg_ttl_ms,
+	    int max_ents);
+
+/*
+ * Free the resolver.  Outstanding lookups are dropped without their
+ * callbacks being called.  Any still running in a helper thread
+ * finish in the background, so the fde_head must outlive them.
+ */
+extern	void iapp_resolver_free(struct iapp_resolver *rs);
+
+/*
+ * Look up host/port.  The callback is always called later from the
+ * event loop, never from inside this call, even on a cache hit.
+ */
+extern	int iapp_resolver_lookup(struct iapp_resolver *rs, const char *host,
+	    const char *port, iapp_resolver_cb *cb, void *arg);
+
+/*
+ * Return a fresh cached answer without any callback; -1 if there
+ * isn't one (and nothing is started.)  'idx' picks among the
+ * addresses, modulo how many there are.
+ */
+extern	int iapp_resolver_get_cached(struct iapp_resolver *rs,
+	    const char *host, const char *port, int idx,
+	    struct iapp_resolver_addr *ra);
+
+extern	void iapp_resolver_get_stats(struct iapp_resolver *rs,
+	    struct iapp_resolver_stats *st, int do_clear);
+
+#endif	/* __LIBIAPP_RESOLVER_H__ */
@@ -1,9 +1,16 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define	_GNU_SOURCE		/* memfd_create() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <strings.h>
 #include <pthread.h>
@@ -12,13 +19,278 @@
 
 #include "shm_alloc.h"
 
+/*
+ * Smallest block order holding npages.
+ */
+static int
+shm_alloc_order(size_t npages)
+{
+	int order = 0;
+
+	while (((size_t) 1 << order) < npages)
+		order++;
+	return (order);
+}
+
+/*
+ * Size class for a small allocation.
+ */
+static int
+shm_alloc_class(size_t size)
+{
+	int shift = SHM_ALLOC_MIN_SHIFT;
+
+	while (((size_t) 1 << shift) < size)
+		shift++;
+	return (shift - SHM_ALLOC_MIN_SHIFT);
+}
+
+/*
+ * Bytes at the end of a slab of the given size kept for metadata.
+ * Peers work it out from the size the same way.
+ */
+static size_t
+shm_alloc_meta_len(size_t shm_size, int meta_shift, int page_size)
+{
+
+	if (meta_shift == 0)
+		return (0);
+	return (((shm_size >> meta_shift) + page_size - 1) &
+	    ~((size_t) page_size - 1));
+}
+
+static inline size_t
+shm_alloc_page_idx(struct shm_alloc_page *pg)
+{
+
+	return (pg - pg->sh->pages);
+}
+
+static inline char *
+shm_alloc_page_ptr(struct shm_alloc_page *pg)
+{
+
+	return (pg->sh->shm_m +
+	    (shm_alloc_page_idx(pg) << pg->sh->sm->page_shift));
+}
+
+/*
+ * Free a block, merging it with its buddy for as long as the buddy
+ * is a free block of the same order.
+ *
+ * This assumes the lock is held.
+ */
+static void
+shm_alloc_block_free(struct shm_alloc_slab *sh, size_t idx, int order)
+{
+	struct shm_alloc_state *sm = sh->sm;
+	struct shm_alloc_page *bp;
+	size_t b;
+
+	sh->pages[idx].state = SHM_PG_NONE;
+
+	while (order < SHM_ALLOC_MAX_ORDER) {
+		b = idx ^ ((size_t) 1 << order);
+		if (b + ((size_t) 1 << order) > sh->npages)
+			break;
+		bp = &sh->pages[b];
+		if (bp->state != SHM_PG_FREE || bp->order != order)
+			break;
+		TAILQ_REMOVE(&sm->free_pages[order], bp, node);
+		bp->state = SHM_PG_NONE;
+		if (b < idx)
+			idx = b;
+		order++;
+	}
+
+	sh->pages[idx].state = SHM_PG_FREE;
+	sh->pages[idx].order = order;
+	TAILQ_INSERT_HEAD(&sm->free_pages[order], &sh->pages[idx], node);
+}
+
+/*
+ * Free an arbitrary run of pages as the naturally aligned blocks
+ * it's made of.
+ */
+static void
+shm_alloc_range_free(struct shm_alloc_slab *sh, size_t idx, size_t n)
+{
+	int order;
+
+	while (n > 0) {
+		order = 0;
+		while (order < SHM_ALLOC_MAX_ORDER &&
+		    (idx & ((size_t) 1 << order)) == 0 &&
+		    ((size_t) 2 << order) <= n)
+			order++;
+		shm_alloc_block_free(sh, idx, order);
+		idx += (size_t) 1 << order;
+		n -= (size_t) 1 << order;
+	}
+}
+
+/*
+ * Take npages contiguous pages from the smallest free block that
+ * fits; the halves split off it and the tail past npages go back.
+ */
+static struct shm_alloc_page *
+shm_alloc_pages(struct shm_alloc_state *sm, size_t npages)
+{
+	struct shm_alloc_page *pg = NULL;
+	struct shm_alloc_slab *sh;
+	size_t idx;
+	int j, order;
+
+	order = shm_alloc_order(npages);
+	for (j = order; j <= SHM_ALLOC_MAX_ORDER; j++) {
+		pg = TAILQ_FIRST(&sm->free_pages[j]);
+		if (pg != NULL)
+			break;
+	}
+	if (pg == NULL)
+		return (NULL);
+
+	TAILQ_REMOVE(&sm->free_pages[j], pg, node);
+	pg->state = SHM_PG_NONE;
+	sh = pg->sh;
+	idx = shm_alloc_page_idx(pg);
+
+	while (j > order) {
+		j--;
+		shm_alloc_block_free(sh, idx + ((size_t) 1 << j), j);
+	}
+	shm_alloc_range_free(sh, idx + npages, ((size_t) 1 << order) - npages);
+
+	return (pg);
+}
+
+/*
+ * As above, adding a slab if nothing fits and there's room left.
+ */
+static struct shm_alloc_page *
+shm_alloc_pages_grow(struct shm_alloc_state *sm, size_t npages)
+{
+	struct shm_alloc_page *pg;
+	size_t size;
+	int order;
+
+	order = shm_alloc_order(npages);
+	if (order > SHM_ALLOC_MAX_ORDER)
+		return (NULL);
+
+	pg = shm_alloc_pages(sm, npages);
+	if (pg != NULL)
+		return (pg);
+
+	/* The slab has to hold an aligned block of that order */
+	size = (size_t) sm->page_size << order;
+	if (sm->slab_size - shm_alloc_meta_len(sm->slab_size, sm->meta_shift,
+	    sm->page_size) >= size)
+		size = sm->slab_size;
+	else
+		size += 2 * shm_alloc_meta_len(size, sm->meta_shift,
+		    sm->page_size);
+	if (sm->total_size + size > sm->max_size)
+		return (NULL);
+	if (shm_alloc_new_slab(sm, size, sm->do_mlock) == NULL)
+		return (NULL);
+
+	return (shm_alloc_pages(sm, npages));
+}
+
+/*
+ * Take an object of the given class, carving up a fresh page if
+ * no page of that class has a free one.
+ */
+static struct shm_alloc_page *
+shm_alloc_obj(struct shm_alloc_state *sm, int cls, off_t *ofs)
+{
+	struct shm_alloc_page *pg;
+	size_t osize;
+	uint16_t link;
+	char *base;
+	int i, nobj;
+
+	osize = (size_t) 1 << (cls + SHM_ALLOC_MIN_SHIFT);
+
+	pg = TAILQ_FIRST(&sm->partial[cls]);
+	if (pg == NULL) {
+		pg = shm_alloc_pages_grow(sm, 1);
+		if (pg == NULL)
+			return (NULL);
+
+		/* Thread the free list through the objects themselves */
+		base = shm_alloc_page_ptr(pg);
+		nobj = sm->page_size / osize;
+		for (i = 0; i < nobj; i++) {
+			link = i + 1;
+			memcpy(base + i * osize, &link, sizeof(link));
+		}
+		pg->state = SHM_PG_SMALL;
+		pg->cls = cls;
+		pg->free_head = 0;
+		pg->nfree = nobj;
+		TAILQ_INSERT_HEAD(&sm->partial[cls], pg, node);
+	}
+
+	i = pg->free_head;
+	base = shm_alloc_page_ptr(pg);
+	memcpy(&link, base + i * osize, sizeof(link));
+	pg->free_head = link;
+	if (--pg->nfree == 0)
+		TAILQ_REMOVE(&sm->partial[cls], pg, node);
+
+	*ofs = (shm_alloc_page_idx(pg) << sm->page_shift) + i * osize;
+	return (pg);
+}
+
+/*
+ * Return an object to its page.  A page that's entirely free goes
+ * back to the buddy allocator, unless it's the class's only page
+ * with free objects.
+ */
+static void
+shm_alloc_obj_free(struct shm_alloc_state *sm, struct shm_alloc_page *pg,
+    struct shm_alloc_allocation *sa)
+{
+	size_t osize;
+	uint16_t link;
+	int nobj;
+
+	osize = (size_t) 1 << (pg->cls + SHM_ALLOC_MIN_SHIFT);
+	nobj = sm->page_size / osize;
+
+	link = pg->free_head;
+	memcpy(sa->sha_ptr, &link, sizeof(link));
+	pg->free_head = (sa->sha_offset & (sm->page_size - 1)) / osize;
+	if (pg->nfree++ == 0)
+		TAILQ_INSERT_HEAD(&sm->partial[pg->cls], pg, node);
+
+	if (pg->nfree == nobj &&
+	    (TAILQ_NEXT(pg, node) != NULL ||
+	    TAILQ_FIRST(&sm->partial[pg->cls]) != pg)) {
+		TAILQ_REMOVE(&sm->partial[pg->cls], pg, node);
+		shm_alloc_block_free(pg->sh, shm_alloc_page_idx(pg), 0);
+	}
+}
+
 void
 shm_alloc_init(struct shm_alloc_state *sm, size_t max_size, size_t slab_size,
 	    int do_mlock)
 {
-	struct shm_alloc_slab *sh;
+
+	shm_alloc_init_named(sm, NULL, max_size, slab_size, do_mlock, 0);
+}
+
+void
+shm_alloc_init_named(struct shm_alloc_state *sm, const char *name,
+    size_t max_size, size_t slab_size, int do_mlock, int meta_shift)
+{
+	int i;
 
 	bzero(sm, sizeof(*sm));
+	if (name != NULL && (sm->shm_name = strdup(name)) == NULL)
+		warn("%s: strdup; slabs will be anonymous", __func__);
 
 	/*
 	 * Initial setup!
@@ -27,9 +299,25 @@ shm_alloc_init(struct shm_alloc_state *sm, size_t max_size, size_t slab_size,
 	sm->max_size = max_size;
 	sm->slab_size = slab_size;
 	sm->do_mlock = do_mlock;
+	sm->meta_shift = meta_shift;
+	sm->page_size = getpagesize();
+	while ((1 << sm->page_shift) < sm->page_size)
+		sm->page_shift++;
+	for (i = 0; i <= SHM_ALLOC_MAX_ORDER; i++)
+		TAILQ_INIT(&sm->free_pages[i]);
+	for (i = 0; i < SHM_ALLOC_NCLASSES; i++)
+		TAILQ_INIT(&sm->partial[i]);
+	TAILQ_INIT(&sm->spare);
 
 	pthread_mutex_init(&sm->l, NULL);
 
+	sm->do_cache = 1;
+	for (i = 0; i < SHM_ALLOC_NCACHE; i++) {
+		TAILQ_INIT(&sm->depot[i].full);
+		TAILQ_INIT(&sm->depot[i].empty);
+	}
+	pthread_mutex_init(&sm->depot_l, NULL);
+
 	/*
 	 * Allocate our first slab.  If it fails, it's okay,
 	 * we'll just do this at the first allocation.
@@ -39,16 +327,23 @@ shm_alloc_init(struct shm_alloc_state *sm, size_t max_size, size_t slab_size,
 	pthread_mutex_unlock(&sm->l);
 }
 
+static void
+shm_alloc_slab_path(const char *name, uint32_t slab_id, char *buf,
+    size_t len)
+{
+
+	snprintf(buf, len, "%s.%u", name, slab_id);
+}
+
 struct shm_alloc_slab *
 shm_alloc_new_slab(struct shm_alloc_state *sm, size_t size, int do_mlock)
 {
-	int fd;
-	void *m;
-	int reterror = 0;
-	const char *shm_path = SHM_ANON;
-	int sys_pagesize;
-	int i;
+	const char *shm_path = NULL;
+	char path[256];
+	size_t i;
 	struct shm_alloc_slab *sh;
+	size_t meta_len;
+	int flags;
 
 	sh = calloc(1, sizeof(*sh));
 	if (sh == NULL) {
@@ -57,13 +352,37 @@ shm_alloc_new_slab(struct shm_alloc_state *sm, size_t size, int do_mlock)
 	}
 	sh->shm_fd = -1;
 
-#if 0
-	/* Unlink it if it exists */
-	(void) shm_unlink(shm_path);
-#endif
+	/* Whole pages only; the metadata area isn't handed out */
+	size &= ~((size_t) sm->page_size - 1);
+	meta_len = shm_alloc_meta_len(size, sm->meta_shift, sm->page_size);
+	sh->npages = (size - meta_len) >> sm->page_shift;
+	if (size <= meta_len || sh->npages == 0) {
+		warnx("%s: slab smaller than a page", __func__);
+		free(sh);
+		return (NULL);
+	}
+	sh->pages = calloc(sh->npages, sizeof(*sh->pages));
+	if (sh->pages == NULL) {
+		warn("%s: calloc", __func__);
+		free(sh);
+		return (NULL);
+	}
 
-	/* Open a posix shared memory thing, by name */
-	sh->shm_fd = shm_open(shm_path, O_CREAT | O_RDWR, 0600);
+	/* Open a posix shared memory thing, by name if we have one */
+	sh->slab_id = sm->next_slab_id;
+	if (sm->shm_name != NULL) {
+		shm_alloc_slab_path(sm->shm_name, sh->slab_id, path,
+		    sizeof(path));
+		shm_path = path;
+		sh->shm_fd = shm_open(shm_path, O_CREAT | O_EXCL | O_RDWR,
+		    0600);
+	} else {
+#ifdef	__linux__
+		sh->shm_fd = memfd_create("shm_alloc", MFD_CLOEXEC);
+#else
+		sh->shm_fd = shm_open(SHM_ANON, O_CREAT | O_RDWR, 0600);
+#endif
+	}
 	sh->shm_size = size;
 
 	if (sh->shm_fd < 0) {
@@ -75,18 +394,21 @@ shm_alloc_new_slab(struct shm_alloc_state *sm, size_t size, int do_mlock)
 	/* Truncate it to the correct size */
 	if (ftruncate(sh->shm_fd, sh->shm_size) < 0) {
 		warn("%s: ftruncate", __func__);
-		reterror = 1;
 		goto cleanup;
 	}
 
-	/* mmap() the whole range */
+	/* mmap() the whole range, superpage aligned where we can ask */
+	flags = MAP_SHARED;
+#ifdef	MAP_ALIGNED_SUPER
+	flags |= MAP_ALIGNED_SUPER;
+#endif
 	sh->shm_m = mmap(NULL, sh->shm_size,
 	    PROT_READ | PROT_WRITE,
-	    MAP_ALIGNED_SUPER | MAP_SHARED,
+	    flags,
 	    sh->shm_fd, 0);
 	if (sh->shm_m == MAP_FAILED) {
+		sh->shm_m = NULL;
 		warn("%s: mmap", __func__);
-		reterror = 1;
 		goto cleanup;
 	}
 
@@ -94,23 +416,28 @@ shm_alloc_new_slab(struct shm_alloc_state *sm, size_t size, int do_mlock)
 	if (do_mlock) {
 		if (mlock(sh->shm_m, sh->shm_size) < 0) {
 			warn("%s: mlock", __func__);
-			reterror = 1;
 			goto cleanup;
 		}
 	}
 
+	if (meta_len != 0)
+		sh->shm_meta = sh->shm_m + size - meta_len;
+
 	/* Add it to the list of slabs */
 	TAILQ_INSERT_TAIL(&sm->slab_list, sh, node);
-
-	/* Setup the free list */
-	TAILQ_INIT(&sh->free_list);
-	sh->free_list_cnt = 0;
+	sm->total_size += sh->shm_size;
 
 	/* And link back to the parent */
 	sh->sm = sm;
+	sm->next_slab_id++;
+
+	/* Every page starts out free */
+	for (i = 0; i < sh->npages; i++)
+		sh->pages[i].sh = sh;
+	shm_alloc_range_free(sh, 0, sh->npages);
 
 	/* Done! Good */
-	return (0);
+	return (sh);
 
 cleanup:
 	/* Unlink it if it exists */
@@ -120,150 +447,608 @@ cleanup:
 	if (sh->shm_fd != -1)
 		close(sh->shm_fd);
 
-	if (shm_path != SHM_ANON)
+	/* .. but only if it was us that created it */
+	if (shm_path != NULL && sh->shm_fd != -1)
 		(void) shm_unlink(shm_path);
+	free(sh->pages);
 	free(sh);
 	return (NULL);
 }
 
-/*
- * Add the given allocation to the free list.
- */
 void
-shm_alloc_add_freelist(struct shm_alloc_state *sm,
-    struct shm_alloc_allocation *sa)
+shm_alloc_unlink(struct shm_alloc_state *sm)
 {
+	struct shm_alloc_slab *sh;
+	char path[256];
 
-	assert(sa->sha_isactive == 1);
-
-	/* Don't add an inactive entry onto the free list! */
-	if (sa->sha_isactive == 0) {
-		fprintf(stderr,
-		    "%s: %p: putting inactive item on the freelist?\n",
-		    __func__,
-		    sa);
+	if (sm->shm_name == NULL)
 		return;
+
+	pthread_mutex_lock(&sm->l);
+	TAILQ_FOREACH(sh, &sm->slab_list, node) {
+		shm_alloc_slab_path(sm->shm_name, sh->slab_id, path,
+		    sizeof(path));
+		if (shm_unlink(path) < 0)
+			warn("%s: shm_unlink (%s)", __func__, path);
 	}
+	pthread_mutex_unlock(&sm->l);
+}
 
-	/* Mark the allocation as inactive */
-	sa->sha_isactive = 0;
+int
+shm_alloc_slab_fd(struct shm_alloc_state *sm, uint32_t slab_id)
+{
+	struct shm_alloc_slab *sh;
+	int fd = -1;
 
-	/*
-	 * Add the entry to the head of the list;
-	 * if we're lucky then the next allocation will grab
-	 * it and it'll be cache-hot.
-	 */
 	pthread_mutex_lock(&sm->l);
-	TAILQ_INSERT_HEAD(&sa->sha_slab->free_list, sa, node);
-	sa->sha_slab->free_list_cnt++;
-	/* XXX TODO: also add a top-level free list */
+	TAILQ_FOREACH(sh, &sm->slab_list, node) {
+		if (sh->slab_id == slab_id) {
+			fd = sh->shm_fd;
+			break;
+		}
+	}
 	pthread_mutex_unlock(&sm->l);
+	return (fd);
 }
 
 /*
- * Find a suitable item on the freelist.  Bail out if nothing suitable
- * is found.
- *
- * This assumes the lock is held.
+ * Allocate; called with the allocator lock held.
  */
-struct shm_alloc_allocation *
-shm_alloc_lookup_freelist(struct shm_alloc_state *sm, size_t size)
+static struct shm_alloc_allocation *
+shm_alloc_alloc_locked(struct shm_alloc_state *sm, size_t size)
 {
-	struct shm_alloc_allocation *sa, *sa_found;
-	struct shm_alloc_slab *sh;
+	struct shm_alloc_allocation *sa;
+	struct shm_alloc_page *pg;
+	off_t ofs;
 
-	sa_found = NULL;
+	/* Reuse a descriptor if there's one spare */
+	sa = TAILQ_FIRST(&sm->spare);
+	if (sa != NULL)
+		TAILQ_REMOVE(&sm->spare, sa, node);
+	else {
+		sa = malloc(sizeof(*sa));
+		if (sa == NULL) {
+			warn("%s: malloc failed", __func__);
+			return (NULL);
+		}
+	}
 
-	/*
-	 * XXX TODO: we should just keep the freelist entries on
-	 * a top-level list too, in order to make this lookup
-	 * quicker!
-	 */
-	TAILQ_FOREACH(sh, &sm->slab_list, node) {
-		TAILQ_FOREACH(sa, &sh->free_list, node) {
-			if (sa->sha_len == size) {
-				sa_found = sa;
-				break;
-			}
+	if (size <= (size_t) sm->page_size / 2)
+		pg = shm_alloc_obj(sm, shm_alloc_class(size), &ofs);
+	else {
+		pg = shm_alloc_pages_grow(sm,
+		    (size + sm->page_size - 1) >> sm->page_shift);
+		if (pg != NULL) {
+			pg->state = SHM_PG_ALLOC;
+			ofs = shm_alloc_page_idx(pg) << sm->page_shift;
 		}
 	}
+	if (pg == NULL) {
+		TAILQ_INSERT_HEAD(&sm->spare, sa, node);
+		return (NULL);
+	}
+
+	sa->sha_slab = pg->sh;
+	sa->sha_fd = pg->sh->shm_fd;
+	sa->sha_offset = ofs;
+	sa->sha_len = size;
+	sa->sha_ptr = pg->sh->shm_m + ofs;
+	return (sa);
+}
+
+/*
+ * Free; called with the allocator lock held.
+ */
+static void
+shm_alloc_free_locked(struct shm_alloc_allocation *sa)
+{
+	struct shm_alloc_slab *sh = sa->sha_slab;
+	struct shm_alloc_state *sm = sh->sm;
+	struct shm_alloc_page *pg;
+	size_t idx;
+
+	idx = sa->sha_offset >> sm->page_shift;
+	pg = &sh->pages[idx];
+	if (pg->state == SHM_PG_SMALL)
+		shm_alloc_obj_free(sm, pg, sa);
+	else
+		shm_alloc_range_free(sh, idx,
+		    (sa->sha_len + sm->page_size - 1) >> sm->page_shift);
 
 	/*
-	 * If we found something, pull it off of the free list.
+	 * Keep the descriptor; if we're lucky the next allocation
+	 * grabs it while it's cache-hot.
 	 */
-	if (sa_found != NULL) {
-		TAILQ_REMOVE(&sa_found->sha_slab->free_list, sa_found, node);
-		sa_found->sha_slab->free_list_cnt--;
-		sa_found->sha_isactive = 1;
-	}
+	TAILQ_INSERT_HEAD(&sm->spare, sa, node);
+}
+
+/*
+ * Per-thread magazines, one set per allocator the thread uses.
+ */
+struct shm_alloc_tcache {
+	struct shm_alloc_state *sm;
+	struct shm_alloc_tcache *next;
+	struct {
+		struct shm_alloc_mag *loaded;
+		struct shm_alloc_mag *prev;
+	} c[SHM_ALLOC_NCACHE];
+};
+
+static __thread struct shm_alloc_tcache *shm_alloc_tcaches = NULL;
+static pthread_key_t shm_alloc_tcache_key;
+static pthread_once_t shm_alloc_tcache_once = PTHREAD_ONCE_INIT;
 
-	return (sa_found);
+static void
+shm_alloc_tcache_exit(void *arg)
+{
+
+	while (shm_alloc_tcaches != NULL)
+		shm_alloc_cache_flush(shm_alloc_tcaches->sm);
 }
 
-struct shm_alloc_allocation *
-shm_alloc_alloc(struct shm_alloc_state *sm, size_t size)
+static void
+shm_alloc_tcache_key_init(void)
+{
+
+	if (pthread_key_create(&shm_alloc_tcache_key,
+	    shm_alloc_tcache_exit) != 0)
+		warnx("%s: pthread_key_create failed", __func__);
+}
+
+static struct shm_alloc_tcache *
+shm_alloc_tcache_get(struct shm_alloc_state *sm)
+{
+	struct shm_alloc_tcache *tc;
+
+	for (tc = shm_alloc_tcaches; tc != NULL; tc = tc->next)
+		if (tc->sm == sm)
+			return (tc);
+
+	(void) pthread_once(&shm_alloc_tcache_once,
+	    shm_alloc_tcache_key_init);
+	tc = calloc(1, sizeof(*tc));
+	if (tc == NULL)
+		return (NULL);
+	tc->sm = sm;
+	tc->next = shm_alloc_tcaches;
+	shm_alloc_tcaches = tc;
+
+	/* Only there so the destructor runs at thread exit */
+	(void) pthread_setspecific(shm_alloc_tcache_key, tc);
+	return (tc);
+}
+
+/*
+ * Cache class for an allocation, or -1 if it isn't cached.
+ */
+static int
+shm_alloc_cache_class(struct shm_alloc_state *sm, size_t size)
+{
+	size_t npages;
+
+	if (size <= (size_t) sm->page_size / 2)
+		return (shm_alloc_class(size));
+	npages = (size + sm->page_size - 1) >> sm->page_shift;
+	if (npages > SHM_ALLOC_CACHE_MAX_PAGES)
+		return (-1);
+	return (SHM_ALLOC_NCLASSES + npages - 1);
+}
+
+/*
+ * An empty magazine; from the depot if there's one there.
+ */
+static struct shm_alloc_mag *
+shm_alloc_mag_get(struct shm_alloc_state *sm, int cls)
+{
+	struct shm_alloc_depot *d = &sm->depot[cls];
+	struct shm_alloc_mag *m;
+
+	pthread_mutex_lock(&sm->depot_l);
+	m = TAILQ_FIRST(&d->empty);
+	if (m != NULL)
+		TAILQ_REMOVE(&d->empty, m, node);
+	pthread_mutex_unlock(&sm->depot_l);
+
+	if (m == NULL)
+		m = calloc(1, sizeof(*m));
+	return (m);
+}
+
+/*
+ * Free everything in a magazine to the slabs.
+ */
+static void
+shm_alloc_mag_spill(struct shm_alloc_state *sm, struct shm_alloc_mag *m)
 {
-	struct shm_alloc_slab *sh;
-	struct shm_alloc_allocation *sa = NULL;
 
 	pthread_mutex_lock(&sm->l);
+	while (m->n > 0)
+		shm_alloc_free_locked(m->rounds[--m->n]);
+	sm->stats.n_spill++;
+	pthread_mutex_unlock(&sm->l);
+}
 
-	/* Check the freelist first */
-	sa = shm_alloc_lookup_freelist(sm, size);
-	if (sa != NULL)
-		goto out;
+/*
+ * Swap a full magazine from the depot in for the empty ones.
+ * Returns -1 if the depot has none.
+ */
+static int
+shm_alloc_depot_get_full(struct shm_alloc_state *sm,
+    struct shm_alloc_tcache *tc, int cls)
+{
+	struct shm_alloc_depot *d = &sm->depot[cls];
+	struct shm_alloc_mag *m;
 
-	/* Walk the slab list, look for something free */
-	TAILQ_FOREACH(sh, &sm->slab_list, node) {
-#if 0
-		fprintf(stderr, "%s: curofs=%lld, size=%lld, shm_size=%lld\n",
-		    __func__,
-		    (long long) sh->shm_curofs,
-		    (long long) size,
-		    (long long) sh->shm_size);
-#endif
-		/*
-		 * Skip out if we have no free space
-		 */
-		if (sh->shm_curofs + size > sh->shm_size)
+	pthread_mutex_lock(&sm->depot_l);
+	m = TAILQ_FIRST(&d->full);
+	if (m == NULL) {
+		pthread_mutex_unlock(&sm->depot_l);
+		return (-1);
+	}
+	TAILQ_REMOVE(&d->full, m, node);
+	d->n_full--;
+	if (tc->c[cls].prev != NULL)
+		TAILQ_INSERT_HEAD(&d->empty, tc->c[cls].prev, node);
+	tc->c[cls].prev = tc->c[cls].loaded;
+	tc->c[cls].loaded = m;
+	sm->stats.n_depot++;
+	pthread_mutex_unlock(&sm->depot_l);
+
+	return (0);
+}
+
+/*
+ * Hand the previous (full) magazine to the depot, making the loaded
+ * (full) one previous and loading an empty one.  If the depot is
+ * full itself the magazine is spilled to the slabs instead.
+ */
+static void
+shm_alloc_depot_put_full(struct shm_alloc_state *sm,
+    struct shm_alloc_tcache *tc, int cls)
+{
+	struct shm_alloc_depot *d = &sm->depot[cls];
+	struct shm_alloc_mag *m_spill = NULL, *m;
+
+	pthread_mutex_lock(&sm->depot_l);
+	if (tc->c[cls].prev != NULL) {
+		if (d->n_full < SHM_ALLOC_DEPOT_MAX) {
+			TAILQ_INSERT_HEAD(&d->full, tc->c[cls].prev, node);
+			d->n_full++;
+		} else
+			m_spill = tc->c[cls].prev;
+	}
+	tc->c[cls].prev = tc->c[cls].loaded;
+	m = TAILQ_FIRST(&d->empty);
+	if (m != NULL)
+		TAILQ_REMOVE(&d->empty, m, node);
+	sm->stats.n_depot++;
+	pthread_mutex_unlock(&sm->depot_l);
+
+	if (m_spill != NULL) {
+		shm_alloc_mag_spill(sm, m_spill);
+		if (m == NULL)
+			m = m_spill;
+		else
+			free(m_spill);
+	}
+	if (m == NULL)
+		m = calloc(1, sizeof(*m));
+
+	/* If that failed the caller frees through the lock */
+	tc->c[cls].loaded = m;
+}
+
+static struct shm_alloc_allocation *
+shm_alloc_cache_alloc(struct shm_alloc_state *sm,
+    struct shm_alloc_tcache *tc, int cls, size_t size)
+{
+	struct shm_alloc_mag *m;
+	struct shm_alloc_allocation *sa;
+
+	for (;;) {
+		m = tc->c[cls].loaded;
+		if (m != NULL && m->n > 0)
+			return (m->rounds[--m->n]);
+
+		/* Previous one has some left? */
+		if (tc->c[cls].prev != NULL && tc->c[cls].prev->n > 0) {
+			tc->c[cls].loaded = tc->c[cls].prev;
+			tc->c[cls].prev = m;
 			continue;
+		}
 
-		/* There is enough space, so use it */
+		if (shm_alloc_depot_get_full(sm, tc, cls) == 0)
+			continue;
 
 		/*
-		 * Allocate the state node; if we fail, don't
-		 * bother finishing the shared memory allocation.
+		 * Fill half a magazine from the slabs, leaving room
+		 * for frees before we have to go back to the depot.
 		 */
-		sa = malloc(sizeof(*sa));
-		if (sa == NULL) {
-			warn("%s: malloc failed", __func__);
+		if (m == NULL) {
+			m = shm_alloc_mag_get(sm, cls);
+			if (m == NULL)
+				break;
+			tc->c[cls].loaded = m;
+		}
+		pthread_mutex_lock(&sm->l);
+		while (m->n < SHM_ALLOC_MAG_ROUNDS / 2) {
+			sa = shm_alloc_alloc_locked(sm, size);
+			if (sa == NULL)
+				break;
+			m->rounds[m->n++] = sa;
+		}
+		sm->stats.n_refill++;
+		pthread_mutex_unlock(&sm->l);
+		if (m->n == 0)
 			return (NULL);
+	}
+
+	/* No magazine; go straight to the slabs */
+	pthread_mutex_lock(&sm->l);
+	sa = shm_alloc_alloc_locked(sm, size);
+	pthread_mutex_unlock(&sm->l);
+	return (sa);
+}
+
+static void
+shm_alloc_cache_free(struct shm_alloc_state *sm,
+    struct shm_alloc_tcache *tc, int cls, struct shm_alloc_allocation *sa)
+{
+	struct shm_alloc_mag *m;
+
+	for (;;) {
+		m = tc->c[cls].loaded;
+		if (m != NULL && m->n < SHM_ALLOC_MAG_ROUNDS) {
+			m->rounds[m->n++] = sa;
+			return;
 		}
 
-		/* OK, we can finish the allocation */
+		/* Previous one has room? */
+		if (tc->c[cls].prev != NULL &&
+		    tc->c[cls].prev->n < SHM_ALLOC_MAG_ROUNDS) {
+			tc->c[cls].loaded = tc->c[cls].prev;
+			tc->c[cls].prev = m;
+			continue;
+		}
 
-		sa->sha_fd = sh->shm_fd;
-		sa->sha_offset = sh->shm_curofs;
-		sa->sha_len = size;
-		sa->sha_ptr = (sh->shm_m) + sh->shm_curofs;
-		sa->sha_isactive = 1;
-		sa->sha_slab = sh;
+		if (m == NULL) {
+			m = shm_alloc_mag_get(sm, cls);
+			if (m == NULL)
+				break;
+			tc->c[cls].loaded = m;
+			continue;
+		}
 
-		/* And bump the allocation offset along */
-		sh->shm_curofs += size;
-		break;
+		shm_alloc_depot_put_full(sm, tc, cls);
+		if (tc->c[cls].loaded == NULL)
+			break;
 	}
 
-out:
+	pthread_mutex_lock(&sm->l);
+	shm_alloc_free_locked(sa);
 	pthread_mutex_unlock(&sm->l);
+}
+
+struct shm_alloc_allocation *
+shm_alloc_alloc(struct shm_alloc_state *sm, size_t size)
+{
+	struct shm_alloc_allocation *sa;
+	struct shm_alloc_tcache *tc = NULL;
+	int cls = -1;
+
+	if (sm->do_cache)
+		cls = shm_alloc_cache_class(sm, size);
+	if (cls >= 0)
+		tc = shm_alloc_tcache_get(sm);
+
+	if (tc != NULL)
+		sa = shm_alloc_cache_alloc(sm, tc, cls, size);
+	else {
+		pthread_mutex_lock(&sm->l);
+		sa = shm_alloc_alloc_locked(sm, size);
+		pthread_mutex_unlock(&sm->l);
+	}
+	if (sa == NULL)
+		return (NULL);
+
+	sa->sha_len = size;
+	sa->sha_isactive = 1;
 	return (sa);
 }
 
 int
 shm_alloc_free(struct shm_alloc_allocation *sa)
 {
+	struct shm_alloc_state *sm = sa->sha_slab->sm;
+	struct shm_alloc_tcache *tc = NULL;
+	int cls = -1;
 
-	shm_alloc_add_freelist(sa->sha_slab->sm, sa);
+	assert(sa->sha_isactive == 1);
+
+	/* Don't free an inactive entry twice! */
+	if (sa->sha_isactive == 0) {
+		fprintf(stderr,
+		    "%s: %p: freeing an inactive allocation?\n",
+		    __func__,
+		    sa);
+		return (-1);
+	}
+	sa->sha_isactive = 0;
+
+	if (sm->do_cache)
+		cls = shm_alloc_cache_class(sm, sa->sha_len);
+	if (cls >= 0)
+		tc = shm_alloc_tcache_get(sm);
+
+	if (tc != NULL)
+		shm_alloc_cache_free(sm, tc, cls, sa);
+	else {
+		pthread_mutex_lock(&sm->l);
+		shm_alloc_free_locked(sa);
+		pthread_mutex_unlock(&sm->l);
+	}
 
 	return (0);
 }
+
+void
+shm_alloc_cache_flush(struct shm_alloc_state *sm)
+{
+	struct shm_alloc_tcache *tc, **tcp;
+	struct shm_alloc_mag *m;
+	int i;
+
+	for (tcp = &shm_alloc_tcaches; *tcp != NULL; tcp = &(*tcp)->next)
+		if ((*tcp)->sm == sm)
+			break;
+	tc = *tcp;
+	if (tc == NULL)
+		return;
+	*tcp = tc->next;
+	(void) pthread_setspecific(shm_alloc_tcache_key, shm_alloc_tcaches);
+
+	for (i = 0; i < SHM_ALLOC_NCACHE; i++) {
+		m = tc->c[i].loaded;
+		if (m != NULL && m->n > 0)
+			shm_alloc_mag_spill(sm, m);
+		free(m);
+		m = tc->c[i].prev;
+		if (m != NULL && m->n > 0)
+			shm_alloc_mag_spill(sm, m);
+		free(m);
+	}
+	free(tc);
+}
+
+int
+shm_alloc_peer_init(struct shm_alloc_peer *p, const char *name,
+    int meta_shift)
+{
+
+	bzero(p, sizeof(*p));
+	p->meta_shift = meta_shift;
+	if (name != NULL) {
+		p->shm_name = strdup(name);
+		if (p->shm_name == NULL) {
+			warn("%s: strdup", __func__);
+			return (-1);
+		}
+	}
+	pthread_mutex_init(&p->l, NULL);
+	return (0);
+}
+
+void
+shm_alloc_peer_free(struct shm_alloc_peer *p)
+{
+	uint32_t i;
+
+	for (i = 0; i < p->nslabs; i++)
+		if (p->slabs[i].shm_m != NULL)
+			munmap(p->slabs[i].shm_m, p->slabs[i].map_len);
+	free(p->slabs);
+	free(p->shm_name);
+	pthread_mutex_destroy(&p->l);
+	bzero(p, sizeof(*p));
+}
+
+/*
+ * Map a slab; called with the peer lock held.  Closes fd.
+ */
+static int
+shm_alloc_peer_map(struct shm_alloc_peer *p, uint32_t slab_id, int fd)
+{
+	struct shm_alloc_peer_slab *ps;
+	struct stat st;
+	size_t meta_len;
+	uint32_t n;
+	char *m;
+
+	if (fstat(fd, &st) < 0) {
+		warn("%s: fstat", __func__);
+		goto error;
+	}
+
+	/* Grow the slab table to fit */
+	if (slab_id >= p->nslabs) {
+		n = p->nslabs ? p->nslabs : 8;
+		while (n <= slab_id)
+			n *= 2;
+		ps = realloc(p->slabs, n * sizeof(*ps));
+		if (ps == NULL) {
+			warn("%s: realloc", __func__);
+			goto error;
+		}
+		bzero(ps + p->nslabs, (n - p->nslabs) * sizeof(*ps));
+		p->slabs = ps;
+		p->nslabs = n;
+	}
+	ps = &p->slabs[slab_id];
+	if (ps->shm_m != NULL) {
+		warnx("%s: slab %u is already mapped", __func__, slab_id);
+		goto error;
+	}
+
+	m = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		warn("%s: mmap", __func__);
+		goto error;
+	}
+	ps->shm_m = m;
+	ps->map_len = st.st_size;
+	meta_len = shm_alloc_meta_len(st.st_size, p->meta_shift,
+	    getpagesize());
+	ps->shm_size = st.st_size - meta_len;
+	if (meta_len != 0)
+		ps->shm_meta = m + ps->shm_size;
+	close(fd);
+	return (0);
+
+error:
+	close(fd);
+	return (-1);
+}
+
+int
+shm_alloc_peer_add_slab(struct shm_alloc_peer *p, uint32_t slab_id, int fd)
+{
+	int ret;
+
+	pthread_mutex_lock(&p->l);
+	ret = shm_alloc_peer_map(p, slab_id, fd);
+	pthread_mutex_unlock(&p->l);
+	return (ret);
+}
+
+char *
+shm_alloc_peer_lookup(struct shm_alloc_peer *p, uint32_t slab_id,
+    uint64_t offset, size_t len, char **meta)
+{
+	struct shm_alloc_peer_slab *ps;
+	char path[256];
+	char *ptr = NULL;
+	int fd;
+
+	pthread_mutex_lock(&p->l);
+	if ((slab_id >= p->nslabs || p->slabs[slab_id].shm_m == NULL) &&
+	    p->shm_name != NULL) {
+		/* Not seen this one yet; map it by name */
+		shm_alloc_slab_path(p->shm_name, slab_id, path, sizeof(path));
+		fd = shm_open(path, O_RDWR, 0);
+		if (fd < 0)
+			warn("%s: shm_open (%s)", __func__, path);
+		else
+			(void) shm_alloc_peer_map(p, slab_id, fd);
+	}
+	if (slab_id < p->nslabs) {
+		ps = &p->slabs[slab_id];
+		if (ps->shm_m != NULL && offset <= ps->shm_size &&
+		    len <= ps->shm_size - offset) {
+			ptr = ps->shm_m + offset;
+			if (meta != NULL)
+				*meta = ps->shm_meta;
+		}
+	}
+	pthread_mutex_unlock(&p->l);
+	return (ptr);
+}
@@ -1,8 +1,73 @@
 #ifndef	__LIBIAPP_SHM_ALLOC_H__
 #define	__LIBIAPP_SHM_ALLOC_H__
 
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+
 struct shm_alloc_slab;
 struct shm_alloc_allocation;
+struct shm_alloc_page;
+struct shm_alloc_mag;
+
+/*
+ * Slabs are carved up in pages with a binary buddy allocator.
+ *
+ * Allocations of more than half a page get whole pages: the
+ * smallest power of two block that fits, with the unused tail
+ * handed straight back, so they're page aligned and don't waste
+ * more than a page.  Freed pages are coalesced with their buddy.
+ *
+ * Smaller allocations come from power of two size classes, each
+ * a page split into equal objects.  A page goes back to the buddy
+ * allocator once all its objects are free.
+ *
+ * The free lists span every slab, so neither allocating nor
+ * freeing walks slabs or free entries.
+ */
+#define	SHM_ALLOC_MAX_ORDER	18	/* largest block: page << this */
+#define	SHM_ALLOC_MIN_SHIFT	6	/* smallest object: 64 bytes */
+#define	SHM_ALLOC_NCLASSES	16
+
+/*
+ * Each thread keeps a couple of magazines of freed allocations per
+ * cache class in front of that, so most allocations and frees don't
+ * take a lock.  A thread that runs out, or fills up, swaps whole
+ * magazines with the depot; only when the depot can't help are
+ * allocations made or freed in bulk under the allocator lock.
+ *
+ * The cache classes are the size classes, then page allocations of
+ * 1 .. SHM_ALLOC_CACHE_MAX_PAGES pages.  Frees on another thread
+ * land in that thread's magazines and make it back to the depot a
+ * magazine at a time.
+ */
+#define	SHM_ALLOC_MAG_ROUNDS		32
+#define	SHM_ALLOC_CACHE_MAX_PAGES	16
+#define	SHM_ALLOC_NCACHE	(SHM_ALLOC_NCLASSES + SHM_ALLOC_CACHE_MAX_PAGES)
+#define	SHM_ALLOC_DEPOT_MAX	16	/* full magazines per class */
+
+TAILQ_HEAD(shm_alloc_page_list, shm_alloc_page);
+
+struct shm_alloc_mag {
+	TAILQ_ENTRY(shm_alloc_mag) node;
+	int n;
+	struct shm_alloc_allocation *rounds[SHM_ALLOC_MAG_ROUNDS];
+};
+
+TAILQ_HEAD(shm_alloc_mag_list, shm_alloc_mag);
+
+struct shm_alloc_depot {
+	struct shm_alloc_mag_list full;
+	struct shm_alloc_mag_list empty;
+	int n_full;
+};
+
+struct shm_alloc_stats {
+	uint64_t n_refill;	/* magazines filled under l */
+	uint64_t n_spill;	/* .. and emptied under it */
+	uint64_t n_depot;	/* swaps with the depot, under depot_l */
+};
 
 /*
  * This represents the allocator state.
@@ -11,8 +76,49 @@ struct shm_alloc_state {
 	TAILQ_HEAD(, shm_alloc_slab) slab_list;
 	size_t max_size;
 	size_t slab_size;
+	size_t total_size;	/* of all slabs */
 	int do_mlock;
+	char *shm_name;		/* NULL - anonymous slabs */
+	int meta_shift;		/* 0 - no per-slab metadata area */
+	uint32_t next_slab_id;
+	int page_size;
+	int page_shift;
 	pthread_mutex_t l;
+
+	/* Free blocks, by order */
+	struct shm_alloc_page_list free_pages[SHM_ALLOC_MAX_ORDER + 1];
+
+	/* Small object pages with free objects, by size class */
+	struct shm_alloc_page_list partial[SHM_ALLOC_NCLASSES];
+
+	/* Spare allocation descriptors */
+	TAILQ_HEAD(, shm_alloc_allocation) spare;
+
+	/* Magazine depot; 0 - no per-thread caching */
+	int do_cache;
+	pthread_mutex_t depot_l;
+	struct shm_alloc_depot depot[SHM_ALLOC_NCACHE];
+	struct shm_alloc_stats stats;
+};
+
+/*
+ * Per page state.
+ */
+typedef enum {
+	SHM_PG_NONE = 0,	/* inside a free block, or an allocation */
+	SHM_PG_FREE,		/* first page of a free block */
+	SHM_PG_ALLOC,		/* first page of a page allocation */
+	SHM_PG_SMALL,		/* split into small objects */
+} shm_alloc_page_state;
+
+struct shm_alloc_page {
+	struct shm_alloc_slab *sh;
+	TAILQ_ENTRY(shm_alloc_page) node;	/* free or partial list */
+	uint8_t state;		/* shm_alloc_page_state */
+	uint8_t order;		/* SHM_PG_FREE: block order */
+	uint8_t cls;		/* SHM_PG_SMALL: size class */
+	uint16_t nfree;		/* SHM_PG_SMALL: free objects .. */
+	uint16_t free_head;	/* .. and the first; linked in place */
 };
 
 /*
@@ -20,6 +126,7 @@ struct shm_alloc_state {
  */
 struct shm_alloc_slab {
 	int shm_fd;
+	uint32_t slab_id;	/* from 0, in creation order */
 	size_t shm_size;
 	struct shm_alloc_state *sm;
 
@@ -29,18 +136,13 @@ struct shm_alloc_slab {
 	 * This is the mmap()'ed address.
 	 */
 	char *shm_m;
+	char *shm_meta;		/* metadata area at the end, or NULL */
 
 	/*
-	 * This is the current offset in the slab that
-	 * we've allocated pages from.
+	 * Page state, shm_size / page_size of them.
 	 */
-	off_t shm_curofs;
-
-	/*
-	 * This is the current free list state.
-	 */
-	TAILQ_HEAD(, shm_alloc_allocation) free_list;
-	int free_list_cnt;
+	struct shm_alloc_page *pages;
+	size_t npages;
 };
 
 /*
@@ -56,12 +158,85 @@ struct shm_alloc_allocation {
 	int sha_isactive;
 };
 
+/*
+ * Set up an allocator.  Slabs of slab_size are added as needed up
+ * to max_size in total; a larger allocation gets a slab to itself.
+ */
 extern	void shm_alloc_init(struct shm_alloc_state *sm,
 	    size_t max_size, size_t slab_size, int do_mlock);
+
+/*
+ * As above, but the slabs are named <name>.<slab id> (name starting
+ * with a '/') so other processes can map them by name.  The names
+ * stay until shm_alloc_unlink().
+ *
+ * With a non-zero meta_shift, the last shm_size >> meta_shift bytes
+ * of each slab (rounded up to a page) are kept back for the caller
+ * to keep per-allocation state in, out of line; the pages handed
+ * out are unchanged.
+ */
+extern	void shm_alloc_init_named(struct shm_alloc_state *sm,
+	    const char *name, size_t max_size, size_t slab_size, int do_mlock,
+	    int meta_shift);
+extern	void shm_alloc_unlink(struct shm_alloc_state *sm);
+
+/*
+ * A slab's descriptor, for passing to a peer (eg with
+ * comm_fdpass_send()); -1 if there's no such slab.
+ */
+extern	int shm_alloc_slab_fd(struct shm_alloc_state *sm, uint32_t slab_id);
+
+/*
+ * Add a slab.  Must be called with the allocator lock held.
+ */
 extern	struct shm_alloc_slab * shm_alloc_new_slab(struct shm_alloc_state *sm,
 	    size_t size, int do_mlock);
 extern	struct shm_alloc_allocation * shm_alloc_alloc(struct shm_alloc_state *sm,
 	    size_t size);
 extern	int shm_alloc_free(struct shm_alloc_allocation *);
 
+/*
+ * Hand the calling thread's magazines for this allocator back.
+ * Threads that exit have this done for them.
+ */
+extern	void shm_alloc_cache_flush(struct shm_alloc_state *sm);
+
+/*
+ * Another process' view of an allocator's slabs, for resolving
+ * (slab id, offset) pairs it was handed.  Slabs are mapped on first
+ * use by name, or added from descriptors the owner passed over.
+ */
+struct shm_alloc_peer_slab {
+	char *shm_m;
+	char *shm_meta;
+	size_t shm_size;	/* without the metadata area */
+	size_t map_len;
+};
+
+struct shm_alloc_peer {
+	char *shm_name;		/* NULL - descriptors only */
+	int meta_shift;		/* as the owner's */
+	pthread_mutex_t l;
+	struct shm_alloc_peer_slab *slabs;	/* by slab id */
+	uint32_t nslabs;
+};
+
+extern	int shm_alloc_peer_init(struct shm_alloc_peer *p, const char *name,
+	    int meta_shift);
+extern	void shm_alloc_peer_free(struct shm_alloc_peer *p);
+
+/*
+ * Map a slab from its descriptor.  The descriptor is closed.
+ */
+extern	int shm_alloc_peer_add_slab(struct shm_alloc_peer *p,
+	    uint32_t slab_id, int fd);
+
+/*
+ * [offset, offset+len) of a slab, or NULL if it isn't mapped (and
+ * can't be) or the range is outside it.  If meta isn't NULL it's
+ * set to the slab's metadata area.
+ */
+extern	char * shm_alloc_peer_lookup(struct shm_alloc_peer *p,
+	    uint32_t slab_id, uint64_t offset, size_t len, char **meta);
+
 #endif	/* __LIBIAPP_SHM_ALLOC_H__ */
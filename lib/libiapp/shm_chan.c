@@ -0,0 +1,371 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#ifdef	__linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "shm_alloc.h"
+#include "shm_chan.h"
+
+#define	XMIN(x,y)	((x) < (y) ? (x) : (y))
+
+static int
+iapp_shm_chan_doorbell_create(struct iapp_shm_chan *ch, int side)
+{
+#ifdef	__linux__
+	int fd;
+
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0) {
+		warn("%s: eventfd", __func__);
+		return (-1);
+	}
+	ch->db_rfd[side] = ch->db_wfd[side] = fd;
+#else
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		warn("%s: pipe", __func__);
+		return (-1);
+	}
+	(void) fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	(void) fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	ch->db_rfd[side] = fds[0];
+	ch->db_wfd[side] = fds[1];
+#endif
+	return (0);
+}
+
+/*
+ * Wake up 'side'.  A full pipe / saturated eventfd means a wakeup
+ * is already pending, which is all we want.
+ */
+static void
+iapp_shm_chan_ring(struct iapp_shm_chan *ch, int side)
+{
+#ifdef	__linux__
+	uint64_t v = 1;
+
+	(void) write(ch->db_wfd[side], &v, sizeof(v));
+#else
+	char v = 0;
+
+	(void) write(ch->db_wfd[side], &v, sizeof(v));
+#endif
+	ch->n_wakeups[side]++;
+}
+
+void
+iapp_shm_chan_drain(struct iapp_shm_chan *ch, int side)
+{
+#ifdef	__linux__
+	uint64_t v;
+
+	/* One read resets the eventfd */
+	(void) read(ch->db_rfd[side], &v, sizeof(v));
+#else
+	char buf[64];
+
+	while (read(ch->db_rfd[side], buf, sizeof(buf)) > 0)
+		;
+#endif
+}
+
+int
+iapp_shm_chan_fd(struct iapp_shm_chan *ch, int side)
+{
+
+	return (ch->db_rfd[side]);
+}
+
+static void
+iapp_shm_chan_setup(struct iapp_shm_chan *ch, char *m, size_t ring_size)
+{
+
+	ch->hdr = (struct iapp_shm_chan_hdr *) m;
+	ch->data[0] = m + IAPP_SHM_CHAN_HDR_SIZE;
+	ch->data[1] = ch->data[0] + ring_size;
+	ch->map_len = IAPP_SHM_CHAN_HDR_SIZE + 2 * ring_size;
+}
+
+static struct iapp_shm_chan *
+iapp_shm_chan_new(void)
+{
+	struct iapp_shm_chan *ch;
+
+	ch = calloc(1, sizeof(*ch));
+	if (ch == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	ch->shm_fd = -1;
+	ch->db_rfd[0] = ch->db_rfd[1] = -1;
+	ch->db_wfd[0] = ch->db_wfd[1] = -1;
+	return (ch);
+}
+
+struct iapp_shm_chan *
+iapp_shm_chan_create(struct shm_alloc_state *sm, size_t ring_size)
+{
+	struct iapp_shm_chan *ch;
+
+	if (ring_size < (size_t) getpagesize() ||
+	    (ring_size & (ring_size - 1)) != 0) {
+		warnx("%s: ring size %zu isn't a power of two page multiple",
+		    __func__, ring_size);
+		return (NULL);
+	}
+
+	ch = iapp_shm_chan_new();
+	if (ch == NULL)
+		return (NULL);
+
+	ch->sa = shm_alloc_alloc(sm, IAPP_SHM_CHAN_HDR_SIZE + 2 * ring_size);
+	if (ch->sa == NULL) {
+		warnx("%s: shm_alloc_alloc failed", __func__);
+		goto error;
+	}
+	ch->shm_fd = ch->sa->sha_fd;
+	ch->shm_offset = ch->sa->sha_offset;
+	iapp_shm_chan_setup(ch, ch->sa->sha_ptr, ring_size);
+
+	/* Allocations get reused; start from a clean header */
+	bzero(ch->hdr, sizeof(*ch->hdr));
+	ch->hdr->magic = IAPP_SHM_CHAN_MAGIC;
+	ch->hdr->ring_size = ring_size;
+
+	if (iapp_shm_chan_doorbell_create(ch, 0) < 0 ||
+	    iapp_shm_chan_doorbell_create(ch, 1) < 0)
+		goto error;
+
+	return (ch);
+
+error:
+	iapp_shm_chan_free(ch);
+	return (NULL);
+}
+
+void
+iapp_shm_chan_fds(struct iapp_shm_chan *ch, int fds[IAPP_SHM_CHAN_NFDS])
+{
+
+	fds[0] = ch->shm_fd;
+	fds[1] = ch->db_rfd[0];
+	fds[2] = ch->db_wfd[0];
+	fds[3] = ch->db_rfd[1];
+	fds[4] = ch->db_wfd[1];
+}
+
+/*
+ * Map a channel from descriptors passed by its creator.  The new
+ * handle owns the descriptors.
+ */
+struct iapp_shm_chan *
+iapp_shm_chan_attach(const int fds[IAPP_SHM_CHAN_NFDS], off_t offset,
+    size_t ring_size)
+{
+	struct iapp_shm_chan *ch;
+	char *m;
+
+	if (offset % getpagesize() != 0) {
+		warnx("%s: offset %lld isn't page aligned", __func__,
+		    (long long) offset);
+		return (NULL);
+	}
+
+	ch = iapp_shm_chan_new();
+	if (ch == NULL)
+		return (NULL);
+
+	ch->shm_fd = fds[0];
+	ch->shm_offset = offset;
+	ch->db_rfd[0] = fds[1];
+	ch->db_wfd[0] = fds[2];
+	ch->db_rfd[1] = fds[3];
+	ch->db_wfd[1] = fds[4];
+
+	m = mmap(NULL, IAPP_SHM_CHAN_HDR_SIZE + 2 * ring_size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, ch->shm_fd, offset);
+	if (m == MAP_FAILED) {
+		warn("%s: mmap", __func__);
+		goto error;
+	}
+	iapp_shm_chan_setup(ch, m, ring_size);
+
+	if (ch->hdr->magic != IAPP_SHM_CHAN_MAGIC ||
+	    ch->hdr->ring_size != ring_size) {
+		warnx("%s: not a channel of this size", __func__);
+		goto error;
+	}
+
+	return (ch);
+
+error:
+	iapp_shm_chan_free(ch);
+	return (NULL);
+}
+
+void
+iapp_shm_chan_free(struct iapp_shm_chan *ch)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (ch->db_wfd[i] != -1 && ch->db_wfd[i] != ch->db_rfd[i])
+			close(ch->db_wfd[i]);
+		if (ch->db_rfd[i] != -1)
+			close(ch->db_rfd[i]);
+	}
+
+	/* Our own allocation goes back to the allocator */
+	if (ch->sa != NULL)
+		shm_alloc_free(ch->sa);
+	else {
+		if (ch->hdr != NULL)
+			munmap(ch->hdr, ch->map_len);
+		if (ch->shm_fd != -1)
+			close(ch->shm_fd);
+	}
+	free(ch);
+}
+
+ssize_t
+iapp_shm_chan_write(struct iapp_shm_chan *ch, int side, const char *buf,
+    size_t len)
+{
+	struct iapp_shm_ring_hdr *r = &ch->hdr->ring[side];
+	size_t size = ch->hdr->ring_size;
+	uint64_t head, tail;
+	size_t n, off, c;
+
+	if (atomic_load_explicit(&r->cons_closed, memory_order_acquire)) {
+		errno = EPIPE;
+		return (-1);
+	}
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	n = XMIN(len, size - (tail - head));
+	if (n == 0) {
+		/* Full; ask to be woken, then check again */
+		atomic_store_explicit(&r->prod_wait, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		n = XMIN(len, size - (tail - head));
+		if (n == 0) {
+			errno = EAGAIN;
+			return (-1);
+		}
+		atomic_store_explicit(&r->prod_wait, 0, memory_order_relaxed);
+	}
+
+	off = tail & (size - 1);
+	c = XMIN(n, size - off);
+	memcpy(ch->data[side] + off, buf, c);
+	memcpy(ch->data[side], buf + c, n - c);
+	atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+
+	/* Only make a syscall if the consumer is idle */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&r->cons_wait, memory_order_relaxed) &&
+	    atomic_exchange(&r->cons_wait, 0))
+		iapp_shm_chan_ring(ch, 1 - side);
+
+	return (n);
+}
+
+ssize_t
+iapp_shm_chan_read(struct iapp_shm_chan *ch, int side, char *buf,
+    size_t len)
+{
+	struct iapp_shm_ring_hdr *r = &ch->hdr->ring[1 - side];
+	size_t size = ch->hdr->ring_size;
+	uint64_t head, tail;
+	size_t n, off, c;
+	int is_closed;
+
+	/* Closed is set after the last tail update, so check it first */
+	is_closed = atomic_load_explicit(&r->prod_closed,
+	    memory_order_acquire);
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (tail == head) {
+		if (is_closed)
+			return (0);
+
+		/* Empty; ask to be woken, then check again */
+		atomic_store_explicit(&r->cons_wait, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (tail == head) {
+			errno = EAGAIN;
+			return (-1);
+		}
+		atomic_store_explicit(&r->cons_wait, 0, memory_order_relaxed);
+	}
+
+	n = XMIN(len, tail - head);
+	off = head & (size - 1);
+	c = XMIN(n, size - off);
+	memcpy(buf, ch->data[1 - side] + off, c);
+	memcpy(buf + c, ch->data[1 - side], n - c);
+	atomic_store_explicit(&r->head, head + n, memory_order_release);
+
+	/* Only make a syscall if the producer is waiting for space */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&r->prod_wait, memory_order_relaxed) &&
+	    atomic_exchange(&r->prod_wait, 0))
+		iapp_shm_chan_ring(ch, 1 - side);
+
+	return (n);
+}
+
+/*
+ * This side is done: the peer reads EOF once it has drained what
+ * we wrote, and its writes fail with EPIPE.
+ */
+void
+iapp_shm_chan_close(struct iapp_shm_chan *ch, int side)
+{
+
+	atomic_store_explicit(&ch->hdr->ring[side].prod_closed, 1,
+	    memory_order_release);
+	atomic_store_explicit(&ch->hdr->ring[1 - side].cons_closed, 1,
+	    memory_order_release);
+	iapp_shm_chan_ring(ch, 1 - side);
+}
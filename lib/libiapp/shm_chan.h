@@ -0,0 +1,128 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	__LIBIAPP_SHM_CHAN_H__
+#define	__LIBIAPP_SHM_CHAN_H__
+
+/*
+ * A duplex byte channel between two sides (threads or processes)
+ * made of two single-producer/single-consumer rings in shared
+ * memory.
+ *
+ * Data never goes through the kernel.  Each side has a doorbell
+ * descriptor (an eventfd on Linux, a pipe elsewhere) which its peer
+ * only rings when this side has said it's idle - out of data to
+ * read or space to write - so a busy channel makes no syscalls.
+ *
+ * comm_create_shm() wraps a side in an fde_comm.
+ */
+
+#define	IAPP_SHM_CHAN_MAGIC	0x69736863	/* "ishc" */
+#define	IAPP_SHM_CHAN_HDR_SIZE	4096		/* rings start here */
+
+/* Descriptors a peer process needs; see iapp_shm_chan_fds() */
+#define	IAPP_SHM_CHAN_NFDS	5
+
+struct shm_alloc_state;
+struct shm_alloc_allocation;
+
+/* Shared; one per direction, written by side 'n' in ring[n] */
+struct iapp_shm_ring_hdr {
+	/* Producer */
+	_Alignas(64) _Atomic uint64_t tail;
+	_Atomic int prod_wait;		/* producer waits for space */
+	_Atomic int prod_closed;
+
+	/* Consumer */
+	_Alignas(64) _Atomic uint64_t head;
+	_Atomic int cons_wait;		/* consumer waits for data */
+	_Atomic int cons_closed;
+};
+
+struct iapp_shm_chan_hdr {
+	uint32_t magic;
+	uint32_t ring_size;
+	struct iapp_shm_ring_hdr ring[2];
+};
+
+/* Per-process handle */
+struct iapp_shm_chan {
+	struct iapp_shm_chan_hdr *hdr;
+	char *data[2];			/* ring[n]'s bytes */
+	size_t map_len;
+
+	/* Allocated here, or mapped from a peer's descriptor */
+	struct shm_alloc_allocation *sa;
+	int shm_fd;
+	off_t shm_offset;
+
+	int db_rfd[2];			/* side n's doorbell; read end */
+	int db_wfd[2];			/* .. and write end (same for eventfd) */
+
+	/* Statistics */
+	uint64_t n_wakeups[2];		/* times side n was woken from here */
+};
+
+/*
+ * Create a channel with two rings of 'ring_size' bytes (a power of
+ * two, at least a page) from the shared memory allocator.
+ *
+ * For a forked peer, create it before fork(); both processes then
+ * use the same handle, one per side.
+ */
+extern	struct iapp_shm_chan * iapp_shm_chan_create(struct shm_alloc_state *sm,
+	    size_t ring_size);
+
+/*
+ * For an unrelated peer: the descriptors to pass it (eg with
+ * comm_fdpass_send()), in order, plus the offset and ring size which
+ * it gets some other way.  The offset must be page aligned.
+ */
+extern	void iapp_shm_chan_fds(struct iapp_shm_chan *ch,
+	    int fds[IAPP_SHM_CHAN_NFDS]);
+extern	struct iapp_shm_chan * iapp_shm_chan_attach(
+	    const int fds[IAPP_SHM_CHAN_NFDS], off_t offset, size_t ring_size);
+
+/*
+ * Free this process' handle.  Close the comms using it first.
+ */
+extern	void iapp_shm_chan_free(struct iapp_shm_chan *ch);
+
+/*
+ * IO for one side; these behave like non-blocking read() / write(),
+ * returning -1 with EAGAIN when there's nothing to do yet (the
+ * doorbell will be rung when there is), 0 for EOF once the peer has
+ * closed and the ring is drained, and EPIPE writing to a closed peer.
+ */
+extern	ssize_t iapp_shm_chan_read(struct iapp_shm_chan *ch, int side,
+	    char *buf, size_t len);
+extern	ssize_t iapp_shm_chan_write(struct iapp_shm_chan *ch, int side,
+	    const char *buf, size_t len);
+
+extern	int iapp_shm_chan_fd(struct iapp_shm_chan *ch, int side);
+extern	void iapp_shm_chan_drain(struct iapp_shm_chan *ch, int side);
+extern	void iapp_shm_chan_close(struct iapp_shm_chan *ch, int side);
+
+#endif	/* __LIBIAPP_SHM_CHAN_H__ */
@@ -0,0 +1,248 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <err.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+#include "fde.h"
+#include "taskq.h"
+
+#define	IAPP_TASKQ_DEFAULT_NTHREADS	4
+
+static pthread_once_t iapp_taskq_def_once = PTHREAD_ONCE_INIT;
+static struct iapp_taskq *iapp_taskq_def = NULL;
+static int iapp_taskq_def_nthreads = IAPP_TASKQ_DEFAULT_NTHREADS;
+
+static void *
+iapp_taskq_thread(void *arg)
+{
+	struct iapp_taskq *tq = arg;
+	struct iapp_task *t;
+
+	pthread_mutex_lock(&tq->l);
+	while (1) {
+		while (tq->is_shutdown == 0 &&
+		    (t = TAILQ_FIRST(&tq->t_head)) == NULL)
+			pthread_cond_wait(&tq->cv, &tq->l);
+		if (tq->is_shutdown)
+			break;
+
+		TAILQ_REMOVE(&tq->t_head, t, node);
+		t->is_queued = 0;
+		pthread_mutex_unlock(&tq->l);
+
+		/*
+		 * Do the work, then hand the task back to its owner.
+		 * The owner may not touch the task until the completion
+		 * runs, so there's no locking required around the results.
+		 */
+		t->run(t, t->arg);
+		fde_add_remote(t->fh, t->ev_done);
+
+		pthread_mutex_lock(&tq->l);
+	}
+	pthread_mutex_unlock(&tq->l);
+
+	return (NULL);
+}
+
+struct iapp_taskq *
+iapp_taskq_create(int nthreads)
+{
+	struct iapp_taskq *tq;
+	int i;
+
+	tq = calloc(1, sizeof(*tq));
+	if (tq == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	tq->threads = calloc(nthreads, sizeof(pthread_t));
+	if (tq->threads == NULL) {
+		warn("%s: calloc", __func__);
+		free(tq);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&tq->l, NULL);
+	pthread_cond_init(&tq->cv, NULL);
+	TAILQ_INIT(&tq->t_head);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&tq->threads[i], NULL, iapp_taskq_thread,
+		    tq) != 0) {
+			warn("%s: pthread_create", __func__);
+			break;
+		}
+		tq->n_threads++;
+	}
+
+	if (tq->n_threads == 0) {
+		iapp_taskq_free(tq);
+		return (NULL);
+	}
+
+	return (tq);
+}
+
+void
+iapp_taskq_free(struct iapp_taskq *tq)
+{
+	int i;
+
+	pthread_mutex_lock(&tq->l);
+	tq->is_shutdown = 1;
+	pthread_cond_broadcast(&tq->cv);
+	pthread_mutex_unlock(&tq->l);
+
+	for (i = 0; i < tq->n_threads; i++)
+		pthread_join(tq->threads[i], NULL);
+
+	pthread_cond_destroy(&tq->cv);
+	pthread_mutex_destroy(&tq->l);
+	free(tq->threads);
+	free(tq);
+}
+
+static void
+iapp_taskq_default_create(void)
+{
+
+	iapp_taskq_def = iapp_taskq_create(iapp_taskq_def_nthreads);
+}
+
+void
+iapp_taskq_init(int nthreads)
+{
+
+	if (nthreads > 0)
+		iapp_taskq_def_nthreads = nthreads;
+}
+
+struct iapp_taskq *
+iapp_taskq_default(void)
+{
+
+	(void) pthread_once(&iapp_taskq_def_once, iapp_taskq_default_create);
+	return (iapp_taskq_def);
+}
+
+/*
+ * Completion - this runs in the owner thread.
+ */
+static void
+iapp_task_done_fde_cb(int fd, struct fde *f, void *arg, fde_cb_status status)
+{
+	struct iapp_task *t = arg;
+
+	t->is_busy = 0;
+	t->done(t, t->arg);
+	/* t may be free at this point */
+}
+
+int
+iapp_task_init(struct iapp_task *t, struct fde_head *fh,
+    iapp_task_run_cb *run, iapp_task_done_cb *done, void *arg)
+{
+
+	bzero(t, sizeof(*t));
+
+	t->ev_done = fde_create(fh, -1, FDE_T_CALLBACK, 0,
+	    iapp_task_done_fde_cb, t);
+	if (t->ev_done == NULL)
+		return (-1);
+
+	t->fh = fh;
+	t->run = run;
+	t->done = done;
+	t->arg = arg;
+
+	return (0);
+}
+
+void
+iapp_task_cleanup(struct iapp_task *t)
+{
+
+	if (t->is_busy) {
+		fprintf(stderr, "%s: %p: task is still busy!\n",
+		    __func__,
+		    t);
+	}
+
+	if (t->ev_done != NULL)
+		fde_free(t->fh, t->ev_done);
+	t->ev_done = NULL;
+}
+
+int
+iapp_taskq_submit(struct iapp_taskq *tq, struct iapp_task *t)
+{
+
+	if (t->is_busy)
+		return (-1);
+
+	t->is_busy = 1;
+	t->retval = 0;
+	t->xerrno = 0;
+
+	pthread_mutex_lock(&tq->l);
+	t->is_queued = 1;
+	TAILQ_INSERT_TAIL(&tq->t_head, t, node);
+	pthread_cond_signal(&tq->cv);
+	pthread_mutex_unlock(&tq->l);
+
+	return (0);
+}
+
+int
+iapp_taskq_cancel(struct iapp_taskq *tq, struct iapp_task *t)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&tq->l);
+	if (t->is_queued) {
+		TAILQ_REMOVE(&tq->t_head, t, node);
+		t->is_queued = 0;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&tq->l);
+
+	if (ret == 1)
+		t->is_busy = 0;
+
+	return (ret);
+}
@@ -0,0 +1,121 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	__LIBIAPP_TASKQ_H__
+#define	__LIBIAPP_TASKQ_H__
+
+/*
+ * A pool of helper threads for doing blocking work (disk IO,
+ * name lookups, etc) on behalf of fde_head event loops.
+ *
+ * A task is submitted from the owning thread.  The run method is
+ * called from a helper thread; once it returns the task's completion
+ * callback is scheduled back on the owning fde_head via
+ * fde_add_remote().  So the owner never blocks and never sees the
+ * completion from the wrong thread.
+ *
+ * A task can only be queued once at a time.  The task must stay
+ * valid until its completion callback has run (or it was successfully
+ * cancelled.)
+ */
+
+struct iapp_taskq;
+struct iapp_task;
+
+typedef void	iapp_task_run_cb(struct iapp_task *t, void *arg);
+typedef void	iapp_task_done_cb(struct iapp_task *t, void *arg);
+
+struct iapp_task {
+	TAILQ_ENTRY(iapp_task) node;
+	struct fde_head *fh;		/* owner to complete into */
+	struct fde *ev_done;		/* FDE_T_CALLBACK run on completion */
+	iapp_task_run_cb *run;		/* called in a helper thread */
+	iapp_task_done_cb *done;	/* called in the owner thread */
+	void *arg;
+	int is_queued;			/* on the pending queue; taskq lock */
+	int is_busy;			/* submitted, not completed; owner */
+
+	/* Results, filled in by the run method */
+	ssize_t retval;
+	int xerrno;
+};
+
+struct iapp_taskq {
+	pthread_mutex_t l;
+	pthread_cond_t cv;
+	TAILQ_HEAD(, iapp_task) t_head;
+	int is_shutdown;
+	int n_threads;
+	pthread_t *threads;
+};
+
+/*
+ * Create a task queue with the given number of helper threads.
+ */
+extern	struct iapp_taskq * iapp_taskq_create(int nthreads);
+
+/*
+ * Stop the helper threads and free the task queue.
+ * Any pending tasks are not run.
+ */
+extern	void iapp_taskq_free(struct iapp_taskq *tq);
+
+/*
+ * Set the size of the library default task queue.  This must be
+ * called before the first call to iapp_taskq_default().
+ */
+extern	void iapp_taskq_init(int nthreads);
+
+/*
+ * Return the library default task queue, creating it if required.
+ */
+extern	struct iapp_taskq * iapp_taskq_default(void);
+
+/*
+ * Setup a task.  'done' is called in the thread owning 'fh' once the
+ * task has been run.
+ */
+extern	int iapp_task_init(struct iapp_task *t, struct fde_head *fh,
+	    iapp_task_run_cb *run, iapp_task_done_cb *done, void *arg);
+
+/*
+ * Free the completion state for a task.  The task must not be
+ * queued or running.
+ */
+extern	void iapp_task_cleanup(struct iapp_task *t);
+
+/*
+ * Queue a task to be run.  Returns -1 if the task is already queued.
+ */
+extern	int iapp_taskq_submit(struct iapp_taskq *tq, struct iapp_task *t);
+
+/*
+ * Attempt to cancel a queued task.  Returns 1 if the task was removed
+ * before it was run (and thus the completion won't be called), 0 if
+ * it's already running or completed.
+ */
+extern	int iapp_taskq_cancel(struct iapp_taskq *tq, struct iapp_task *t);
+
+#endif	/* __LIBIAPP_TASKQ_H__ */
@@ -0,0 +1,176 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+
+#include "shm_alloc.h"
+#include "vring.h"
+
+/*
+ * Map 'size' bytes of fd at 'offset' twice, back to back.
+ *
+ * Reserve twice the space first so nothing else can land in the
+ * second half, then map the same pages over each half.
+ */
+static char *
+iapp_vring_map(int fd, off_t offset, size_t size)
+{
+	char *m;
+
+	m = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (m == MAP_FAILED) {
+		warn("%s: mmap (reserve)", __func__);
+		return (NULL);
+	}
+
+	if (mmap(m, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+	    fd, offset) == MAP_FAILED ||
+	    mmap(m + size, size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+		warn("%s: mmap", __func__);
+		(void) munmap(m, size * 2);
+		return (NULL);
+	}
+
+	return (m);
+}
+
+static size_t
+iapp_vring_roundup(size_t size)
+{
+	size_t pg;
+
+	pg = getpagesize();
+	return ((size + pg - 1) / pg * pg);
+}
+
+/*
+ * Create a ring backed by its own anonymous shared memory object.
+ * The size is rounded up to a page.
+ */
+struct iapp_vring *
+iapp_vring_create(size_t size)
+{
+	struct iapp_vring *vr;
+
+	vr = calloc(1, sizeof(*vr));
+	if (vr == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	vr->size = iapp_vring_roundup(size);
+
+#ifdef	SHM_ANON
+	vr->fd = shm_open(SHM_ANON, O_CREAT | O_RDWR, 0600);
+#else
+	vr->fd = memfd_create("iapp_vring", MFD_CLOEXEC);
+#endif
+	if (vr->fd < 0) {
+		warn("%s: shm_open", __func__);
+		goto cleanup;
+	}
+
+	if (ftruncate(vr->fd, vr->size) < 0) {
+		warn("%s: ftruncate", __func__);
+		goto cleanup;
+	}
+
+	vr->base = iapp_vring_map(vr->fd, 0, vr->size);
+	if (vr->base == NULL)
+		goto cleanup;
+
+	return (vr);
+
+cleanup:
+	if (vr->fd != -1)
+		close(vr->fd);
+	free(vr);
+	return (NULL);
+}
+
+/*
+ * Create a ring out of a shared memory slab allocation, so large
+ * numbers of rings share a handful of shm objects.
+ *
+ * The mapping needs a page aligned offset, so every allocation
+ * made from 'sm' must be a multiple of the page size.
+ */
+struct iapp_vring *
+iapp_vring_create_shm(struct shm_alloc_state *sm, size_t size)
+{
+	struct iapp_vring *vr;
+
+	vr = calloc(1, sizeof(*vr));
+	if (vr == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	vr->fd = -1;
+	vr->size = iapp_vring_roundup(size);
+
+	vr->sa = shm_alloc_alloc(sm, vr->size);
+	if (vr->sa == NULL)
+		goto cleanup;
+
+	if (vr->sa->sha_offset % getpagesize() != 0) {
+		warnx("%s: allocation at %lld isn't page aligned", __func__,
+		    (long long) vr->sa->sha_offset);
+		goto cleanup;
+	}
+
+	vr->base = iapp_vring_map(vr->sa->sha_fd, vr->sa->sha_offset,
+	    vr->size);
+	if (vr->base == NULL)
+		goto cleanup;
+
+	return (vr);
+
+cleanup:
+	if (vr->sa != NULL)
+		(void) shm_alloc_free(vr->sa);
+	free(vr);
+	return (NULL);
+}
+
+void
+iapp_vring_free(struct iapp_vring *vr)
+{
+
+	(void) munmap(vr->base, vr->size * 2);
+	if (vr->sa != NULL)
+		(void) shm_alloc_free(vr->sa);
+	if (vr->fd != -1)
+		close(vr->fd);
+	free(vr);
+}
@@ -0,0 +1,92 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef	__LIBIAPP_VRING_H__
+#define	__LIBIAPP_VRING_H__
+
+/*
+ * A byte ring whose pages are mapped twice, back to back.
+ *
+ * Anything readable (and anything writable) is therefore one
+ * virtually contiguous region, even when it wraps the end of the
+ * ring, so consumers never have to copy or compact.  The size is
+ * always a multiple of the page size.
+ */
+
+struct shm_alloc_state;
+struct shm_alloc_allocation;
+
+struct iapp_vring {
+	char *base;		/* 2 * size of address space */
+	size_t size;
+	size_t head;		/* offset of the first readable byte */
+	size_t fill;		/* readable bytes */
+
+	int fd;			/* backing fd if we own it, else -1 */
+	struct shm_alloc_allocation *sa;	/* or the slab allocation */
+};
+
+extern	struct iapp_vring * iapp_vring_create(size_t size);
+extern	struct iapp_vring * iapp_vring_create_shm(struct shm_alloc_state *sm,
+	    size_t size);
+extern	void iapp_vring_free(struct iapp_vring *vr);
+
+/* Readable data: always contiguous */
+static inline char *
+iapp_vring_read_ptr(struct iapp_vring *vr, size_t *len)
+{
+
+	*len = vr->fill;
+	return (vr->base + vr->head);
+}
+
+/* Free space to write (or comm_read()) into: always contiguous */
+static inline char *
+iapp_vring_write_ptr(struct iapp_vring *vr, size_t *len)
+{
+
+	*len = vr->size - vr->fill;
+	return (vr->base + vr->head + vr->fill);
+}
+
+/* Commit 'len' bytes written at the write pointer */
+static inline void
+iapp_vring_produce(struct iapp_vring *vr, size_t len)
+{
+
+	vr->fill += len;
+}
+
+/* Release 'len' bytes from the read pointer */
+static inline void
+iapp_vring_consume(struct iapp_vring *vr, size_t len)
+{
+
+	vr->fill -= len;
+	vr->head += len;
+	if (vr->head >= vr->size)
+		vr->head -= vr->size;
+}
+
+#endif	/* __LIBIAPP_VRING_H__ */
@@ -0,0 +1,192 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * shm_alloc throughput with threads sharing one allocator.
+ *
+ * Each thread keeps a window of live allocations of size=<n> bytes,
+ * freeing the oldest and allocating a new one, for seconds=<n>.
+ * remote=1 hands every allocation to the next thread to free, to
+ * exercise frees on a thread other than the allocating one.
+ * cache=0 turns the per-thread magazines off.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include "shm_alloc.h"
+
+#define	BENCH_WINDOW		64
+#define	BENCH_MAX_THREADS	256
+#define	BENCH_SLAB_SIZE		(16 * 1024 * 1024)
+
+struct bench;
+
+struct bench_thr {
+	int id;
+	struct bench *b;
+	pthread_t thr;
+	uint64_t n_ops;
+	struct shm_alloc_allocation *win[BENCH_WINDOW];
+
+	/* remote=1: single slot mailbox from the previous thread */
+	_Atomic(struct shm_alloc_allocation *) inbox;
+};
+
+struct bench {
+	int nthreads;
+	size_t size;
+	int seconds;
+	int is_remote;
+	volatile int is_done;
+	struct shm_alloc_state sm;
+	struct bench_thr thr[BENCH_MAX_THREADS];
+};
+
+static void *
+bench_thread(void *arg)
+{
+	struct bench_thr *t = arg;
+	struct bench *b = t->b;
+	struct bench_thr *next = &b->thr[(t->id + 1) % b->nthreads];
+	struct shm_alloc_allocation *sa;
+	int i = 0;
+
+	while (b->is_done == 0) {
+		/* Free what the previous thread passed along */
+		sa = atomic_exchange(&t->inbox, NULL);
+		if (sa != NULL)
+			(void) shm_alloc_free(sa);
+
+		sa = t->win[i];
+		if (sa != NULL) {
+			if (b->is_remote == 0)
+				(void) shm_alloc_free(sa);
+			else {
+				sa = atomic_exchange(&next->inbox, sa);
+				if (sa != NULL)
+					(void) shm_alloc_free(sa);
+			}
+		}
+		t->win[i] = shm_alloc_alloc(&b->sm, b->size);
+		if (t->win[i] == NULL)
+			errx(1, "%s: allocation failed", __func__);
+		t->win[i]->sha_ptr[0] = i;
+		i = (i + 1) % BENCH_WINDOW;
+		t->n_ops++;
+	}
+
+	for (i = 0; i < BENCH_WINDOW; i++)
+		if (t->win[i] != NULL)
+			(void) shm_alloc_free(t->win[i]);
+	shm_alloc_cache_flush(&b->sm);
+	return (NULL);
+}
+
+static void
+usage(const char *progname)
+{
+
+	printf("Usage: %s [threads=<n>] [size=<n>] [seconds=<n>] "
+	    "[remote=0|1] [cache=0|1]\n",
+	    progname);
+	exit(127);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct bench *b;
+	uint64_t n_ops = 0;
+	int i, do_cache = 1;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		err(1, "calloc");
+	b->nthreads = 8;
+	b->size = 2048;
+	b->seconds = 5;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "threads=", 8) == 0)
+			b->nthreads = atoi(argv[i] + 8);
+		else if (strncmp(argv[i], "size=", 5) == 0)
+			b->size = strtoul(argv[i] + 5, NULL, 0);
+		else if (strncmp(argv[i], "seconds=", 8) == 0)
+			b->seconds = atoi(argv[i] + 8);
+		else if (strncmp(argv[i], "remote=", 7) == 0)
+			b->is_remote = atoi(argv[i] + 7);
+		else if (strncmp(argv[i], "cache=", 6) == 0)
+			do_cache = atoi(argv[i] + 6);
+		else
+			usage(argv[0]);
+	}
+	if (b->nthreads <= 0 || b->nthreads > BENCH_MAX_THREADS ||
+	    b->size == 0 || b->seconds <= 0)
+		usage(argv[0]);
+
+	/* Room for every window and every magazine, twice over */
+	shm_alloc_init(&b->sm, (size_t) 2 * b->nthreads *
+	    (BENCH_WINDOW + 4 * SHM_ALLOC_MAG_ROUNDS) * b->size +
+	    (size_t) SHM_ALLOC_DEPOT_MAX * SHM_ALLOC_MAG_ROUNDS * b->size +
+	    BENCH_SLAB_SIZE, BENCH_SLAB_SIZE, 0);
+	b->sm.do_cache = do_cache;
+
+	for (i = 0; i < b->nthreads; i++) {
+		b->thr[i].id = i;
+		b->thr[i].b = b;
+		if (pthread_create(&b->thr[i].thr, NULL, bench_thread,
+		    &b->thr[i]) != 0)
+			err(1, "pthread_create");
+	}
+
+	sleep(b->seconds);
+	b->is_done = 1;
+	for (i = 0; i < b->nthreads; i++) {
+		(void) pthread_join(b->thr[i].thr, NULL);
+		n_ops += b->thr[i].n_ops;
+	}
+
+	printf("threads=%d size=%zu remote=%d cache=%d: %.2f Mops/sec "
+	    "(%.2f per thread)\n",
+	    b->nthreads, b->size, b->is_remote, do_cache,
+	    (double) n_ops / b->seconds / 1e6,
+	    (double) n_ops / b->seconds / 1e6 / b->nthreads);
+	printf("refills=%llu spills=%llu depot swaps=%llu\n",
+	    (unsigned long long) b->sm.stats.n_refill,
+	    (unsigned long long) b->sm.stats.n_spill,
+	    (unsigned long long) b->sm.stats.n_depot);
+
+	exit(0);
+}
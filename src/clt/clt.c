@@ -49,6 +49,9 @@
 #include "shm_alloc.h"
 #include "netbuf.h"
 #include "comm.h"
+#include "connpool.h"
+#include "taskq.h"
+#include "resolver.h"
 
 struct clt_app;
 struct conn;
@@ -73,6 +76,8 @@ struct conn {
 	conn_state_t state;
 	uint64_t total_read, total_written;
 	uint64_t write_close_thr;
+	struct iapp_pconn *pc;		/* checked out of the pool */
+	struct timeval t_open;
 	struct {
 		char *buf;
 		int size;
@@ -88,7 +93,7 @@ struct conn {
 
 struct clt_app {
 	pthread_t thr_id;
-	struct shm_alloc_state sm;
+	struct shm_alloc_state *sm;	/* shared by all threads */
 	int app_id;
 	int max_io_size;
 	int nconns;
@@ -99,9 +104,18 @@ struct clt_app {
 	struct fde *ev_newconn;
 	char *remote_host;
 	char *remote_port;
+	struct iapp_resolver *rs;
+	int is_resolving;
+	int addr_idx;		/* round robin over the addresses */
+	uint64_t conn_bytes;	/* bytes to write per connection; 0 - forever */
+	struct iapp_connpool *pool;	/* NULL - connect every time */
+	int use_tfo;		/* send the first buffer in the SYN */
 	uint64_t total_read, total_written;
 	uint64_t total_opened;
+	uint64_t total_reused;
+	uint64_t total_tfo;	/* connects which carried data */
 	uint64_t total_closed;
+	uint64_t total_setup_usec;
 	TAILQ_HEAD(, conn) conn_list;
 };
 
@@ -147,6 +161,20 @@ conn_close(struct conn *c)
 #endif
 
 	c->state = CONN_STATE_CLOSING;
+	c->parent->total_closed++;
+
+	/*
+	 * A pooled comm's close callback belongs to the pool, and a
+	 * failed checkout never had a comm; tidy up directly.
+	 */
+	if (c->pc != NULL || c->comm == NULL) {
+		if (c->pc != NULL)
+			iapp_connpool_discard(c->pc);
+		c->pc = NULL;
+		c->comm = NULL;
+		fde_add(c->parent->h, c->ev_cleanup);
+		return;
+	}
 
 	/* Call comm_close(); when IO completes we'll get notified */
 	/*
@@ -156,13 +184,31 @@ conn_close(struct conn *c)
 	comm_close(c->comm);
 	c->comm = NULL;
 
-	c->parent->total_closed++;
-
 	/*
 	 * The rest of close will occur once the close handler is called.
 	 */
 }
 
+/*
+ * Done with a pooled connection; hand the comm back to the pool
+ * for the next conn to the same server and free ourselves.
+ */
+static void
+conn_release(struct conn *c)
+{
+
+	c->state = CONN_STATE_CLOSING;
+	c->parent->total_closed++;
+
+	/* There's always a read outstanding; the write just finished */
+	comm_read_cancel(c->comm);
+	iapp_connpool_put(c->pc);
+	c->pc = NULL;
+	c->comm = NULL;
+
+	fde_add(c->parent->h, c->ev_cleanup);
+}
+
 static void
 conn_write_cb(int fd, struct fde_comm *fc, void *arg,
     fde_comm_cb_status status, int nwritten)
@@ -195,7 +241,10 @@ conn_write_cb(int fd, struct fde_comm *fc, void *arg,
 	 * If the threshold value is set, bail out if we reach it.
 	 */
 	if (c->write_close_thr != 0 && c->total_written > c->write_close_thr) {
-		conn_close(c);
+		if (c->pc != NULL)
+			conn_release(c);
+		else
+			conn_close(c);
 		return;
 	}
 
@@ -256,6 +305,8 @@ conn_close_cb(int fd, struct fde_comm *fc, void *arg)
 	fde_add(c->parent->h, c->ev_cleanup);
 }
 
+static void conn_start(struct conn *c);
+
 static void
 conn_connect_cb(int fd, struct fde_comm *fc, void *arg,
     fde_comm_cb_status status, int retval)
@@ -278,6 +329,24 @@ conn_connect_cb(int fd, struct fde_comm *fc, void *arg,
 		return;
 	}
 
+	/* With TCP Fast Open, retval is what went out with the SYN */
+	if (retval > 0) {
+		c->total_written += retval;
+		c->parent->total_written += retval;
+		c->parent->total_tfo++;
+	}
+
+	conn_start(c);
+}
+
+/*
+ * The connection is up, either freshly connected or out of the pool.
+ */
+static void
+conn_start(struct conn *c)
+{
+	struct timeval tv;
+
 	/* Success? Start writing data */
 	c->state = CONN_STATE_RUNNING;
 
@@ -290,13 +359,42 @@ conn_connect_cb(int fd, struct fde_comm *fc, void *arg,
 
 	/* Total successfully opened */
 	c->parent->total_opened++;
+	(void) gettimeofday(&tv, NULL);
+	c->parent->total_setup_usec +=
+	    (tv.tv_sec - c->t_open.tv_sec) * 1000000 +
+	    (tv.tv_usec - c->t_open.tv_usec);
 
 	comm_read(c->comm, c->r.buf, c->r.size, conn_read_cb, c);
 //	comm_write(c->comm, c->w.nb, 0, iapp_netbuf_size(c->w.nb), conn_write_cb, c);
+
+	/* Writing a fixed amount per connection; get going */
+	if (c->write_close_thr != 0)
+		comm_write(c->comm, c->w.nb, 0, iapp_netbuf_size(c->w.nb),
+		    conn_write_cb, c);
 }
 
-struct conn *
-conn_new(struct clt_app *r, int type, conn_owner_update_cb *cb, void *cbdata)
+static void
+conn_pool_cb(struct iapp_connpool *cp, void *arg, struct iapp_pconn *pc,
+    fde_comm_cb_status status)
+{
+	struct conn *c = arg;
+
+	if (status != FDE_COMM_CB_COMPLETED) {
+		c->state = CONN_STATE_ERROR;
+		c->cb.cb(c, c->cb.cbdata, CONN_STATE_ERROR);
+		return;
+	}
+
+	c->pc = pc;
+	c->comm = pc->fc;
+	c->fd = pc->fc->fd;
+	if (pc->is_reused)
+		c->parent->total_reused++;
+	conn_start(c);
+}
+
+static struct conn *
+conn_alloc(struct clt_app *r, conn_owner_update_cb *cb, void *cbdata)
 {
 	struct conn *c;
 	int i;
@@ -316,7 +414,7 @@ conn_new(struct clt_app *r, int type, conn_owner_update_cb *cb, void *cbdata)
 		return (NULL);
 	}
 
-	c->w.nb = iapp_netbuf_alloc(&r->sm, NB_ALLOC_MALLOC, r->max_io_size);
+	c->w.nb = iapp_netbuf_alloc(r->sm, NB_ALLOC_MALLOC, r->max_io_size);
 	if (c->w.nb == NULL) {
 		warn("%s: iapp_netbuf_alloc", __func__);
 		free(c->r.buf);
@@ -330,21 +428,10 @@ conn_new(struct clt_app *r, int type, conn_owner_update_cb *cb, void *cbdata)
 		buf[i] = (i % 10) + '0';
 	}
 
-	/* Create an 'type' socket */
-	/* XXX should be a method */
-	c->fd = socket(type, SOCK_STREAM, 0);
-	if (c->fd < 0) {
-		warn("%s: socket", __func__);
-		free(c);
-		free(c->r.buf);
-		iapp_netbuf_free(c->w.nb);
-		return (NULL);
-	}
+	c->fd = -1;
 	c->parent = r;
-	c->comm = comm_create(c->fd, r->h, conn_close_cb, c);
 	c->ev_cleanup = fde_create(r->h, -1, FDE_T_CALLBACK, 0,
 	    conn_ev_cleanup_cb, c);
-	comm_set_nonblocking(c->comm, 1);
 
 	c->cb.cb = cb;
 	c->cb.cbdata = cbdata;
@@ -353,12 +440,41 @@ conn_new(struct clt_app *r, int type, conn_owner_update_cb *cb, void *cbdata)
 	/* If there's a threshold for closing; set it */
 	c->write_close_thr = random() % 10485760;
 #endif
+	c->write_close_thr = r->conn_bytes;
+	(void) gettimeofday(&c->t_open, NULL);
 
 	TAILQ_INSERT_TAIL(&r->conn_list, c, node);
 
 	return (c);
 }
 
+struct conn *
+conn_new(struct clt_app *r, int type, conn_owner_update_cb *cb, void *cbdata)
+{
+	struct conn *c;
+
+	c = conn_alloc(r, cb, cbdata);
+	if (c == NULL)
+		return (NULL);
+
+	/* Create an 'type' socket */
+	/* XXX should be a method */
+	c->fd = socket(type, SOCK_STREAM, 0);
+	if (c->fd < 0) {
+		warn("%s: socket", __func__);
+		TAILQ_REMOVE(&r->conn_list, c, node);
+		fde_free(r->h, c->ev_cleanup);
+		free(c->r.buf);
+		iapp_netbuf_free(c->w.nb);
+		free(c);
+		return (NULL);
+	}
+	c->comm = comm_create(c->fd, r->h, conn_close_cb, c);
+	comm_set_nonblocking(c->comm, 1);
+
+	return (c);
+}
+
 /*
  * Owner related routines
  */
@@ -395,57 +511,79 @@ thrclt_conn_update_cb(struct conn *c, void *arg, conn_state_t newstate)
 }
 
 #define	MAX_ADDRINFO	8
+#define	CLT_POOL_IDLE_MS	30000
+#define	CLT_RESOLVE_TTL_MS	60000
+#define	CLT_RESOLVE_NEG_TTL_MS	5000
+
+static void
+thrclt_resolve_cb(struct iapp_resolver *rs, void *arg, int error,
+    const struct iapp_resolver_addr *addrs, int naddrs)
+{
+	struct clt_app *r = arg;
+
+	r->is_resolving = 0;
+	if (error != 0)
+		fprintf(stderr, "%s: [%d]: %s:%s: %s\n", __func__, r->app_id,
+		    r->remote_host, r->remote_port, gai_strerror(error));
+
+	/* The next new connection pass picks it up from the cache */
+}
 
 int
 thrclt_open_new_conn(struct clt_app *r)
 {
 	struct conn *c;
-	struct sockaddr_in sin;
-	socklen_t slen;
-	struct addrinfo *ai;
-	struct addrinfo ai_hints;
-	int rr;
+	struct iapp_resolver_addr ra;
 
 	/*
-	 * Do a lookup!
+	 * Only ever use a cached answer here; if there isn't one,
+	 * ask for it and try again on the next pass.
 	 */
-	bzero(&ai_hints, sizeof(ai_hints));
-	ai_hints.ai_family = PF_UNSPEC;
-	ai_hints.ai_socktype = 0;
-	ai_hints.ai_protocol = IPPROTO_TCP;
-	ai_hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
-
-	rr = getaddrinfo(r->remote_host, r->remote_port, &ai_hints, &ai);
-	if (rr != 0) {
-		warn("%s: getaddrinfo", __func__);
+	if (iapp_resolver_get_cached(r->rs, r->remote_host, r->remote_port,
+	    r->addr_idx++, &ra) < 0) {
+		if (r->is_resolving == 0 &&
+		    iapp_resolver_lookup(r->rs, r->remote_host,
+		    r->remote_port, thrclt_resolve_cb, r) == 0)
+			r->is_resolving = 1;
 		return (-1);
 	}
 
 	/*
-	 * Next, extract out the first entry.
+	 * Pooled? Check out a connection; it's either handed straight
+	 * over from the idle list or connected on our behalf.
 	 */
-	if (ai == NULL) {
-		fprintf(stderr, "%s: ai=NULL\n", __func__);
-		return -1;
+	if (r->pool != NULL) {
+		c = conn_alloc(r, thrclt_conn_update_cb, r);
+		if (c == NULL)
+			return (-1);
+		c->state = CONN_STATE_CONNECTING;
+		r->num_clients++;
+		if (iapp_connpool_get(r->pool, (struct sockaddr *) &ra.sa,
+		    ra.slen, conn_pool_cb, c) < 0)
+			conn_close(c);
+		return (0);
 	}
+
 	/*
 	 * For now, let's create one client object and kick-start it.
 	 * XXX shuld also pass in res->ai_socktype and res->ai_protocol
 	 */
-	c = conn_new(r, ai->ai_family, thrclt_conn_update_cb, r);
-	if (c == NULL) {
-		freeaddrinfo(ai);
+	c = conn_new(r, ra.sa.ss_family, thrclt_conn_update_cb, r);
+	if (c == NULL)
 		return (-1);
-	}
 
 	/* Start connecting */
 	c->state = CONN_STATE_CONNECTING;
-	(void) comm_connect(c->comm, ai->ai_addr, ai->ai_addrlen,
-	    conn_connect_cb, c);
+	if (r->use_tfo)
+		(void) comm_connect_data(c->comm, (struct sockaddr *) &ra.sa,
+		    ra.slen, iapp_netbuf_buf(c->w.nb),
+		    iapp_netbuf_size(c->w.nb), conn_connect_cb, c);
+	else
+		(void) comm_connect(c->comm, (struct sockaddr *) &ra.sa,
+		    ra.slen, conn_connect_cb, c);
 
 	r->num_clients++;
 
-	freeaddrinfo(ai);
 	return (0);
 }
 
@@ -487,20 +625,40 @@ thrclt_stat_print(int fd, struct fde *f, void *arg, fde_cb_status s)
 	struct clt_app *r = arg;
 	struct timeval tv;
 
-	fprintf(stderr, "%s: [%d]: %d clients; new=%lld, closed=%lld, TX=%lld bytes, RX=%lld bytes\n",
+	fprintf(stderr, "%s: [%d]: %d clients; new=%lld, reused=%lld, tfo=%lld, closed=%lld, setup=%lld us, TX=%lld bytes, RX=%lld bytes\n",
 	    __func__,
 	    r->app_id,
 	    r->num_clients,
 	    (unsigned long long) r->total_opened,
+	    (unsigned long long) r->total_reused,
+	    (unsigned long long) r->total_tfo,
 	    (unsigned long long) r->total_closed,
+	    (unsigned long long) (r->total_opened == 0 ? 0 :
+	      r->total_setup_usec / r->total_opened),
 	    (unsigned long long) r->total_written,
 	    (unsigned long long) r->total_read);
 
+	if (r->pool != NULL) {
+		fprintf(stderr, "%s: [%d]: pool: idle=%d, connect=%llu, reuse=%llu, unhealthy=%llu, expired=%llu, evicted=%llu\n",
+		    __func__,
+		    r->app_id,
+		    r->pool->n_idle,
+		    (unsigned long long) r->pool->stats.n_connect,
+		    (unsigned long long) r->pool->stats.n_reuse,
+		    (unsigned long long) r->pool->stats.n_unhealthy,
+		    (unsigned long long) r->pool->stats.n_expired,
+		    (unsigned long long) r->pool->stats.n_evicted);
+		bzero(&r->pool->stats, sizeof(r->pool->stats));
+	}
+
 	/* Blank this out, so we get per-second stats */
 	r->total_read = 0;
 	r->total_written = 0;
 	r->total_opened = 0;
+	r->total_reused = 0;
+	r->total_tfo = 0;
 	r->total_closed = 0;
+	r->total_setup_usec = 0;
 
 	/*
 	 * Schedule for another second from now.
@@ -520,6 +678,11 @@ thrclt_new(void *arg)
 
 	fprintf(stderr, "%s: %p: created\n", __func__, r);
 
+	r->rs = iapp_resolver_create(r->h, NULL, SOCK_STREAM,
+	    CLT_RESOLVE_TTL_MS, CLT_RESOLVE_NEG_TTL_MS, 16);
+	if (r->rs == NULL)
+		return (NULL);
+
 	r->ev_newconn = fde_create(r->h, -1, FDE_T_TIMER, 0,
 	    thrclt_ev_newconn_cb, r);
 	r->ev_stats = fde_create(r->h, -1, FDE_T_TIMER, 0,
@@ -552,7 +715,7 @@ null_signal_hdl(int sig)
 static void
 usage(const char *progname)
 {
-	printf("Usage: %s <numthreads> <numconns> <connrate> <bufsize> <remote IPv4 address> <port>\n",
+	printf("Usage: %s <numthreads> <numconns> <connrate> <bufsize> <remote host> <port> [<bytes per conn> [<use pool> [<use tfo>]]]\n",
 	    progname);
 	exit(127);
 }
@@ -560,9 +723,12 @@ usage(const char *progname)
 int
 main(int argc, const char *argv[])
 {
+	struct shm_alloc_state sm;
 	struct clt_app *rp, *r;
 	int i;
 	int nthreads, connrate, bufsize, nconns;
+	int use_pool = 0, use_tfo = 0;
+	uint64_t conn_bytes = 0;
 	char *rem_ip, *rem_port;
 
 	/* XXX validate command line parameters */
@@ -575,6 +741,12 @@ main(int argc, const char *argv[])
 	bufsize = atoi(argv[4]);
 	rem_ip = strdup(argv[5]);
 	rem_port = strdup(argv[6]);
+	if (argc > 7)
+		conn_bytes = strtoull(argv[7], NULL, 0);
+	if (argc > 8)
+		use_pool = atoi(argv[8]);
+	if (argc > 9)
+		use_tfo = atoi(argv[9]);
 
 	/* XXX these should be done as part of a global setup */
 	iapp_netbuf_init();
@@ -586,6 +758,14 @@ main(int argc, const char *argv[])
 
 	signal(SIGPIPE, null_signal_hdl);
 
+	/*
+	 * One allocator for everyone; the per-thread magazines keep
+	 * the threads off its lock.  Twice over, for size class
+	 * rounding.
+	 */
+	shm_alloc_init(&sm, (size_t) 2*nthreads*nconns*bufsize,
+	    (size_t) nconns*bufsize, 0);
+
 	/* Create listen threads */
 	for (i = 0; i < nthreads; i++) {
 		r = &rp[i];
@@ -596,7 +776,15 @@ main(int argc, const char *argv[])
 		r->max_io_size = bufsize;
 		r->nconns = nconns;
 		r->connrate = connrate;
-		shm_alloc_init(&r->sm, nconns*bufsize, nconns*bufsize, 0);
+		r->conn_bytes = conn_bytes;
+		r->use_tfo = use_tfo;
+		if (use_pool) {
+			r->pool = iapp_connpool_create(r->h, nconns, nconns,
+			    CLT_POOL_IDLE_MS);
+			if (r->pool == NULL)
+				exit(1);
+		}
+		r->sm = &sm;
 		TAILQ_INIT(&r->conn_list);
 		if (pthread_create(&r->thr_id, NULL, thrclt_new, r) != 0)
 			perror("pthread_create");
@@ -0,0 +1,347 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Multi-process server: a front process accepts TCP connections and
+ * passes them over AF_UNIX socketpairs (SCM_RIGHTS) to worker
+ * processes, which sink the data.  Connections accepted during one
+ * event loop pass are passed in as few messages as possible; the
+ * front prints the descriptors per message once a second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/event.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "fde.h"
+#include "comm.h"
+#include "fd_util.h"
+
+#define	FDSRV_MAX_PROCS		64
+#define	FDSRV_IO_SIZE		16384
+#define	FDSRV_SEND_QLEN		4096
+
+struct front {
+	struct fde_head *h;
+	struct fde_comm *fc_listen;
+	struct fde_comm *fc_worker[FDSRV_MAX_PROCS];
+	int num_procs;
+	int next;
+	struct fde *ev_stats;
+
+	uint64_t n_accepted;
+	uint64_t n_passed;
+	uint64_t n_msgs;
+	uint64_t n_dropped;
+};
+
+struct worker {
+	int id;
+	struct fde_head *h;
+	struct fde_comm *fc_ctl;
+	struct fde *ev_stats;
+
+	uint64_t num_clients;
+	uint64_t n_received;
+	uint64_t n_msgs;
+	uint64_t total_read;
+};
+
+struct sink {
+	struct worker *w;
+	struct fde_comm *fc;
+	char buf[FDSRV_IO_SIZE];
+};
+
+static void
+stats_rearm(struct fde_head *h, struct fde *f)
+{
+	struct timeval tv;
+
+	(void) gettimeofday(&tv, NULL);
+	tv.tv_sec += 1;
+	fde_add_timeout(h, f, &tv);
+}
+
+/* Worker */
+
+static void
+sink_close_cb(int fd, struct fde_comm *fc, void *arg)
+{
+	struct sink *s = arg;
+
+	s->w->num_clients--;
+	free(s);
+}
+
+static void
+sink_read_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval)
+{
+	struct sink *s = arg;
+
+	if (status != FDE_COMM_CB_COMPLETED || retval <= 0) {
+		comm_close(fc);
+		return;
+	}
+
+	s->w->total_read += retval;
+	if (comm_read(fc, s->buf, sizeof(s->buf), sink_read_cb, s) < 0)
+		comm_close(fc);
+}
+
+static void
+worker_fd_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, const int *fds, int nfds, int xerrno)
+{
+	struct worker *w = arg;
+	struct sink *s;
+	int i;
+
+	if (status != FDE_COMM_CB_COMPLETED) {
+		if (status == FDE_COMM_CB_ERROR && xerrno == EMSGSIZE)
+			return;
+		/* Front has gone away */
+		fprintf(stderr, "%s: [%d]: control socket status=%d, errno=%d\n",
+		    __func__, w->id, status, xerrno);
+		exit(0);
+	}
+
+	w->n_msgs++;
+	for (i = 0; i < nfds; i++) {
+		w->n_received++;
+		s = calloc(1, sizeof(*s));
+		if (s == NULL) {
+			warn("%s: calloc", __func__);
+			close(fds[i]);
+			continue;
+		}
+		s->w = w;
+		s->fc = comm_create(fds[i], w->h, sink_close_cb, s);
+		if (s->fc == NULL) {
+			close(fds[i]);
+			free(s);
+			continue;
+		}
+		w->num_clients++;
+		if (comm_read(s->fc, s->buf, sizeof(s->buf), sink_read_cb,
+		    s) < 0)
+			comm_close(s->fc);
+	}
+}
+
+static void
+worker_stat_print(int fd, struct fde *f, void *arg, fde_cb_status s)
+{
+	struct worker *w = arg;
+
+	fprintf(stderr, "%s: [%d]: %llu clients; received=%llu in %llu msgs, RX=%llu bytes\n",
+	    __func__,
+	    w->id,
+	    (unsigned long long) w->num_clients,
+	    (unsigned long long) w->n_received,
+	    (unsigned long long) w->n_msgs,
+	    (unsigned long long) w->total_read);
+
+	w->n_received = w->n_msgs = w->total_read = 0;
+	stats_rearm(w->h, w->ev_stats);
+}
+
+static void
+worker_run(int id, int ctlfd)
+{
+	struct worker w;
+	struct timeval tv;
+
+	bzero(&w, sizeof(w));
+	w.id = id;
+
+	/* kqueues aren't inherited; each worker has its own */
+	w.h = fde_ctx_new();
+	if (w.h == NULL)
+		errx(1, "fde_ctx_new failed");
+	w.fc_ctl = comm_create(ctlfd, w.h, NULL, NULL);
+	if (w.fc_ctl == NULL || comm_fdpass_recv(w.fc_ctl, worker_fd_cb,
+	    &w) < 0)
+		errx(1, "couldn't set up control socket");
+
+	w.ev_stats = fde_create(w.h, -1, FDE_T_TIMER, 0, worker_stat_print,
+	    &w);
+	stats_rearm(w.h, w.ev_stats);
+
+	while (1) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		fde_runloop(w.h, &tv);
+	}
+}
+
+/* Front */
+
+static void
+front_sent_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int nfds, int xerrno)
+{
+	struct front *fr = arg;
+
+	if (status != FDE_COMM_CB_COMPLETED) {
+		fr->n_dropped += nfds;
+		return;
+	}
+	fr->n_passed += nfds;
+	fr->n_msgs++;
+}
+
+static void
+front_accept_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status s, int newfd, struct sockaddr *saddr, socklen_t slen,
+    int xerrno)
+{
+	struct front *fr = arg;
+
+	if (s != FDE_COMM_CB_COMPLETED)
+		return;
+
+	fr->n_accepted++;
+
+	/* Round robin; the comm closes our copy once it's sent */
+	if (comm_fdpass_send(fr->fc_worker[fr->next], newfd) < 0) {
+		fr->n_dropped++;
+		close(newfd);
+	}
+	fr->next = (fr->next + 1) % fr->num_procs;
+}
+
+static void
+front_stat_print(int fd, struct fde *f, void *arg, fde_cb_status s)
+{
+	struct front *fr = arg;
+
+	fprintf(stderr, "%s: accepted=%llu, passed=%llu in %llu msgs (%.1f per msg), dropped=%llu\n",
+	    __func__,
+	    (unsigned long long) fr->n_accepted,
+	    (unsigned long long) fr->n_passed,
+	    (unsigned long long) fr->n_msgs,
+	    fr->n_msgs ? (double) fr->n_passed / fr->n_msgs : 0.0,
+	    (unsigned long long) fr->n_dropped);
+
+	fr->n_accepted = fr->n_passed = fr->n_msgs = fr->n_dropped = 0;
+	stats_rearm(fr->h, fr->ev_stats);
+}
+
+static void
+usage(const char *progname)
+{
+
+	printf("Usage: %s [num_procs=<n>] [port=<n>]\n", progname);
+	exit(127);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct front fr;
+	struct timeval tv;
+	int ctl[FDSRV_MAX_PROCS][2];
+	int i, j, port = 1667, lfd;
+
+	bzero(&fr, sizeof(fr));
+	fr.num_procs = 4;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "num_procs=", 10) == 0)
+			fr.num_procs = atoi(argv[i] + 10);
+		else if (strncmp(argv[i], "port=", 5) == 0)
+			port = atoi(argv[i] + 5);
+		else
+			usage(argv[0]);
+	}
+	if (fr.num_procs <= 0 || fr.num_procs > FDSRV_MAX_PROCS)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = comm_fd_create_listen_tcp_v4(port);
+	if (lfd < 0)
+		errx(1, "couldn't create listen socket");
+
+	/* One control socket per worker; message boundaries are kept */
+	for (i = 0; i < fr.num_procs; i++) {
+		if (comm_fd_create_unix_pair(SOCK_SEQPACKET, ctl[i]) < 0)
+			exit(127);
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			close(lfd);
+			for (j = 0; j <= i; j++)
+				close(ctl[j][0]);
+			worker_run(i, ctl[i][1]);
+			exit(0);
+		default:
+			close(ctl[i][1]);
+		}
+	}
+
+	fr.h = fde_ctx_new();
+	if (fr.h == NULL)
+		errx(1, "fde_ctx_new failed");
+
+	for (i = 0; i < fr.num_procs; i++) {
+		fr.fc_worker[i] = comm_create(ctl[i][0], fr.h, NULL, NULL);
+		if (fr.fc_worker[i] == NULL ||
+		    comm_fdpass_send_setup(fr.fc_worker[i], front_sent_cb, &fr,
+		    FDSRV_SEND_QLEN) < 0)
+			errx(1, "couldn't set up worker %d", i);
+	}
+
+	fr.fc_listen = comm_create(lfd, fr.h, NULL, NULL);
+	if (fr.fc_listen == NULL ||
+	    comm_listen(fr.fc_listen, front_accept_cb, &fr) < 0)
+		errx(1, "couldn't listen");
+
+	fr.ev_stats = fde_create(fr.h, -1, FDE_T_TIMER, 0, front_stat_print,
+	    &fr);
+	stats_rearm(fr.h, fr.ev_stats);
+
+	while (1) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		fde_runloop(fr.h, &tv);
+	}
+
+	exit(0);
+}
@@ -0,0 +1,432 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Framing throughput: a writer thread streams small messages down
+ * a socketpair and the reader frames them with comm_frame, printing
+ * messages/sec once a second.
+ *
+ * With respond=<n> every message is answered with an n byte
+ * response, either one comm_write() at a time or coalesced
+ * (coalesce=1), and the write syscalls per response are printed.
+ * tcp=1 uses a loopback TCP connection with TCP_NODELAY instead of
+ * a socketpair, so packets per response can be compared with
+ * netstat -s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/event.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "shm_alloc.h"
+#include "netbuf.h"
+#include "fde.h"
+#include "comm.h"
+#include "fd_util.h"
+#include "vring.h"
+#include "frame.h"
+
+#define	BENCH_RING_SIZE		65536
+#define	BENCH_WRITE_SIZE	16384
+
+struct bench {
+	int is_delim;
+	int msg_size;
+	int seconds;
+	int respond;		/* response size; 0 - don't respond */
+	int coalesce;
+	int use_tcp;
+	int fd[2];
+	pthread_t wr_thr;
+	pthread_t rd_thr;
+	volatile int is_done;
+
+	struct fde_head *h;
+	struct fde_comm *fc;
+	struct iapp_vring *vr;
+	struct comm_frame *cf;
+	struct fde *ev_stats;
+	int n_ticks;
+
+	struct iapp_netbuf *resp_nb;
+	int resp_busy;		/* uncoalesced write outstanding */
+	uint64_t resp_pending;	/* uncoalesced responses not yet written */
+
+	uint64_t n_msgs;
+	uint64_t n_bytes;
+	uint64_t n_bad;
+	uint64_t n_resp;
+	uint64_t n_writes;	/* comm_write()s, when not coalescing */
+	uint64_t n_writev;	/* last snapshot of wc.n_writev */
+};
+
+/*
+ * Fill a write block with as many whole messages as fit; the
+ * block is written repeatedly so messages straddle reads.
+ */
+static int
+bench_fill(struct bench *b, char *buf, int len)
+{
+	int off = 0, hdr, i;
+
+	hdr = b->is_delim ? 1 : 2;
+	while (off + b->msg_size + hdr <= len) {
+		if (b->is_delim == 0) {
+			buf[off++] = (b->msg_size >> 8) & 0xff;
+			buf[off++] = b->msg_size & 0xff;
+		}
+		for (i = 0; i < b->msg_size; i++)
+			buf[off++] = 'a' + (i % 26);
+		if (b->is_delim)
+			buf[off++] = '\n';
+	}
+	return (off);
+}
+
+static void *
+bench_writer(void *arg)
+{
+	struct bench *b = arg;
+	char *buf;
+	int len, off;
+	ssize_t ret;
+
+	buf = malloc(BENCH_WRITE_SIZE);
+	if (buf == NULL)
+		err(1, "malloc");
+	len = bench_fill(b, buf, BENCH_WRITE_SIZE);
+
+	while (b->is_done == 0) {
+		for (off = 0; off < len; off += ret) {
+			ret = write(b->fd[1], buf + off, len - off);
+			if (ret <= 0) {
+				free(buf);
+				return (NULL);
+			}
+		}
+	}
+
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * Sink the responses.
+ */
+static void *
+bench_drain(void *arg)
+{
+	struct bench *b = arg;
+	char buf[16384];
+
+	while (b->is_done == 0) {
+		if (read(b->fd[1], buf, sizeof(buf)) <= 0)
+			break;
+	}
+
+	return (NULL);
+}
+
+static void bench_respond(struct bench *b);
+
+static void
+bench_write_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status s, int nwritten)
+{
+	struct bench *b = arg;
+
+	if (s == FDE_COMM_CB_CLOSING || s == FDE_COMM_CB_ERROR) {
+		b->is_done = 1;
+		return;
+	}
+
+	b->n_resp++;
+	if (b->coalesce == 0) {
+		b->resp_busy = 0;
+		bench_respond(b);
+	}
+}
+
+/*
+ * Without coalescing only one write can be outstanding, so queue
+ * the rest here and write them one at a time.
+ */
+static void
+bench_respond(struct bench *b)
+{
+
+	if (b->resp_busy || b->resp_pending == 0)
+		return;
+	if (comm_write(b->fc, b->resp_nb, 0, b->respond, bench_write_cb,
+	    b) < 0)
+		return;
+	b->resp_busy = 1;
+	b->resp_pending--;
+	b->n_writes++;
+}
+
+static void
+bench_frame_cb(struct comm_frame *cf, void *arg, fde_comm_cb_status s,
+    const char *msg, int len, int xerrno)
+{
+	struct bench *b = arg;
+
+	if (s != FDE_COMM_CB_COMPLETED) {
+		fprintf(stderr, "%s: status=%d, errno=%d\n", __func__, s,
+		    xerrno);
+		b->is_done = 1;
+		return;
+	}
+
+	if (len != b->msg_size || msg[len - 1] != 'a' + ((len - 1) % 26))
+		b->n_bad++;
+	b->n_msgs++;
+	b->n_bytes += len;
+
+	if (b->respond == 0)
+		return;
+	if (b->coalesce) {
+		if (comm_write(b->fc, b->resp_nb, 0, b->respond,
+		    bench_write_cb, b) < 0)
+			b->is_done = 1;
+		return;
+	}
+	b->resp_pending++;
+	bench_respond(b);
+}
+
+static void
+bench_stat_print(int fd, struct fde *f, void *arg, fde_cb_status s)
+{
+	struct bench *b = arg;
+	struct timeval tv;
+	uint64_t n_sys;
+
+	fprintf(stderr, "%s: %llu msgs/sec; %.1f MB/sec; bad=%llu; "
+	    "kq changes=%llu\n",
+	    __func__,
+	    (unsigned long long) b->n_msgs,
+	    (double) b->n_bytes / (1024.0 * 1024.0),
+	    (unsigned long long) b->n_bad,
+	    (unsigned long long) b->h->stats.n_changes);
+
+	if (b->respond != 0) {
+		if (b->coalesce)
+			n_sys = b->fc->wc.n_writev - b->n_writev;
+		else
+			n_sys = b->n_writes;
+		fprintf(stderr, "%s: %llu responses/sec; %.3f writes/response\n",
+		    __func__,
+		    (unsigned long long) b->n_resp,
+		    b->n_resp ? (double) n_sys / (double) b->n_resp : 0.0);
+	}
+
+	/* Blank this out, so we get per-second stats */
+	b->n_msgs = 0;
+	b->n_bytes = 0;
+	b->n_resp = 0;
+	b->n_writes = 0;
+	b->n_writev = b->fc->wc.n_writev;
+	b->h->stats.n_changes = 0;
+
+	if (++b->n_ticks >= b->seconds) {
+		b->is_done = 1;
+		return;
+	}
+
+	(void) gettimeofday(&tv, NULL);
+	tv.tv_sec += 1;
+	fde_add_timeout(b->h, b->ev_stats, &tv);
+}
+
+/*
+ * Connect a pair of sockets over loopback TCP.
+ */
+static int
+bench_tcp_pair(int fd[2])
+{
+	struct sockaddr_in sin;
+	socklen_t slen;
+	int lfd, on = 1;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0)
+		return (-1);
+
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	slen = sizeof(sin);
+	if (bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *) &sin, &slen) < 0)
+		goto cleanup;
+
+	fd[1] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd[1] < 0)
+		goto cleanup;
+	if (connect(fd[1], (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		close(fd[1]);
+		goto cleanup;
+	}
+	fd[0] = accept(lfd, NULL, NULL);
+	if (fd[0] < 0) {
+		close(fd[1]);
+		goto cleanup;
+	}
+	close(lfd);
+
+	/* Every response write is its own segment unless coalesced */
+	(void) setsockopt(fd[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return (0);
+
+cleanup:
+	close(lfd);
+	return (-1);
+}
+
+static void
+usage(const char *progname)
+{
+
+	printf("Usage: %s [mode=len|delim] [msg_size=<n>] [seconds=<n>] "
+	    "[respond=<n>] [coalesce=0|1] [tcp=0|1]\n",
+	    progname);
+	exit(127);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct bench b;
+	struct timeval tv;
+	int i;
+
+	bzero(&b, sizeof(b));
+	b.msg_size = 64;
+	b.seconds = 10;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "mode=len") == 0)
+			b.is_delim = 0;
+		else if (strcmp(argv[i], "mode=delim") == 0)
+			b.is_delim = 1;
+		else if (strncmp(argv[i], "msg_size=", 9) == 0)
+			b.msg_size = atoi(argv[i] + 9);
+		else if (strncmp(argv[i], "seconds=", 8) == 0)
+			b.seconds = atoi(argv[i] + 8);
+		else if (strncmp(argv[i], "respond=", 8) == 0)
+			b.respond = atoi(argv[i] + 8);
+		else if (strncmp(argv[i], "coalesce=", 9) == 0)
+			b.coalesce = atoi(argv[i] + 9);
+		else if (strncmp(argv[i], "tcp=", 4) == 0)
+			b.use_tcp = atoi(argv[i] + 4);
+		else
+			usage(argv[0]);
+	}
+	if (b.msg_size <= 0 || b.msg_size > 4096 || b.seconds <= 0 ||
+	    b.respond < 0 || b.respond > 4096)
+		usage(argv[0]);
+
+	if (b.use_tcp) {
+		if (bench_tcp_pair(b.fd) < 0)
+			err(1, "bench_tcp_pair");
+	} else if (socketpair(AF_UNIX, SOCK_STREAM, 0, b.fd) < 0)
+		err(1, "socketpair");
+	(void) comm_fd_set_nonblocking(b.fd[0], 1);
+
+	b.h = fde_ctx_new();
+	b.fc = comm_create(b.fd[0], b.h, NULL, NULL);
+	b.vr = iapp_vring_create(BENCH_RING_SIZE);
+	if (b.vr != NULL)
+		b.cf = comm_frame_create(b.fc, b.vr, bench_frame_cb, &b);
+	if (b.h == NULL || b.fc == NULL || b.cf == NULL)
+		errx(1, "couldn't set up reader");
+
+	if (b.respond != 0) {
+		b.resp_nb = iapp_netbuf_alloc(NULL, NB_ALLOC_MALLOC,
+		    b.respond);
+		if (b.resp_nb == NULL)
+			errx(1, "couldn't allocate response");
+		memset(iapp_netbuf_buf_nonconst(b.resp_nb), 'r', b.respond);
+		if (b.coalesce)
+			(void) comm_set_coalesce(b.fc, b.respond, 1);
+	}
+
+	if (b.is_delim)
+		(void) comm_frame_set_delim(b.cf, "\n", 1, b.msg_size);
+	else
+		(void) comm_frame_set_len_prefix(b.cf, 2, b.msg_size);
+	if (comm_frame_start(b.cf) < 0)
+		errx(1, "comm_frame_start failed");
+
+	b.ev_stats = fde_create(b.h, -1, FDE_T_TIMER, 0, bench_stat_print,
+	    &b);
+	(void) gettimeofday(&tv, NULL);
+	tv.tv_sec += 1;
+	fde_add_timeout(b.h, b.ev_stats, &tv);
+
+	if (pthread_create(&b.wr_thr, NULL, bench_writer, &b) != 0)
+		err(1, "pthread_create");
+	if (b.respond != 0 &&
+	    pthread_create(&b.rd_thr, NULL, bench_drain, &b) != 0)
+		err(1, "pthread_create");
+
+	while (b.is_done == 0) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		fde_runloop(b.h, &tv);
+	}
+
+	/* Unblock the writer and tidy up */
+	(void) shutdown(b.fd[0], SHUT_RDWR);
+	(void) pthread_join(b.wr_thr, NULL);
+	if (b.respond != 0)
+		(void) pthread_join(b.rd_thr, NULL);
+	comm_frame_free(b.cf);
+	comm_close(b.fc);
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	fde_runloop(b.h, &tv);
+	iapp_vring_free(b.vr);
+	if (b.resp_nb != NULL)
+		iapp_netbuf_free(b.resp_nb);
+	close(b.fd[1]);
+
+	exit(0);
+}
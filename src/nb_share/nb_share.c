@@ -0,0 +1,286 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Handing payloads from a front process to a worker process.
+ *
+ * The front allocates msg_size byte buffers and passes them to a
+ * forked worker over a unix socket in batches; the worker looks at
+ * each one and lets it go.  mode=handle allocates shared netbufs
+ * from named slabs and sends 16 byte handles, which the worker
+ * imports (mapping the slabs by name) - the payload never moves.
+ * mode=copy writes the payload bytes down the socket instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "shm_alloc.h"
+#include "netbuf.h"
+
+#define	BENCH_BATCH		64
+#define	BENCH_WINDOW		4	/* batches in flight */
+#define	BENCH_SLAB_SIZE		(16 * 1024 * 1024)
+
+struct bench {
+	int is_copy;
+	int msg_size;
+	int seconds;
+	char name[64];
+	int fd;
+	struct shm_alloc_state sm;
+};
+
+static int
+bench_io(int fd, void *buf, size_t len, int is_write)
+{
+	char *p = buf;
+	ssize_t r;
+
+	while (len > 0) {
+		if (is_write)
+			r = write(fd, p, len);
+		else
+			r = read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return (-1);
+		p += r;
+		len -= r;
+	}
+	return (0);
+}
+
+static void
+bench_worker(struct bench *b)
+{
+	struct iapp_netbuf_handle h[BENCH_BATCH];
+	struct shm_alloc_peer p;
+	struct iapp_netbuf *nb;
+	const char *buf;
+	char *cbuf = NULL;
+	uint64_t n_bad = 0;
+	char ack = 0;
+	int i;
+
+	if (b->is_copy) {
+		cbuf = malloc((size_t) BENCH_BATCH * b->msg_size);
+		if (cbuf == NULL)
+			err(1, "malloc");
+	} else if (shm_alloc_peer_init(&p, b->name,
+	    IAPP_NETBUF_SHM_META_SHIFT) < 0)
+		exit(1);
+
+	for (;;) {
+		if (b->is_copy) {
+			if (bench_io(b->fd, cbuf,
+			    (size_t) BENCH_BATCH * b->msg_size, 0) < 0)
+				break;
+			for (i = 0; i < BENCH_BATCH; i++) {
+				buf = cbuf + (size_t) i * b->msg_size;
+				if (buf[0] != buf[b->msg_size - 1])
+					n_bad++;
+			}
+		} else {
+			if (bench_io(b->fd, h, sizeof(h), 0) < 0)
+				break;
+			for (i = 0; i < BENCH_BATCH; i++) {
+				nb = iapp_netbuf_import(&p, &h[i]);
+				if (nb == NULL) {
+					n_bad++;
+					continue;
+				}
+				buf = iapp_netbuf_buf(nb);
+				if (buf[0] != buf[b->msg_size - 1])
+					n_bad++;
+				iapp_netbuf_free(nb);
+			}
+		}
+		if (bench_io(b->fd, &ack, 1, 1) < 0)
+			break;
+	}
+
+	if (n_bad != 0)
+		warnx("worker: %llu bad messages", (unsigned long long) n_bad);
+	exit(n_bad != 0);
+}
+
+static uint64_t
+bench_front(struct bench *b)
+{
+	struct iapp_netbuf_handle h[BENCH_BATCH];
+	struct iapp_netbuf *nb;
+	struct timespec ts_start, ts;
+	char *cbuf = NULL, *buf;
+	uint64_t n_msgs = 0;
+	int i, inflight = 0;
+	char ack;
+
+	if (b->is_copy) {
+		cbuf = malloc((size_t) BENCH_BATCH * b->msg_size);
+		if (cbuf == NULL)
+			err(1, "malloc");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		if (ts.tv_sec - ts_start.tv_sec >= b->seconds)
+			break;
+
+		/* Wait for the worker if it's far enough behind */
+		if (inflight == BENCH_WINDOW) {
+			if (bench_io(b->fd, &ack, 1, 0) < 0)
+				errx(1, "worker went away");
+			inflight--;
+		}
+
+		for (i = 0; i < BENCH_BATCH; i++) {
+			if (b->is_copy)
+				buf = cbuf + (size_t) i * b->msg_size;
+			else {
+				nb = iapp_netbuf_alloc(&b->sm,
+				    NB_ALLOC_SHM_SHARED, b->msg_size);
+				if (nb == NULL)
+					errx(1, "out of buffers");
+				buf = iapp_netbuf_buf_nonconst(nb);
+			}
+			buf[0] = buf[b->msg_size - 1] = (char) n_msgs;
+			n_msgs++;
+			if (b->is_copy)
+				continue;
+
+			/* Hand it over; the worker frees it */
+			(void) iapp_netbuf_export(nb, &h[i]);
+			iapp_netbuf_free(nb);
+		}
+		if (b->is_copy)
+			i = bench_io(b->fd, cbuf,
+			    (size_t) BENCH_BATCH * b->msg_size, 1);
+		else
+			i = bench_io(b->fd, h, sizeof(h), 1);
+		if (i < 0)
+			errx(1, "worker went away");
+		inflight++;
+	}
+
+	while (inflight-- > 0)
+		(void) bench_io(b->fd, &ack, 1, 0);
+	return (n_msgs);
+}
+
+static void
+usage(const char *progname)
+{
+
+	printf("Usage: %s [mode=handle|copy] [msg_size=<n>] "
+	    "[seconds=<n>]\n",
+	    progname);
+	exit(127);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct bench b;
+	uint64_t n_msgs;
+	int i, sv[2], status;
+	pid_t pid;
+
+	bzero(&b, sizeof(b));
+	b.msg_size = 16384;
+	b.seconds = 5;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "mode=handle") == 0)
+			b.is_copy = 0;
+		else if (strcmp(argv[i], "mode=copy") == 0)
+			b.is_copy = 1;
+		else if (strncmp(argv[i], "msg_size=", 9) == 0)
+			b.msg_size = atoi(argv[i] + 9);
+		else if (strncmp(argv[i], "seconds=", 8) == 0)
+			b.seconds = atoi(argv[i] + 8);
+		else
+			usage(argv[0]);
+	}
+	if (b.msg_size <= 0 || b.seconds <= 0)
+		usage(argv[0]);
+
+	/* Room for every buffer in flight, and then some */
+	snprintf(b.name, sizeof(b.name), "/iapp_nb_share.%d", (int) getpid());
+	if (b.is_copy == 0)
+		shm_alloc_init_named(&b.sm, b.name,
+		    (size_t) 4 * BENCH_BATCH * (BENCH_WINDOW + 1) *
+		    b.msg_size + 2 * BENCH_SLAB_SIZE,
+		    BENCH_SLAB_SIZE, 0, IAPP_NETBUF_SHM_META_SHIFT);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		err(1, "socketpair");
+	signal(SIGPIPE, SIG_IGN);
+
+	pid = fork();
+	if (pid < 0)
+		err(1, "fork");
+	if (pid == 0) {
+		close(sv[0]);
+		b.fd = sv[1];
+		bench_worker(&b);
+	}
+	close(sv[1]);
+	b.fd = sv[0];
+
+	n_msgs = bench_front(&b);
+	close(b.fd);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		warnx("worker failed");
+
+	printf("%s: msg_size=%d, %.0f msgs/sec, %.1f MB/sec\n",
+	    b.is_copy ? "copy" : "handle",
+	    b.msg_size,
+	    (double) n_msgs / b.seconds,
+	    (double) n_msgs * b.msg_size / b.seconds / (1024 * 1024));
+
+	if (b.is_copy == 0) {
+		printf("reaped at exit: %d\n", iapp_netbuf_shm_reap());
+		shm_alloc_unlink(&b.sm);
+	}
+
+	exit(0);
+}
@@ -0,0 +1,191 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Free a resolver with lookups outstanding: one still queued behind
+ * a blocked helper thread, and one that a helper has already picked
+ * up.  Neither callback may run, and the late completion must not
+ * touch freed memory (run it under a memory checker.)  Exits
+ * non-zero on failure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "fde.h"
+#include "taskq.h"
+#include "resolver.h"
+
+struct rt_blocker {
+	pthread_mutex_t l;
+	pthread_cond_t cv;
+	int is_running;
+	int is_released;
+	int is_done;
+};
+
+static int n_cb = 0;
+
+static void
+rt_resolve_cb(struct iapp_resolver *rs, void *arg, int error,
+    const struct iapp_resolver_addr *addrs, int naddrs)
+{
+
+	n_cb++;
+}
+
+static void
+rt_block_run(struct iapp_task *t, void *arg)
+{
+	struct rt_blocker *b = arg;
+
+	pthread_mutex_lock(&b->l);
+	b->is_running = 1;
+	pthread_cond_broadcast(&b->cv);
+	while (b->is_released == 0)
+		pthread_cond_wait(&b->cv, &b->l);
+	pthread_mutex_unlock(&b->l);
+}
+
+static void
+rt_block_done(struct iapp_task *t, void *arg)
+{
+	struct rt_blocker *b = arg;
+
+	b->is_done = 1;
+}
+
+/*
+ * Run the loop until the blocker task has completed.  The taskq has
+ * a single thread, so anything submitted before it has completed
+ * too.
+ */
+static void
+rt_wait_done(struct fde_head *h, struct rt_blocker *b)
+{
+	struct timeval tv;
+	int i;
+
+	for (i = 0; i < 50 && b->is_done == 0; i++) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		fde_runloop(h, &tv);
+	}
+	if (b->is_done == 0)
+		errx(1, "helper task never completed");
+
+	/* One more pass for anything queued behind it */
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	fde_runloop(h, &tv);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct fde_head *h;
+	struct iapp_taskq *tq;
+	struct iapp_resolver *rs;
+	struct iapp_task bt;
+	struct rt_blocker b;
+	int is_queued;
+
+	h = fde_ctx_new();
+	if (h == NULL)
+		errx(1, "fde_ctx_new failed");
+	tq = iapp_taskq_create(1);
+	if (tq == NULL)
+		errx(1, "iapp_taskq_create failed");
+	bzero(&b, sizeof(b));
+	pthread_mutex_init(&b.l, NULL);
+	pthread_cond_init(&b.cv, NULL);
+	if (iapp_task_init(&bt, h, rt_block_run, rt_block_done, &b) < 0)
+		errx(1, "iapp_task_init failed");
+
+	/* Queued: the only helper thread is stuck in the blocker */
+	if (iapp_taskq_submit(tq, &bt) < 0)
+		errx(1, "iapp_taskq_submit failed");
+	pthread_mutex_lock(&b.l);
+	while (b.is_running == 0)
+		pthread_cond_wait(&b.cv, &b.l);
+	pthread_mutex_unlock(&b.l);
+
+	rs = iapp_resolver_create(h, tq, SOCK_STREAM, 1000, 1000, 16);
+	if (rs == NULL)
+		errx(1, "iapp_resolver_create failed");
+	if (iapp_resolver_lookup(rs, "localhost", "80", rt_resolve_cb,
+	    NULL) < 0)
+		errx(1, "iapp_resolver_lookup failed");
+	iapp_resolver_free(rs);
+
+	pthread_mutex_lock(&b.l);
+	b.is_released = 1;
+	pthread_cond_broadcast(&b.cv);
+	pthread_mutex_unlock(&b.l);
+	rt_wait_done(h, &b);
+	printf("queued lookup: %d callbacks\n", n_cb);
+
+	/* Running: let the helper take the lookup before freeing */
+	rs = iapp_resolver_create(h, tq, SOCK_STREAM, 1000, 1000, 16);
+	if (rs == NULL)
+		errx(1, "iapp_resolver_create failed");
+	if (iapp_resolver_lookup(rs, "localhost", "80", rt_resolve_cb,
+	    NULL) < 0)
+		errx(1, "iapp_resolver_lookup failed");
+	do {
+		pthread_mutex_lock(&tq->l);
+		is_queued = (TAILQ_FIRST(&tq->t_head) != NULL);
+		pthread_mutex_unlock(&tq->l);
+	} while (is_queued);
+	iapp_resolver_free(rs);
+
+	b.is_running = b.is_released = b.is_done = 0;
+	b.is_released = 1;
+	if (iapp_taskq_submit(tq, &bt) < 0)
+		errx(1, "iapp_taskq_submit failed");
+	rt_wait_done(h, &b);
+	printf("running lookup: %d callbacks\n", n_cb);
+
+	iapp_task_cleanup(&bt);
+	iapp_taskq_free(tq);
+	fde_ctx_free(h);
+
+	if (n_cb != 0) {
+		printf("FAIL: a freed resolver called back\n");
+		exit(1);
+	}
+	printf("OK\n");
+	exit(0);
+}
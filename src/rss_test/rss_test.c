@@ -0,0 +1,180 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Check the Toeplitz hash against the Microsoft RSS verification
+ * suite, IPv4 and IPv6, with and without ports, through both the
+ * table and the bit at a time implementations.  Exits non-zero on
+ * any mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "iapp_rss.h"
+
+struct rss_vec {
+	int af;
+	const char *src;
+	uint16_t sport;
+	const char *dst;
+	uint16_t dport;
+	uint32_t hash_ip;	/* addresses only */
+	uint32_t hash_ports;	/* addresses and ports */
+};
+
+static const struct rss_vec rss_vecs[] = {
+	{ AF_INET, "66.9.149.187", 2794, "161.142.100.80", 1766,
+	    0x323e8fc2, 0x51ccc178 },
+	{ AF_INET, "199.92.111.2", 14230, "65.69.140.83", 4739,
+	    0xd718262a, 0xc626b0ea },
+	{ AF_INET, "24.19.198.95", 12898, "12.22.207.184", 38024,
+	    0xd2d0a5de, 0x5c2b394a },
+	{ AF_INET, "38.27.205.30", 48228, "209.142.163.6", 2217,
+	    0x82989176, 0xafc7327f },
+	{ AF_INET, "153.39.163.191", 44251, "202.188.127.2", 1303,
+	    0x5d1809c5, 0x10e828a2 },
+	{ AF_INET6, "3ffe:2501:200:1fff::7", 2794,
+	    "3ffe:2501:200:3::1", 1766,
+	    0x2cc18cd5, 0x40207d3d },
+	{ AF_INET6, "3ffe:501:8::260:97ff:fe40:efab", 14230,
+	    "ff02::1", 4739,
+	    0x0f0c461c, 0xdde51bbf },
+	{ AF_INET6, "3ffe:1900:4545:3:200:f8ff:fe21:67cf", 44251,
+	    "fe80::200:f8ff:fe21:67cf", 38024,
+	    0x4b61e985, 0x02d1feef },
+};
+
+static int n_fail = 0;
+
+static void
+rss_check(const char *what, int i, uint32_t got, uint32_t want)
+{
+
+	if (got == want)
+		return;
+	printf("FAIL: vector %d %s: got 0x%08x, want 0x%08x\n",
+	    i, what, got, want);
+	n_fail++;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	const struct rss_vec *v;
+	struct sockaddr_storage ss, sd;
+	struct sockaddr_in *s4, *d4;
+	struct sockaddr_in6 *s6, *d6;
+	uint8_t buf[IAPP_RSS_MAX_INPUT], key[IAPP_RSS_KEY_LEN];
+	struct iapp_rss *r;
+	uint16_t port;
+	uint32_t h;
+	int i, alen, len;
+
+	r = iapp_rss_create(NULL, 0, 1);
+	if (r == NULL)
+		errx(1, "iapp_rss_create failed");
+
+	for (i = 0; i < (int) (sizeof(rss_vecs) / sizeof(rss_vecs[0])); i++) {
+		v = &rss_vecs[i];
+		alen = (v->af == AF_INET) ? 4 : 16;
+		if (inet_pton(v->af, v->src, buf) != 1 ||
+		    inet_pton(v->af, v->dst, buf + alen) != 1)
+			errx(1, "vector %d: bad address", i);
+		len = 2 * alen;
+		port = htons(v->sport);
+		memcpy(buf + len, &port, 2);
+		port = htons(v->dport);
+		memcpy(buf + len + 2, &port, 2);
+
+		rss_check("table, addresses", i,
+		    iapp_rss_hash(r, buf, len), v->hash_ip);
+		rss_check("slow, addresses", i,
+		    iapp_rss_hash_slow(iapp_rss_default_key,
+		    IAPP_RSS_KEY_LEN, buf, len), v->hash_ip);
+		rss_check("table, ports", i,
+		    iapp_rss_hash(r, buf, len + 4), v->hash_ports);
+		rss_check("slow, ports", i,
+		    iapp_rss_hash_slow(iapp_rss_default_key,
+		    IAPP_RSS_KEY_LEN, buf, len + 4), v->hash_ports);
+
+		/* .. and the way srv gets at it */
+		memset(&ss, 0, sizeof(ss));
+		memset(&sd, 0, sizeof(sd));
+		if (v->af == AF_INET) {
+			s4 = (struct sockaddr_in *) &ss;
+			d4 = (struct sockaddr_in *) &sd;
+			s4->sin_family = d4->sin_family = AF_INET;
+			memcpy(&s4->sin_addr, buf, 4);
+			memcpy(&d4->sin_addr, buf + 4, 4);
+			s4->sin_port = htons(v->sport);
+			d4->sin_port = htons(v->dport);
+		} else {
+			s6 = (struct sockaddr_in6 *) &ss;
+			d6 = (struct sockaddr_in6 *) &sd;
+			s6->sin6_family = d6->sin6_family = AF_INET6;
+			memcpy(&s6->sin6_addr, buf, 16);
+			memcpy(&d6->sin6_addr, buf + 16, 16);
+			s6->sin6_port = htons(v->sport);
+			d6->sin6_port = htons(v->dport);
+		}
+		if (iapp_rss_hash_sockaddr(r, (struct sockaddr *) &ss,
+		    (struct sockaddr *) &sd, &h) < 0)
+			rss_check("sockaddr", i, 0, v->hash_ports);
+		else
+			rss_check("sockaddr", i, h, v->hash_ports);
+	}
+
+	/* Key parsing */
+	if (iapp_rss_parse_key("6d:5a:56:da:25:5b:0e:c2:41:67:25:3d:43:a3:"
+	    "8f:b0:d0:ca:2b:cb:ae:7b:30:b4:77:cb:2d:a3:80:30:f2:0c:"
+	    "6a:42:b7:3b:be:ac:01:fa", key, sizeof(key)) != IAPP_RSS_KEY_LEN ||
+	    memcmp(key, iapp_rss_default_key, IAPP_RSS_KEY_LEN) != 0) {
+		printf("FAIL: parsing the default key\n");
+		n_fail++;
+	}
+	if (iapp_rss_parse_key("6z", key, sizeof(key)) != -1 ||
+	    iapp_rss_parse_key("6d:5", key, sizeof(key)) != -1 ||
+	    iapp_rss_parse_key("6d:5a:", key, sizeof(key)) != 2) {
+		printf("FAIL: partial hex in a key\n");
+		n_fail++;
+	}
+
+	iapp_rss_free(r);
+
+	if (n_fail != 0) {
+		printf("%d failures\n", n_fail);
+		exit(1);
+	}
+	printf("all RSS vectors ok\n");
+	exit(0);
+}
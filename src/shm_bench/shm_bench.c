@@ -0,0 +1,338 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory channel versus loopback TCP, between two threads
+ * each running their own event loop over an fde_comm.
+ *
+ * mode=thru streams msg_size byte writes from one side to the other
+ * and prints MB/sec; mode=pingpong bounces a msg_size message back
+ * and forth and prints the mean round trip time.  transport=shm|tcp
+ * picks the transport; the shm runs also print how often a doorbell
+ * had to be rung.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/event.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "shm_alloc.h"
+#include "netbuf.h"
+#include "fde.h"
+#include "comm.h"
+#include "fd_util.h"
+#include "shm_chan.h"
+
+#define	BENCH_RING_SIZE		(1024 * 1024)
+#define	BENCH_SLAB_SIZE		(4 * 1024 * 1024)
+#define	BENCH_READ_SIZE		65536
+
+struct bench;
+
+struct bench_side {
+	int id;
+	struct bench *b;
+	pthread_t thr;
+	struct fde_head *h;
+	struct fde_comm *fc;
+	struct iapp_netbuf *nb;
+	char *rbuf;
+	int rfill;		/* pingpong: bytes of this message so far */
+
+	uint64_t n_bytes;
+	uint64_t n_msgs;
+	uint64_t rtt_ns;
+	struct timespec ts_sent;
+};
+
+struct bench {
+	int use_tcp;
+	int is_pingpong;
+	int msg_size;
+	int seconds;
+	volatile int is_done;
+
+	int fd[2];
+	struct shm_alloc_state sm;
+	struct iapp_shm_chan *ch;
+	struct bench_side side[2];
+};
+
+static void bench_read_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval);
+
+static uint64_t
+bench_ts_ns(const struct timespec *a, const struct timespec *b)
+{
+
+	return ((b->tv_sec - a->tv_sec) * 1000000000ULL +
+	    (b->tv_nsec - a->tv_nsec));
+}
+
+static void
+bench_write_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int nwritten)
+{
+	struct bench_side *s = arg;
+
+	if (status != FDE_COMM_CB_COMPLETED)
+		return;
+
+	/* Streaming: keep the writer busy */
+	if (s->b->is_pingpong == 0 && s->b->is_done == 0)
+		(void) comm_write(fc, s->nb, 0, s->b->msg_size,
+		    bench_write_cb, s);
+}
+
+static void
+bench_send(struct bench_side *s)
+{
+
+	if (s->id == 0)
+		clock_gettime(CLOCK_MONOTONIC, &s->ts_sent);
+	(void) comm_write(s->fc, s->nb, 0, s->b->msg_size, bench_write_cb, s);
+}
+
+static void
+bench_read_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval)
+{
+	struct bench_side *s = arg;
+	struct timespec ts;
+	int len;
+
+	if (status != FDE_COMM_CB_COMPLETED)
+		return;
+
+	s->n_bytes += retval;
+
+	if (s->b->is_pingpong) {
+		s->rfill += retval;
+		if (s->rfill == s->b->msg_size) {
+			s->rfill = 0;
+			s->n_msgs++;
+			if (s->id == 0) {
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+				s->rtt_ns += bench_ts_ns(&s->ts_sent, &ts);
+			}
+			if (s->b->is_done == 0)
+				bench_send(s);
+		}
+		len = s->b->msg_size - s->rfill;
+	} else
+		len = BENCH_READ_SIZE;
+
+	if (s->b->is_done == 0)
+		(void) comm_read(fc, s->rbuf + (s->b->is_pingpong ? s->rfill : 0),
+		    len, bench_read_cb, s);
+}
+
+static void *
+bench_thread(void *arg)
+{
+	struct bench_side *s = arg;
+	struct bench *b = s->b;
+	struct timeval tv;
+
+	s->h = fde_ctx_new();
+	if (s->h == NULL)
+		errx(1, "fde_ctx_new failed");
+	if (b->use_tcp)
+		s->fc = comm_create(b->fd[s->id], s->h, NULL, NULL);
+	else
+		s->fc = comm_create_shm(b->ch, s->id, s->h, NULL, NULL);
+	if (s->fc == NULL)
+		errx(1, "couldn't create comm");
+
+	s->nb = iapp_netbuf_alloc(NULL, NB_ALLOC_MALLOC, b->msg_size);
+	s->rbuf = malloc(BENCH_READ_SIZE > b->msg_size ? BENCH_READ_SIZE :
+	    b->msg_size);
+	if (s->nb == NULL || s->rbuf == NULL)
+		errx(1, "couldn't allocate buffers");
+	memset(iapp_netbuf_buf_nonconst(s->nb), 'x', b->msg_size);
+
+	/* Side 0 writes; side 1 reads (and echoes, for pingpong) */
+	if (s->id == 0 || b->is_pingpong)
+		(void) comm_read(s->fc, s->rbuf,
+		    b->is_pingpong ? b->msg_size : BENCH_READ_SIZE,
+		    bench_read_cb, s);
+	if (s->id == 0)
+		bench_send(s);
+
+	while (b->is_done == 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		fde_runloop(s->h, &tv);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Connect a pair of sockets over loopback TCP.
+ */
+static int
+bench_tcp_pair(int fd[2])
+{
+	struct sockaddr_in sin;
+	socklen_t slen;
+	int lfd, on = 1;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0)
+		return (-1);
+
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	slen = sizeof(sin);
+	if (bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *) &sin, &slen) < 0)
+		goto cleanup;
+
+	fd[1] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd[1] < 0)
+		goto cleanup;
+	if (connect(fd[1], (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		close(fd[1]);
+		goto cleanup;
+	}
+	fd[0] = accept(lfd, NULL, NULL);
+	if (fd[0] < 0) {
+		close(fd[1]);
+		goto cleanup;
+	}
+	close(lfd);
+
+	/* Latency, not batching */
+	(void) setsockopt(fd[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	(void) setsockopt(fd[1], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	(void) comm_fd_set_nonblocking(fd[0], 1);
+	(void) comm_fd_set_nonblocking(fd[1], 1);
+	return (0);
+
+cleanup:
+	close(lfd);
+	return (-1);
+}
+
+static void
+usage(const char *progname)
+{
+
+	printf("Usage: %s [transport=shm|tcp] [mode=thru|pingpong] "
+	    "[msg_size=<n>] [seconds=<n>]\n",
+	    progname);
+	exit(127);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct bench b;
+	int i;
+
+	bzero(&b, sizeof(b));
+	b.msg_size = 16384;
+	b.seconds = 10;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "transport=shm") == 0)
+			b.use_tcp = 0;
+		else if (strcmp(argv[i], "transport=tcp") == 0)
+			b.use_tcp = 1;
+		else if (strcmp(argv[i], "mode=thru") == 0)
+			b.is_pingpong = 0;
+		else if (strcmp(argv[i], "mode=pingpong") == 0)
+			b.is_pingpong = 1;
+		else if (strncmp(argv[i], "msg_size=", 9) == 0)
+			b.msg_size = atoi(argv[i] + 9);
+		else if (strncmp(argv[i], "seconds=", 8) == 0)
+			b.seconds = atoi(argv[i] + 8);
+		else
+			usage(argv[0]);
+	}
+	if (b.msg_size <= 0 || b.msg_size > BENCH_RING_SIZE || b.seconds <= 0)
+		usage(argv[0]);
+
+	if (b.use_tcp) {
+		if (bench_tcp_pair(b.fd) < 0)
+			err(1, "bench_tcp_pair");
+	} else {
+		shm_alloc_init(&b.sm, BENCH_SLAB_SIZE, BENCH_SLAB_SIZE, 0);
+		b.ch = iapp_shm_chan_create(&b.sm, BENCH_RING_SIZE);
+		if (b.ch == NULL)
+			errx(1, "couldn't create channel");
+	}
+
+	for (i = 0; i < 2; i++) {
+		b.side[i].id = i;
+		b.side[i].b = &b;
+		if (pthread_create(&b.side[i].thr, NULL, bench_thread,
+		    &b.side[i]) != 0)
+			err(1, "pthread_create");
+	}
+
+	sleep(b.seconds);
+	b.is_done = 1;
+	for (i = 0; i < 2; i++)
+		(void) pthread_join(b.side[i].thr, NULL);
+
+	if (b.is_pingpong)
+		printf("%s pingpong: msg_size=%d, %llu round trips, "
+		    "mean rtt=%.2f usec\n",
+		    b.use_tcp ? "tcp" : "shm",
+		    b.msg_size,
+		    (unsigned long long) b.side[0].n_msgs,
+		    b.side[0].n_msgs ? (double) b.side[0].rtt_ns /
+		    b.side[0].n_msgs / 1000.0 : 0.0);
+	else
+		printf("%s thru: msg_size=%d, %.1f MB/sec\n",
+		    b.use_tcp ? "tcp" : "shm",
+		    b.msg_size,
+		    (double) b.side[1].n_bytes / b.seconds / (1024 * 1024));
+
+	if (b.ch != NULL)
+		printf("shm doorbells: side0=%llu, side1=%llu\n",
+		    (unsigned long long) b.ch->n_wakeups[0],
+		    (unsigned long long) b.ch->n_wakeups[1]);
+
+	exit(0);
+}
@@ -35,10 +35,6 @@
 #include <signal.h>
 #include <pthread.h>
 
-/* For thread affinity */
-#include <pthread_np.h>
-#include <sys/cpuset.h>
-
 #include <sys/time.h>
 
 #include <fcntl.h>
@@ -54,34 +50,20 @@
 #include "netbuf.h"
 #include "comm.h"
 #include "iapp_cpu.h"
+#include "iapp_place.h"
+#include "iapp_rss.h"
+#include "handoff.h"
 
 #include "conn_cfg.h"
 #include "thr.h"
 #include "conn.h"
 #include "fd_util.h"
+#include "listener.h"
 
-struct thr *rp;
-
-static int
-thrsrv_newfd_enqueue(int newfd, uint32_t flowid, struct thr *dr)
-{
-	struct thrsrv_newfd *th;
-
-	th = calloc(1, sizeof(*th));
-	if (th == NULL) {
-		warn("%s: calloc", __func__);
-		return (-1);
-	}
-
-	th->newfd = newfd;
-	th->flowid = flowid;
+/* Per-thread ring of connections handed over from other threads */
+#define	SRV_HANDOFF_RING_SIZE	1024
 
-	pthread_mutex_lock(&dr->newfd_lock);
-	TAILQ_INSERT_TAIL(&dr->newfd_list, th, node);
-	pthread_mutex_unlock(&dr->newfd_lock);
-
-	return (0);
-}
+struct thr *rp;
 
 static void
 thrsrv_conn_update_cb(struct conn *c, void *arg, conn_state_t newstate)
@@ -111,14 +93,64 @@ thrsrv_conn_stats_update_cb(struct conn *c, void *arg, size_t tx_bytes,
 	r->total_written += tx_bytes;
 }
 
+static void
+thrsrv_conn_io_stats_cb(struct conn *c, void *arg,
+    const struct comm_stats *st)
+{
+	struct thr *r = arg;
+	struct comm_stats *io = &r->io;
+
+	io->n_read += st->n_read;
+	io->n_write += st->n_write;
+	io->n_rd_eagain += st->n_rd_eagain;
+	io->n_wr_eagain += st->n_wr_eagain;
+	io->n_short_write += st->n_short_write;
+	io->n_rd_lat += st->n_rd_lat;
+	io->rd_lat_usec += st->rd_lat_usec;
+	if (st->rd_lat_max_usec > io->rd_lat_max_usec)
+		io->rd_lat_max_usec = st->rd_lat_max_usec;
+	io->n_wr_lat += st->n_wr_lat;
+	io->wr_lat_usec += st->wr_lat_usec;
+	if (st->wr_lat_max_usec > io->wr_lat_max_usec)
+		io->wr_lat_max_usec = st->wr_lat_max_usec;
+
+	/* Only connections sampled since the last push */
+	if (st->n_tcpi != 0) {
+		r->n_tcpi++;
+		r->tcpi_rtt_sum += st->tcpi_rtt_usec;
+		r->tcpi_cwnd_sum += st->tcpi_cwnd;
+		if (st->tcpi_retrans > r->tcpi_retrans_max)
+			r->tcpi_retrans_max = st->tcpi_retrans;
+	}
+}
+
+/*
+ * Map a flow to a thread the way the NIC maps it to a queue.
+ *
+ * If the NIC handed us its RSS hash use that, otherwise compute
+ * the Toeplitz hash over the 4-tuple ourselves.
+ */
 static int
-thrsrv_flowid_to_thread(uint32_t flowid)
+thrsrv_rss_to_thread(struct thr *r, int newfd, struct sockaddr *saddr,
+    uint32_t flowid)
 {
-	if (flowid == 0)
+	struct sockaddr_storage ss;
+	socklen_t sl;
+	uint32_t hash;
+
+	if (flowid != 0)
+		return (iapp_rss_to_queue(r->rss, flowid));
+
+	sl = sizeof(ss);
+	if (getsockname(newfd, (struct sockaddr *) &ss, &sl) < 0) {
+		warn("%s: getsockname", __func__);
+		return (-1);
+	}
+	if (iapp_rss_hash_sockaddr(r->rss, saddr, (struct sockaddr *) &ss,
+	    &hash) < 0)
 		return (-1);
 
-	/* for now we just assume this is correct - 8 CPUs */
-	return (flowid & 0x7);
+	return (iapp_rss_to_queue(r->rss, hash));
 }
 
 static void
@@ -133,6 +165,9 @@ thrsrv_finish_setup(struct thr *r, int newfd, uint32_t flowid)
 		return;
 	}
 	conn_set_stats_cb(c, thrsrv_conn_stats_update_cb, r);
+	if (r->cfg->io_stats_ms > 0)
+		(void) conn_set_io_stats_cb(c, thrsrv_conn_io_stats_cb, r,
+		    r->cfg->io_stats_ms);
 
 	c->flowid = flowid;
 
@@ -143,35 +178,16 @@ thrsrv_finish_setup(struct thr *r, int newfd, uint32_t flowid)
 	r->num_clients ++;
 }
 
+/*
+ * Connection handed to us by another thread's accept.
+ */
 static void
-thrsrv_run_deferred(int fd, struct fde *f, void *arg, fde_cb_status s)
+thrsrv_handoff_cb(struct iapp_handoff *ho, void *arg,
+    const struct iapp_handoff_ent *e)
 {
-	struct timeval tv;
 	struct thr *r = arg;
-	struct thrsrv_newfd *th;
 
-	/*
-	 * XXX should just extract the list first!
-	 */
-	pthread_mutex_lock(&r->newfd_lock);
-	while (! TAILQ_EMPTY(&r->newfd_list)) {
-		th = TAILQ_FIRST(&r->newfd_list);
-		TAILQ_REMOVE(&r->newfd_list, th, node);
-		thrsrv_finish_setup(r, th->newfd, th->flowid);
-		free(th);
-	}
-	pthread_mutex_unlock(&r->newfd_lock);
-
-	/*
-	 * Run 100ms in advance.
-	 */
-	(void) gettimeofday(&tv, NULL);
-	tv.tv_usec += (100 * 1000);
-	if (tv.tv_usec > (1000 * 1000)) {
-		tv.tv_usec -= (1000 * 1000);
-		tv.tv_sec += 1;
-	}
-	fde_add_timeout(r->h, r->ev_deferred, &tv);
+	thrsrv_finish_setup(r, e->fd, e->flowid);
 }
 
 void
@@ -179,9 +195,12 @@ thrsrv_acceptfd(int fd, struct fde_comm *fc, void *arg, fde_comm_cb_status s,
     int newfd, struct sockaddr *saddr, socklen_t slen, int xerrno)
 {
 	struct thr *r = arg;
-	int rr, flowid;
-	socklen_t sl;
+	uint32_t flowid = 0;
 	int thr_id;
+#ifdef	IP_FLOWID
+	socklen_t sl;
+	int rr;
+#endif
 
 	if (s != FDE_COMM_CB_COMPLETED) {
 		fprintf(stderr,
@@ -190,6 +209,7 @@ thrsrv_acceptfd(int fd, struct fde_comm *fc, void *arg, fde_comm_cb_status s,
 		return;
 	}
 
+#ifdef	IP_FLOWID
 	/*
 	 * Flowid!
 	 */
@@ -198,11 +218,16 @@ thrsrv_acceptfd(int fd, struct fde_comm *fc, void *arg, fde_comm_cb_status s,
 	if (rr == 0) {
 		printf("%s: FD=%d, flowid=0x%08x, len=%d\n", __func__, newfd, flowid, (int) sl);
 	}
+#endif
 
 	/*
-	 * Figure out the correct destination thread.
+	 * Figure out the correct destination thread - the one pinned
+	 * to the CPU which received the packets.  Fall back to the
+	 * RSS hash if the receive CPU isn't known.
 	 */
-	thr_id = thrsrv_flowid_to_thread(flowid);
+	thr_id = iapp_place_fd(r->place, r->app_id, newfd);
+	if (thr_id == -1)
+		thr_id = thrsrv_rss_to_thread(r, newfd, saddr, flowid);
 
 	/*
 	 * Only do thread affinity work if configured.
@@ -216,29 +241,103 @@ thrsrv_acceptfd(int fd, struct fde_comm *fc, void *arg, fde_comm_cb_status s,
 		    __func__,
 		    newfd,
 		    r->app_id, thr_id);
-		if (thrsrv_newfd_enqueue(newfd, flowid, &rp[thr_id]) < 0)
-			close(newfd);
+		/* Ring full - just keep it here */
+		if (iapp_handoff_push(rp[thr_id].ho, newfd, flowid, saddr,
+		    slen) < 0)
+			thrsrv_finish_setup(r, newfd, flowid);
 	} else {
 		thrsrv_finish_setup(r, newfd, flowid);
 	}
 }
 
+/*
+ * accept_data=<n>: whatever arrived with (or just after) the SYN
+ * is read here; we only sink data, so just count it.
+ */
+static void
+thrsrv_acceptfd_data(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status s, int newfd, struct sockaddr *saddr, socklen_t slen,
+    const char *buf, int len, int xerrno)
+{
+	struct thr *r = arg;
+
+	if (s == FDE_COMM_CB_COMPLETED && len > 0) {
+		r->total_read += len;
+		r->total_early++;
+	}
+	thrsrv_acceptfd(fd, fc, arg, s, newfd, saddr, slen, xerrno);
+}
+
 static void
 thrsrv_stat_print(int fd, struct fde *f, void *arg, fde_cb_status s)
 {
 	struct thr *r = arg;
 	struct timeval tv;
+	struct iapp_place_stats ps;
+	struct iapp_handoff_stats hs;
+
+	iapp_place_get_stats(r->place, r->app_id, &ps, 1);
+	iapp_handoff_get_stats(r->ho, &hs, 1);
 
-	fprintf(stderr, "%s: [%d]: %lld clients; new=%lld, closed=%lld, TX=%lld bytes, RX=%lld bytes\n",
+	fprintf(stderr, "%s: [%d]: %lld clients; new=%lld, closed=%lld, TX=%lld bytes, RX=%lld bytes; placed local=%llu, remote=%llu, unknown=%llu; kq changes=%llu\n",
 	    __func__,
 	    r->app_id,
 	    (unsigned long long) r->num_clients,
 	    (unsigned long long) r->total_opened,
 	    (unsigned long long) r->total_closed,
 	    (unsigned long long) r->total_written,
-	    (unsigned long long) r->total_read);
+	    (unsigned long long) r->total_read,
+	    (unsigned long long) ps.local,
+	    (unsigned long long) ps.remote,
+	    (unsigned long long) ps.unknown,
+	    (unsigned long long) r->h->stats.n_changes);
+	if (hs.n_handoff != 0 || hs.n_full != 0)
+		fprintf(stderr, "%s: [%d]: handoff in=%llu, full=%llu; latency p50<%uus, p99<%uus, max<%uus\n",
+		    __func__,
+		    r->app_id,
+		    (unsigned long long) hs.n_handoff,
+		    (unsigned long long) hs.n_full,
+		    iapp_handoff_hist_pct(&hs, 50),
+		    iapp_handoff_hist_pct(&hs, 99),
+		    iapp_handoff_hist_pct(&hs, 100));
+	if (r->total_early != 0)
+		fprintf(stderr, "%s: [%d]: accepted with early data=%llu\n",
+		    __func__,
+		    r->app_id,
+		    (unsigned long long) r->total_early);
+	if (r->cfg->io_stats_ms > 0) {
+		fprintf(stderr, "%s: [%d]: io: reads=%llu, writes=%llu, eagain rd/wr=%llu/%llu, short writes=%llu; ready->callback rd avg/max=%llu/%lluus, wr avg/max=%llu/%lluus\n",
+		    __func__,
+		    r->app_id,
+		    (unsigned long long) r->io.n_read,
+		    (unsigned long long) r->io.n_write,
+		    (unsigned long long) r->io.n_rd_eagain,
+		    (unsigned long long) r->io.n_wr_eagain,
+		    (unsigned long long) r->io.n_short_write,
+		    (unsigned long long) (r->io.n_rd_lat == 0 ? 0 :
+		      r->io.rd_lat_usec / r->io.n_rd_lat),
+		    (unsigned long long) r->io.rd_lat_max_usec,
+		    (unsigned long long) (r->io.n_wr_lat == 0 ? 0 :
+		      r->io.wr_lat_usec / r->io.n_wr_lat),
+		    (unsigned long long) r->io.wr_lat_max_usec);
+		bzero(&r->io, sizeof(r->io));
+	}
+	if (r->n_tcpi != 0) {
+		fprintf(stderr, "%s: [%d]: tcp_info: conns=%llu, rtt avg=%lluus, cwnd avg=%llu, retrans max=%llu\n",
+		    __func__,
+		    r->app_id,
+		    (unsigned long long) r->n_tcpi,
+		    (unsigned long long) (r->tcpi_rtt_sum / r->n_tcpi),
+		    (unsigned long long) (r->tcpi_cwnd_sum / r->n_tcpi),
+		    (unsigned long long) r->tcpi_retrans_max);
+		r->n_tcpi = 0;
+		r->tcpi_rtt_sum = r->tcpi_cwnd_sum = 0;
+		r->tcpi_retrans_max = 0;
+	}
 
 	/* Blank this out, so we get per-second stats */
+	r->total_early = 0;
+	r->h->stats.n_changes = 0;
 	r->total_read = 0;
 	r->total_written = 0;
 	r->total_opened = 0;
@@ -265,32 +364,34 @@ thrsrv_new(void *arg)
 	if (r->thr_sockfd_v4 != -1) {
 		r->comm_listen_v4 = comm_create(r->thr_sockfd_v4, r->h, NULL, NULL);
 		comm_mark_nonclose(r->comm_listen_v4);
-		(void) comm_listen(r->comm_listen_v4, thrsrv_acceptfd, r);
+		if (r->cfg->accept_data > 0)
+			(void) comm_listen_data(r->comm_listen_v4,
+			    r->cfg->accept_data, thrsrv_acceptfd_data, r);
+		else
+			(void) comm_listen(r->comm_listen_v4, thrsrv_acceptfd,
+			    r);
 	}
 
 	if (r->thr_sockfd_v6 != -1) {
 		r->comm_listen_v6 = comm_create(r->thr_sockfd_v6, r->h, NULL, NULL);
 		comm_mark_nonclose(r->comm_listen_v6);
-		(void) comm_listen(r->comm_listen_v6, thrsrv_acceptfd, r);
+		if (r->cfg->accept_data > 0)
+			(void) comm_listen_data(r->comm_listen_v6,
+			    r->cfg->accept_data, thrsrv_acceptfd_data, r);
+		else
+			(void) comm_listen(r->comm_listen_v6, thrsrv_acceptfd,
+			    r);
 	}
 
-	pthread_mutex_init(&r->newfd_lock, NULL);
-
 	/* Create statistics timer */
 	r->ev_stats = fde_create(r->h, -1, FDE_T_TIMER, 0,
 	    thrsrv_stat_print, r);
-	r->ev_deferred = fde_create(r->h, -1, FDE_T_TIMER, 0,
-	    thrsrv_run_deferred, r);
 
 	/* Add stat - to be called one second in the future */
 	(void) gettimeofday(&tv, NULL);
 	tv.tv_sec += 1;
 	fde_add_timeout(r->h, r->ev_stats, &tv);
 
-	/* .. and the deferred handler */
-	(void) gettimeofday(&tv, NULL);
-	fde_add_timeout(r->h, r->ev_deferred, &tv);
-
 	/* Loop around, listening for events; farm them off as required */
 	while (1) {
 		tv.tv_sec = 1;
@@ -360,6 +461,31 @@ srv_parse_option(struct cfg *cfg, const char *opt)
 		cfg->do_thread_pin = atoi(sv);
 	} else if (strcmp("do_fd_affinity", sa) == 0) {
 		cfg->do_fd_affinity = atoi(sv);
+	} else if (strcmp("accept_data", sa) == 0) {
+		cfg->accept_data = atoi(sv);
+	} else if (strcmp("io_stats_ms", sa) == 0) {
+		cfg->io_stats_ms = atoi(sv);
+	} else if (strcmp("tcp_info_sample", sa) == 0) {
+		cfg->tcp_info_sample = atoi(sv);
+	} else if (strcmp("tcp_info_ms", sa) == 0) {
+		cfg->tcp_info_ms = atoi(sv);
+	} else if (strcmp("shared_buf", sa) == 0) {
+		cfg->shared_buf = atoi(sv);
+	} else if (strcmp("listen_steer", sa) == 0) {
+		iapp_listen_steer_t steer;
+
+		if (iapp_listener_parse_steer(sv, &steer) < 0) {
+			printf("unknown listen_steer "
+			    "(none, cpu or hash, got '%s')\n", sv);
+			goto finish_err;
+		}
+		cfg->listen_steer = steer;
+	} else if (strcmp("rss_key", sa) == 0) {
+		free(cfg->rss_key);
+		cfg->rss_key = strdup(sv);
+	} else if (strcmp("rss_indir", sa) == 0) {
+		free(cfg->rss_indir);
+		cfg->rss_indir = strdup(sv);
 	} else {
 		printf("unknown option '%s'\n", sa);
 		goto finish_err;
@@ -379,11 +505,16 @@ main(int argc, const char *argv[])
 {
 	struct thr *r;
 	int i;
-	int fd_v4 = -1;
-	int fd_v6 = -1;
+	struct iapp_listener *l_v4, *l_v6;
+	struct iapp_place *place;
+	struct iapp_rss *rss;
+	uint8_t rss_key[IAPP_RSS_KEY_LEN];
+	uint32_t rss_indir[IAPP_RSS_INDIR_SIZE];
+	int rss_key_len, n;
 	int ncpu;
 	struct cfg srv_cfg;
 	sigset_t ss;
+	char *buf;
 
 	bzero(&srv_cfg, sizeof(srv_cfg));
 
@@ -395,6 +526,8 @@ main(int argc, const char *argv[])
 	srv_cfg.port = 1667;
 	srv_cfg.do_thread_pin = 1;
 	srv_cfg.do_fd_affinity = 0;
+	srv_cfg.listen_steer = IAPP_LISTEN_STEER_NONE;
+	srv_cfg.tcp_info_ms = 1000;
 
 	/* Parse command line */
 	for (i = 1; i < argc; i++) {
@@ -402,6 +535,25 @@ main(int argc, const char *argv[])
 			exit(127);
 	}
 
+	if (srv_cfg.tcp_info_sample > 0 && srv_cfg.io_stats_ms <= 0)
+		fprintf(stderr, "%s: tcp_info_sample needs io_stats_ms; "
+		    "not sampling\n", argv[0]);
+
+	/*
+	 * One payload buffer referenced by every connection, rather
+	 * than one each.  It's malloc backed; the posixshm slabs are
+	 * per thread.
+	 */
+	if (srv_cfg.shared_buf) {
+		srv_cfg.shared_nb = iapp_netbuf_alloc(NULL, NB_ALLOC_MALLOC,
+		    srv_cfg.io_size);
+		if (srv_cfg.shared_nb == NULL)
+			exit(127);
+		buf = iapp_netbuf_buf_nonconst(srv_cfg.shared_nb);
+		for (i = 0; i < srv_cfg.io_size; i++)
+			buf[i] = (i % 10) + '0';
+	}
+
 	/* Mark SIGPIPE as an ignore on all threads */
 	sigemptyset(&ss);
 	sigaddset(&ss, SIGPIPE);
@@ -413,18 +565,20 @@ main(int argc, const char *argv[])
 		perror("malloc");
 
 	/*
-	 * Create a single listen FD; we'll create separate conn state
-	 * for each, but it'll be a single listen queue.
+	 * Create a listen FD per thread, so each thread has its own
+	 * listen queue and only wakes up for its own connections.
 	 */
-	fd_v4 = comm_fd_create_listen_tcp_v4(1667);
-	if (fd_v4 < 0) {
-		perror("listenfd");
+	l_v4 = iapp_listener_create(AF_INET, SOCK_STREAM, srv_cfg.port,
+	    srv_cfg.num_threads, srv_cfg.listen_steer);
+	if (l_v4 == NULL) {
+		fprintf(stderr, "%s: couldn't create v4 listeners\n", argv[0]);
 	}
 
 	/* .. and v6 */
-	fd_v6 = comm_fd_create_listen_tcp_v6(1667);
-	if (fd_v6 < 0) {
-		perror("listenfd");
+	l_v6 = iapp_listener_create(AF_INET6, SOCK_STREAM, srv_cfg.port,
+	    srv_cfg.num_threads, srv_cfg.listen_steer);
+	if (l_v6 == NULL) {
+		fprintf(stderr, "%s: couldn't create v6 listeners\n", argv[0]);
 	}
 
 	iapp_netbuf_init();
@@ -433,45 +587,98 @@ main(int argc, const char *argv[])
 	if (ncpu < 0)
 		exit(127);	/* XXX */
 
-	/* Create listen threads */
+	/*
+	 * Placement policy - map receive CPU back to the thread pinned
+	 * there.  The mapping has to be complete before any thread
+	 * starts accepting.
+	 */
+	place = iapp_place_create(srv_cfg.num_threads);
+	if (place == NULL)
+		exit(127);
+	if (srv_cfg.do_thread_pin) {
+		for (i = 0; i < srv_cfg.num_threads; i++)
+			(void) iapp_place_set_thread_cpu(place, i, i % ncpu);
+	}
+
+	/*
+	 * Software RSS, used when the receive CPU isn't known.  Set
+	 * rss_key/rss_indir to match the NIC configuration.
+	 */
+	rss_key_len = 0;
+	if (srv_cfg.rss_key != NULL) {
+		rss_key_len = iapp_rss_parse_key(srv_cfg.rss_key, rss_key,
+		    sizeof(rss_key));
+		if (rss_key_len <= 0) {
+			fprintf(stderr, "%s: invalid rss_key '%s'\n", argv[0],
+			    srv_cfg.rss_key);
+			exit(127);
+		}
+	}
+	rss = iapp_rss_create(rss_key_len > 0 ? rss_key : NULL, rss_key_len,
+	    srv_cfg.num_threads);
+	if (rss == NULL)
+		exit(127);
+	if (srv_cfg.rss_indir != NULL) {
+		n = iapp_rss_parse_indir(srv_cfg.rss_indir, rss_indir,
+		    IAPP_RSS_INDIR_SIZE);
+		if (n <= 0) {
+			fprintf(stderr, "%s: invalid rss_indir '%s'\n", argv[0],
+			    srv_cfg.rss_indir);
+			exit(127);
+		}
+		(void) iapp_rss_set_indir(rss, rss_indir, n);
+	}
+
+	/*
+	 * Event contexts and handoff rings; these must all exist
+	 * before any thread starts accepting and handing off.
+	 */
 	for (i = 0; i < srv_cfg.num_threads; i++) {
-		cpuset_t cp;
+		r = &rp[i];
+		r->h = fde_ctx_new();
+		if (r->h == NULL)
+			exit(127);
+		r->ho = iapp_handoff_create(r->h, SRV_HANDOFF_RING_SIZE,
+		    thrsrv_handoff_cb, r);
+		if (r->ho == NULL)
+			exit(127);
+	}
 
+	/* Create listen threads */
+	for (i = 0; i < srv_cfg.num_threads; i++) {
 		r = &rp[i];
 
-		/* Shared single listen FD, multiple threads interested */
-		r->thr_sockfd_v4 = fd_v4;
-		r->thr_sockfd_v6 = fd_v6;
+		/* Per-thread listen FD from each listen group */
+		r->thr_sockfd_v4 = (l_v4 != NULL) ? iapp_listener_fd(l_v4, i) : -1;
+		r->thr_sockfd_v6 = (l_v6 != NULL) ? iapp_listener_fd(l_v6, i) : -1;
 
-		r->h = fde_ctx_new();
 		r->cfg = &srv_cfg;
+		r->place = place;
+		r->rss = rss;
 		r->app_id = i;
 
 		/*
 		 * Only allocate the shared memory bits if we need them.
 		 *
 		 * + Allocate the whole lot at once;
-		 * + mlock it.
+		 * + mlock it;
+		 * + leave room for another slab if size class rounding
+		 *   means io_size buffers don't pack exactly.
 		 */
 		if (srv_cfg.atype == NB_ALLOC_POSIXSHM)
 			shm_alloc_init(&r->sm,
-			    srv_cfg.max_num_conns*srv_cfg.io_size,
+			    2*srv_cfg.max_num_conns*srv_cfg.io_size,
 			    srv_cfg.max_num_conns*srv_cfg.io_size,
 			    1);
 		TAILQ_INIT(&r->conn_list);
-		TAILQ_INIT(&r->newfd_list);
 		if (pthread_create(&r->thr_id, NULL, thrsrv_new, r) != 0)
 			perror("pthread_create");
 
 		if (srv_cfg.do_thread_pin) {
 			/* Set affinity */
-			CPU_ZERO(&cp);
-			CPU_SET(i % ncpu, &cp);
-
 			printf("%s: thread id %d -> CPU %d\n", argv[0], i, i % ncpu);
 
-			if (pthread_setaffinity_np(r->thr_id, sizeof(cpuset_t), &cp) != 0)
-				warn("pthread_setaffinity_np (id %d)", i);
+			(void) iapp_thread_pin(r->thr_id, i % ncpu);
 		}
 	}
 
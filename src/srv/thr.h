@@ -31,18 +31,16 @@
 struct thr;
 struct conn;
 struct cfg;
-struct thrsrv_newfd;
-
-struct thrsrv_newfd {
-	int newfd;
-	uint32_t flowid;
-	TAILQ_ENTRY(thrsrv_newfd) node;
-};
+struct iapp_place;
+struct iapp_rss;
+struct iapp_handoff;
 
 struct thr {
 	pthread_t thr_id;
 	int app_id;
 	struct cfg *cfg;
+	struct iapp_place *place;
+	struct iapp_rss *rss;
 	struct shm_alloc_state sm;
 	int thr_sockfd_v4;
 	int thr_sockfd_v6;
@@ -52,13 +50,18 @@ struct thr {
 	struct fde *ev_stats;
 	TAILQ_HEAD(, conn) conn_list;
 
-	struct fde *ev_deferred;
-	TAILQ_HEAD(, thrsrv_newfd) newfd_list;
-	pthread_mutex_t newfd_lock;
+	struct iapp_handoff *ho;
 
 	uint64_t total_read, total_written;
 	uint64_t total_opened, total_closed;
+	uint64_t total_early;	/* accepted with data already there */
 	uint64_t num_clients;
+
+	/* Comm IO statistics, summed over the connections */
+	struct comm_stats io;
+	uint64_t n_tcpi;	/* connections with a TCP_INFO sample */
+	uint64_t tcpi_rtt_sum, tcpi_cwnd_sum;
+	uint64_t tcpi_retrans_max;
 };
 
 #endif	/* __THR_H__ */
@@ -0,0 +1,547 @@
+/*-
+ * Copyright 2026 Adrian Chadd <adrian@FreeBSD.org>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel TLS throughput benchmark.
+ *
+ * Two threads stream msg_size byte writes from one end of a loopback
+ * TCP connection to the other for 'seconds' and print MB/sec.
+ *
+ * transport=tcp is plain TCP; transport=ktls does the handshake with
+ * comm_tls_start() and then the exact same comm IO with the kernel
+ * doing the records; transport=tls is the usual userspace SSL_write()
+ * and SSL_read() loop, for comparison.  source=sendfile sends a
+ * msg_size file with comm_sendfile() instead of comm_write().
+ *
+ * Without cert= and key= a throwaway self-signed certificate for
+ * localhost is made.  The client verifies the server against ca=
+ * (default: the certificate itself) and host= (default: localhost);
+ * verify=0 turns verification off.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <aio.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/event.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include "shm_alloc.h"
+#include "netbuf.h"
+#include "fde.h"
+#include "comm.h"
+#include "disk.h"
+#include "fd_util.h"
+#include "iapp_tls.h"
+
+#define	BENCH_READ_SIZE		65536
+
+typedef enum {
+	BENCH_T_TCP,
+	BENCH_T_KTLS,
+	BENCH_T_TLS
+} bench_transport;
+
+static const char *bench_transport_names[] = { "tcp", "ktls", "tls" };
+
+struct bench;
+
+struct bench_side {
+	int id;			/* 0 - server, writes; 1 - client, reads */
+	struct bench *b;
+	pthread_t thr;
+	struct fde_head *h;
+	struct fde_comm *fc;
+	struct fde_disk *fdd;
+	struct iapp_netbuf *nb;
+	char *rbuf;
+
+	uint64_t n_bytes;
+};
+
+struct bench {
+	bench_transport transport;
+	int use_sendfile;
+	int msg_size;
+	int seconds;
+	volatile int is_done;
+
+	int fd[2];
+	int file_fd;
+	const char *host;
+	struct iapp_tls_ctx *tc[2];
+	struct bench_side side[2];
+};
+
+static void bench_send(struct bench_side *s);
+
+static void
+bench_write_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int nwritten)
+{
+	struct bench_side *s = arg;
+
+	if (status != FDE_COMM_CB_COMPLETED) {
+		warnx("%s: write failed (%d)", __func__, status);
+		return;
+	}
+	s->n_bytes += nwritten;
+	bench_send(s);
+}
+
+static void
+bench_sendfile_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, off_t nwritten, int xerrno)
+{
+	struct bench_side *s = arg;
+
+	if (status != FDE_COMM_CB_COMPLETED) {
+		warnx("%s: sendfile failed (%d): %s", __func__, status,
+		    strerror(xerrno));
+		return;
+	}
+	s->n_bytes += nwritten;
+	bench_send(s);
+}
+
+static void
+bench_send(struct bench_side *s)
+{
+
+	if (s->b->is_done)
+		return;
+	if (s->b->use_sendfile)
+		(void) comm_sendfile(s->fc, s->fdd, 0, s->b->msg_size,
+		    bench_sendfile_cb, s);
+	else
+		(void) comm_write(s->fc, s->nb, 0, s->b->msg_size,
+		    bench_write_cb, s);
+}
+
+static void
+bench_read_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int retval)
+{
+	struct bench_side *s = arg;
+
+	if (status != FDE_COMM_CB_COMPLETED) {
+		if (s->b->is_done == 0)
+			warnx("%s: read failed (%d)", __func__, status);
+		return;
+	}
+
+	s->n_bytes += retval;
+	if (s->b->is_done == 0)
+		(void) comm_read(fc, s->rbuf, BENCH_READ_SIZE, bench_read_cb,
+		    s);
+}
+
+static void
+bench_start(struct bench_side *s)
+{
+
+	if (s->id == 0)
+		bench_send(s);
+	else
+		(void) comm_read(s->fc, s->rbuf, BENCH_READ_SIZE,
+		    bench_read_cb, s);
+}
+
+static void
+bench_tls_cb(int fd, struct fde_comm *fc, void *arg,
+    fde_comm_cb_status status, int xerrno)
+{
+	struct bench_side *s = arg;
+
+	if (status != FDE_COMM_CB_COMPLETED)
+		errx(1, "side %d: TLS handshake failed: %s", s->id,
+		    strerror(xerrno));
+	bench_start(s);
+}
+
+static void *
+bench_thread(void *arg)
+{
+	struct bench_side *s = arg;
+	struct bench *b = s->b;
+	struct timeval tv;
+
+	s->h = fde_ctx_new();
+	if (s->h == NULL)
+		errx(1, "fde_ctx_new failed");
+	s->fc = comm_create(b->fd[s->id], s->h, NULL, NULL);
+	if (s->fc == NULL)
+		errx(1, "couldn't create comm");
+
+	s->nb = iapp_netbuf_alloc(NULL, NB_ALLOC_MALLOC, b->msg_size);
+	s->rbuf = malloc(BENCH_READ_SIZE);
+	if (s->nb == NULL || s->rbuf == NULL)
+		errx(1, "couldn't allocate buffers");
+	memset(iapp_netbuf_buf_nonconst(s->nb), 'x', b->msg_size);
+
+	if (b->use_sendfile && s->id == 0) {
+		s->fdd = disk_create(s->h, NULL, NULL);
+		if (s->fdd == NULL || disk_set_fd(s->fdd, b->file_fd, 0) < 0)
+			errx(1, "couldn't create disk handle");
+	}
+
+	if (b->transport == BENCH_T_KTLS) {
+		if (comm_tls_start(s->fc, b->tc[s->id], b->host, 0,
+		    bench_tls_cb, s) < 0)
+			errx(1, "comm_tls_start failed");
+	} else
+		bench_start(s);
+
+	while (b->is_done == 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		fde_runloop(s->h, &tv);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Userspace TLS: blocking SSL calls with a socket timeout so the
+ * loop notices is_done.
+ */
+static void *
+bench_tls_thread(void *arg)
+{
+	struct bench_side *s = arg;
+	struct bench *b = s->b;
+	struct timeval tv;
+	char *buf;
+	SSL *ssl;
+	int r, len;
+
+	(void) comm_fd_set_nonblocking(b->fd[s->id], 0);
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	(void) setsockopt(b->fd[s->id], SOL_SOCKET, SO_RCVTIMEO, &tv,
+	    sizeof(tv));
+	(void) setsockopt(b->fd[s->id], SOL_SOCKET, SO_SNDTIMEO, &tv,
+	    sizeof(tv));
+
+	len = (s->id == 0) ? b->msg_size : BENCH_READ_SIZE;
+	buf = malloc(len);
+	if (buf == NULL)
+		errx(1, "couldn't allocate buffers");
+	memset(buf, 'x', len);
+
+	ssl = SSL_new(b->tc[s->id]->ctx);
+	if (ssl == NULL || SSL_set_fd(ssl, b->fd[s->id]) != 1)
+		errx(1, "couldn't create SSL");
+	SSL_clear_options(ssl, SSL_OP_ENABLE_KTLS);
+	if (s->id == 0)
+		SSL_set_accept_state(ssl);
+	else {
+		if (b->host != NULL && iapp_tls_set_peer_name(ssl, b->host) < 0)
+			errx(1, "couldn't set the server name");
+		SSL_set_connect_state(ssl);
+	}
+
+	while (b->is_done == 0) {
+		if (SSL_is_init_finished(ssl) == 0) {
+			r = SSL_do_handshake(ssl);
+			if (r == 1)
+				continue;
+		} else if (s->id == 0)
+			r = SSL_write(ssl, buf, len);
+		else
+			r = SSL_read(ssl, buf, len);
+		if (r > 0) {
+			s->n_bytes += r;
+			continue;
+		}
+		switch (SSL_get_error(ssl, r)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			continue;
+		default:
+			if (b->is_done == 0)
+				errx(1, "side %d: SSL IO failed", s->id);
+		}
+	}
+
+	SSL_free(ssl);
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * Connect a pair of sockets over loopback TCP.
+ */
+static int
+bench_tcp_pair(int fd[2])
+{
+	struct sockaddr_in sin;
+	socklen_t slen;
+	int lfd;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0)
+		return (-1);
+
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	slen = sizeof(sin);
+	if (bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *) &sin, &slen) < 0)
+		goto cleanup;
+
+	fd[1] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd[1] < 0)
+		goto cleanup;
+	if (connect(fd[1], (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		close(fd[1]);
+		goto cleanup;
+	}
+	fd[0] = accept(lfd, NULL, NULL);
+	if (fd[0] < 0) {
+		close(fd[1]);
+		goto cleanup;
+	}
+	close(lfd);
+
+	(void) comm_fd_set_nonblocking(fd[0], 1);
+	(void) comm_fd_set_nonblocking(fd[1], 1);
+	return (0);
+
+cleanup:
+	close(lfd);
+	return (-1);
+}
+
+/*
+ * Write a throwaway self-signed P-256 certificate and key.
+ */
+static int
+bench_make_cert(char *cert_path, char *key_path)
+{
+	EVP_PKEY *pk = NULL;
+	X509 *x = NULL;
+	X509_NAME *name;
+	FILE *fp;
+	int fd, ret = -1;
+
+	pk = EVP_EC_gen("P-256");
+	x = X509_new();
+	if (pk == NULL || x == NULL)
+		goto cleanup;
+
+	ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x), 86400);
+	X509_set_pubkey(x, pk);
+	name = X509_get_subject_name(x);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (const unsigned char *) "localhost", -1, -1, 0);
+	X509_set_issuer_name(x, name);
+	if (X509_sign(x, pk, EVP_sha256()) == 0)
+		goto cleanup;
+
+	fd = mkstemp(cert_path);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL)
+		goto cleanup;
+	ret = PEM_write_X509(fp, x) ? 0 : -1;
+	fclose(fp);
+	if (ret < 0)
+		goto cleanup;
+
+	ret = -1;
+	fd = mkstemp(key_path);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL)
+		goto cleanup;
+	ret = PEM_write_PrivateKey(fp, pk, NULL, NULL, 0, NULL, NULL) ?
+	    0 : -1;
+	fclose(fp);
+
+cleanup:
+	X509_free(x);
+	EVP_PKEY_free(pk);
+	return (ret);
+}
+
+/*
+ * A msg_size file for source=sendfile; it's unlinked straight away.
+ */
+static int
+bench_make_file(int len)
+{
+	char path[] = "/tmp/tls_bench.dat.XXXXXX";
+	char buf[4096];
+	int fd, n;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return (-1);
+	(void) unlink(path);
+
+	memset(buf, 'x', sizeof(buf));
+	while (len > 0) {
+		n = len > (int) sizeof(buf) ? (int) sizeof(buf) : len;
+		if (write(fd, buf, n) != n) {
+			close(fd);
+			return (-1);
+		}
+		len -= n;
+	}
+	return (fd);
+}
+
+static void
+usage(const char *progname)
+{
+
+	printf("Usage: %s [transport=tcp|ktls|tls] [source=write|sendfile] "
+	    "[msg_size=<n>] [seconds=<n>] [cert=<pem> key=<pem>] "
+	    "[ca=<pem>] [host=<name>] [verify=0|1]\n",
+	    progname);
+	exit(127);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	char cert_tmp[] = "/tmp/tls_bench.crt.XXXXXX";
+	char key_tmp[] = "/tmp/tls_bench.key.XXXXXX";
+	const char *cert = NULL, *key = NULL, *ca = NULL;
+	struct bench b;
+	int i, tc_flags = 0;
+
+	bzero(&b, sizeof(b));
+	b.msg_size = 16384;
+	b.seconds = 10;
+	b.file_fd = -1;
+	b.host = "localhost";
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "transport=tcp") == 0)
+			b.transport = BENCH_T_TCP;
+		else if (strcmp(argv[i], "transport=ktls") == 0)
+			b.transport = BENCH_T_KTLS;
+		else if (strcmp(argv[i], "transport=tls") == 0)
+			b.transport = BENCH_T_TLS;
+		else if (strcmp(argv[i], "source=write") == 0)
+			b.use_sendfile = 0;
+		else if (strcmp(argv[i], "source=sendfile") == 0)
+			b.use_sendfile = 1;
+		else if (strncmp(argv[i], "msg_size=", 9) == 0)
+			b.msg_size = atoi(argv[i] + 9);
+		else if (strncmp(argv[i], "seconds=", 8) == 0)
+			b.seconds = atoi(argv[i] + 8);
+		else if (strncmp(argv[i], "cert=", 5) == 0)
+			cert = argv[i] + 5;
+		else if (strncmp(argv[i], "key=", 4) == 0)
+			key = argv[i] + 4;
+		else if (strncmp(argv[i], "ca=", 3) == 0)
+			ca = argv[i] + 3;
+		else if (strncmp(argv[i], "host=", 5) == 0)
+			b.host = argv[i] + 5;
+		else if (strcmp(argv[i], "verify=0") == 0)
+			tc_flags |= IAPP_TLS_CTX_F_INSECURE_NO_VERIFY;
+		else if (strcmp(argv[i], "verify=1") == 0)
+			tc_flags &= ~IAPP_TLS_CTX_F_INSECURE_NO_VERIFY;
+		else
+			usage(argv[0]);
+	}
+	if (b.msg_size <= 0 || b.seconds <= 0 ||
+	    (cert == NULL) != (key == NULL))
+		usage(argv[0]);
+	/* Userspace TLS can't sendfile */
+	if (b.use_sendfile && b.transport == BENCH_T_TLS)
+		usage(argv[0]);
+
+	if (b.transport != BENCH_T_TCP) {
+		if (cert == NULL) {
+			if (bench_make_cert(cert_tmp, key_tmp) < 0)
+				errx(1, "couldn't make a certificate");
+			cert = cert_tmp;
+			key = key_tmp;
+		}
+		/* Self-signed: the server's certificate is its own CA */
+		if (ca == NULL)
+			ca = cert;
+		b.tc[0] = iapp_tls_ctx_create(1, cert, key, NULL, 0);
+		b.tc[1] = iapp_tls_ctx_create(0, NULL, NULL, ca, tc_flags);
+		if (cert == cert_tmp) {
+			(void) unlink(cert_tmp);
+			(void) unlink(key_tmp);
+		}
+		if (b.tc[0] == NULL || b.tc[1] == NULL)
+			errx(1, "couldn't create TLS contexts");
+	}
+
+	if (b.use_sendfile) {
+		b.file_fd = bench_make_file(b.msg_size);
+		if (b.file_fd < 0)
+			err(1, "bench_make_file");
+	}
+
+	if (bench_tcp_pair(b.fd) < 0)
+		err(1, "bench_tcp_pair");
+
+	for (i = 0; i < 2; i++) {
+		b.side[i].id = i;
+		b.side[i].b = &b;
+		if (pthread_create(&b.side[i].thr, NULL,
+		    b.transport == BENCH_T_TLS ? bench_tls_thread :
+		    bench_thread, &b.side[i]) != 0)
+			err(1, "pthread_create");
+	}
+
+	sleep(b.seconds);
+	b.is_done = 1;
+	for (i = 0; i < 2; i++)
+		(void) pthread_join(b.side[i].thr, NULL);
+
+	printf("%s%s thru: msg_size=%d, %.1f MB/sec\n",
+	    bench_transport_names[b.transport],
+	    b.use_sendfile ? "+sendfile" : "",
+	    b.msg_size,
+	    (double) b.side[1].n_bytes / b.seconds / (1024 * 1024));
+
+	exit(0);
+}
@@ -35,6 +35,7 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/queue.h>
@@ -47,6 +48,19 @@
 #include "comm.h"
 #include "fd_util.h"
 
+/*
+ * Leads every datagram big enough for it, so udp_srv can work out
+ * loss, reordering and one-way latency.  Must match udp_srv.c.
+ */
+#define	UDP_PROBE_MAGIC		0x69617070
+
+struct udp_probe_hdr {
+	uint32_t magic;
+	uint32_t stream_id;	/* sending thread; seq is per stream */
+	uint64_t seq;
+	uint64_t ts_send_ns;	/* CLOCK_REALTIME when queued */
+};
+
 struct clt_app;
 
 struct clt_app {
@@ -61,10 +75,28 @@ struct clt_app {
 	struct fde_comm *comm_wr;
 	char *remote_host;
 	int remote_port;
+	uint64_t seq;
 	uint64_t total_pkt_read, total_pkt_written;
 	uint64_t total_byte_read, total_byte_written;
 };
 
+static void
+thrclt_stamp_frame(struct clt_app *r, struct fde_comm_udp_frame *fr)
+{
+	struct udp_probe_hdr hdr;
+	struct timespec ts;
+
+	if (fr->len < (int) sizeof(hdr))
+		return;
+
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+	hdr.magic = UDP_PROBE_MAGIC;
+	hdr.stream_id = r->app_id;
+	hdr.seq = r->seq++;
+	hdr.ts_send_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	memcpy(fr->buf, &hdr, sizeof(hdr));
+}
+
 static void
 thrclt_send_frames(struct clt_app *r)
 {
@@ -97,9 +129,13 @@ thrclt_send_frames(struct clt_app *r)
 
 		/*
 		 * Queue frame; bail out if we hit the max queue
-		 * depth.
+		 * depth.  The sequence number is only used up if
+		 * it's queued.
 		 */
+		thrclt_stamp_frame(r, fr);
 		if (comm_udp_write(r->comm_wr, fr) < 0) {
+			if (fr->len >= (int) sizeof(struct udp_probe_hdr))
+				r->seq--;
 			fde_comm_udp_free(r->comm_wr, fr);
 			break;
 		}
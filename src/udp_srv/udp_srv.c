@@ -34,7 +34,9 @@
 #include <string.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/event.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
@@ -43,20 +45,154 @@
 #include "fde.h"
 #include "comm.h"
 #include "fd_util.h"
+#include "listener.h"
 
 #define	NUM_THREADS		4
 
 #define	IO_SIZE			16384
 
+/* Probe streams tracked per thread; more than that aren't checked */
+#define	MAX_STREAMS		64
+
+/*
+ * udp_clt leads each datagram with this.  Must match udp_clt.c.
+ */
+#define	UDP_PROBE_MAGIC		0x69617070
+
+struct udp_probe_hdr {
+	uint32_t magic;
+	uint32_t stream_id;	/* sending thread; seq is per stream */
+	uint64_t seq;
+	uint64_t ts_send_ns;	/* CLOCK_REALTIME when queued */
+};
+
+/* A sender socket and thread */
+struct stream {
+	struct sockaddr_storage sa;
+	socklen_t slen;
+	uint32_t stream_id;
+	uint64_t next_seq;
+};
+
+/* Latency accumulator, in microseconds */
+struct lat {
+	uint64_t n;
+	int64_t sum;
+	int64_t max;
+};
+
 struct thr;
 
 struct thr {
 	pthread_t thr_id;
 	int thr_sockfd;
+	int do_timestamps;
 	struct fde_head *h;
 	struct fde_comm *comm_recvfrom;
+	struct fde *ev_stats;
+	uint64_t n_pkts;
+
+	struct stream streams[MAX_STREAMS];
+	int n_streams;
+
+	/* Per second */
+	uint64_t n_probes;
+	uint64_t n_lost;
+	uint64_t n_reordered;
+	struct lat lat_oneway;	/* sender -> kernel receive */
+	struct lat lat_queue;	/* kernel receive -> read callback */
 };
 
+static int64_t
+ts_usec(const struct timespec *ts)
+{
+
+	return ((int64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000);
+}
+
+static void
+lat_add(struct lat *l, int64_t usec)
+{
+
+	l->n++;
+	l->sum += usec;
+	if (usec > l->max)
+		l->max = usec;
+}
+
+/*
+ * Find the stream a probe belongs to; a new one starts at the
+ * first sequence number seen, so a late start isn't loss.
+ */
+static struct stream *
+stream_lookup(struct thr *r, struct fde_comm_udp_frame *fr, uint32_t id,
+    uint64_t seq)
+{
+	struct stream *st;
+	int i;
+
+	for (i = 0; i < r->n_streams; i++) {
+		st = &r->streams[i];
+		if (st->stream_id == id && st->slen == fr->sl_rem &&
+		    memcmp(&st->sa, &fr->sa_rem, fr->sl_rem) == 0)
+			return (st);
+	}
+	if (r->n_streams == MAX_STREAMS)
+		return (NULL);
+
+	st = &r->streams[r->n_streams++];
+	memcpy(&st->sa, &fr->sa_rem, fr->sl_rem);
+	st->slen = fr->sl_rem;
+	st->stream_id = id;
+	st->next_seq = seq;
+	return (st);
+}
+
+/*
+ * Account a probe datagram.  A gap counts as loss straight away;
+ * if the missing datagram turns up later it's moved from lost to
+ * reordered.
+ */
+static void
+conn_probe(struct thr *r, struct fde_comm_udp_frame *fr)
+{
+	struct udp_probe_hdr hdr;
+	struct stream *st;
+	const struct timespec *ts_rx;
+
+	if (fr->len < (int) sizeof(hdr))
+		return;
+	memcpy(&hdr, fr->buf, sizeof(hdr));
+	if (hdr.magic != UDP_PROBE_MAGIC)
+		return;
+
+	r->n_probes++;
+	st = stream_lookup(r, fr, hdr.stream_id, hdr.seq);
+	if (st != NULL) {
+		if (hdr.seq >= st->next_seq) {
+			r->n_lost += hdr.seq - st->next_seq;
+			st->next_seq = hdr.seq + 1;
+		} else {
+			r->n_reordered++;
+			if (r->n_lost > 0)
+				r->n_lost--;
+		}
+	}
+
+	if (r->do_timestamps == 0)
+		return;
+
+	/* No kernel timestamp; the best we have is the dispatch time */
+	ts_rx = &fr->ts_kern;
+	if (ts_rx->tv_sec == 0 && ts_rx->tv_nsec == 0)
+		ts_rx = &fr->ts_dispatch;
+	else
+		lat_add(&r->lat_queue, ts_usec(&fr->ts_dispatch) -
+		    ts_usec(ts_rx));
+	lat_add(&r->lat_oneway, ts_usec(ts_rx) -
+	    (int64_t) (hdr.ts_send_ns / 1000));
+}
+
 static void
 conn_recvmsg(int fd, struct fde_comm *fc, void *arg,
     struct fde_comm_udp_frame *fr, fde_comm_cb_status s, int xerrno)
@@ -85,6 +221,9 @@ conn_recvmsg(int fd, struct fde_comm *fc, void *arg,
 	    fr->len);
 #endif
 
+	r->n_pkts++;
+	conn_probe(r, fr);
+
 	/*
 	 * Free the UDP frame.
 	 */
@@ -93,6 +232,45 @@ conn_recvmsg(int fd, struct fde_comm *fc, void *arg,
 	}
 }
 
+static void
+thrsrv_stat_print(int fd, struct fde *f, void *arg, fde_cb_status s)
+{
+	struct thr *r = arg;
+	struct timeval tv;
+
+	fprintf(stderr, "%s: [%p]: RX=%llu frames; kq changes=%llu\n",
+	    __func__,
+	    r,
+	    (unsigned long long) r->n_pkts,
+	    (unsigned long long) r->h->stats.n_changes);
+	if (r->n_probes > 0)
+		fprintf(stderr, "%s: [%p]: probes=%llu, lost=%llu, "
+		    "reordered=%llu; one-way avg=%lld max=%lld usec; "
+		    "queued avg=%lld max=%lld usec\n",
+		    __func__,
+		    r,
+		    (unsigned long long) r->n_probes,
+		    (unsigned long long) r->n_lost,
+		    (unsigned long long) r->n_reordered,
+		    (long long) (r->lat_oneway.n ?
+		      r->lat_oneway.sum / (int64_t) r->lat_oneway.n : 0),
+		    (long long) r->lat_oneway.max,
+		    (long long) (r->lat_queue.n ?
+		      r->lat_queue.sum / (int64_t) r->lat_queue.n : 0),
+		    (long long) r->lat_queue.max);
+
+	/* Blank this out, so we get per-second stats */
+	r->n_pkts = 0;
+	r->h->stats.n_changes = 0;
+	r->n_probes = r->n_lost = r->n_reordered = 0;
+	bzero(&r->lat_oneway, sizeof(r->lat_oneway));
+	bzero(&r->lat_queue, sizeof(r->lat_queue));
+
+	(void) gettimeofday(&tv, NULL);
+	tv.tv_sec += 1;
+	fde_add_timeout(r->h, r->ev_stats, &tv);
+}
+
 void *
 thrsrv_new(void *arg)
 {
@@ -104,8 +282,19 @@ thrsrv_new(void *arg)
 	/* Create a listen comm object */
 	r->comm_recvfrom = comm_create(r->thr_sockfd, r->h, NULL, NULL);
 	comm_mark_nonclose(r->comm_recvfrom);
+	if (r->do_timestamps &&
+	    comm_udp_set_timestamps(r->comm_recvfrom, 1) < 0)
+		fprintf(stderr, "%s: %p: no kernel timestamps; using "
+		    "dispatch time\n", __func__, r);
 	(void) comm_udp_read(r->comm_recvfrom, conn_recvmsg, r, 8192);
 
+	/* Statistics, once a second */
+	r->ev_stats = fde_create(r->h, -1, FDE_T_TIMER, 0,
+	    thrsrv_stat_print, r);
+	(void) gettimeofday(&tv, NULL);
+	tv.tv_sec += 1;
+	fde_add_timeout(r->h, r->ev_stats, &tv);
+
 	/* Loop around, listening for events; farm them off as required */
 	while (1) {
 
@@ -118,72 +307,40 @@ thrsrv_new(void *arg)
 }
 
 int
-thrsrv_listenfd(int port)
+main(int argc, const char *argv[])
 {
-	int fd;
-	struct sockaddr_in sin;
-	int a;
-
-	bzero(&sin, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = 0;
-	sin.sin_port = htons(port);
-	sin.sin_len = sizeof(sin);
-
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (fd < 0) {
-		fprintf(stderr, "%s: socket() failed; errno=%d (%s)\n",
-		    __func__,
-		    errno,
-		    strerror(errno));
-		return (-1);
-	}
-
-	/* Make non-blocking */
-	(void) comm_fd_set_nonblocking(fd, 1);
-
-	/* make reuse */
-	a = 1;
-	(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &a, sizeof(a));
-
-	/* and reuse port */
-	a = 1;
-	(void) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &a, sizeof(a));
+	struct iapp_listener *l;
+	iapp_listen_steer_t steer = IAPP_LISTEN_STEER_NONE;
+	struct thr *rp, *r;
+	int i, do_timestamps = 1;
 
-	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
-		fprintf(stderr, "%s: bind() failed; errno=%d (%s)\n",
-		    __func__,
-		    errno,
-		    strerror(errno));
-		close(fd);
-		return (-1);
+	/* Optional: how to steer datagrams across the thread sockets */
+	if (argc > 1 && iapp_listener_parse_steer(argv[1], &steer) < 0) {
+		printf("Usage: %s [none|cpu|hash [<timestamps>]]\n", argv[0]);
+		exit(127);
 	}
 
-	return (fd);
-}
-
-int
-main(int argc, const char *argv[])
-{
-	int fd;
-	struct thr *rp, *r;
-	int i;
+	/* Optional: kernel receive timestamps; on by default */
+	if (argc > 2)
+		do_timestamps = atoi(argv[2]);
 
 	/* Allocate thread pool */
 	rp = calloc(NUM_THREADS, sizeof(struct thr));
 	if (rp == NULL)
 		perror("malloc");
 
-	/* Create listen socket */
-	fd = thrsrv_listenfd(1667);
-	if (fd < 0) {
-		perror("listenfd");
+	/* Create a receive socket per thread */
+	l = iapp_listener_create(AF_INET, SOCK_DGRAM, 1667, NUM_THREADS, steer);
+	if (l == NULL) {
+		fprintf(stderr, "%s: couldn't create listen sockets\n", argv[0]);
+		exit(127);
 	}
 
 	/* Create listen threads */
 	for (i = 0; i < NUM_THREADS; i++) {
 		r = &rp[i];
-		r->thr_sockfd = fd;
+		r->thr_sockfd = iapp_listener_fd(l, i);
+		r->do_timestamps = do_timestamps;
 		r->h = fde_ctx_new();
 		if (pthread_create(&r->thr_id, NULL, thrsrv_new, r) != 0)
 			perror("pthread_create");